@@ -0,0 +1,221 @@
+//
+// libnesemu: the emulator core as a shared library with a C interface.
+//
+
+#include "nesemu.h"
+#include "../system/nes.hpp"
+#include "../system/thread_pool.hpp"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+static_assert(NESEMU_SCREEN_WIDTH == constants::SCREEN_WIDTH && NESEMU_SCREEN_HEIGHT == constants::SCREEN_HEIGHT,
+              "frame buffer size mismatch");
+static_assert(NESEMU_WORK_RAM_SIZE == constants::NES_RAM_SIZE, "work RAM size mismatch");
+static_assert(NESEMU_SAMPLE_RATE == constants::AUDIO_SAMPLE_RATE, "sample rate mismatch");
+static_assert(NESEMU_AUDIO_CAPACITY >= constants::AUDIO_RING_SIZE, "a drain must fit in the audio buffer");
+static_assert(NESEMU_BUTTON_A == buttons::A && NESEMU_BUTTON_RIGHT == buttons::RIGHT, "button bits mismatch");
+
+struct nesemu
+{
+    NES nes;
+
+    // Samples of the last step, drained from the APU's ring after every frame.
+    std::vector<float> audio;
+    std::size_t audio_count = 0;
+
+    // Save states pass through here when the caller's buffer isn't aligned for one.
+    std::unique_ptr<savestate_t> scratch;
+
+    nesemu() : audio(NESEMU_AUDIO_CAPACITY) {}
+};
+
+namespace
+{
+    // Workers for nesemu_step_many, started on first use. Batches run one at a time, since
+    // a batch waits for the whole pool.
+    std::mutex batch_mutex;
+    std::unique_ptr<ThreadPool> batch_pool;
+
+    // Moves whatever the APU has queued to the end of the instance's buffer, dropping the
+    // oldest samples if it is full.
+    void drain_audio(nesemu& emu)
+    {
+        APU& apu = emu.nes.get_apu();
+        const std::size_t queued = apu.queued_samples();
+
+        if (queued == 0)
+            return;
+
+        if (emu.audio_count + queued > emu.audio.size())
+        {
+            const std::size_t dropped = emu.audio_count + queued - emu.audio.size();
+            std::memmove(emu.audio.data(), emu.audio.data() + dropped, (emu.audio_count - dropped) * sizeof(float));
+            emu.audio_count -= dropped;
+        }
+
+        emu.audio_count += apu.read_samples(emu.audio.data() + emu.audio_count, queued);
+    }
+
+    bool is_aligned(const void* buffer)
+    {
+        return reinterpret_cast<uintptr_t>(buffer) % alignof(savestate_t) == 0;
+    }
+
+    uint32_t run(nesemu& emu, uint32_t frames, const uint8_t* inputs, std::size_t input_stride)
+    {
+        emu.audio_count = 0;
+
+        uint32_t frame = 0;
+        for (; frame < frames && !emu.nes.get_cpu().is_halted(); frame++)
+        {
+            const uint8_t* held = inputs != nullptr ? inputs + frame * input_stride : nullptr;
+            emu.nes.set_controller(0, held != nullptr ? held[0] : 0);
+            emu.nes.set_controller(1, held != nullptr ? held[1] : 0);
+
+            emu.nes.run_frames(1);
+            drain_audio(emu);
+        }
+
+        return frame;
+    }
+} // namespace
+
+nesemu_t* nesemu_create(void)
+{
+    return new (std::nothrow) nesemu();
+}
+
+void nesemu_destroy(nesemu_t* emu)
+{
+    delete emu;
+}
+
+int nesemu_load_rom(nesemu_t* emu, const uint8_t* data, size_t size)
+{
+    emu->audio_count = 0;
+    return emu->nes.load_rom(data, size) ? 1 : 0;
+}
+
+int nesemu_set_jit(nesemu_t* emu, int enabled)
+{
+    return emu->nes.set_jit_enabled(enabled != 0) ? 1 : 0;
+}
+
+void nesemu_set_idle_skip(nesemu_t* emu, int enabled)
+{
+    emu->nes.set_idle_skip_enabled(enabled != 0);
+}
+
+void nesemu_set_output(nesemu_t* emu, int video, int audio)
+{
+    emu->nes.set_output_enabled(video != 0, audio != 0);
+}
+
+uint32_t nesemu_step(nesemu_t* emu, uint32_t frames, const uint8_t* inputs)
+{
+    return run(*emu, frames, inputs, 2);
+}
+
+size_t nesemu_step_many(nesemu_t* const* instances, size_t count, uint32_t frames, const uint8_t* actions)
+{
+    // Each console holds the same two bytes every frame: an input stride of 0.
+    auto run_range = [=](std::size_t first, std::size_t last) {
+        for (std::size_t i = first; i < last; i++)
+            run(*instances[i], frames, actions != nullptr ? actions + 2 * i : nullptr, 0);
+    };
+
+    {
+        std::unique_lock<std::mutex> lock(batch_mutex);
+
+        if (!batch_pool)
+            batch_pool.reset(new ThreadPool());
+
+        // Handing work to other threads only pays off if there are other cores.
+        if (count < 2 || batch_pool->size() < 2)
+        {
+            lock.unlock();
+            run_range(0, count);
+        }
+        else
+        {
+            // A few tasks per worker, so stealing can even out consoles that run slower.
+            const std::size_t tasks = std::min(count, batch_pool->size() * 4);
+
+            for (std::size_t task = 0; task < tasks; task++)
+                batch_pool->submit([=](std::size_t) { run_range(task * count / tasks, (task + 1) * count / tasks); });
+
+            batch_pool->wait();
+        }
+    }
+
+    size_t halted = 0;
+    for (size_t i = 0; i < count; i++)
+        halted += instances[i]->nes.get_cpu().is_halted() ? 1 : 0;
+
+    return halted;
+}
+
+int nesemu_is_halted(nesemu_t* emu)
+{
+    return emu->nes.get_cpu().is_halted() ? 1 : 0;
+}
+
+size_t nesemu_state_size(void)
+{
+    return sizeof(savestate_t);
+}
+
+int nesemu_save_state(nesemu_t* emu, void* buffer, size_t size)
+{
+    if (size < sizeof(savestate_t))
+        return 0;
+
+    if (is_aligned(buffer))
+        return emu->nes.save_state(*static_cast<savestate_t*>(buffer)) ? 1 : 0;
+
+    if (!emu->scratch)
+        emu->scratch.reset(new savestate_t());
+
+    if (!emu->nes.save_state(*emu->scratch))
+        return 0;
+
+    std::memcpy(buffer, emu->scratch.get(), sizeof(savestate_t));
+    return 1;
+}
+
+int nesemu_load_state(nesemu_t* emu, const void* buffer, size_t size)
+{
+    if (size < sizeof(savestate_t))
+        return 0;
+
+    if (is_aligned(buffer))
+        return emu->nes.load_state(*static_cast<const savestate_t*>(buffer)) ? 1 : 0;
+
+    if (!emu->scratch)
+        emu->scratch.reset(new savestate_t());
+
+    std::memcpy(emu->scratch.get(), buffer, sizeof(savestate_t));
+    return emu->nes.load_state(*emu->scratch) ? 1 : 0;
+}
+
+const uint32_t* nesemu_framebuffer(nesemu_t* emu)
+{
+    return emu->nes.get_ppu().get_frame_buffer();
+}
+
+const float* nesemu_audio(nesemu_t* emu, size_t* count)
+{
+    if (count != nullptr)
+        *count = emu->audio_count;
+
+    return emu->audio.data();
+}
+
+const uint8_t* nesemu_work_ram(nesemu_t* emu)
+{
+    return emu->nes.get_ram().get_internal_ram();
+}
@@ -0,0 +1,166 @@
+//
+// libnesemu: the emulator core as a shared library with a C interface.
+//
+
+#ifndef NESEMULATOR_NESEMU_H
+#define NESEMULATOR_NESEMU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define NESEMU_API __declspec(dllexport)
+#else
+#define NESEMU_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Controller buttons, one bit each, as passed to nesemu_step / nesemu_step_many. */
+#define NESEMU_BUTTON_A      0x01
+#define NESEMU_BUTTON_B      0x02
+#define NESEMU_BUTTON_SELECT 0x04
+#define NESEMU_BUTTON_START  0x08
+#define NESEMU_BUTTON_UP     0x10
+#define NESEMU_BUTTON_DOWN   0x20
+#define NESEMU_BUTTON_LEFT   0x40
+#define NESEMU_BUTTON_RIGHT  0x80
+
+#define NESEMU_SCREEN_WIDTH  256
+#define NESEMU_SCREEN_HEIGHT 240
+#define NESEMU_WORK_RAM_SIZE 2048
+#define NESEMU_SAMPLE_RATE   48000
+#define NESEMU_AUDIO_CAPACITY 48000 /* Samples nesemu_audio holds at most (1 s). */
+
+/**
+ * One console. Instances are independent: different instances may be used from different
+ * threads at once, one instance from one thread at a time.
+ */
+typedef struct nesemu nesemu_t;
+
+/**
+ * Creates a console with no cartridge. Returns NULL if out of memory.
+ */
+NESEMU_API nesemu_t* nesemu_create(void);
+
+NESEMU_API void nesemu_destroy(nesemu_t* emu);
+
+/**
+ * Loads an iNES / NES 2.0 image from memory and powers on. The bytes are copied (once per
+ * process: instances loading identical images share the copy), so the buffer can be freed
+ * afterwards. Returns 1 on success, 0 if the image is invalid.
+ * @param emu
+ * @param data
+ * @param size
+ */
+NESEMU_API int nesemu_load_rom(nesemu_t* emu, const uint8_t* data, size_t size);
+
+/**
+ * Switches the recompiler on or off. Returns 1 if compiled code will run.
+ * @param emu
+ * @param enabled
+ */
+NESEMU_API int nesemu_set_jit(nesemu_t* emu, int enabled);
+
+/**
+ * Switches skipping idle loops on or off: loops that only wait for vertical blank or an
+ * interrupt are jumped over instead of executed. Emulation is identical either way.
+ * @param emu
+ * @param enabled
+ */
+NESEMU_API void nesemu_set_idle_skip(nesemu_t* emu, int enabled);
+
+/**
+ * Switches drawing the picture and producing audio on or off. Emulation is identical either
+ * way; turning unused output off makes stepping faster.
+ * @param emu
+ * @param video
+ * @param audio
+ */
+NESEMU_API void nesemu_set_output(nesemu_t* emu, int video, int audio);
+
+/**
+ * Runs `frames' frames. `inputs' holds two bytes per frame, the NESEMU_BUTTON_* bits held on
+ * controller ports 1 and 2 during that frame, or is NULL for no buttons held. Returns the
+ * number of frames run: fewer than asked if the CPU halted.
+ * @param emu
+ * @param frames
+ * @param inputs
+ */
+NESEMU_API uint32_t nesemu_step(nesemu_t* emu, uint32_t frames, const uint8_t* inputs);
+
+/**
+ * Runs `frames' frames on each of `count' consoles, console i holding actions[2 * i] and
+ * actions[2 * i + 1] on ports 1 and 2 throughout. The consoles run in parallel on a pool of
+ * worker threads shared by all calls; none may appear twice. Returns how many of them have a
+ * halted CPU afterwards.
+ * @param instances
+ * @param count
+ * @param frames
+ * @param actions
+ */
+NESEMU_API size_t nesemu_step_many(nesemu_t* const* instances, size_t count, uint32_t frames, const uint8_t* actions);
+
+/**
+ * Whether the CPU hit an opcode it cannot execute. A halted console runs no more frames
+ * until a ROM is loaded or a state restored.
+ * @param emu
+ */
+NESEMU_API int nesemu_is_halted(nesemu_t* emu);
+
+/**
+ * Size of the buffer nesemu_save_state writes and nesemu_load_state reads.
+ */
+NESEMU_API size_t nesemu_state_size(void);
+
+/**
+ * Saves the whole machine state into `buffer' (nesemu_state_size() bytes; 8-byte aligned
+ * buffers avoid a copy). Returns 1 on success, 0 if the buffer is too small or the board's
+ * RAM does not fit in a state.
+ * @param emu
+ * @param buffer
+ * @param size
+ */
+NESEMU_API int nesemu_save_state(nesemu_t* emu, void* buffer, size_t size);
+
+/**
+ * Restores a state saved from a console running the same ROM. Returns 1 on success, 0 if
+ * the buffer is too small, or the state is not of this version or for another ROM.
+ * @param emu
+ * @param buffer
+ * @param size
+ */
+NESEMU_API int nesemu_load_state(nesemu_t* emu, const void* buffer, size_t size);
+
+/**
+ * The picture, NESEMU_SCREEN_WIDTH x NESEMU_SCREEN_HEIGHT pixels in 0xAARRGGBB format, row
+ * by row with no padding. The pointer is fixed for the instance's lifetime; the contents
+ * are those of the last frame drawn.
+ * @param emu
+ */
+NESEMU_API const uint32_t* nesemu_framebuffer(nesemu_t* emu);
+
+/**
+ * The mono samples (in [-1, 1], at NESEMU_SAMPLE_RATE) produced by the last nesemu_step or
+ * nesemu_step_many call; their number goes to `count'. The pointer is fixed for the
+ * instance's lifetime. Holds at most NESEMU_AUDIO_CAPACITY samples; longer steps keep the
+ * latest.
+ * @param emu
+ * @param count
+ */
+NESEMU_API const float* nesemu_audio(nesemu_t* emu, size_t* count);
+
+/**
+ * The console's NESEMU_WORK_RAM_SIZE bytes of work RAM ($0000-$07FF). The pointer is fixed
+ * for the instance's lifetime and always shows the current contents.
+ * @param emu
+ */
+NESEMU_API const uint8_t* nesemu_work_ram(nesemu_t* emu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //NESEMULATOR_NESEMU_H
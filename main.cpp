@@ -7,25 +7,125 @@
  * https://github.com/josephazrak
  */
 
+#include "system/cartridge.hpp"
+#include "system/frame_pacer.hpp"
 #include "system/mos6502.hpp"
+#include "system/movie.hpp"
+#include "system/nes.hpp"
 #include "system/ram.hpp"
+#include "system/trace.hpp"
 #include <allegro5/allegro5.h>
+#include <allegro5/allegro_audio.h>
 #include <allegro5/allegro_font.h>
 #include <iostream>
+#include <atomic>
 #include <bitset>
 #include <cassert>
+#include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iterator>
-#include <vector>
+#include <memory>
 #include <thread>
-#include <chrono>
+#include <vector>
 
 const std::string VERSION = "0.1 alpha (test)";
-const double CPU_CLOCK = 1.789773 * 10e6; // 1.789 MHz is the clock speed of the 6502 in the
-                                          // NES.
+const double CPU_CLOCK = 1.789773e6; // 1.789 MHz is the clock speed of the 6502 in the
+                                     // NES.
+const double FRAME_RATE = 60.0988;   // NTSC frames per second.
+const uint64_t REPORT_INTERVAL = 600; // Print frame timing every this many frames (~10 s).
+const int DISPLAY_SCALE = 2;          // Window size as a multiple of the 256x240 picture.
+const unsigned int AUDIO_FRAGMENTS = 4;        // Audio stream buffering: 4 x 512 samples (~43 ms).
+const unsigned int AUDIO_FRAGMENT_SIZE = 512;
+
+// Copies the PPU's picture into `screen' and shows it, scaled up to the window.
+static void present_frame(ALLEGRO_BITMAP* screen, const uint32_t* pixels)
+{
+    ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(screen, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_WRITEONLY);
+    if (region == nullptr)
+        return;
+
+    for (int y = 0; y < constants::SCREEN_HEIGHT; y++)
+    {
+        std::memcpy(static_cast<uint8_t*>(region->data) + y * region->pitch, pixels + y * constants::SCREEN_WIDTH,
+                    constants::SCREEN_WIDTH * sizeof(uint32_t));
+    }
+
+    al_unlock_bitmap(screen);
+    al_draw_scaled_bitmap(screen, 0, 0, constants::SCREEN_WIDTH, constants::SCREEN_HEIGHT, 0, 0,
+                          constants::SCREEN_WIDTH * DISPLAY_SCALE, constants::SCREEN_HEIGHT * DISPLAY_SCALE, 0);
+    al_flip_display();
+}
+
+// Controller 1 from the keyboard: arrows, X = A, Z = B, right shift = Select, enter = Start.
+static uint8_t read_keyboard()
+{
+    static const struct { int key; uint8_t button; } KEYS[] = {
+        { ALLEGRO_KEY_X, buttons::A }, { ALLEGRO_KEY_Z, buttons::B }, { ALLEGRO_KEY_RSHIFT, buttons::SELECT },
+        { ALLEGRO_KEY_ENTER, buttons::START }, { ALLEGRO_KEY_UP, buttons::UP }, { ALLEGRO_KEY_DOWN, buttons::DOWN },
+        { ALLEGRO_KEY_LEFT, buttons::LEFT }, { ALLEGRO_KEY_RIGHT, buttons::RIGHT }
+    };
+
+    ALLEGRO_KEYBOARD_STATE keyboard;
+    al_get_keyboard_state(&keyboard);
+
+    uint8_t held = 0;
+    for (const auto& key : KEYS)
+    {
+        if (al_key_down(&keyboard, key.key))
+            held |= key.button;
+    }
+
+    return held;
+}
+
+// Audio thread: refills the stream's fragments from the APU's ring as Allegro asks for them.
+// Never blocks the emulation thread; if the APU falls behind the fragment is padded.
+static void feed_audio(ALLEGRO_AUDIO_STREAM* stream, APU* apu, const std::atomic<bool>* running)
+{
+    ALLEGRO_EVENT_QUEUE* queue = al_create_event_queue();
+    al_register_event_source(queue, al_get_audio_stream_event_source(stream));
+
+    while (running->load())
+    {
+        ALLEGRO_EVENT event;
+        if (!al_wait_for_event_timed(queue, &event, 0.1f) || event.type != ALLEGRO_EVENT_AUDIO_STREAM_FRAGMENT)
+            continue;
+
+        float* fragment = static_cast<float*>(al_get_audio_stream_fragment(stream));
+        if (fragment == nullptr)
+            continue;
+
+        apu->read_samples(fragment, AUDIO_FRAGMENT_SIZE);
+        al_set_audio_stream_fragment(stream, fragment);
+    }
+
+    al_destroy_event_queue(queue);
+}
 
 int main(int argc, char **argv) {
-    address_t ENTRY_POINT = 0x0004; // TODO: iNES parser should set this; this should not be hardcoded.
+    address_t ENTRY_POINT = 0x0004; // Raw (non-iNES) binaries are loaded at $0000 and started here.
+    std::string rom_path = "rom.bin";
+    pacing_mode_t pacing = pacing_mode_t::REALTIME;
+    std::string record_path; // --record: write the input of this session to a movie.
+    std::string play_path;   // --play: fast-forward through a movie, then carry on from its end.
+    std::string trace_path;  // --trace: log every executed instruction (Debug builds only).
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+
+        if (argument == "--fast")
+            pacing = pacing_mode_t::UNTHROTTLED; // Run as fast as possible.
+        else if (argument == "--record" && i + 1 < argc)
+            record_path = argv[++i];
+        else if (argument == "--play" && i + 1 < argc)
+            play_path = argv[++i];
+        else if (argument == "--trace" && i + 1 < argc)
+            trace_path = argv[++i];
+        else
+            rom_path = argument;
+    }
 
     std::cout << std::endl << "NES Emulator version " << VERSION << std::endl;
     std::cout << "https://github.com/josephazrak" << std::endl;
@@ -65,28 +165,212 @@ int main(int argc, char **argv) {
     std::cout << "Clearing RAM..." << std::endl;
     test_ram.clear_address_space();
 
-    std::cout << "Will now read the file ``rom.bin'' and load it into $0000. Execution will start at $0004. Press <enter> if that's OK or <ctrl-c> to abort. ";
-    std::cin.get();
+    std::unique_ptr<NES> nes; // The whole console, for iNES images.
+    uint8_t magic[constants::INES_HEADER_SIZE] = {};
+
+    std::ifstream test_rom(rom_path, std::ios::binary);
+    test_rom.read(reinterpret_cast<char*>(magic), sizeof(magic));
+    bool is_ines = Cartridge::is_ines(magic, test_rom.gcount());
+
+    if (is_ines)
+    {
+        test_rom.close();
+
+        nes.reset(new NES());
+        if (!nes->load_rom(rom_path))
+            return 1;
+
+        const ines_header_t& header = nes->get_cartridge().get_header();
+        std::cout << "Loaded iNES" << (header.nes2 ? " 2.0" : "") << " image ``" << rom_path << "'': mapper " << header.mapper
+                  << ", " << header.prg_rom_size / 1024 << "KiB PRG-ROM, " << header.chr_rom_size / 1024 << "KiB CHR-ROM"
+                  << (header.battery ? ", battery-backed PRG-RAM" : "") << std::endl;
+    }
+    else
+    {
+        std::cout << "Will now read the file ``" << rom_path << "'' and load it into $0000. Execution will start at $"
+                  << std::hex << ENTRY_POINT << std::dec << ". Press <enter> if that's OK or <ctrl-c> to abort. ";
+        std::cin.get();
+
+        test_rom.clear();
+        test_rom.seekg(0);
+        std::vector<uint8_t> test_rom_bytes ((std::istreambuf_iterator<char>(test_rom)),(std::istreambuf_iterator<char>())); // Load rom into byte array
+        test_rom.close();
+
+        std::cout << "Read " << test_rom_bytes.size() << " byte(s) from file. Writing to $0000" << std::endl;
+
+        test_ram.load(test_rom_bytes, 0x0000);
+        test_ram.hexdump_bytes(0x0000, 100, 20);
+
+        test_cpu.PC = ENTRY_POINT;
+    }
+
+    MOS6502& cpu = nes ? nes->get_cpu() : test_cpu;
+
+    // Debug builds can trace every executed instruction, as binary records; NESTraceFormat
+    // turns the file into a nestest-style log.
+    std::unique_ptr<Tracer> tracer;
+
+    if (!trace_path.empty())
+    {
+#ifdef NESEMU_TRACE
+        tracer.reset(new Tracer(trace_path, trace_format_t::BINARY));
+        cpu.attach_tracer(tracer.get());
+#else
+        std::cout << "[Trace] Tracing is only compiled into Debug builds; ignoring --trace." << std::endl;
+#endif
+    }
+
+    if (nes && !play_path.empty())
+    {
+        Movie played;
+        movie_replay_result_t result;
+
+        if (!played.read_file(play_path))
+            return 1;
 
-    std::ifstream test_rom("rom.bin", std::ios::binary);
-    std::vector<uint8_t> test_rom_bytes ((std::istreambuf_iterator<char>(test_rom)),(std::istreambuf_iterator<char>())); // Load rom into byte array
-    test_rom.close();
+        if (!played.replay(*nes, result))
+        {
+            std::cout << "[Movie] ERROR! ``" << play_path << "'' was not recorded with ``" << rom_path << "''." << std::endl;
+            return 1;
+        }
 
-    std::cout << "Read " << test_rom_bytes.size() << " byte(s) from file. Writing to $0000" << std::endl;
+        std::cout << "[Movie] Replayed " << result.frames << " frame(s), " << result.checkpoints << " checkpoint(s) matched";
+        if (result.desync_frame != 0)
+            std::cout << "; DESYNC after frame " << result.desync_frame;
+        std::cout << "." << std::endl;
+    }
 
-    test_ram.write_byte_vector(0x0000, test_rom_bytes);
-    test_ram.hexdump_bytes(0x0000, 100, 20);
+    Movie recording;
+    bool recording_input = false;
+
+    if (nes && !record_path.empty())
+    {
+        recording_input = recording.begin(*nes);
+        if (!recording_input)
+            std::cout << "[Movie] ERROR! Could not capture the starting state; not recording." << std::endl;
+    }
 
     std::cout << std::endl << std::endl;
-    std::cout << "Starting processor with PC = $0004. Ctrl-C to stop emulation." << std::endl;
+    std::cout << "Starting processor with PC = $" << std::hex << cpu.PC << std::dec << ". Ctrl-C to stop emulation." << std::endl;
+
+    // A whole console is paced by PPU frames; a bare CPU by cycles.
+    std::unique_ptr<FramePacer> pacer(nes ? new FramePacer(*nes, pacing, FRAME_RATE)
+                                          : new FramePacer(test_cpu, pacing, CPU_CLOCK, FRAME_RATE));
+
+    // Only consoles have a picture to show. Without a display (or Allegro) the emulation
+    // just runs.
+    ALLEGRO_DISPLAY* display = nullptr;
+    ALLEGRO_BITMAP* screen = nullptr;
+    ALLEGRO_EVENT_QUEUE* events = nullptr;
+
+    if (nes && al_init())
+        display = al_create_display(constants::SCREEN_WIDTH * DISPLAY_SCALE, constants::SCREEN_HEIGHT * DISPLAY_SCALE);
 
-    test_cpu.PC = 0x0004;
-    std::chrono::milliseconds clock_period(3000); // 3 seconds per clock cycle.
+    if (display != nullptr)
+    {
+        al_set_window_title(display, ("NES Emulator - " + rom_path).c_str());
+        screen = al_create_bitmap(constants::SCREEN_WIDTH, constants::SCREEN_HEIGHT);
+        events = al_create_event_queue();
+        al_register_event_source(events, al_get_display_event_source(display));
+    }
+    else if (nes)
+    {
+        std::cout << "[Display] Could not open a window; running without video." << std::endl;
+    }
+
+    // Controller 1 is played from the keyboard of the window.
+    const bool keyboard = display != nullptr && al_install_keyboard();
+
+    // Sound, fed from its own thread.
+    ALLEGRO_AUDIO_STREAM* stream = nullptr;
+    std::atomic<bool> audio_running(true);
+    std::thread audio_thread;
+
+    if (display != nullptr && al_install_audio() && al_reserve_samples(1))
+    {
+        stream = al_create_audio_stream(AUDIO_FRAGMENTS, AUDIO_FRAGMENT_SIZE, constants::AUDIO_SAMPLE_RATE,
+                                        ALLEGRO_AUDIO_DEPTH_FLOAT32, ALLEGRO_CHANNEL_CONF_1);
+    }
+
+    if (stream != nullptr && al_attach_audio_stream_to_mixer(stream, al_get_default_mixer()))
+        audio_thread = std::thread(feed_audio, stream, &nes->get_apu(), &audio_running);
+    else if (display != nullptr)
+        std::cout << "[Audio] Could not open an audio stream; running without sound." << std::endl;
 
     // Main loop
-    while (true)
+    bool running = true;
+
+    while (running && !cpu.is_halted())
     {
-        test_cpu.clock();
-        std::this_thread::sleep_for(clock_period);
+        const uint8_t held = keyboard ? read_keyboard() : 0;
+
+        if (recording_input)
+            recording.input_frame(*nes, held, 0);
+        else if (nes)
+            nes->set_controller(0, held);
+
+        pacer->run_frame();
+
+        if (recording_input)
+            recording.end_frame(*nes);
+
+        if (display != nullptr)
+        {
+            present_frame(screen, nes->get_ppu().get_frame_buffer());
+
+            ALLEGRO_EVENT event;
+            while (al_get_next_event(events, &event))
+            {
+                if (event.type == ALLEGRO_EVENT_DISPLAY_CLOSE)
+                    running = false;
+            }
+        }
+
+        if (pacer->get_stats().frames == REPORT_INTERVAL)
+        {
+            pacer->report();
+
+            if (audio_thread.joinable())
+            {
+                const audio_stats_t audio = nes->get_apu().get_stats();
+                std::cout << "[Audio] " << audio.underruns << " underrun(s), " << audio.overrun_samples
+                          << " sample(s) dropped so far." << std::endl;
+            }
+        }
     }
+
+    if (audio_thread.joinable())
+    {
+        audio_running = false;
+        audio_thread.join();
+    }
+
+    if (stream != nullptr)
+        al_destroy_audio_stream(stream);
+
+    // Flushes the last records to disk.
+    cpu.attach_tracer(nullptr);
+    tracer.reset();
+
+    if (recording_input)
+    {
+        if (recording.write_file(record_path))
+            std::cout << "[Movie] Recorded " << recording.get_frame_count() << " frame(s) to ``" << record_path << "''." << std::endl;
+    }
+
+    if (display != nullptr)
+    {
+        al_destroy_event_queue(events);
+        al_destroy_bitmap(screen);
+        al_destroy_display(display);
+    }
+
+    if (!cpu.is_halted())
+        return 0;
+
+    std::cout << "[6502] Hit an unimplemented opcode at $" << std::setw(4) << std::hex << cpu.halt_address << std::dec << "." << std::endl;
+    std::cout << "[6502] byte \"" << std::setw(2) << std::hex << +cpu.halt_opcode << "\" at $" << std::setw(4) << cpu.halt_address << std::dec << std::endl;
+    std::cout << "[6502] Halting execution" << std::endl;
+
+    return 0;
 }
@@ -0,0 +1,819 @@
+//
+// The audio processing unit (the 2A03's sound channels).
+//
+
+#include "apu.hpp"
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+    const uint8_t LENGTH_TABLE[32] = {
+        10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+        12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+    };
+
+    const uint8_t DUTY_TABLE[4][8] = {
+        { 0, 1, 0, 0, 0, 0, 0, 0 }, // 12.5%
+        { 0, 1, 1, 0, 0, 0, 0, 0 }, // 25%
+        { 0, 1, 1, 1, 1, 0, 0, 0 }, // 50%
+        { 1, 0, 0, 1, 1, 1, 1, 1 }  // 25% negated
+    };
+
+    const uint8_t TRIANGLE_TABLE[32] = {
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+    };
+
+    // NTSC periods in CPU cycles.
+    const uint16_t NOISE_PERIODS[16] = { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
+    const uint16_t DMC_PERIODS[16] = { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54 };
+
+    // Frame counter: CPU cycles after the sequence start at which each of its four steps
+    // happens (4-step mode, 5-step mode), and the sequence lengths. Steps 1 and 3 also clock
+    // the length counters and sweeps; step 3 of the 4-step sequence raises the frame IRQ.
+    const uint32_t FRAME_STEP_CYCLES[2][4] = { { 7457, 14913, 22371, 29829 }, { 7457, 14913, 22371, 37281 } };
+    const uint32_t FRAME_SEQUENCE_LENGTH[2] = { 29830, 37282 };
+
+    // The console's non-linear mixer, as lookup tables.
+    struct mixer_tables_t
+    {
+        float pulse[31];
+        float tnd[203];
+    };
+
+    const mixer_tables_t& mixer()
+    {
+        static const mixer_tables_t tables = []() {
+            mixer_tables_t mix;
+            mix.pulse[0] = 0;
+            for (unsigned int i = 1; i < 31; i++)
+                mix.pulse[i] = 95.52f / (8128.0f / i + 100.0f);
+            mix.tnd[0] = 0;
+            for (unsigned int i = 1; i < 203; i++)
+                mix.tnd[i] = 163.67f / (24329.0f / i + 100.0f);
+            return mix;
+        }();
+
+        return tables;
+    }
+
+    // First-order filter coefficients at the output rate.
+    float high_pass_coefficient(double cutoff)
+    {
+        const double rc = 1.0 / (2.0 * M_PI * cutoff);
+        const double dt = 1.0 / constants::AUDIO_SAMPLE_RATE;
+        return (float)(rc / (rc + dt));
+    }
+
+    float low_pass_coefficient(double cutoff)
+    {
+        const double rc = 1.0 / (2.0 * M_PI * cutoff);
+        const double dt = 1.0 / constants::AUDIO_SAMPLE_RATE;
+        return (float)(dt / (rc + dt));
+    }
+
+    const float HIGH_PASS_90 = high_pass_coefficient(90.0);
+    const float HIGH_PASS_440 = high_pass_coefficient(440.0);
+    const float LOW_PASS_14K = low_pass_coefficient(14000.0);
+
+    // ===========================
+    // CHANNEL HELPERS
+    // ===========================
+
+    uint32_t envelope_volume(uint32_t constant_volume, uint32_t volume, uint32_t decay)
+    {
+        return constant_volume ? volume : decay;
+    }
+
+    void clock_envelope(uint32_t& start, uint32_t& divider, uint32_t& decay, uint32_t period, uint32_t loop)
+    {
+        if (start)
+        {
+            start = 0;
+            decay = 15;
+            divider = period;
+            return;
+        }
+
+        if (divider > 0)
+        {
+            divider--;
+            return;
+        }
+
+        divider = period;
+        if (decay > 0)
+            decay--;
+        else if (loop)
+            decay = 15;
+    }
+
+    // Pulse 1 negates with ones' complement, pulse 2 with two's complement.
+    uint32_t sweep_target(const apu_pulse_t& pulse, bool ones_complement)
+    {
+        const uint32_t change = pulse.timer_period >> pulse.sweep_shift;
+
+        if (!pulse.sweep_negate)
+            return pulse.timer_period + change;
+
+        const uint32_t subtract = change + (ones_complement ? 1 : 0);
+        return subtract > pulse.timer_period ? 0 : pulse.timer_period - subtract;
+    }
+
+    bool pulse_muted(const apu_pulse_t& pulse, bool ones_complement)
+    {
+        return pulse.timer_period < 8 || sweep_target(pulse, ones_complement) > 0x7FF;
+    }
+
+    bool pulse_active(const apu_pulse_t& pulse, bool ones_complement)
+    {
+        return pulse.length > 0 && !pulse_muted(pulse, ones_complement);
+    }
+
+    uint32_t pulse_output(const apu_pulse_t& pulse, bool ones_complement)
+    {
+        if (!pulse_active(pulse, ones_complement) || !DUTY_TABLE[pulse.duty][pulse.duty_step])
+            return 0;
+
+        return envelope_volume(pulse.constant_volume, pulse.volume, pulse.envelope_decay);
+    }
+
+    // Periods below 2 are ultrasonic; the channel is left frozen rather than stepped every cycle.
+    bool triangle_active(const apu_triangle_t& triangle)
+    {
+        return triangle.length > 0 && triangle.linear_counter > 0 && triangle.timer_period >= 2;
+    }
+
+    uint32_t noise_output(const apu_noise_t& noise)
+    {
+        if (noise.length == 0 || (noise.shift & 1))
+            return 0;
+
+        return envelope_volume(noise.constant_volume, noise.volume, noise.envelope_decay);
+    }
+
+    void clock_noise(apu_noise_t& noise)
+    {
+        const uint32_t feedback = (noise.shift ^ (noise.shift >> (noise.mode ? 6 : 1))) & 1;
+        noise.shift = (noise.shift >> 1) | (feedback << 14);
+    }
+
+    // Runs a channel timer for `cycles' cycles, reloading it with `period' each time it
+    // expires. Returns how many times it expired.
+    uint64_t advance_timer(uint32_t& timer, uint32_t period, uint64_t cycles)
+    {
+        if (cycles < timer)
+        {
+            timer -= (uint32_t)cycles;
+            return 0;
+        }
+
+        const uint64_t over = cycles - timer;
+        timer = period - (uint32_t)(over % period);
+        return 1 + over / period;
+    }
+} // namespace
+
+APU::APU(MOS6502* cpu, RAM* bus)
+    : cpu(cpu), bus(bus), ring(constants::AUDIO_RING_SIZE), samples_produced(0), overrun_samples(0), underruns(0),
+      underrun_samples(0)
+{
+    power_on();
+}
+
+APU::~APU() = default;
+
+void APU::power_on()
+{
+    std::memset(&state, 0x00, sizeof(state));
+
+    state.pulse[0].timer = 2;
+    state.pulse[1].timer = 2;
+    state.triangle.timer = 1;
+    state.noise.period = NOISE_PERIODS[0];
+    state.noise.timer = state.noise.period;
+    state.noise.shift = 1;
+    state.dmc.period = DMC_PERIODS[0];
+    state.dmc.timer = state.dmc.period;
+    state.dmc.bits_remaining = 8;
+    state.dmc.silence = 1;
+
+    std::memset(high_pass_90, 0x00, sizeof(high_pass_90));
+    std::memset(high_pass_440, 0x00, sizeof(high_pass_440));
+    low_pass_14k = 0;
+    block_fill = 0;
+    sample_phase = 0;
+
+    start_sample();
+    update_level();
+}
+
+// ===========================
+// TIMING
+// ===========================
+
+void APU::catch_up()
+{
+    run_to(cpu->cycles);
+}
+
+void APU::run_to(uint64_t target)
+{
+    if (!audio_output)
+    {
+        skip_to(target);
+        return;
+    }
+
+    apu_state_t& s = state;
+
+    while (s.cycle < target)
+    {
+        // Run to whichever comes first: the target, the next frame counter step, the end of
+        // the output sample, or a channel timer expiring. Nothing audible changes in between.
+        const uint64_t frame_event = s.frame_start + FRAME_STEP_CYCLES[s.frame_mode][s.frame_step];
+        const bool pulse_on[2] = { pulse_active(s.pulse[0], true), pulse_active(s.pulse[1], false) };
+        const bool triangle_on = triangle_active(s.triangle);
+        const bool noise_on = s.noise.length > 0;
+
+        uint64_t step = target - s.cycle;
+        if (frame_event - s.cycle < step)
+            step = frame_event - s.cycle;
+        if (sample_cycles < step)
+            step = sample_cycles;
+        for (unsigned int i = 0; i < 2; i++)
+        {
+            if (pulse_on[i] && s.pulse[i].timer < step)
+                step = s.pulse[i].timer;
+        }
+        if (triangle_on && s.triangle.timer < step)
+            step = s.triangle.timer;
+        if (noise_on && s.noise.timer < step)
+            step = s.noise.timer;
+        if (s.dmc.timer < step)
+            step = s.dmc.timer;
+
+        accumulator += level * step;
+        s.cycle += step;
+        sample_cycles -= step;
+
+        bool changed = false;
+
+        for (unsigned int i = 0; i < 2; i++)
+        {
+            if (pulse_on[i] && (s.pulse[i].timer -= step) == 0)
+            {
+                s.pulse[i].duty_step = (s.pulse[i].duty_step + 1) & 7;
+                s.pulse[i].timer = 2 * (s.pulse[i].timer_period + 1);
+                changed = true;
+            }
+        }
+
+        if (triangle_on && (s.triangle.timer -= step) == 0)
+        {
+            s.triangle.step = (s.triangle.step + 1) & 31;
+            s.triangle.timer = s.triangle.timer_period + 1;
+            changed = true;
+        }
+
+        if (noise_on && (s.noise.timer -= step) == 0)
+        {
+            clock_noise(s.noise);
+            s.noise.timer = s.noise.period;
+            changed = true;
+        }
+
+        if ((s.dmc.timer -= step) == 0 && clock_dmc())
+            changed = true;
+
+        if (s.cycle == frame_event)
+        {
+            clock_frame_counter();
+            changed = true;
+        }
+
+        if (changed)
+            update_level();
+
+        if (sample_cycles == 0)
+            emit_sample();
+    }
+}
+
+void APU::skip_to(uint64_t target)
+{
+    apu_state_t& s = state;
+
+    // As run_to(), but only the frame counter and the DMC (which reads memory and stalls the
+    // CPU) have to be met exactly; the other channels' timers are advanced in one go.
+    while (s.cycle < target)
+    {
+        const uint64_t frame_event = s.frame_start + FRAME_STEP_CYCLES[s.frame_mode][s.frame_step];
+
+        uint64_t step = target - s.cycle;
+        if (frame_event - s.cycle < step)
+            step = frame_event - s.cycle;
+        if (s.dmc.timer < step)
+            step = s.dmc.timer;
+
+        for (unsigned int i = 0; i < 2; i++)
+        {
+            apu_pulse_t& pulse = s.pulse[i];
+            if (pulse_active(pulse, i == 0))
+                pulse.duty_step = (pulse.duty_step + advance_timer(pulse.timer, 2 * (pulse.timer_period + 1), step)) & 7;
+        }
+
+        if (triangle_active(s.triangle))
+            s.triangle.step = (s.triangle.step + advance_timer(s.triangle.timer, s.triangle.timer_period + 1, step)) & 31;
+
+        if (s.noise.length > 0)
+        {
+            for (uint64_t n = advance_timer(s.noise.timer, s.noise.period, step); n > 0; n--)
+                clock_noise(s.noise);
+        }
+
+        s.cycle += step;
+
+        if ((s.dmc.timer -= step) == 0)
+            clock_dmc();
+
+        if (s.cycle == frame_event)
+            clock_frame_counter();
+    }
+}
+
+bool APU::clock_dmc()
+{
+    apu_dmc_t& dmc = state.dmc;
+    bool changed = false;
+
+    if (!dmc.silence)
+    {
+        if (dmc.shift_register & 1)
+        {
+            if (dmc.output_level <= 125)
+                dmc.output_level += 2;
+        }
+        else if (dmc.output_level >= 2)
+        {
+            dmc.output_level -= 2;
+        }
+        dmc.shift_register >>= 1;
+        changed = true;
+    }
+
+    if (--dmc.bits_remaining == 0)
+    {
+        dmc.bits_remaining = 8;
+        dmc.silence = !dmc.buffer_full;
+
+        if (dmc.buffer_full)
+        {
+            dmc.shift_register = dmc.buffer;
+            dmc.buffer_full = 0;
+            dmc_fetch();
+        }
+    }
+
+    dmc.timer = dmc.period;
+    return changed;
+}
+
+void APU::clock_frame_counter()
+{
+    const uint32_t step = state.frame_step;
+
+    quarter_frame();
+    if (step & 1)
+        half_frame();
+
+    if (step < 3)
+    {
+        state.frame_step++;
+        return;
+    }
+
+    if (state.frame_mode == 0 && !state.irq_inhibit)
+    {
+        state.frame_irq_flag = 1;
+        update_irq();
+    }
+
+    state.frame_start += FRAME_SEQUENCE_LENGTH[state.frame_mode];
+    state.frame_step = 0;
+}
+
+void APU::quarter_frame()
+{
+    for (apu_pulse_t& pulse : state.pulse)
+        clock_envelope(pulse.envelope_start, pulse.envelope_divider, pulse.envelope_decay, pulse.volume, pulse.halt);
+
+    apu_noise_t& noise = state.noise;
+    clock_envelope(noise.envelope_start, noise.envelope_divider, noise.envelope_decay, noise.volume, noise.halt);
+
+    apu_triangle_t& triangle = state.triangle;
+    if (triangle.linear_reload)
+        triangle.linear_counter = triangle.linear_reload_value;
+    else if (triangle.linear_counter > 0)
+        triangle.linear_counter--;
+
+    if (!triangle.control)
+        triangle.linear_reload = 0;
+}
+
+void APU::half_frame()
+{
+    for (unsigned int i = 0; i < 2; i++)
+    {
+        apu_pulse_t& pulse = state.pulse[i];
+
+        if (!pulse.halt && pulse.length > 0)
+            pulse.length--;
+
+        const uint32_t target = sweep_target(pulse, i == 0);
+        if (pulse.sweep_divider == 0 && pulse.sweep_enabled && pulse.sweep_shift > 0 && !pulse_muted(pulse, i == 0))
+            pulse.timer_period = target;
+
+        if (pulse.sweep_divider == 0 || pulse.sweep_reload)
+        {
+            pulse.sweep_divider = pulse.sweep_period;
+            pulse.sweep_reload = 0;
+        }
+        else
+        {
+            pulse.sweep_divider--;
+        }
+    }
+
+    if (!state.triangle.control && state.triangle.length > 0)
+        state.triangle.length--;
+
+    if (!state.noise.halt && state.noise.length > 0)
+        state.noise.length--;
+}
+
+void APU::dmc_fetch()
+{
+    apu_dmc_t& dmc = state.dmc;
+
+    if (dmc.buffer_full || dmc.bytes_remaining == 0)
+        return;
+
+    dmc.buffer = bus->read_byte(dmc.current_address);
+    dmc.buffer_full = 1;
+    dmc.current_address = dmc.current_address == 0xFFFF ? 0x8000 : dmc.current_address + 1;
+
+    // The CPU is stalled while the DMC reads memory.
+    cpu->cycles += 4;
+
+    if (--dmc.bytes_remaining > 0)
+        return;
+
+    if (dmc.loop)
+    {
+        dmc.current_address = dmc.sample_address;
+        dmc.bytes_remaining = dmc.sample_length;
+    }
+    else if (dmc.irq_enabled)
+    {
+        dmc.irq_flag = 1;
+        update_irq();
+    }
+}
+
+void APU::update_level()
+{
+    const mixer_tables_t& mix = mixer();
+
+    const uint32_t pulse = pulse_output(state.pulse[0], true) + pulse_output(state.pulse[1], false);
+    const uint32_t triangle = TRIANGLE_TABLE[state.triangle.step];
+    const uint32_t noise = noise_output(state.noise);
+
+    level = mix.pulse[pulse] + mix.tnd[3 * triangle + 2 * noise + state.dmc.output_level];
+}
+
+void APU::update_irq()
+{
+    // End the CPU's run so whoever drives it can look at the IRQ line.
+    if (irq_asserted())
+        cpu->run_target = 0;
+}
+
+bool APU::irq_asserted() const
+{
+    return state.frame_irq_flag || state.dmc.irq_flag;
+}
+
+uint64_t APU::next_irq_cycle() const
+{
+    uint64_t next = std::numeric_limits<uint64_t>::max();
+
+    if (state.frame_mode == 0 && !state.irq_inhibit && !state.frame_irq_flag)
+        next = state.frame_start + FRAME_STEP_CYCLES[0][3];
+
+    const apu_dmc_t& dmc = state.dmc;
+    if (dmc.irq_enabled && !dmc.loop && !dmc.irq_flag && dmc.bytes_remaining > 0)
+    {
+        // The last byte is fetched when the byte before it leaves the buffer.
+        const uint64_t first_fetch = dmc.buffer_full ? next_dmc_fetch_cycle() : state.cycle;
+        const uint64_t last_fetch = first_fetch + (uint64_t)(dmc.bytes_remaining - 1) * 8 * dmc.period;
+        if (last_fetch < next)
+            next = last_fetch;
+    }
+
+    return next;
+}
+
+uint64_t APU::next_dmc_fetch_cycle() const
+{
+    // The next byte is read as the buffered one moves into the shift register.
+    const apu_dmc_t& dmc = state.dmc;
+    if (!dmc.buffer_full || dmc.bytes_remaining == 0)
+        return std::numeric_limits<uint64_t>::max();
+
+    return state.cycle + dmc.timer + (uint64_t)(dmc.bits_remaining - 1) * dmc.period;
+}
+
+// ===========================
+// OUTPUT
+// ===========================
+
+void APU::start_sample()
+{
+    // Output samples are 37 or 38 cycles long so that they average out to exactly
+    // CPU clock / sample rate.
+    sample_phase += constants::APU_CPU_CLOCK;
+    sample_length = sample_phase / constants::AUDIO_SAMPLE_RATE;
+    sample_phase %= constants::AUDIO_SAMPLE_RATE;
+
+    sample_cycles = sample_length;
+    accumulator = 0;
+}
+
+void APU::emit_sample()
+{
+    const float input = (float)(accumulator / sample_length);
+
+    // The console's output stage: two high-pass filters (90 Hz, 440 Hz) and a low-pass
+    // filter (14 kHz).
+    high_pass_90[1] = HIGH_PASS_90 * (high_pass_90[1] + input - high_pass_90[0]);
+    high_pass_90[0] = input;
+
+    high_pass_440[1] = HIGH_PASS_440 * (high_pass_440[1] + high_pass_90[1] - high_pass_440[0]);
+    high_pass_440[0] = high_pass_90[1];
+
+    low_pass_14k += LOW_PASS_14K * (high_pass_440[1] - low_pass_14k);
+
+    float sample = low_pass_14k;
+    if (sample > 1.0f)
+        sample = 1.0f;
+    else if (sample < -1.0f)
+        sample = -1.0f;
+
+    block[block_fill++] = sample;
+    if (block_fill == constants::AUDIO_BLOCK_SIZE)
+        flush_block();
+
+    start_sample();
+}
+
+void APU::flush_block()
+{
+    const std::size_t pushed = ring.push_bulk(block, block_fill);
+
+    samples_produced.fetch_add(block_fill, std::memory_order_relaxed);
+    if (pushed < block_fill)
+        overrun_samples.fetch_add(block_fill - pushed, std::memory_order_relaxed);
+
+    block_fill = 0;
+}
+
+std::size_t APU::read_samples(float* samples, std::size_t count)
+{
+    const std::size_t popped = ring.pop_bulk(samples, count);
+
+    if (popped > 0)
+        last_sample = samples[popped - 1];
+
+    if (popped < count)
+    {
+        for (std::size_t i = popped; i < count; i++)
+            samples[i] = last_sample;
+
+        underruns.fetch_add(1, std::memory_order_relaxed);
+        underrun_samples.fetch_add(count - popped, std::memory_order_relaxed);
+    }
+
+    return popped;
+}
+
+std::size_t APU::queued_samples() const
+{
+    return ring.size();
+}
+
+void APU::set_audio_output(bool enabled)
+{
+    if (enabled && !audio_output)
+    {
+        // Start afresh from the current channel outputs.
+        start_sample();
+        update_level();
+    }
+
+    audio_output = enabled;
+}
+
+audio_stats_t APU::get_stats() const
+{
+    audio_stats_t stats;
+    stats.samples_produced = samples_produced.load(std::memory_order_relaxed);
+    stats.overrun_samples = overrun_samples.load(std::memory_order_relaxed);
+    stats.underruns = underruns.load(std::memory_order_relaxed);
+    stats.underrun_samples = underrun_samples.load(std::memory_order_relaxed);
+    return stats;
+}
+
+// ===========================
+// CPU INTERFACE
+// ===========================
+
+uint8_t APU::read(address_t addr)
+{
+    if ((addr & 0xFFFF) != 0x4015)
+        return 0x00;
+
+    catch_up();
+
+    const uint8_t status = peek(addr);
+
+    // Reading the status acknowledges the frame IRQ.
+    state.frame_irq_flag = 0;
+
+    return status;
+}
+
+uint8_t APU::peek(address_t addr) const
+{
+    if ((addr & 0xFFFF) != 0x4015)
+        return 0x00;
+
+    return (state.dmc.irq_flag << 7) | (state.frame_irq_flag << 6) | ((state.dmc.bytes_remaining > 0) << 4) |
+           ((state.noise.length > 0) << 3) | ((state.triangle.length > 0) << 2) | ((state.pulse[1].length > 0) << 1) |
+           (state.pulse[0].length > 0);
+}
+
+void APU::write(address_t addr, uint8_t value)
+{
+    catch_up();
+
+    const unsigned int reg = addr & 0x1F;
+
+    switch (reg)
+    {
+        case 0x00: case 0x04: // Pulse duty, envelope
+        {
+            apu_pulse_t& pulse = state.pulse[reg >> 2];
+            pulse.duty = value >> 6;
+            pulse.halt = (value >> 5) & 1;
+            pulse.constant_volume = (value >> 4) & 1;
+            pulse.volume = value & 0x0F;
+            break;
+        }
+        case 0x01: case 0x05: // Pulse sweep
+        {
+            apu_pulse_t& pulse = state.pulse[reg >> 2];
+            pulse.sweep_enabled = value >> 7;
+            pulse.sweep_period = (value >> 4) & 7;
+            pulse.sweep_negate = (value >> 3) & 1;
+            pulse.sweep_shift = value & 7;
+            pulse.sweep_reload = 1;
+            break;
+        }
+        case 0x02: case 0x06: // Pulse timer low
+        {
+            apu_pulse_t& pulse = state.pulse[reg >> 2];
+            pulse.timer_period = (pulse.timer_period & 0x700) | value;
+            break;
+        }
+        case 0x03: case 0x07: // Pulse length, timer high
+        {
+            apu_pulse_t& pulse = state.pulse[reg >> 2];
+            pulse.timer_period = (pulse.timer_period & 0x0FF) | ((value & 7) << 8);
+            if (pulse.enabled)
+                pulse.length = LENGTH_TABLE[value >> 3];
+            pulse.duty_step = 0;
+            pulse.envelope_start = 1;
+            break;
+        }
+        case 0x08: // Triangle linear counter
+            state.triangle.control = value >> 7;
+            state.triangle.linear_reload_value = value & 0x7F;
+            break;
+        case 0x0A: // Triangle timer low
+            state.triangle.timer_period = (state.triangle.timer_period & 0x700) | value;
+            break;
+        case 0x0B: // Triangle length, timer high
+            state.triangle.timer_period = (state.triangle.timer_period & 0x0FF) | ((value & 7) << 8);
+            if (state.triangle.enabled)
+                state.triangle.length = LENGTH_TABLE[value >> 3];
+            state.triangle.linear_reload = 1;
+            break;
+        case 0x0C: // Noise envelope
+            state.noise.halt = (value >> 5) & 1;
+            state.noise.constant_volume = (value >> 4) & 1;
+            state.noise.volume = value & 0x0F;
+            break;
+        case 0x0E: // Noise mode, period
+            state.noise.mode = value >> 7;
+            state.noise.period = NOISE_PERIODS[value & 0x0F];
+            break;
+        case 0x0F: // Noise length
+            if (state.noise.enabled)
+                state.noise.length = LENGTH_TABLE[value >> 3];
+            state.noise.envelope_start = 1;
+            break;
+        case 0x10: // DMC IRQ, loop, rate
+            state.dmc.irq_enabled = value >> 7;
+            state.dmc.loop = (value >> 6) & 1;
+            state.dmc.period = DMC_PERIODS[value & 0x0F];
+            if (!state.dmc.irq_enabled)
+                state.dmc.irq_flag = 0;
+            break;
+        case 0x11: // DMC direct load
+            state.dmc.output_level = value & 0x7F;
+            break;
+        case 0x12: // DMC sample address
+            state.dmc.sample_address = 0xC000 + value * 64;
+            break;
+        case 0x13: // DMC sample length
+            state.dmc.sample_length = value * 16 + 1;
+            break;
+        case 0x15: // Channel enables
+            state.pulse[0].enabled = value & 1;
+            state.pulse[1].enabled = (value >> 1) & 1;
+            state.triangle.enabled = (value >> 2) & 1;
+            state.noise.enabled = (value >> 3) & 1;
+
+            if (!state.pulse[0].enabled)
+                state.pulse[0].length = 0;
+            if (!state.pulse[1].enabled)
+                state.pulse[1].length = 0;
+            if (!state.triangle.enabled)
+                state.triangle.length = 0;
+            if (!state.noise.enabled)
+                state.noise.length = 0;
+
+            state.dmc.irq_flag = 0;
+            if (!(value & 0x10))
+            {
+                state.dmc.bytes_remaining = 0;
+            }
+            else if (state.dmc.bytes_remaining == 0)
+            {
+                state.dmc.current_address = state.dmc.sample_address;
+                state.dmc.bytes_remaining = state.dmc.sample_length;
+                dmc_fetch();
+            }
+            break;
+        case 0x17: // Frame counter
+            state.frame_mode = value >> 7;
+            state.irq_inhibit = (value >> 6) & 1;
+            if (state.irq_inhibit)
+                state.frame_irq_flag = 0;
+
+            state.frame_start = state.cycle;
+            state.frame_step = 0;
+
+            // The 5-step mode clocks everything straight away.
+            if (state.frame_mode)
+            {
+                quarter_frame();
+                half_frame();
+            }
+            break;
+        default:
+            break;
+    }
+
+    update_level();
+}
+
+// ===========================
+// SAVE STATES
+// ===========================
+
+void APU::save_state(apu_state_t& out) const
+{
+    out = state;
+}
+
+void APU::load_state(const apu_state_t& in)
+{
+    state = in;
+
+    start_sample();
+    update_level();
+}
@@ -0,0 +1,263 @@
+//
+// The audio processing unit (the 2A03's sound channels).
+//
+
+#ifndef NESEMULATOR_APU_HPP
+#define NESEMULATOR_APU_HPP
+
+#include "mos6502.hpp"
+#include "ram.hpp"
+#include "spsc_ring.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace constants
+{
+    const uint32_t AUDIO_SAMPLE_RATE = 48000;
+    const uint32_t APU_CPU_CLOCK = 1789773;    // Integer NTSC CPU clock, for exact resampling.
+    const std::size_t AUDIO_BLOCK_SIZE = 256;  // Samples produced before handing a block to the ring.
+    const std::size_t AUDIO_RING_SIZE = 8192;  // About 170 ms at 48 kHz.
+} // namespace constants
+
+// Emulation state of the channels and frame counter. Every field is a uint32_t (apart from
+// the leading cycle counter) so the struct has no padding; it is saved as-is in savestate_t.
+// Timers count CPU cycles to the channel's next step.
+struct apu_pulse_t
+{
+    uint32_t enabled;
+    uint32_t duty;
+    uint32_t duty_step;
+    uint32_t halt;              // Length counter halt / envelope loop.
+    uint32_t constant_volume;
+    uint32_t volume;            // Constant volume, or envelope period.
+    uint32_t envelope_start;
+    uint32_t envelope_divider;
+    uint32_t envelope_decay;
+    uint32_t sweep_enabled;
+    uint32_t sweep_period;
+    uint32_t sweep_negate;
+    uint32_t sweep_shift;
+    uint32_t sweep_reload;
+    uint32_t sweep_divider;
+    uint32_t timer_period;      // The 11-bit register value; one step every 2 * (period + 1) cycles.
+    uint32_t timer;
+    uint32_t length;
+};
+
+struct apu_triangle_t
+{
+    uint32_t enabled;
+    uint32_t control;           // Length counter halt / linear counter control.
+    uint32_t linear_reload_value;
+    uint32_t linear_counter;
+    uint32_t linear_reload;
+    uint32_t timer_period;      // One step every period + 1 cycles.
+    uint32_t timer;
+    uint32_t step;
+    uint32_t length;
+};
+
+struct apu_noise_t
+{
+    uint32_t enabled;
+    uint32_t halt;
+    uint32_t constant_volume;
+    uint32_t volume;
+    uint32_t envelope_start;
+    uint32_t envelope_divider;
+    uint32_t envelope_decay;
+    uint32_t mode;
+    uint32_t period;            // In CPU cycles.
+    uint32_t timer;
+    uint32_t shift;             // 15-bit LFSR.
+    uint32_t length;
+};
+
+struct apu_dmc_t
+{
+    uint32_t irq_enabled;
+    uint32_t loop;
+    uint32_t period;            // In CPU cycles.
+    uint32_t timer;
+    uint32_t output_level;
+    uint32_t sample_address;
+    uint32_t sample_length;
+    uint32_t current_address;
+    uint32_t bytes_remaining;
+    uint32_t shift_register;
+    uint32_t bits_remaining;
+    uint32_t buffer;
+    uint32_t buffer_full;
+    uint32_t silence;
+    uint32_t irq_flag;
+    uint32_t reserved;
+};
+
+struct apu_state_t
+{
+    uint64_t cycle;             // CPU cycle the APU has been run up to.
+    uint64_t frame_start;       // Cycle the frame counter sequence last (re)started at.
+    uint32_t frame_mode;        // 0: 4-step, 1: 5-step.
+    uint32_t frame_step;        // Next step of the sequence.
+    uint32_t irq_inhibit;
+    uint32_t frame_irq_flag;
+
+    apu_pulse_t pulse[2];
+    apu_triangle_t triangle;
+    apu_noise_t noise;
+    apu_dmc_t dmc;
+    uint32_t reserved;
+};
+
+// Audio hand-off counters. Overruns are samples dropped because the ring was full (nobody
+// is consuming fast enough); underruns are reads that found too few samples queued.
+struct audio_stats_t
+{
+    uint64_t samples_produced;
+    uint64_t overrun_samples;
+    uint64_t underruns;
+    uint64_t underrun_samples;
+};
+
+/**
+ * The APU, attached to the CPU bus at $4000-$4017 by the console.
+ *
+ * Like the PPU it runs lazily, catching up to the CPU's cycle counter when the CPU touches
+ * its registers and at the end of every frame. Catching up does not step cycle by cycle: it
+ * jumps from one event (a channel timer expiring, a frame counter step, the end of an output
+ * sample) to the next, integrating the mixer output in between. Each 48 kHz output sample is
+ * the average of the mixer output over its span (a box filter, which band-limits before the
+ * decimation), followed by the console's analog high- and low-pass filters.
+ *
+ * Samples are handed over in blocks through a lock-free single-producer/single-consumer
+ * ring. The emulation thread never waits: if the ring is full the block's excess is dropped
+ * and counted. The audio thread calls read_samples(), which never waits either.
+ */
+class APU
+{
+private:
+    MOS6502* cpu;
+    RAM* bus;
+
+    apu_state_t state;
+
+    // Mixer output over the current run of cycles (all channel outputs constant).
+    float level = 0;
+
+    // Off: no samples are produced and catching up only stops where the machine state can
+    // change. Not part of the emulated state.
+    bool audio_output = true;
+
+    // Resampler and output filters. Not part of the emulated state.
+    double accumulator = 0;       // Integral of `level' over the current output sample.
+    uint32_t sample_cycles = 0;   // Cycles left in the current output sample...
+    uint32_t sample_length = 0;   // ...out of this many.
+    uint32_t sample_phase = 0;    // Remainder carrying the fractional cycles per sample.
+    float high_pass_90[2] = {};   // Previous input / output of each filter.
+    float high_pass_440[2] = {};
+    float low_pass_14k = 0;
+
+    float block[constants::AUDIO_BLOCK_SIZE];
+    std::size_t block_fill = 0;
+
+    SpscRing<float> ring;
+    float last_sample = 0;        // Consumer side: repeated to cover underruns.
+
+    std::atomic<uint64_t> samples_produced;
+    std::atomic<uint64_t> overrun_samples;
+    std::atomic<uint64_t> underruns;
+    std::atomic<uint64_t> underrun_samples;
+
+    void run_to(uint64_t target);
+    void skip_to(uint64_t target);
+    void clock_frame_counter();
+    void quarter_frame();
+    void half_frame();
+
+    void update_level();
+    void update_irq();
+    void start_sample();
+    void emit_sample();
+    void flush_block();
+
+    // Clocks the DMC output unit; returns whether its output level changed.
+    bool clock_dmc();
+    void dmc_fetch();
+public:
+    /**
+     * @param cpu CPU whose cycle counter the APU follows and whose IRQ line it drives
+     * @param bus CPU address space, read by the DMC channel
+     */
+    APU(MOS6502* cpu, RAM* bus);
+    ~APU();
+
+    APU(const APU&) = delete;
+    APU& operator=(const APU&) = delete;
+
+    /**
+     * Register access for $4000-$4017, for whoever maps the I/O page. Reads of anything but
+     * $4015 return open bus (0).
+     * @param addr
+     */
+    uint8_t read(address_t addr);
+    uint8_t peek(address_t addr) const;
+    void write(address_t addr, uint8_t value);
+
+    /**
+     * Silences all channels and resets the frame counter.
+     */
+    void power_on();
+
+    /**
+     * Runs the APU up to the CPU's current cycle and hands any finished sample blocks to the
+     * ring.
+     */
+    void catch_up();
+
+    /**
+     * Whether the frame counter or DMC is holding the IRQ line low. When either raises it, the
+     * CPU's current run is ended so the caller can deliver the interrupt.
+     */
+    bool irq_asserted() const;
+
+    /**
+     * The CPU cycle at which the APU will next raise an IRQ (frame counter or DMC), or
+     * UINT64_MAX if none is coming. The CPU can run freely until then.
+     */
+    uint64_t next_irq_cycle() const;
+
+    /**
+     * The CPU cycle at which the DMC will next read a sample byte (stalling the CPU), or
+     * UINT64_MAX if it has nothing left to read.
+     */
+    uint64_t next_dmc_fetch_cycle() const;
+
+    /**
+     * Audio thread side. Copies `count' mono samples in [-1, 1] to `samples'. If fewer are
+     * queued the rest is filled by repeating the last sample and an underrun is counted.
+     * Returns how many real samples were copied.
+     * @param samples
+     * @param count
+     */
+    std::size_t read_samples(float* samples, std::size_t count);
+
+    /**
+     * Number of samples queued for the audio thread.
+     */
+    std::size_t queued_samples() const;
+
+    audio_stats_t get_stats() const;
+
+    /**
+     * Switches sample output on or off. While off the channels keep running (length counters,
+     * IRQs and DMC fetches happen as usual) but nothing is mixed or queued.
+     * @param enabled
+     */
+    void set_audio_output(bool enabled);
+
+    void save_state(apu_state_t& out) const;
+    void load_state(const apu_state_t& in);
+};
+
+#endif //NESEMULATOR_APU_HPP
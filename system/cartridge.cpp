@@ -0,0 +1,544 @@
+//
+// iNES / NES 2.0 cartridge images.
+//
+
+#include "cartridge.hpp"
+#include "hash.hpp"
+#include "mapper.hpp"
+#include "ppu.hpp"
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    // Identifies a file on disk, as of its last modification.
+    struct file_key_t
+    {
+        dev_t device;
+        ino_t inode;
+        off_t size;
+        int64_t modified_ns;
+
+        bool operator==(const file_key_t& other) const
+        {
+            return device == other.device && inode == other.inode && size == other.size &&
+                   modified_ns == other.modified_ns;
+        }
+    };
+
+    struct file_key_hash
+    {
+        std::size_t operator()(const file_key_t& key) const
+        {
+            return hashing::fnv1a_64(&key.inode, sizeof(key.inode), (uint64_t)key.modified_ns ^ (uint64_t)key.device);
+        }
+    };
+
+    // Identifies an image by its contents. The size goes with the hash so that a colliding
+    // image of another size can never pick up a header whose ROM sizes don't fit it.
+    struct content_key_t
+    {
+        uint64_t hash;
+        std::size_t size;
+
+        bool operator==(const content_key_t& other) const
+        {
+            return hash == other.hash && size == other.size;
+        }
+    };
+
+    struct content_key_hash
+    {
+        std::size_t operator()(const content_key_t& key) const
+        {
+            return key.hash ^ key.size;
+        }
+    };
+
+    std::mutex cache_mutex;
+
+    // A parsed header and the 16 bytes it was parsed from: an image of the same size whose
+    // hash collides only gets the entry if its header bytes match too.
+    struct cached_header_t
+    {
+        uint8_t raw[constants::INES_HEADER_SIZE];
+        ines_header_t header;
+    };
+
+    // Parsed headers, keyed by the contents of the image they came from.
+    std::unordered_map<content_key_t, cached_header_t, content_key_hash> header_cache;
+
+    // Images some cartridge still holds, keyed by the file they were mapped from, or (for
+    // images loaded from memory) by their content hash.
+    std::unordered_map<file_key_t, std::weak_ptr<const rom_image_t>, file_key_hash> image_cache;
+    std::unordered_map<uint64_t, std::weak_ptr<const rom_image_t>> memory_image_cache;
+
+    // Fills in the header of a freshly loaded image, from the cache or by parsing it.
+    bool read_header(rom_image_t& image)
+    {
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto entry = header_cache.find(content_key_t{image.content_hash, image.size});
+            if (entry != header_cache.end() &&
+                std::memcmp(entry->second.raw, image.data, constants::INES_HEADER_SIZE) == 0)
+            {
+                image.header = entry->second.header;
+                return true;
+            }
+        }
+
+        if (!Cartridge::parse_header(image.data, image.size, image.header))
+            return false;
+
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cached_header_t& cached = header_cache[content_key_t{image.content_hash, image.size}];
+        std::memcpy(cached.raw, image.data, constants::INES_HEADER_SIZE);
+        cached.header = image.header;
+        return true;
+    }
+
+    // Drops cache entries whose image nobody holds any more. Call with cache_mutex held.
+    template <typename Map>
+    void forget_expired(Map& cache)
+    {
+        for (auto entry = cache.begin(); entry != cache.end();)
+            entry = entry->second.expired() ? cache.erase(entry) : std::next(entry);
+    }
+
+    // NES 2.0 ROM sizes: either a plain count of banks (with a high nibble from byte 9) or,
+    // when that nibble is $F, an exponent-multiplier pair: 2^E * (MM * 2 + 1) bytes. Returns
+    // false for exponents too big for any real image.
+    bool nes2_rom_size(uint8_t lsb, uint8_t msb_nibble, uint32_t bank_size, uint64_t& size)
+    {
+        if (msb_nibble == 0x0F)
+        {
+            uint64_t exponent = lsb >> 2;
+            uint64_t multiplier = (lsb & 0x03) * 2 + 1;
+            if (exponent >= 48)
+                return false;
+
+            size = (1ull << exponent) * multiplier;
+            return true;
+        }
+
+        size = (uint64_t)((msb_nibble << 8) | lsb) * bank_size;
+        return true;
+    }
+
+    // NES 2.0 RAM sizes are shift counts: 0 means none, otherwise 64 << n bytes.
+    uint32_t nes2_ram_size(uint8_t shift)
+    {
+        return shift == 0 ? 0 : (64u << shift);
+    }
+
+    // RAM is mapped in whole pages and banks: NES 2.0 sizes smaller than that (or not a
+    // multiple of it) are allocated rounded up.
+    std::size_t round_up(std::size_t size, std::size_t unit)
+    {
+        return (size + unit - 1) / unit * unit;
+    }
+} // namespace
+
+rom_image_t::~rom_image_t()
+{
+    if (data != nullptr && copy.empty())
+        munmap(const_cast<uint8_t*>(data), size);
+}
+
+Cartridge::Cartridge() = default;
+
+Cartridge::~Cartridge()
+{
+    unload();
+}
+
+void Cartridge::unload()
+{
+    // The PPU must not call into a board that is gone.
+    if (mapper && ppu != nullptr)
+        ppu->set_scanline_handler(nullptr, nullptr);
+
+    mapper.reset();
+    image.reset();
+    prg_rom = nullptr;
+    chr_rom = nullptr;
+    prg_ram.clear();
+    chr_ram.clear();
+}
+
+bool Cartridge::is_ines(const uint8_t* data, std::size_t size)
+{
+    return size >= (std::size_t)constants::INES_HEADER_SIZE &&
+           data[0] == 'N' && data[1] == 'E' && data[2] == 'S' && data[3] == 0x1A;
+}
+
+bool Cartridge::parse_header(const uint8_t* data, std::size_t image_size, ines_header_t& header)
+{
+    if (!is_ines(data, image_size))
+        return false;
+
+    header = ines_header_t();
+
+    header.nes2 = (data[7] & 0x0C) == 0x08;
+    header.trainer = (data[6] & 0x04) != 0;
+    header.battery = (data[6] & 0x02) != 0;
+
+    if (data[6] & 0x08)
+        header.mirroring = mirroring_t::FOUR_SCREEN;
+    else
+        header.mirroring = (data[6] & 0x01) ? mirroring_t::VERTICAL : mirroring_t::HORIZONTAL;
+
+    uint64_t prg_size;
+    uint64_t chr_size;
+
+    if (header.nes2)
+    {
+        header.mapper = (data[6] >> 4) | (data[7] & 0xF0) | ((data[8] & 0x0F) << 8);
+        header.submapper = data[8] >> 4;
+
+        if (!nes2_rom_size(data[4], data[9] & 0x0F, constants::PRG_BANK_SIZE, prg_size) ||
+            !nes2_rom_size(data[5], data[9] >> 4, constants::CHR_BANK_SIZE, chr_size))
+            return false;
+
+        header.prg_ram_size = nes2_ram_size(data[10] & 0x0F) + nes2_ram_size(data[10] >> 4);
+        header.chr_ram_size = nes2_ram_size(data[11] & 0x0F) + nes2_ram_size(data[11] >> 4);
+    }
+    else
+    {
+        // Old dumping tools wrote signatures (e.g. "DiskDude!") into bytes 7-15; when the
+        // tail of the header isn't zero, the high mapper nibble can't be trusted.
+        bool dirty_tail = data[12] != 0 || data[13] != 0 || data[14] != 0 || data[15] != 0;
+
+        header.mapper = (data[6] >> 4) | (dirty_tail ? 0 : (data[7] & 0xF0));
+
+        prg_size = (uint64_t)data[4] * constants::PRG_BANK_SIZE;
+        chr_size = (uint64_t)data[5] * constants::CHR_BANK_SIZE;
+
+        // iNES 1.0 boards are assumed to have 8KiB of PRG-RAM unless byte 8 says more.
+        header.prg_ram_size = (data[8] == 0 || dirty_tail) ? constants::DEFAULT_PRG_RAM_SIZE
+                                                           : data[8] * constants::DEFAULT_PRG_RAM_SIZE;
+        header.chr_ram_size = chr_size == 0 ? constants::CHR_BANK_SIZE : 0;
+    }
+
+    // Each size on its own first, so that the sum below cannot wrap around.
+    if (prg_size > image_size || chr_size > image_size)
+        return false;
+
+    uint64_t needed = constants::INES_HEADER_SIZE + (header.trainer ? constants::INES_TRAINER_SIZE : 0) + prg_size + chr_size;
+    if (prg_size == 0 || needed > image_size)
+        return false;
+
+    // PRG-ROM is switched in 8KiB slots; NES 2.0's exponent form can describe sizes that are
+    // not a whole number of them.
+    if (prg_size % constants::PRG_SLOT_SIZE != 0)
+        return false;
+
+    // Likewise CHR-ROM, in the PPU's 1KiB pattern slots.
+    if (chr_size % constants::PATTERN_SLOT_SIZE != 0)
+        return false;
+
+    header.prg_rom_size = (uint32_t)prg_size;
+    header.chr_rom_size = (uint32_t)chr_size;
+
+    return true;
+}
+
+bool Cartridge::load_file(const std::string& path)
+{
+    unload();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cout << "[Cartridge] ERROR! Could not open ``" << path << "''." << std::endl;
+        return false;
+    }
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) != 0 || file_info.st_size < constants::INES_HEADER_SIZE)
+    {
+        std::cout << "[Cartridge] ERROR! ``" << path << "'' is too small to be an iNES image." << std::endl;
+        close(fd);
+        return false;
+    }
+
+    const file_key_t key = { file_info.st_dev, file_info.st_ino, file_info.st_size,
+                             (int64_t)file_info.st_mtim.tv_sec * 1000000000 + file_info.st_mtim.tv_nsec };
+
+    // Another cartridge has this file already: share its image.
+    std::shared_ptr<const rom_image_t> shared;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto entry = image_cache.find(key);
+        if (entry != image_cache.end())
+            shared = entry->second.lock();
+    }
+
+    if (shared)
+    {
+        close(fd);
+        return load_image(shared);
+    }
+
+    // The mapping outlives the descriptor; pages are shared with every other process that
+    // maps the same file.
+    void* mapping = mmap(nullptr, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        std::cout << "[Cartridge] ERROR! Could not map ``" << path << "'' into memory." << std::endl;
+        return false;
+    }
+
+    std::shared_ptr<rom_image_t> loaded = std::make_shared<rom_image_t>();
+    loaded->data = static_cast<const uint8_t*>(mapping);
+    loaded->size = file_info.st_size;
+    loaded->content_hash = hashing::fnv1a_64(loaded->data, loaded->size);
+
+    if (!read_header(*loaded))
+    {
+        std::cout << "[Cartridge] ERROR! ``" << path << "'' is not a valid iNES / NES 2.0 image." << std::endl;
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        forget_expired(image_cache);
+        image_cache[key] = loaded;
+    }
+
+    return load_image(loaded);
+}
+
+bool Cartridge::load_memory(const uint8_t* data, std::size_t size)
+{
+    unload();
+
+    if (data == nullptr || size < (std::size_t)constants::INES_HEADER_SIZE)
+    {
+        std::cout << "[Cartridge] ERROR! The buffer is too small to be an iNES image." << std::endl;
+        return false;
+    }
+
+    const uint64_t content_hash = hashing::fnv1a_64(data, size);
+
+    std::shared_ptr<const rom_image_t> shared;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto entry = memory_image_cache.find(content_hash);
+        if (entry != memory_image_cache.end())
+            shared = entry->second.lock();
+    }
+
+    // The hash only finds a candidate; the bytes decide, since FNV-1a collisions are easy to
+    // construct.
+    if (shared && shared->size == size && std::memcmp(shared->data, data, size) == 0)
+        return load_image(shared);
+
+    std::shared_ptr<rom_image_t> loaded = std::make_shared<rom_image_t>();
+    loaded->copy.assign(data, data + size);
+    loaded->data = loaded->copy.data();
+    loaded->size = size;
+    loaded->content_hash = content_hash;
+
+    if (!read_header(*loaded))
+    {
+        std::cout << "[Cartridge] ERROR! The buffer is not a valid iNES / NES 2.0 image." << std::endl;
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        forget_expired(memory_image_cache);
+        memory_image_cache[content_hash] = loaded;
+    }
+
+    return load_image(loaded);
+}
+
+bool Cartridge::load_image(std::shared_ptr<const rom_image_t> shared)
+{
+    if (!shared)
+        return false;
+
+    unload();
+
+    image = std::move(shared);
+    header = image->header;
+
+    const uint8_t* cursor = image->data + constants::INES_HEADER_SIZE;
+    const uint8_t* trainer = nullptr;
+
+    if (header.trainer)
+    {
+        trainer = cursor;
+        cursor += constants::INES_TRAINER_SIZE;
+    }
+
+    prg_rom = cursor;
+    chr_rom = header.chr_rom_size > 0 ? cursor + header.prg_rom_size : nullptr;
+
+    prg_ram.assign(round_up(header.prg_ram_size > 0 ? header.prg_ram_size : constants::DEFAULT_PRG_RAM_SIZE,
+                            constants::DEFAULT_PRG_RAM_SIZE), 0x00);
+    chr_ram.assign(round_up(header.chr_ram_size, constants::CHR_BANK_SIZE), 0x00);
+
+    // The trainer is loaded at $7000, i.e. 4KiB into PRG-RAM.
+    if (trainer != nullptr && prg_ram.size() >= 0x1000 + (std::size_t)constants::INES_TRAINER_SIZE)
+        std::memcpy(prg_ram.data() + 0x1000, trainer, constants::INES_TRAINER_SIZE);
+
+    if (!mappers::is_supported(header.mapper))
+        std::cout << "[Cartridge] Mapper " << header.mapper << " is not supported yet; mapping the first and last PRG banks only." << std::endl;
+
+    mapper = mappers::create(header);
+    if (cpu != nullptr)
+        mapper->attach_cpu(cpu);
+
+    return true;
+}
+
+void Cartridge::map_into(RAM& ram)
+{
+    // $6000-$7FFF: PRG-RAM (always at least 8KiB; see load_image).
+    ram.map_memory(0x6000, 0x7FFF, prg_ram.data(), 0x2000, true);
+
+    // $8000-$FFFF: PRG-ROM, banked by the mapper, whose registers take the writes.
+    if (mapper)
+        mapper->attach_ram(&ram, prg_rom, header.prg_rom_size);
+}
+
+void Cartridge::map_into(PPU& ppu)
+{
+    if (chr_rom != nullptr)
+        ppu.attach_chr_rom(chr_rom, header.chr_rom_size);
+    else
+        ppu.attach_chr_ram(chr_ram.empty() ? nullptr : chr_ram.data(), chr_ram.size());
+
+    // Pattern banks and nametable mirroring are the mapper's.
+    this->ppu = &ppu;
+    if (mapper)
+        mapper->attach_ppu(&ppu);
+}
+
+void Cartridge::connect_irq(MOS6502& processor)
+{
+    cpu = &processor;
+    if (mapper)
+        mapper->attach_cpu(cpu);
+}
+
+void Cartridge::power_on()
+{
+    if (mapper)
+        mapper->power_on();
+}
+
+bool Cartridge::irq_asserted() const
+{
+    return mapper && mapper->irq_asserted();
+}
+
+uint64_t Cartridge::next_irq_cycle() const
+{
+    return mapper ? mapper->next_irq_cycle() : std::numeric_limits<uint64_t>::max();
+}
+
+bool Cartridge::save_state(cartridge_state_t& state) const
+{
+    if (prg_ram.size() > sizeof(state.prg_ram) || chr_ram.size() > sizeof(state.chr_ram))
+        return false;
+
+    save_mapper_state(state.mapper);
+    state.prg_ram_size = prg_ram.size();
+    state.chr_ram_size = chr_ram.size();
+    // Empty vectors (no cartridge, or CHR-ROM) have no data() to copy from.
+    if (!prg_ram.empty())
+        std::memcpy(state.prg_ram, prg_ram.data(), prg_ram.size());
+    if (!chr_ram.empty())
+        std::memcpy(state.chr_ram, chr_ram.data(), chr_ram.size());
+
+    return true;
+}
+
+bool Cartridge::load_state(const cartridge_state_t& state, bool restore_prg_ram, bool restore_chr_ram)
+{
+    if (state.prg_ram_size != prg_ram.size() || state.chr_ram_size != chr_ram.size())
+        return false;
+
+    if (mapper && !mapper->load_state(state.mapper))
+        return false;
+
+    if (restore_prg_ram && !prg_ram.empty())
+        std::memcpy(prg_ram.data(), state.prg_ram, prg_ram.size());
+    if (restore_chr_ram && !chr_ram.empty())
+        std::memcpy(chr_ram.data(), state.chr_ram, chr_ram.size());
+
+    return true;
+}
+
+void Cartridge::save_mapper_state(mapper_state_t& state) const
+{
+    if (mapper)
+        mapper->save_state(state);
+    else
+        std::memset(&state, 0x00, sizeof(state));
+}
+
+const ines_header_t& Cartridge::get_header() const
+{
+    return header;
+}
+
+const std::shared_ptr<const rom_image_t>& Cartridge::get_image() const
+{
+    return image;
+}
+
+uint64_t Cartridge::get_content_hash() const
+{
+    return image ? image->content_hash : 0;
+}
+
+const uint8_t* Cartridge::get_prg_rom() const
+{
+    return prg_rom;
+}
+
+const uint8_t* Cartridge::get_chr_rom() const
+{
+    return chr_rom;
+}
+
+uint8_t* Cartridge::get_prg_ram()
+{
+    return prg_ram.data();
+}
+
+const uint8_t* Cartridge::get_prg_ram() const
+{
+    return prg_ram.data();
+}
+
+std::size_t Cartridge::get_prg_ram_size() const
+{
+    return prg_ram.size();
+}
+
+uint8_t* Cartridge::get_chr_ram()
+{
+    return chr_ram.empty() ? nullptr : chr_ram.data();
+}
+
+std::size_t Cartridge::get_chr_ram_size() const
+{
+    return chr_ram.size();
+}
@@ -0,0 +1,241 @@
+//
+// iNES / NES 2.0 cartridge images.
+//
+
+#ifndef NESEMULATOR_CARTRIDGE_HPP
+#define NESEMULATOR_CARTRIDGE_HPP
+
+#include "ram.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace constants
+{
+    const int INES_HEADER_SIZE = 16;
+    const int INES_TRAINER_SIZE = 512;
+    const int PRG_BANK_SIZE = 0x4000; // PRG-ROM sizes in iNES headers are in 16KiB units...
+    const int CHR_BANK_SIZE = 0x2000; // ...and CHR-ROM sizes in 8KiB units.
+    const int DEFAULT_PRG_RAM_SIZE = 0x2000;
+    const int MAX_PRG_RAM_STATE = 0x8000; // Largest PRG-RAM / CHR-RAM a save state can hold.
+    const int MAX_CHR_RAM_STATE = 0x8000;
+    const int MAPPER_REGISTERS_STATE = 56; // Bytes of mapper registers a save state can hold.
+} // namespace constants
+
+class Mapper;
+class MOS6502;
+class PPU;
+
+enum class mirroring_t : uint8_t
+{
+    HORIZONTAL,
+    VERTICAL,
+    FOUR_SCREEN,
+    SINGLE_SCREEN_LOWER, // All four nametables are the first 1KiB page...
+    SINGLE_SCREEN_UPPER  // ...or the second.
+};
+
+// Everything the emulator needs from an iNES or NES 2.0 header. Sizes are in bytes.
+struct ines_header_t
+{
+    bool nes2 = false;          // NES 2.0 header (otherwise archaic/plain iNES).
+    uint16_t mapper = 0;
+    uint8_t submapper = 0;
+    uint32_t prg_rom_size = 0;
+    uint32_t chr_rom_size = 0;  // 0 means the board has CHR-RAM instead.
+    uint32_t prg_ram_size = 0;  // Volatile plus battery-backed PRG-RAM.
+    uint32_t chr_ram_size = 0;
+    mirroring_t mirroring = mirroring_t::HORIZONTAL;
+    bool battery = false;       // PRG-RAM is battery-backed (save games).
+    bool trainer = false;       // 512-byte trainer precedes PRG-ROM, loaded at $7000.
+};
+
+// Snapshot of a board's bank switching registers (see mapper.hpp). Fixed layout.
+struct mapper_state_t
+{
+    uint16_t mapper;            // iNES mapper number the registers belong to.
+    uint8_t reserved[6];
+    uint8_t registers[constants::MAPPER_REGISTERS_STATE];
+};
+
+// Snapshot of the writable parts of a cartridge. Fixed layout; part of savestate_t.
+struct cartridge_state_t
+{
+    mapper_state_t mapper;
+    uint32_t prg_ram_size;
+    uint32_t chr_ram_size;
+    uint8_t prg_ram[constants::MAX_PRG_RAM_STATE];
+    uint8_t chr_ram[constants::MAX_CHR_RAM_STATE];
+};
+
+/**
+ * An iNES / NES 2.0 file mapped read-only into memory (or copied there from a buffer), with
+ * its parsed header. Images are shared: every cartridge that loads the same file (or forks
+ * from a console running it) holds a reference to one image, which is unmapped when the last
+ * of them lets go.
+ */
+struct rom_image_t
+{
+    const uint8_t* data = nullptr;
+    std::size_t size = 0;
+    uint64_t content_hash = 0; // Hash of the whole file; identifies the ROM.
+    ines_header_t header;
+
+    // Backing memory of images loaded from a buffer; empty when `data' is a file mapping.
+    std::vector<uint8_t> copy;
+
+    rom_image_t() = default;
+    ~rom_image_t();
+
+    rom_image_t(const rom_image_t&) = delete;
+    rom_image_t& operator=(const rom_image_t&) = delete;
+};
+
+/**
+ * A cartridge loaded from an iNES / NES 2.0 file.
+ *
+ * The file is mmap'ed read-only and PRG-ROM pages are mapped straight onto the CPU's page
+ * table, so the ROM data is never copied. Images are cached process-wide while in use, keyed
+ * by the file's identity, so hundreds of consoles running the same game share one mapping
+ * and one parsed header. Parsed headers are also cached by a hash of the file contents, so
+ * loading the same image again skips validation.
+ *
+ * The board's mapper (see mapper.hpp) does the bank switching: it keeps the CPU's page table
+ * and the PPU's pattern slots pointing at the selected banks, and can raise IRQs.
+ */
+class Cartridge
+{
+private:
+    // The whole file, as mapped into memory (shared with other cartridges).
+    std::shared_ptr<const rom_image_t> image;
+
+    ines_header_t header;
+
+    const uint8_t* prg_rom = nullptr;
+    const uint8_t* chr_rom = nullptr;
+
+    std::vector<uint8_t> prg_ram;
+    std::vector<uint8_t> chr_ram;
+
+    std::unique_ptr<Mapper> mapper;
+    PPU* ppu = nullptr;         // What the mapper was attached to.
+    MOS6502* cpu = nullptr;
+
+    void unload();
+public:
+    Cartridge();
+    ~Cartridge();
+
+    // Owns a memory mapping, so it cannot be copied.
+    Cartridge(const Cartridge&) = delete;
+    Cartridge& operator=(const Cartridge&) = delete;
+
+    /**
+     * Parses a 16-byte iNES / NES 2.0 header. Returns false if `data' is not an iNES image or
+     * the sizes it declares do not fit in `image_size' bytes.
+     * @param data
+     * @param image_size size of the whole image the header belongs to
+     * @param header
+     */
+    static bool parse_header(const uint8_t* data, std::size_t image_size, ines_header_t& header);
+
+    /**
+     * Returns true if the buffer starts with the iNES magic ("NES" followed by $1A).
+     * @param data
+     * @param size
+     */
+    static bool is_ines(const uint8_t* data, std::size_t size);
+
+    /**
+     * Memory-maps and parses a ROM file, or takes the image another cartridge already has of
+     * it. Prints an error and returns false on failure.
+     * @param path
+     */
+    bool load_file(const std::string& path);
+
+    /**
+     * Parses and loads an iNES image held in memory. The data is copied once per process:
+     * loading identical bytes again (in any cartridge) shares the first copy. Prints an error
+     * and returns false on failure.
+     * @param data
+     * @param size
+     */
+    bool load_memory(const uint8_t* data, std::size_t size);
+
+    /**
+     * Loads an image another cartridge has (see get_image). Returns false if `shared' is null.
+     * @param shared
+     */
+    bool load_image(std::shared_ptr<const rom_image_t> shared);
+
+    /**
+     * Maps PRG-ROM and PRG-RAM into the CPU's address space.
+     * @param ram
+     */
+    void map_into(RAM& ram);
+
+    /**
+     * Attaches CHR-ROM (or CHR-RAM) to the PPU's pattern tables and sets the nametable
+     * mirroring.
+     * @param ppu
+     */
+    void map_into(PPU& ppu);
+
+    /**
+     * Connects the cartridge's IRQ output to `cpu': a board that raises or reschedules an
+     * IRQ ends the CPU's current run, like the APU does.
+     * @param cpu
+     */
+    void connect_irq(MOS6502& cpu);
+
+    /**
+     * Puts the mapper in its power-up state (and its banks where that leaves them).
+     */
+    void power_on();
+
+    /**
+     * Whether the board holds the IRQ line low.
+     */
+    bool irq_asserted() const;
+
+    /**
+     * The CPU cycle at which the board will next raise an IRQ, or UINT64_MAX if none is
+     * coming. Never later than the real IRQ; the CPU can run freely until then.
+     */
+    uint64_t next_irq_cycle() const;
+
+    /**
+     * Copies PRG-RAM and CHR-RAM out to / in from a snapshot. Return false if the board has
+     * more RAM than a snapshot holds, or (for load_state) the snapshot is for another board.
+     * load_state can leave either RAM alone when the caller knows it already matches.
+     * @param state
+     */
+    bool save_state(cartridge_state_t& state) const;
+    bool load_state(const cartridge_state_t& state, bool restore_prg_ram = true, bool restore_chr_ram = true);
+
+    /**
+     * The mapper registers alone (part of save_state).
+     * @param state
+     */
+    void save_mapper_state(mapper_state_t& state) const;
+
+    const ines_header_t& get_header() const;
+
+    // The loaded image, or null.
+    const std::shared_ptr<const rom_image_t>& get_image() const;
+
+    // Hash of the whole image file; identifies the ROM.
+    uint64_t get_content_hash() const;
+
+    const uint8_t* get_prg_rom() const;
+    const uint8_t* get_chr_rom() const;
+    uint8_t* get_prg_ram();
+    const uint8_t* get_prg_ram() const;
+    std::size_t get_prg_ram_size() const;
+    uint8_t* get_chr_ram();
+    std::size_t get_chr_ram_size() const;
+};
+
+#endif //NESEMULATOR_CARTRIDGE_HPP
@@ -0,0 +1,54 @@
+//
+// Standard NES controllers on the $4016/$4017 ports.
+//
+
+#include "controller.hpp"
+
+void Controller::set_buttons(uint8_t held)
+{
+    state.buttons = held;
+
+    if (state.strobe)
+        state.shift = held;
+}
+
+uint8_t Controller::get_buttons() const
+{
+    return state.buttons;
+}
+
+void Controller::write_strobe(uint8_t value)
+{
+    state.strobe = value & 1;
+
+    if (state.strobe)
+        state.shift = state.buttons;
+}
+
+uint8_t Controller::read()
+{
+    if (state.strobe)
+        return state.buttons & 1;
+
+    const uint8_t bit = state.shift & 1;
+
+    // Ones are shifted in behind the buttons.
+    state.shift = (state.shift >> 1) | 0x80;
+    return bit;
+}
+
+void Controller::power_on()
+{
+    state.shift = 0;
+    state.strobe = 0;
+}
+
+void Controller::save_state(controller_state_t& out) const
+{
+    out = state;
+}
+
+void Controller::load_state(const controller_state_t& in)
+{
+    state = in;
+}
@@ -0,0 +1,62 @@
+//
+// Standard NES controllers on the $4016/$4017 ports.
+//
+
+#ifndef NESEMULATOR_CONTROLLER_HPP
+#define NESEMULATOR_CONTROLLER_HPP
+
+#include <cstdint>
+
+// Button bits, in the order the controller shifts them out.
+namespace buttons
+{
+    const uint8_t A      = 1 << 0;
+    const uint8_t B      = 1 << 1;
+    const uint8_t SELECT = 1 << 2;
+    const uint8_t START  = 1 << 3;
+    const uint8_t UP     = 1 << 4;
+    const uint8_t DOWN   = 1 << 5;
+    const uint8_t LEFT   = 1 << 6;
+    const uint8_t RIGHT  = 1 << 7;
+} // namespace buttons
+
+// Snapshot of one controller. Fixed layout; part of savestate_t.
+struct controller_state_t
+{
+    uint8_t buttons;   // Buttons held (the input).
+    uint8_t shift;     // Shift register latched from them.
+    uint8_t strobe;
+    uint8_t reserved[5];
+};
+
+/**
+ * A standard controller: writing 1 then 0 to bit 0 of $4016 (the strobe) latches the buttons
+ * held into a shift register, and each read of the controller's port returns the next button
+ * in bit 0. After all eight, reads return 1. While the strobe is high, reads keep returning A.
+ */
+class Controller
+{
+private:
+    controller_state_t state = {};
+public:
+    /**
+     * Sets the buttons held from now on (see the `buttons' namespace).
+     * @param held
+     */
+    void set_buttons(uint8_t held);
+    uint8_t get_buttons() const;
+
+    void write_strobe(uint8_t value);
+
+    /**
+     * Next bit of the shift register (0 or 1).
+     */
+    uint8_t read();
+
+    void power_on();
+
+    void save_state(controller_state_t& out) const;
+    void load_state(const controller_state_t& in);
+};
+
+#endif //NESEMULATOR_CONTROLLER_HPP
@@ -0,0 +1,474 @@
+//
+// Interactive debugger: breakpoints, watchpoints and stepping over a running console.
+//
+
+#include "debugger.hpp"
+#include "mos6502.hpp"
+#include "nes.hpp"
+#include "opcodes.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+namespace
+{
+    // Hexadecimal, with or without a "$" or "0x" prefix.
+    bool parse_address(const std::string& text, uint16_t& address)
+    {
+        std::size_t start = 0;
+        if (text.compare(0, 1, "$") == 0)
+            start = 1;
+        else if (text.compare(0, 2, "0x") == 0 || text.compare(0, 2, "0X") == 0)
+            start = 2;
+
+        if (start >= text.size() || text.size() - start > 4)
+            return false;
+
+        unsigned int value = 0;
+        for (std::size_t i = start; i < text.size(); i++)
+        {
+            const char c = text[i];
+            const unsigned int digit = (c >= '0' && c <= '9') ? c - '0'
+                                     : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                                     : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+                                     : 16;
+            if (digit == 16)
+                return false;
+
+            value = (value << 4) | digit;
+        }
+
+        address = (uint16_t)value;
+        return true;
+    }
+
+    bool parse_count(const std::string& text, uint64_t& count)
+    {
+        if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+
+        count = std::stoull(text);
+        return true;
+    }
+
+    // "r", "w", "x" in any combination.
+    bool parse_kinds(const std::string& text, uint8_t& kinds)
+    {
+        kinds = 0;
+        for (char c : text)
+        {
+            if (c == 'r')
+                kinds |= watchpoint_t::READ;
+            else if (c == 'w')
+                kinds |= watchpoint_t::WRITE;
+            else if (c == 'x')
+                kinds |= watchpoint_t::EXECUTE;
+            else
+                return false;
+        }
+
+        return kinds != 0;
+    }
+
+    std::string kinds_name(uint8_t kinds)
+    {
+        std::string name;
+        if (kinds & watchpoint_t::READ) name += 'r';
+        if (kinds & watchpoint_t::WRITE) name += 'w';
+        if (kinds & watchpoint_t::EXECUTE) name += 'x';
+        return name;
+    }
+
+    std::string hex(unsigned int value, int digits)
+    {
+        char text[8];
+        std::snprintf(text, sizeof(text), "$%0*X", digits, value);
+        return text;
+    }
+} // namespace
+
+Debugger::Debugger(NES& nes) : nes(nes), cpu(nes.get_cpu()), bus(nes.get_ram()),
+                               break_addresses(constants::ADDRESS_SPACE_SIZE / 64)
+{
+    rebuild();
+    bus.set_watch_handler(&Debugger::access_watched, this);
+    cpu.attach_debugger(this);
+}
+
+Debugger::~Debugger()
+{
+    cpu.attach_debugger(nullptr);
+    cpu.clear_stop();
+    bus.set_watch_handler(nullptr, nullptr);
+    bus.watch_pages(0x0000, constants::MAX_ADDRESS_SIZE, 0);
+}
+
+// ===========================
+// BREAK AND WATCHPOINTS
+// ===========================
+
+unsigned int Debugger::add_watchpoint(uint16_t start, uint16_t end, uint8_t kinds)
+{
+    points.push_back({ next_id, std::min(start, end), std::max(start, end), kinds });
+    rebuild();
+
+    return next_id++;
+}
+
+unsigned int Debugger::add_breakpoint(uint16_t address)
+{
+    return add_watchpoint(address, address, watchpoint_t::EXECUTE);
+}
+
+bool Debugger::remove(unsigned int id)
+{
+    auto found = std::find_if(points.begin(), points.end(), [id](const watchpoint_t& point) {
+        return point.id == id;
+    });
+
+    if (found == points.end())
+        return false;
+
+    points.erase(found);
+    rebuild();
+    return true;
+}
+
+void Debugger::remove_all()
+{
+    points.clear();
+    rebuild();
+}
+
+const std::vector<watchpoint_t>& Debugger::get_watchpoints() const
+{
+    return points;
+}
+
+void Debugger::rebuild()
+{
+    std::memset(break_pages, 0x00, sizeof(break_pages));
+    std::fill(break_addresses.begin(), break_addresses.end(), 0);
+
+    uint8_t page_flags[constants::PAGE_COUNT] = {};
+
+    for (const watchpoint_t& point : points)
+    {
+        if (point.kinds & watchpoint_t::EXECUTE)
+        {
+            for (unsigned int addr = point.start; addr <= point.end; addr++)
+            {
+                break_addresses[addr >> 6] |= 1ull << (addr & 63);
+                break_pages[addr >> 14] |= 1ull << ((addr >> 8) & 63);
+            }
+        }
+
+        for (unsigned int page = point.start >> 8; page <= (unsigned int)(point.end >> 8); page++)
+            page_flags[page] |= point.kinds & (watchpoint_t::READ | watchpoint_t::WRITE);
+    }
+
+    for (unsigned int page = 0; page < constants::PAGE_COUNT; page++)
+        bus.watch_pages(page << 8, (page << 8) | 0xFF, page_flags[page]);
+}
+
+void Debugger::access_watched(void* context, address_t addr, uint8_t value, bool write)
+{
+    Debugger& debugger = *static_cast<Debugger*>(context);
+    const uint8_t kind = write ? watchpoint_t::WRITE : watchpoint_t::READ;
+
+    for (const watchpoint_t& point : debugger.points)
+    {
+        if (!(point.kinds & kind) || addr < point.start || addr > point.end)
+            continue;
+
+        // The instruction completes; the console stops right after it.
+        debugger.stop("Watchpoint " + std::to_string(point.id) + ": " + (write ? "write " : "read ") +
+                      hex(addr, 4) + " = " + hex(value, 2) + " by the instruction at " +
+                      hex(debugger.instruction_address, 4));
+        debugger.cpu.request_stop();
+        return;
+    }
+}
+
+// ===========================
+// RUN CONTROL
+// ===========================
+
+void Debugger::stop(const std::string& reason)
+{
+    // Several watchpoints can fire in one instruction; the first one is the reason.
+    if (stop_reason.empty())
+        stop_reason = reason;
+}
+
+bool Debugger::check(uint16_t pc)
+{
+    // The instruction a run resumes at is where the console stopped before; it runs.
+    const bool resuming = skip_pending && pc == skip_address;
+    skip_pending = false;
+
+    if (!resuming && ((break_addresses[pc >> 6] >> (pc & 63)) & 1))
+    {
+        for (const watchpoint_t& point : points)
+        {
+            if ((point.kinds & watchpoint_t::EXECUTE) && pc >= point.start && pc <= point.end)
+            {
+                stop((point.start == point.end && point.kinds == watchpoint_t::EXECUTE ? "Breakpoint " : "Watchpoint ") +
+                     std::to_string(point.id) + " at " + hex(pc, 4));
+                return true;
+            }
+        }
+    }
+
+    bool stopping = false;
+
+    switch (mode)
+    {
+        case run_mode_t::STEP:
+            if (steps_left == 0)
+            {
+                stop("Stepped to " + hex(pc, 4));
+                stopping = true;
+            }
+            else
+            {
+                steps_left--;
+            }
+            break;
+        case run_mode_t::STEP_OVER:
+            if (pc == return_address && cpu.SP >= return_sp)
+            {
+                stop("Stepped over to " + hex(pc, 4));
+                stopping = true;
+            }
+            break;
+        case run_mode_t::STEP_OUT:
+            if (cpu.SP > return_sp)
+            {
+                stop("Returned to " + hex(pc, 4));
+                stopping = true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    check_every_instruction = mode == run_mode_t::STEP || mode == run_mode_t::STEP_OVER || mode == run_mode_t::STEP_OUT;
+    return stopping;
+}
+
+bool Debugger::resume(run_mode_t run_mode, uint64_t max_frames)
+{
+    mode = run_mode;
+    stop_reason.clear();
+
+    skip_pending = true;
+    skip_address = cpu.PC;
+    check_every_instruction = true;
+
+    cpu.clear_stop();
+    nes.run_frames(max_frames);
+
+    mode = run_mode_t::IDLE;
+    skip_pending = false;
+    check_every_instruction = false;
+
+    return cpu.is_stopped();
+}
+
+bool Debugger::run(uint64_t max_frames)
+{
+    return resume(run_mode_t::CONTINUE, max_frames);
+}
+
+bool Debugger::step(uint64_t count)
+{
+    steps_left = count;
+    return resume(run_mode_t::STEP, constants::DEBUGGER_RUN_LIMIT);
+}
+
+bool Debugger::step_over()
+{
+    if (bus.peek_byte(cpu.PC) != 0x20) // JSR
+        return step(1);
+
+    return_address = (uint16_t)(cpu.PC + 3);
+    return_sp = cpu.SP;
+    return resume(run_mode_t::STEP_OVER, constants::DEBUGGER_RUN_LIMIT);
+}
+
+bool Debugger::step_out()
+{
+    return_sp = cpu.SP;
+    return resume(run_mode_t::STEP_OUT, constants::DEBUGGER_RUN_LIMIT);
+}
+
+const std::string& Debugger::get_stop_reason() const
+{
+    return stop_reason;
+}
+
+// ===========================
+// COMMANDS
+// ===========================
+
+void Debugger::report(std::ostream& output) const
+{
+    if (!stop_reason.empty())
+        output << stop_reason << std::endl;
+    else if (cpu.is_halted())
+        output << "CPU halted on opcode " << hex(cpu.halt_opcode, 2) << " at " << hex(cpu.halt_address, 4) << std::endl;
+    else
+        output << "Run limit reached." << std::endl;
+
+    print_registers(output);
+}
+
+void Debugger::print_registers(std::ostream& output) const
+{
+    const uint8_t opcode = bus.peek_byte(cpu.PC);
+    const unsigned int length = opcodes::instruction_length(opcodes::OPCODE_TABLE[opcode].addrmode);
+
+    char line[128];
+    std::snprintf(line, sizeof(line), "PC:$%04X A:$%02X X:$%02X Y:$%02X P:$%02X SP:$%02X CYC:%llu  $%04X:",
+                  cpu.PC, cpu.ACC, cpu.X, cpu.Y, cpu.FLG, cpu.SP, (unsigned long long)cpu.cycles, cpu.PC);
+    output << line;
+
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        if (i < length)
+            std::snprintf(line, sizeof(line), " %02X", bus.peek_byte((uint16_t)(cpu.PC + i)));
+        else
+            std::snprintf(line, sizeof(line), "   ");
+        output << line;
+    }
+
+    output << "  " << opcodes::OPCODE_NAMES[opcode] << std::endl;
+}
+
+bool Debugger::execute(const std::string& command, std::ostream& output)
+{
+    std::istringstream words(command);
+    std::string verb;
+    std::vector<std::string> arguments;
+
+    words >> verb;
+    for (std::string word; words >> word;)
+        arguments.push_back(word);
+
+    uint16_t start = 0, end = 0;
+    uint64_t count = 0;
+    uint8_t kinds = 0;
+
+    if (verb == "break" && arguments.size() == 1 && parse_address(arguments[0], start))
+    {
+        output << "Breakpoint " << add_breakpoint(start) << " at " << hex(start, 4) << std::endl;
+    }
+    else if (verb == "watch" && (arguments.size() == 2 || arguments.size() == 3) && parse_kinds(arguments[0], kinds) &&
+             parse_address(arguments[1], start) && (arguments.size() == 2 || parse_address(arguments[2], end)))
+    {
+        if (arguments.size() == 2)
+            end = start;
+
+        const unsigned int id = add_watchpoint(start, end, kinds);
+        output << "Watchpoint " << id << " (" << kinds_name(kinds) << ") at " << hex(points.back().start, 4) << "-"
+               << hex(points.back().end, 4) << std::endl;
+    }
+    else if (verb == "delete" && arguments.empty())
+    {
+        remove_all();
+    }
+    else if (verb == "delete" && arguments.size() == 1 && parse_count(arguments[0], count))
+    {
+        if (!remove((unsigned int)count))
+        {
+            output << "[Debugger] ERROR! No break/watchpoint " << count << "." << std::endl;
+            return false;
+        }
+    }
+    else if (verb == "list" && arguments.empty())
+    {
+        for (const watchpoint_t& point : points)
+        {
+            output << point.id << "  " << kinds_name(point.kinds) << "  " << hex(point.start, 4);
+            if (point.end != point.start)
+                output << "-" << hex(point.end, 4);
+            output << std::endl;
+        }
+    }
+    else if (verb == "continue" && arguments.size() <= 1 && (arguments.empty() || parse_count(arguments[0], count)))
+    {
+        run(arguments.empty() ? constants::DEBUGGER_RUN_LIMIT : count);
+        report(output);
+    }
+    else if (verb == "step" && arguments.size() <= 1 && (arguments.empty() || parse_count(arguments[0], count)))
+    {
+        step(arguments.empty() ? 1 : count);
+        report(output);
+    }
+    else if (verb == "next" && arguments.empty())
+    {
+        step_over();
+        report(output);
+    }
+    else if (verb == "finish" && arguments.empty())
+    {
+        step_out();
+        report(output);
+    }
+    else if (verb == "regs" && arguments.empty())
+    {
+        print_registers(output);
+    }
+    else if (verb == "mem" && (arguments.size() == 1 || arguments.size() == 2) && parse_address(arguments[0], start) &&
+             (arguments.size() == 1 || parse_count(arguments[1], count)))
+    {
+        if (arguments.size() == 1)
+            count = 16;
+
+        char text[8];
+        for (uint64_t i = 0; i < count; i++)
+        {
+            const uint16_t addr = (uint16_t)(start + i);
+
+            if (i % 16 == 0)
+                output << (i == 0 ? "" : "\n") << hex(addr, 4) << ":";
+
+            std::snprintf(text, sizeof(text), " %02X", bus.peek_byte(addr));
+            output << text;
+        }
+        output << std::endl;
+    }
+    else
+    {
+        output << "[Debugger] ERROR! Cannot parse command ``" << command << "''." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Debugger::run_script(std::istream& input, std::ostream& output, bool echo)
+{
+    std::string line;
+
+    while (std::getline(input, line))
+    {
+        const std::size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+
+        line = line.substr(first);
+        if (line == "quit")
+            break;
+
+        if (echo)
+            output << "> " << line << std::endl;
+
+        if (!execute(line, output))
+            return false;
+    }
+
+    return true;
+}
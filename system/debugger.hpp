@@ -0,0 +1,208 @@
+//
+// Interactive debugger: breakpoints, watchpoints and stepping over a running console.
+//
+
+#ifndef NESEMULATOR_DEBUGGER_HPP
+#define NESEMULATOR_DEBUGGER_HPP
+
+#include "ram.hpp"
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class MOS6502;
+class NES;
+
+namespace constants
+{
+    const uint64_t DEBUGGER_RUN_LIMIT = 3600; // Frames a run command goes on for without stopping (1 min).
+} // namespace constants
+
+// A breakpoint is an execute watchpoint over a single address.
+struct watchpoint_t
+{
+    static const uint8_t READ = RAM::WATCH_READ;
+    static const uint8_t WRITE = RAM::WATCH_WRITE;
+    static const uint8_t EXECUTE = 1 << 2;
+
+    unsigned int id;
+    uint16_t start;
+    uint16_t end;      // Inclusive.
+    uint8_t kinds;     // READ | WRITE | EXECUTE.
+};
+
+/**
+ * Debugger for one console. While attached it runs the console on the interpreter and can
+ * stop it at PC breakpoints, at read/write/execute watchpoints over address ranges, after
+ * single steps, over subroutine calls (step over) and at the return from the current one
+ * (step out). A stopped console stays at an instruction boundary: interrupts that fell due
+ * are delivered when it resumes.
+ *
+ * Nothing is looked up on the fast paths. Execute breakpoints are kept in a per-page bitmap,
+ * and only instructions in a flagged page test the exact address; read and write watchpoints
+ * flag their pages on the bus (RAM::watch_pages), so only accesses to those pages leave the
+ * usual single indexed load. With nothing armed, the CPU tests one bit per instruction.
+ *
+ * Everything can be driven through text commands (execute, run_script), one per line:
+ *
+ *   break ADDR                   stop before the instruction at ADDR
+ *   watch r|w|x|rw|... START [END]
+ *                                stop on reads, writes and/or execution within [START, END]
+ *   delete [ID]                  remove one, or every, break/watchpoint
+ *   list                         list break/watchpoints
+ *   continue [FRAMES]            run until something stops the console (or FRAMES frames)
+ *   step [N]                     execute N instructions (default 1)
+ *   next                         step, running subroutine calls through to their return
+ *   finish                       run until the current subroutine returns
+ *   regs                         show the CPU registers and the next instruction
+ *   mem ADDR [LENGTH]            hex dump, without side effects
+ *
+ * Addresses are hexadecimal ("C000", "$C000" or "0xC000"); counts are decimal.
+ */
+class Debugger
+{
+private:
+    enum class run_mode_t
+    {
+        IDLE,       // No run under way; only break/watchpoints stop the console.
+        CONTINUE,
+        STEP,
+        STEP_OVER,
+        STEP_OUT
+    };
+
+    NES& nes;
+    MOS6502& cpu;
+    RAM& bus;
+
+    std::vector<watchpoint_t> points;
+    unsigned int next_id = 1;
+
+    // Execute breakpoints: a bit per page holding one, and a bit per address.
+    uint64_t break_pages[constants::PAGE_COUNT / 64];
+    std::vector<uint64_t> break_addresses;
+
+    // Run control. When set, every instruction takes the slow check.
+    bool check_every_instruction = false;
+    run_mode_t mode = run_mode_t::IDLE;
+    uint64_t steps_left = 0;
+    uint16_t return_address = 0;       // Step over: where the call returns to...
+    uint8_t return_sp = 0;             // ...and the stack level it returns at (step out too).
+    bool skip_pending = false;         // The instruction a run resumes at doesn't re-break.
+    uint16_t skip_address = 0;
+
+    uint16_t instruction_address = 0;  // Start of the instruction being executed.
+    std::string stop_reason;
+
+    void rebuild();
+    bool check(uint16_t pc);
+    void stop(const std::string& reason);
+
+    // Runs the console in `run_mode' until it stops, halts or `max_frames' have passed.
+    // Returns whether the debugger stopped it.
+    bool resume(run_mode_t run_mode, uint64_t max_frames);
+
+    static void access_watched(void* context, address_t addr, uint8_t value, bool write);
+
+    // Prints how the last run ended, then the registers.
+    void report(std::ostream& output) const;
+    void print_registers(std::ostream& output) const;
+public:
+    /**
+     * Attaches to `nes' (its CPU and bus) until destroyed.
+     * @param nes
+     */
+    explicit Debugger(NES& nes);
+    ~Debugger();
+
+    Debugger(const Debugger&) = delete;
+    Debugger& operator=(const Debugger&) = delete;
+
+    /**
+     * Adds a breakpoint or watchpoint; returns its id.
+     * @param start
+     * @param end last address (inclusive)
+     * @param kinds watchpoint_t::READ, WRITE and/or EXECUTE
+     */
+    unsigned int add_watchpoint(uint16_t start, uint16_t end, uint8_t kinds);
+    unsigned int add_breakpoint(uint16_t address);
+
+    /**
+     * Removes a break/watchpoint. Returns false if there is none with that id.
+     * @param id
+     */
+    bool remove(unsigned int id);
+    void remove_all();
+
+    const std::vector<watchpoint_t>& get_watchpoints() const;
+
+    /**
+     * Runs until a break/watchpoint is hit, the CPU halts or `max_frames' frames have passed.
+     * The return values of these say whether the debugger stopped the console.
+     * @param max_frames
+     */
+    bool run(uint64_t max_frames = constants::DEBUGGER_RUN_LIMIT);
+
+    /**
+     * Executes `count' instructions (fewer if a break/watchpoint is hit first).
+     * @param count
+     */
+    bool step(uint64_t count = 1);
+
+    /**
+     * Like step(), but a JSR runs until the call returns.
+     */
+    bool step_over();
+
+    /**
+     * Runs until the current subroutine (or interrupt handler) returns.
+     */
+    bool step_out();
+
+    /**
+     * Why the console last stopped ("" if it didn't).
+     */
+    const std::string& get_stop_reason() const;
+
+    /**
+     * Runs one text command (see above), writing its output to `output'. Returns false,
+     * with an error written to `output', if the command is not understood.
+     * @param command
+     * @param output
+     */
+    bool execute(const std::string& command, std::ostream& output);
+
+    /**
+     * Runs commands from `input' line by line until it ends or a "quit" line. Blank lines and
+     * lines starting with '#' are skipped. Stops at the first command that fails and returns
+     * false.
+     * @param input
+     * @param output
+     * @param echo write each command to `output' before running it
+     */
+    bool run_script(std::istream& input, std::ostream& output, bool echo);
+
+    /**
+     * Called by the CPU before each instruction; true stops it there.
+     * @param pc
+     */
+    inline bool should_stop(uint16_t pc);
+};
+
+inline bool Debugger::should_stop(uint16_t pc)
+{
+    instruction_address = pc;
+
+    if (!check_every_instruction)
+    {
+        const unsigned int page = pc >> 8;
+        if (((break_pages[page >> 6] >> (page & 63)) & 1) == 0)
+            return false;
+    }
+
+    return check(pc);
+}
+
+#endif //NESEMULATOR_DEBUGGER_HPP
@@ -0,0 +1,142 @@
+//
+// Real-time frame pacing for the emulation loop.
+//
+
+#include "frame_pacer.hpp"
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+namespace
+{
+    // sleep_until usually wakes up late by up to a scheduler tick; sleep until this long
+    // before the deadline and yield-spin the rest of the way.
+    const std::chrono::microseconds SPIN_MARGIN(1000);
+
+    // If the host falls more than this many frames behind (debugger, suspended laptop...),
+    // don't try to catch up in a burst: restart the schedule from now.
+    const uint64_t MAX_FRAMES_BEHIND = 4;
+
+    double to_us(std::chrono::steady_clock::duration duration)
+    {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    }
+} // namespace
+
+FramePacer::FramePacer(MOS6502& cpu, pacing_mode_t mode, double cpu_clock, double frame_rate)
+    : cpu(cpu), mode(mode)
+{
+    cycles_per_frame = cpu_clock / frame_rate;
+    frame_period = std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double>(1.0 / frame_rate));
+
+    start_cycle = cpu.cycles;
+    start_time = clock_t::now();
+}
+
+FramePacer::FramePacer(NES& nes, pacing_mode_t mode, double frame_rate)
+    : FramePacer(nes.get_cpu(), mode, constants::NTSC_CPU_CLOCK, frame_rate)
+{
+    this->nes = &nes;
+}
+
+void FramePacer::wait_until(clock_t::time_point deadline)
+{
+    if (deadline - clock_t::now() > SPIN_MARGIN)
+        std::this_thread::sleep_until(deadline - SPIN_MARGIN);
+
+    while (clock_t::now() < deadline)
+        std::this_thread::yield();
+}
+
+void FramePacer::run_frame()
+{
+    clock_t::time_point work_start = clock_t::now();
+
+    frames_since_start++;
+
+    if (nes != nullptr)
+        nes->run_frames(1);
+    else
+        cpu.run_until(start_cycle + (uint64_t)(frames_since_start * cycles_per_frame));
+
+    clock_t::time_point work_end = clock_t::now();
+    double work_us = to_us(work_end - work_start);
+
+    stats.frames++;
+    stats.total_work_us += work_us;
+    if (work_us > stats.max_work_us)
+        stats.max_work_us = work_us;
+
+    if (mode == pacing_mode_t::UNTHROTTLED)
+        return;
+
+    clock_t::time_point deadline = start_time + frames_since_start * frame_period;
+
+    if (work_end > deadline)
+    {
+        stats.late_frames++;
+
+        if (work_end - deadline > MAX_FRAMES_BEHIND * frame_period)
+        {
+            // Too far behind to catch up smoothly; make this frame the new origin.
+            stats.resyncs++;
+            start_time = work_end;
+            start_cycle = cpu.cycles;
+            frames_since_start = 0;
+        }
+        return;
+    }
+
+    wait_until(deadline);
+
+    double jitter_us = to_us(clock_t::now() - deadline);
+    stats.waited_frames++;
+    stats.total_jitter_us += jitter_us;
+    if (jitter_us > stats.max_jitter_us)
+        stats.max_jitter_us = jitter_us;
+}
+
+void FramePacer::set_mode(pacing_mode_t new_mode)
+{
+    if (new_mode == mode)
+        return;
+
+    mode = new_mode;
+
+    // Restart the schedule so a switch back to real time doesn't try to "catch up" on the
+    // frames that ran unthrottled.
+    start_time = clock_t::now();
+    start_cycle = cpu.cycles;
+    frames_since_start = 0;
+}
+
+pacing_mode_t FramePacer::get_mode() const
+{
+    return mode;
+}
+
+const frame_timing_stats_t& FramePacer::get_stats() const
+{
+    return stats;
+}
+
+void FramePacer::report()
+{
+    if (stats.frames == 0)
+        return;
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "[Pacer] " << stats.frames << " frame(s): work avg " << stats.total_work_us / stats.frames
+              << "us, max " << stats.max_work_us << "us";
+
+    if (mode == pacing_mode_t::REALTIME)
+    {
+        double average_jitter = stats.waited_frames > 0 ? stats.total_jitter_us / stats.waited_frames : 0;
+        std::cout << "; jitter avg " << average_jitter << "us, max " << stats.max_jitter_us << "us; "
+                  << stats.late_frames << " late, " << stats.resyncs << " resync(s)";
+    }
+
+    std::cout << std::defaultfloat << std::endl;
+
+    stats = frame_timing_stats_t();
+}
@@ -0,0 +1,91 @@
+//
+// Real-time frame pacing for the emulation loop.
+//
+
+#ifndef NESEMULATOR_FRAME_PACER_HPP
+#define NESEMULATOR_FRAME_PACER_HPP
+
+#include "mos6502.hpp"
+#include "nes.hpp"
+#include <chrono>
+#include <cstdint>
+
+namespace constants
+{
+    const double NTSC_CPU_CLOCK = 1789773.0; // Hz; the 21.477272 MHz master clock divided by 12.
+    const double NTSC_FRAME_RATE = 60.0988;  // Hz.
+} // namespace constants
+
+enum class pacing_mode_t
+{
+    REALTIME,   // One frame per 1/60.0988 s, like the real console.
+    UNTHROTTLED // Run frames back to back, as fast as the host allows (batch runs).
+};
+
+// Host-side timing of the frames run so far. Times are in microseconds.
+struct frame_timing_stats_t
+{
+    uint64_t frames = 0;
+    uint64_t late_frames = 0;  // Frames whose emulation work overran the deadline.
+    uint64_t resyncs = 0;      // Times the schedule was reset after falling far behind.
+
+    double total_work_us = 0;  // Time spent emulating (the latency a frame adds).
+    double max_work_us = 0;
+
+    double total_jitter_us = 0; // |wake-up time - deadline|, for frames that had to wait.
+    double max_jitter_us = 0;
+    uint64_t waited_frames = 0;
+};
+
+/**
+ * Runs the emulation in frame-sized batches and, in real-time mode, sleeps until each frame's
+ * deadline on the monotonic clock. A frame is one PPU frame when pacing a whole console, or a
+ * fixed number of cycles when pacing a bare CPU.
+ *
+ * Deadlines are computed from the start of the run (start + n * period) rather than by
+ * adding a period to the last wake-up, so sleep overshoot never accumulates into drift.
+ * Likewise the CPU's cycle target for frame n is derived from n, so the fractional cycles
+ * per frame (about 29780.5) average out exactly.
+ */
+class FramePacer
+{
+private:
+    typedef std::chrono::steady_clock clock_t;
+
+    MOS6502& cpu;
+    NES* nes = nullptr; // Null when pacing a bare CPU.
+    pacing_mode_t mode;
+
+    double cycles_per_frame;
+    clock_t::duration frame_period;
+
+    uint64_t start_cycle;
+    uint64_t frames_since_start = 0;
+    clock_t::time_point start_time;
+
+    frame_timing_stats_t stats;
+
+    // Sleeps (then spins for the last stretch) until `deadline'.
+    static void wait_until(clock_t::time_point deadline);
+public:
+    FramePacer(MOS6502& cpu, pacing_mode_t mode, double cpu_clock = constants::NTSC_CPU_CLOCK,
+               double frame_rate = constants::NTSC_FRAME_RATE);
+    FramePacer(NES& nes, pacing_mode_t mode, double frame_rate = constants::NTSC_FRAME_RATE);
+
+    /**
+     * Emulates one frame, then waits for the frame deadline (real-time mode only).
+     */
+    void run_frame();
+
+    void set_mode(pacing_mode_t new_mode);
+    pacing_mode_t get_mode() const;
+
+    const frame_timing_stats_t& get_stats() const;
+
+    /**
+     * Prints average/max latency and jitter since the last report, then resets the stats.
+     */
+    void report();
+};
+
+#endif //NESEMULATOR_FRAME_PACER_HPP
@@ -0,0 +1,37 @@
+//
+// Content hashing helpers.
+//
+
+#ifndef NESEMULATOR_HASH_HPP
+#define NESEMULATOR_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace hashing
+{
+    const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+    const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+    /**
+     * 64-bit FNV-1a over a block of bytes. Pass a previous result as `hash' to hash several
+     * blocks as one stream.
+     * @param data
+     * @param length
+     * @param hash
+     */
+    inline uint64_t fnv1a_64(const void* data, std::size_t length, uint64_t hash = FNV_OFFSET_BASIS)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+        for (std::size_t i = 0; i < length; i++)
+        {
+            hash ^= bytes[i];
+            hash *= FNV_PRIME;
+        }
+
+        return hash;
+    }
+} // namespace hashing
+
+#endif //NESEMULATOR_HASH_HPP
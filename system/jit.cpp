@@ -0,0 +1,1237 @@
+//
+// Dynamic recompiler: translates hot 6502 basic blocks into x86-64 code.
+//
+
+#include "jit.hpp"
+#include <cstring>
+#include <iostream>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define NESEMU_JIT_X64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // ===========================
+    // x86-64 ASSEMBLER
+    // ===========================
+
+    enum reg_t : int
+    {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+    };
+
+    enum alu_t : int
+    {
+        ADD, OR, ADC, SBB, AND, SUB, XOR, CMP
+    };
+
+    enum cond_t : uint8_t
+    {
+        CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7
+    };
+
+    const int NO_INDEX = -1;
+
+    // [base + index * scale + disp]
+    struct mem_t
+    {
+        int base;
+        int index;
+        int scale;
+        int32_t disp;
+    };
+
+    mem_t at(int base, int32_t disp = 0)
+    {
+        return { base, NO_INDEX, 1, disp };
+    }
+
+    mem_t at(int base, int index, int scale, int32_t disp = 0)
+    {
+        return { base, index, scale, disp };
+    }
+
+    // Emits just the handful of instruction forms the block compiler needs. Memory operands
+    // always use a 32-bit displacement, which keeps the encoder free of special cases.
+    class Assembler
+    {
+    private:
+        std::vector<uint8_t> bytes;
+
+        // A byte register operand numbered 4-7 means SPL-DIL only with a REX prefix.
+        static bool needs_byte_rex(int reg)
+        {
+            return reg >= RSP && reg <= RDI;
+        }
+
+        void rex(bool wide, int reg, int index, int base, bool force)
+        {
+            const uint8_t value = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((index >= 0 && (index & 8)) ? 0x02 : 0) |
+                                  ((base & 8) ? 0x01 : 0);
+
+            if (value != 0x40 || force)
+                emit(value);
+        }
+
+        void modrm_mem(int reg, const mem_t& m)
+        {
+            if (m.index == NO_INDEX && (m.base & 7) != RSP)
+            {
+                emit(0x80 | ((reg & 7) << 3) | (m.base & 7));
+            }
+            else
+            {
+                const int scale_bits = m.scale == 8 ? 3 : m.scale == 4 ? 2 : m.scale == 2 ? 1 : 0;
+                const int index = m.index == NO_INDEX ? RSP : (m.index & 7);
+
+                emit(0x80 | ((reg & 7) << 3) | RSP);
+                emit((scale_bits << 6) | (index << 3) | (m.base & 7));
+            }
+
+            imm32(m.disp);
+        }
+
+        // op reg, rm (register-register form).
+        void rr(bool wide, bool force_rex, std::initializer_list<uint8_t> opcode, int reg, int rm)
+        {
+            rex(wide, reg, NO_INDEX, rm, force_rex);
+            for (uint8_t byte : opcode)
+                emit(byte);
+            emit(0xC0 | ((reg & 7) << 3) | (rm & 7));
+        }
+
+        // op reg, [mem].
+        void rm(bool wide, bool force_rex, std::initializer_list<uint8_t> opcode, int reg, const mem_t& m)
+        {
+            rex(wide, reg, m.index, m.base, force_rex);
+            for (uint8_t byte : opcode)
+                emit(byte);
+            modrm_mem(reg, m);
+        }
+    public:
+        const std::vector<uint8_t>& get_bytes() const { return bytes; }
+        std::size_t size() const { return bytes.size(); }
+
+        void emit(uint8_t byte) { bytes.push_back(byte); }
+
+        void imm16(uint16_t value)
+        {
+            emit(value & 0xFF);
+            emit(value >> 8);
+        }
+
+        void imm32(int32_t value)
+        {
+            for (int i = 0; i < 4; i++)
+                emit(((uint32_t)value >> (8 * i)) & 0xFF);
+        }
+
+        // Points the rel32 at `position' (as returned by jcc/jmp) to `target'.
+        void patch(std::size_t position, std::size_t target)
+        {
+            const int32_t rel = (int32_t)(target - (position + 4));
+            std::memcpy(&bytes[position], &rel, sizeof(rel));
+        }
+
+        void push(int reg) { rex(false, 0, NO_INDEX, reg, false); emit(0x50 | (reg & 7)); }
+        void pop(int reg) { rex(false, 0, NO_INDEX, reg, false); emit(0x58 | (reg & 7)); }
+        void ret() { emit(0xC3); }
+
+        std::size_t jcc(cond_t cc)
+        {
+            emit(0x0F);
+            emit(0x80 | cc);
+            imm32(0);
+            return size() - 4;
+        }
+
+        std::size_t jmp()
+        {
+            emit(0xE9);
+            imm32(0);
+            return size() - 4;
+        }
+
+        void mov32(int dst, int src) { rr(false, false, { 0x89 }, src, dst); }
+        void mov64(int dst, int src) { rr(true, false, { 0x89 }, src, dst); }
+
+        void mov32_imm(int dst, uint32_t value)
+        {
+            rex(false, 0, NO_INDEX, dst, false);
+            emit(0xB8 | (dst & 7));
+            imm32((int32_t)value);
+        }
+
+        void movzx8(int dst, int src) { rr(false, needs_byte_rex(src), { 0x0F, 0xB6 }, dst, src); }
+        void movzx16(int dst, int src) { rr(false, false, { 0x0F, 0xB7 }, dst, src); }
+        void movzx8(int dst, const mem_t& m) { rm(false, false, { 0x0F, 0xB6 }, dst, m); }
+        void movzx16(int dst, const mem_t& m) { rm(false, false, { 0x0F, 0xB7 }, dst, m); }
+        void load64(int dst, const mem_t& m) { rm(true, false, { 0x8B }, dst, m); }
+
+        void store8(const mem_t& m, int src) { rm(false, needs_byte_rex(src), { 0x88 }, src, m); }
+        void store16(const mem_t& m, int src) { emit(0x66); rm(false, false, { 0x89 }, src, m); }
+        void store64(const mem_t& m, int src) { rm(true, false, { 0x89 }, src, m); }
+        void store8_imm(const mem_t& m, uint8_t value) { rm(false, false, { 0xC6 }, 0, m); emit(value); }
+        void store16_imm(const mem_t& m, uint16_t value) { emit(0x66); rm(false, false, { 0xC7 }, 0, m); imm16(value); }
+
+        void alu32(alu_t op, int dst, int src) { rr(false, false, { (uint8_t)((op << 3) | 1) }, src, dst); }
+        void alu64(alu_t op, int dst, int src) { rr(true, false, { (uint8_t)((op << 3) | 1) }, src, dst); }
+        void alu32_imm(alu_t op, int dst, int32_t value) { rr(false, false, { 0x81 }, op, dst); imm32(value); }
+        void alu64_imm(alu_t op, int dst, int32_t value) { rr(true, false, { 0x81 }, op, dst); imm32(value); }
+        void alu64_to_mem(alu_t op, const mem_t& m, int src) { rm(true, false, { (uint8_t)((op << 3) | 1) }, src, m); }
+        void or8_from_mem(int dst, const mem_t& m) { rm(false, needs_byte_rex(dst), { 0x0A }, dst, m); }
+        void cmp64_mem(int reg, const mem_t& m) { rm(true, false, { 0x3B }, reg, m); }
+
+        void test32(int a, int b) { rr(false, false, { 0x85 }, b, a); }
+        void test64(int a, int b) { rr(true, false, { 0x85 }, b, a); }
+        void test32_imm(int reg, uint32_t value) { rr(false, false, { 0xF7 }, 0, reg); imm32((int32_t)value); }
+
+        void shl32(int reg, uint8_t count) { rr(false, false, { 0xC1 }, 4, reg); emit(count); }
+        void shr32(int reg, uint8_t count) { rr(false, false, { 0xC1 }, 5, reg); emit(count); }
+        void shl64_cl(int reg) { rr(true, false, { 0xD3 }, 4, reg); }
+        void not32(int reg) { rr(false, false, { 0xF7 }, 2, reg); }
+        void inc32(int reg) { rr(false, false, { 0xFF }, 0, reg); }
+        void dec32(int reg) { rr(false, false, { 0xFF }, 1, reg); }
+        void inc8(int reg) { rr(false, needs_byte_rex(reg), { 0xFE }, 0, reg); }
+        void dec8(int reg) { rr(false, needs_byte_rex(reg), { 0xFE }, 1, reg); }
+
+        void lea32(int dst, const mem_t& m) { rm(false, false, { 0x8D }, dst, m); }
+        void lea64(int dst, const mem_t& m) { rm(true, false, { 0x8D }, dst, m); }
+
+        void setcc(cond_t cc, int dst) { rr(false, needs_byte_rex(dst), { 0x0F, (uint8_t)(0x90 | cc) }, 0, dst); }
+    };
+
+    // ===========================
+    // BLOCK COMPILER
+    // ===========================
+
+    using O = operation_t;
+    using M = addr_mode_t;
+
+    // Host register assignment inside a block. SP stays in the context.
+    const int CTX = RBX;          // jit_context_t*
+    const int NZ = RBP;           // context->nz_flags
+    const int READ_PAGES = R12;
+    const int WRITE_PAGES = R13;
+    const int WRITE_CHUNKS = R14;
+    const int DIRTY_CHUNKS = R15;
+    const int REG_A = R8;
+    const int REG_X = R9;
+    const int REG_Y = R10;
+    const int REG_P = R11;
+    const int CYCLES = RDX;
+    const int ADDRESS = RDI;      // Effective address of a computed operand.
+    const int WRITE_PTR = RSI;    // Scratch: RAX, RCX (operand value), RSI, RDI.
+
+    const int32_t CTX_CYCLES = offsetof(jit_context_t, cycles);
+    const int32_t CTX_RUN_TARGET = offsetof(jit_context_t, run_target);
+    const int32_t CTX_PC = offsetof(jit_context_t, PC);
+    const int32_t CTX_SP = offsetof(jit_context_t, SP);
+
+    const uint8_t FLAG_C = 0x01, FLAG_Z = 0x02, FLAG_D = 0x08, FLAG_I = 0x04, FLAG_V = 0x40, FLAG_N = 0x80;
+
+    struct insn_t
+    {
+        uint16_t pc;
+        uint8_t opcode;
+        uint16_t operand;
+    };
+
+    // A memory operand: a fixed address, or one computed into ADDRESS.
+    struct operand_t
+    {
+        bool fixed;
+        uint16_t address;
+    };
+
+    bool is_compilable(const opcode_info_t& info)
+    {
+        switch (info.operation)
+        {
+            case O::BRK: case O::CLI: case O::PLP: case O::RTI: case O::XXX:
+                return false;
+            case O::JMP:
+                return info.addrmode == M::ABS;
+            default:
+                return true;
+        }
+    }
+
+    bool ends_block(const opcode_info_t& info)
+    {
+        return info.operation == O::JMP || info.operation == O::JSR || info.operation == O::RTS;
+    }
+
+    bool is_branch(operation_t operation)
+    {
+        switch (operation)
+        {
+            case O::BCC: case O::BCS: case O::BEQ: case O::BMI: case O::BNE: case O::BPL: case O::BVC: case O::BVS:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Operations that pay the addressing mode's page-crossing cycle (see MOS6502::execute).
+    bool pays_page_cross(operation_t operation)
+    {
+        switch (operation)
+        {
+            case O::ADC: case O::AND: case O::CMP: case O::EOR: case O::LDA: case O::LDX: case O::LDY: case O::ORA:
+            case O::SBC:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    class BlockCompiler
+    {
+    private:
+        Assembler a;
+        uint16_t start;
+        uint32_t max_cycles;
+
+        std::size_t body_start = 0;
+
+        // Exits whose code goes after the body, and jumps to the shared epilogue.
+        struct stub_t
+        {
+            std::size_t jump;
+            uint16_t pc;
+            uint32_t cycles;
+        };
+        std::vector<stub_t> stubs;
+        std::vector<std::size_t> epilogue_jumps;
+
+        // Sets PC, settles the cycle counter and leaves. A jump back to the start of the block
+        // stays in the block for as long as another pass is sure to end before the run's target.
+        void emit_exit(uint16_t pc, uint32_t cycles)
+        {
+            if (cycles > 0)
+                a.alu64_imm(ADD, CYCLES, cycles);
+
+            if (pc == start)
+            {
+                a.lea64(RAX, at(CYCLES, max_cycles));
+                a.cmp64_mem(RAX, at(CTX, CTX_RUN_TARGET));
+                const std::size_t leave = a.jcc(CC_A);
+                a.patch(a.jmp(), body_start);
+                a.patch(leave, a.size());
+            }
+
+            a.store16_imm(at(CTX, CTX_PC), pc);
+            epilogue_jumps.push_back(a.jmp());
+        }
+
+        void exit_if(cond_t cc, uint16_t pc, uint32_t cycles)
+        {
+            stubs.push_back({ a.jcc(cc), pc, cycles });
+        }
+
+        // Flags from the byte in `reg'.
+        void set_nz(int reg)
+        {
+            a.alu32_imm(AND, REG_P, (uint8_t)~(FLAG_N | FLAG_Z));
+            a.or8_from_mem(REG_P, at(NZ, reg, 1));
+        }
+
+        operand_t resolve(const insn_t& insn, uint32_t cycles_before)
+        {
+            const opcode_info_t& info = opcodes::OPCODE_TABLE[insn.opcode];
+
+            switch (info.addrmode)
+            {
+                case M::ZP0:
+                    return { true, (uint16_t)(insn.operand & 0xFF) };
+                case M::ABS:
+                    return { true, insn.operand };
+                case M::ZPX:
+                case M::ZPY:
+                    a.lea32(ADDRESS, at(info.addrmode == M::ZPX ? REG_X : REG_Y, insn.operand & 0xFF));
+                    a.movzx8(ADDRESS, ADDRESS);
+                    return { false, 0 };
+                case M::ABX:
+                case M::ABY:
+                    a.lea32(ADDRESS, at(info.addrmode == M::ABX ? REG_X : REG_Y, insn.operand));
+                    a.movzx16(ADDRESS, ADDRESS);
+                    return { false, 0 };
+                case M::IZX:
+                    a.load64(RAX, at(READ_PAGES, 0));
+                    a.test64(RAX, RAX);
+                    exit_if(CC_E, insn.pc, cycles_before);
+                    a.lea32(RCX, at(REG_X, insn.operand & 0xFF));
+                    a.movzx8(RCX, RCX);
+                    a.movzx8(ADDRESS, at(RAX, RCX, 1));
+                    a.inc32(RCX);
+                    a.movzx8(RCX, RCX);
+                    a.movzx8(RCX, at(RAX, RCX, 1));
+                    a.shl32(RCX, 8);
+                    a.alu32(OR, ADDRESS, RCX);
+                    return { false, 0 };
+                case M::IZY:
+                    a.load64(RAX, at(READ_PAGES, 0));
+                    a.test64(RAX, RAX);
+                    exit_if(CC_E, insn.pc, cycles_before);
+                    a.movzx8(ADDRESS, at(RAX, insn.operand & 0xFF));
+                    a.movzx8(RCX, at(RAX, (insn.operand + 1) & 0xFF));
+                    a.shl32(RCX, 8);
+                    a.alu32(OR, ADDRESS, RCX);
+                    a.alu32(ADD, ADDRESS, REG_Y);
+                    a.movzx16(ADDRESS, ADDRESS);
+                    return { false, 0 };
+                default:
+                    return { true, 0 };
+            }
+        }
+
+        // Loads a pointer to the operand byte through `table' into `dst', leaving the block if
+        // the page is not plain memory. Returns the displacement to use with the pointer.
+        int32_t page_pointer(int dst, int table, const operand_t& operand, const insn_t& insn, uint32_t cycles_before)
+        {
+            if (operand.fixed)
+            {
+                a.load64(dst, at(table, (operand.address >> 8) * 8));
+                a.test64(dst, dst);
+                exit_if(CC_E, insn.pc, cycles_before);
+                return operand.address & 0xFF;
+            }
+
+            a.mov32(dst, ADDRESS);
+            a.shr32(dst, 8);
+            a.load64(dst, at(table, dst, 8));
+            a.test64(dst, dst);
+            exit_if(CC_E, insn.pc, cycles_before);
+            a.movzx8(RCX, ADDRESS);
+            a.alu64(ADD, dst, RCX);
+            return 0;
+        }
+
+        // Sets the dirty bit of the page just written (see RAM::write_byte).
+        void mark_dirty(const operand_t& operand)
+        {
+            if (operand.fixed)
+            {
+                a.movzx16(RAX, at(WRITE_CHUNKS, (operand.address >> 8) * 2));
+            }
+            else
+            {
+                a.mov32(RAX, ADDRESS);
+                a.shr32(RAX, 8);
+                a.movzx16(RAX, at(WRITE_CHUNKS, RAX, 2));
+            }
+
+            a.mov32(RCX, RAX);
+            a.shr32(RAX, 6);
+            a.mov32_imm(RSI, 1);
+            a.shl64_cl(RSI);
+            a.alu64_to_mem(OR, at(DIRTY_CHUNKS, RAX, 8), RSI);
+        }
+
+        // Stack accesses. The page one pointers are checked before anything is changed.
+        void check_stack_write(const insn_t& insn, uint32_t cycles_before)
+        {
+            a.load64(WRITE_PTR, at(WRITE_PAGES, 8));
+            a.test64(WRITE_PTR, WRITE_PTR);
+            exit_if(CC_E, insn.pc, cycles_before);
+        }
+
+        void check_stack_read(const insn_t& insn, uint32_t cycles_before)
+        {
+            a.load64(RAX, at(READ_PAGES, 8));
+            a.test64(RAX, RAX);
+            exit_if(CC_E, insn.pc, cycles_before);
+        }
+
+        void push_byte(int src)
+        {
+            a.movzx8(RCX, at(CTX, CTX_SP));
+            a.store8(at(WRITE_PTR, RCX, 1), src);
+            a.dec8(RCX);
+            a.store8(at(CTX, CTX_SP), RCX);
+            mark_dirty({ true, 0x0100 });
+        }
+
+        // Operations on the operand byte in ECX.
+        void read_operation(operation_t operation)
+        {
+            switch (operation)
+            {
+                case O::SBC:
+                    a.alu32_imm(XOR, RCX, 0xFF);
+                    // A - M - (1 - C) is A + ~M + C.
+                    // fall through
+                case O::ADC:
+                    a.mov32(RAX, REG_P);
+                    a.alu32_imm(AND, RAX, FLAG_C);
+                    a.alu32(ADD, RAX, REG_A);
+                    a.alu32(ADD, RAX, RCX);                         // EAX = A + M + C
+                    a.mov32(RDI, REG_A);
+                    a.alu32(XOR, RDI, RCX);
+                    a.not32(RDI);                                   // ~(A ^ M)
+                    a.alu32(XOR, REG_A, RAX);                       // A ^ result
+                    a.alu32(AND, RDI, REG_A);
+                    a.alu32_imm(AND, RDI, 0x80);
+                    a.shr32(RDI, 1);
+                    a.alu32_imm(AND, REG_P, (uint8_t)~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C));
+                    a.alu32(OR, REG_P, RDI);                        // V
+                    a.mov32(RDI, RAX);
+                    a.shr32(RDI, 8);
+                    a.alu32(OR, REG_P, RDI);                        // C
+                    a.movzx8(REG_A, RAX);
+                    a.or8_from_mem(REG_P, at(NZ, REG_A, 1));
+                    break;
+                case O::AND: a.alu32(AND, REG_A, RCX); set_nz(REG_A); break;
+                case O::ORA: a.alu32(OR, REG_A, RCX); set_nz(REG_A); break;
+                case O::EOR: a.alu32(XOR, REG_A, RCX); set_nz(REG_A); break;
+                case O::LDA: a.mov32(REG_A, RCX); set_nz(REG_A); break;
+                case O::LDX: a.mov32(REG_X, RCX); set_nz(REG_X); break;
+                case O::LDY: a.mov32(REG_Y, RCX); set_nz(REG_Y); break;
+                case O::CMP: compare(REG_A); break;
+                case O::CPX: compare(REG_X); break;
+                case O::CPY: compare(REG_Y); break;
+                case O::BIT:
+                    a.alu32_imm(AND, REG_P, (uint8_t)~(FLAG_N | FLAG_V | FLAG_Z));
+                    a.mov32(RAX, RCX);
+                    a.alu32_imm(AND, RAX, FLAG_N | FLAG_V);
+                    a.alu32(OR, REG_P, RAX);
+                    a.test32(REG_A, RCX);
+                    a.setcc(CC_E, RAX);
+                    a.movzx8(RAX, RAX);
+                    a.alu32(ADD, RAX, RAX);
+                    a.alu32(OR, REG_P, RAX);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        void compare(int reg)
+        {
+            a.alu32_imm(AND, REG_P, (uint8_t)~(FLAG_N | FLAG_Z | FLAG_C));
+            a.alu32(CMP, reg, RCX);
+            a.setcc(CC_AE, RAX);
+            a.movzx8(RAX, RAX);
+            a.alu32(OR, REG_P, RAX);
+            a.mov32(RAX, reg);
+            a.alu32(SUB, RAX, RCX);
+            a.movzx8(RAX, RAX);
+            a.or8_from_mem(REG_P, at(NZ, RAX, 1));
+        }
+
+        // Read-modify-write operations on ECX, result left in ECX.
+        void modify_operation(operation_t operation)
+        {
+            switch (operation)
+            {
+                case O::ASL:
+                    a.alu32(ADD, RCX, RCX);
+                    a.alu32_imm(AND, REG_P, (uint8_t)~(FLAG_N | FLAG_Z | FLAG_C));
+                    a.mov32(RAX, RCX);
+                    a.shr32(RAX, 8);
+                    a.alu32(OR, REG_P, RAX);
+                    a.movzx8(RCX, RCX);
+                    break;
+                case O::LSR:
+                    a.alu32_imm(AND, REG_P, (uint8_t)~(FLAG_N | FLAG_Z | FLAG_C));
+                    a.mov32(RAX, RCX);
+                    a.alu32_imm(AND, RAX, FLAG_C);
+                    a.alu32(OR, REG_P, RAX);
+                    a.shr32(RCX, 1);
+                    break;
+                case O::ROL:
+                    a.alu32(ADD, RCX, RCX);
+                    a.mov32(RAX, REG_P);
+                    a.alu32_imm(AND, RAX, FLAG_C);
+                    a.alu32(OR, RCX, RAX);
+                    a.alu32_imm(AND, REG_P, (uint8_t)~(FLAG_N | FLAG_Z | FLAG_C));
+                    a.mov32(RAX, RCX);
+                    a.shr32(RAX, 8);
+                    a.alu32(OR, REG_P, RAX);
+                    a.movzx8(RCX, RCX);
+                    break;
+                case O::ROR:
+                    a.mov32(RAX, REG_P);
+                    a.alu32_imm(AND, RAX, FLAG_C);
+                    a.shl32(RAX, 8);
+                    a.alu32(OR, RCX, RAX);
+                    a.alu32_imm(AND, REG_P, (uint8_t)~(FLAG_N | FLAG_Z | FLAG_C));
+                    a.mov32(RAX, RCX);
+                    a.alu32_imm(AND, RAX, FLAG_C);
+                    a.alu32(OR, REG_P, RAX);
+                    a.shr32(RCX, 1);
+                    break;
+                case O::INC:
+                    a.inc32(RCX);
+                    a.movzx8(RCX, RCX);
+                    break;
+                case O::DEC:
+                    a.dec32(RCX);
+                    a.movzx8(RCX, RCX);
+                    break;
+                default:
+                    break;
+            }
+
+            set_nz(RCX);
+        }
+
+        void step_register(int reg, bool increment)
+        {
+            if (increment)
+                a.inc32(reg);
+            else
+                a.dec32(reg);
+            a.movzx8(reg, reg);
+            set_nz(reg);
+        }
+
+        void transfer(int dst, int src)
+        {
+            a.mov32(dst, src);
+            set_nz(dst);
+        }
+
+        // Returns false if the instruction ended the block.
+        bool compile_instruction(const insn_t& insn, uint32_t& pending)
+        {
+            const opcode_info_t& info = opcodes::OPCODE_TABLE[insn.opcode];
+            const uint16_t next_pc = insn.pc + opcodes::instruction_length(info.addrmode);
+            const uint32_t before = pending;
+            const uint32_t after = pending + info.cycles;
+
+            if (is_branch(info.operation))
+            {
+                const uint16_t target = next_pc + (int8_t)(insn.operand & 0xFF);
+                const uint32_t taken = after + 1 + ((target & 0xFF00) != (next_pc & 0xFF00) ? 1 : 0);
+
+                uint8_t mask = FLAG_C;
+                bool when_set = false;
+                switch (info.operation)
+                {
+                    case O::BCC: mask = FLAG_C; when_set = false; break;
+                    case O::BCS: mask = FLAG_C; when_set = true; break;
+                    case O::BNE: mask = FLAG_Z; when_set = false; break;
+                    case O::BEQ: mask = FLAG_Z; when_set = true; break;
+                    case O::BPL: mask = FLAG_N; when_set = false; break;
+                    case O::BMI: mask = FLAG_N; when_set = true; break;
+                    case O::BVC: mask = FLAG_V; when_set = false; break;
+                    case O::BVS: mask = FLAG_V; when_set = true; break;
+                    default: break;
+                }
+
+                // The taken path leaves through a stub; the block carries on along the other.
+                a.test32_imm(REG_P, mask);
+                const std::size_t skip = a.jcc(when_set ? CC_E : CC_NE);
+                emit_exit(target, taken);
+                a.patch(skip, a.size());
+
+                pending = after;
+                return true;
+            }
+
+            switch (info.operation)
+            {
+                case O::JMP:
+                    emit_exit(insn.operand, after);
+                    return false;
+                case O::JSR:
+                {
+                    const uint16_t return_address = insn.pc + 2;
+
+                    check_stack_write(insn, before);
+                    a.movzx8(RCX, at(CTX, CTX_SP));
+                    a.store8_imm(at(WRITE_PTR, RCX, 1), return_address >> 8);
+                    a.dec8(RCX);
+                    a.store8_imm(at(WRITE_PTR, RCX, 1), return_address & 0xFF);
+                    a.dec8(RCX);
+                    a.store8(at(CTX, CTX_SP), RCX);
+                    mark_dirty({ true, 0x0100 });
+
+                    emit_exit(insn.operand, after);
+                    return false;
+                }
+                case O::RTS:
+                    check_stack_read(insn, before);
+                    a.movzx8(RCX, at(CTX, CTX_SP));
+                    a.inc8(RCX);
+                    a.movzx8(RDI, at(RAX, RCX, 1));
+                    a.inc8(RCX);
+                    a.movzx8(RSI, at(RAX, RCX, 1));
+                    a.store8(at(CTX, CTX_SP), RCX);
+                    a.shl32(RSI, 8);
+                    a.alu32(OR, RDI, RSI);
+                    a.inc32(RDI);
+                    a.store16(at(CTX, CTX_PC), RDI);
+                    a.alu64_imm(ADD, CYCLES, after);
+                    epilogue_jumps.push_back(a.jmp());
+                    return false;
+
+                case O::PHA:
+                    check_stack_write(insn, before);
+                    push_byte(REG_A);
+                    break;
+                case O::PHP:
+                    check_stack_write(insn, before);
+                    a.mov32(RDI, REG_P);
+                    a.alu32_imm(OR, RDI, 0x30);
+                    push_byte(RDI);
+                    break;
+                case O::PLA:
+                    check_stack_read(insn, before);
+                    a.movzx8(RCX, at(CTX, CTX_SP));
+                    a.inc8(RCX);
+                    a.store8(at(CTX, CTX_SP), RCX);
+                    a.movzx8(REG_A, at(RAX, RCX, 1));
+                    set_nz(REG_A);
+                    break;
+
+                case O::STA: case O::STX: case O::STY:
+                {
+                    const int src = info.operation == O::STA ? REG_A : info.operation == O::STX ? REG_X : REG_Y;
+                    const operand_t operand = resolve(insn, before);
+                    const int32_t disp = page_pointer(WRITE_PTR, WRITE_PAGES, operand, insn, before);
+                    a.store8(at(WRITE_PTR, disp), src);
+                    mark_dirty(operand);
+                    break;
+                }
+
+                case O::ASL: case O::LSR: case O::ROL: case O::ROR: case O::INC: case O::DEC:
+                {
+                    if (info.addrmode == M::IMP)
+                    {
+                        a.mov32(RCX, REG_A);
+                        modify_operation(info.operation);
+                        a.mov32(REG_A, RCX);
+                        break;
+                    }
+
+                    const operand_t operand = resolve(insn, before);
+                    const int32_t disp = page_pointer(RAX, READ_PAGES, operand, insn, before);
+                    page_pointer(WRITE_PTR, WRITE_PAGES, operand, insn, before);
+                    a.movzx8(RCX, at(RAX, disp));
+                    modify_operation(info.operation);
+                    a.store8(at(WRITE_PTR, disp), RCX);
+                    mark_dirty(operand);
+                    break;
+                }
+
+                case O::ADC: case O::SBC: case O::AND: case O::ORA: case O::EOR: case O::CMP: case O::CPX:
+                case O::CPY: case O::BIT: case O::LDA: case O::LDX: case O::LDY:
+                {
+                    if (info.addrmode == M::IMM)
+                    {
+                        a.mov32_imm(RCX, insn.operand & 0xFF);
+                        read_operation(info.operation);
+                        break;
+                    }
+
+                    const operand_t operand = resolve(insn, before);
+                    const int32_t disp = page_pointer(RAX, READ_PAGES, operand, insn, before);
+
+                    // One more cycle if indexing crossed a page: the low byte wrapped below the index.
+                    if (pays_page_cross(info.operation) &&
+                        (info.addrmode == M::ABX || info.addrmode == M::ABY || info.addrmode == M::IZY))
+                    {
+                        a.movzx8(RCX, ADDRESS);
+                        a.alu32(CMP, RCX, info.addrmode == M::ABX ? REG_X : REG_Y);
+                        a.alu64_imm(ADC, CYCLES, 0);
+                    }
+
+                    a.movzx8(RCX, at(RAX, disp));
+                    read_operation(info.operation);
+                    break;
+                }
+
+                case O::INX: step_register(REG_X, true); break;
+                case O::INY: step_register(REG_Y, true); break;
+                case O::DEX: step_register(REG_X, false); break;
+                case O::DEY: step_register(REG_Y, false); break;
+                case O::TAX: transfer(REG_X, REG_A); break;
+                case O::TAY: transfer(REG_Y, REG_A); break;
+                case O::TXA: transfer(REG_A, REG_X); break;
+                case O::TYA: transfer(REG_A, REG_Y); break;
+                case O::TSX:
+                    a.movzx8(REG_X, at(CTX, CTX_SP));
+                    set_nz(REG_X);
+                    break;
+                case O::TXS:
+                    a.store8(at(CTX, CTX_SP), REG_X);
+                    break;
+
+                case O::CLC: a.alu32_imm(AND, REG_P, (uint8_t)~FLAG_C); break;
+                case O::CLD: a.alu32_imm(AND, REG_P, (uint8_t)~FLAG_D); break;
+                case O::CLV: a.alu32_imm(AND, REG_P, (uint8_t)~FLAG_V); break;
+                case O::SEC: a.alu32_imm(OR, REG_P, FLAG_C); break;
+                case O::SED: a.alu32_imm(OR, REG_P, FLAG_D); break;
+                case O::SEI: a.alu32_imm(OR, REG_P, FLAG_I); break;
+
+                default: // NOP (all implied)
+                    break;
+            }
+
+            pending = after;
+            return true;
+        }
+    public:
+        BlockCompiler(uint16_t start, uint32_t max_cycles) : start(start), max_cycles(max_cycles) {}
+
+        const std::vector<uint8_t>& compile(const std::vector<insn_t>& insns, uint16_t end_pc)
+        {
+            // Prologue: callee-saved registers, then the context into host registers.
+            a.push(RBX); a.push(RBP); a.push(R12); a.push(R13); a.push(R14); a.push(R15);
+            a.mov64(CTX, RDI);
+            a.load64(NZ, at(CTX, offsetof(jit_context_t, nz_flags)));
+            a.load64(READ_PAGES, at(CTX, offsetof(jit_context_t, read_pages)));
+            a.load64(WRITE_PAGES, at(CTX, offsetof(jit_context_t, write_pages)));
+            a.load64(WRITE_CHUNKS, at(CTX, offsetof(jit_context_t, write_chunks)));
+            a.load64(DIRTY_CHUNKS, at(CTX, offsetof(jit_context_t, dirty_chunks)));
+            a.movzx8(REG_A, at(CTX, offsetof(jit_context_t, ACC)));
+            a.movzx8(REG_X, at(CTX, offsetof(jit_context_t, X)));
+            a.movzx8(REG_Y, at(CTX, offsetof(jit_context_t, Y)));
+            a.movzx8(REG_P, at(CTX, offsetof(jit_context_t, FLG)));
+            a.load64(CYCLES, at(CTX, CTX_CYCLES));
+
+            body_start = a.size();
+
+            uint32_t pending = 0;
+            bool open = true;
+            for (const insn_t& insn : insns)
+                open = compile_instruction(insn, pending);
+
+            if (open)
+                emit_exit(end_pc, pending);
+
+            // Epilogue.
+            const std::size_t epilogue = a.size();
+            a.store64(at(CTX, CTX_CYCLES), CYCLES);
+            a.store8(at(CTX, offsetof(jit_context_t, ACC)), REG_A);
+            a.store8(at(CTX, offsetof(jit_context_t, X)), REG_X);
+            a.store8(at(CTX, offsetof(jit_context_t, Y)), REG_Y);
+            a.store8(at(CTX, offsetof(jit_context_t, FLG)), REG_P);
+            a.pop(R15); a.pop(R14); a.pop(R13); a.pop(R12); a.pop(RBP); a.pop(RBX);
+            a.ret();
+
+            for (std::size_t jump : epilogue_jumps)
+                a.patch(jump, epilogue);
+
+            // Side exits: leave before the instruction at `pc', which the interpreter runs.
+            for (const stub_t& stub : stubs)
+            {
+                a.patch(stub.jump, a.size());
+                if (stub.cycles > 0)
+                    a.alu64_imm(ADD, CYCLES, stub.cycles);
+                a.store16_imm(at(CTX, CTX_PC), stub.pc);
+                a.patch(a.jmp(), epilogue);
+            }
+
+            return a.get_bytes();
+        }
+    };
+
+    const uint8_t* nz_flag_table()
+    {
+        static uint8_t table[256];
+        static bool built = [] {
+            for (unsigned int value = 0; value < 256; value++)
+                table[value] = (value & FLAG_N) | (value == 0 ? FLAG_Z : 0);
+            return true;
+        }();
+
+        (void)built;
+        return table;
+    }
+
+    // Stands in for blocks at PCs whose first instruction cannot be compiled.
+    jit_block_t UNCOMPILABLE = { 0, 0, 0, nullptr, false };
+} // namespace
+
+// ===========================
+// JIT
+// ===========================
+
+JIT::JIT(MOS6502* cpu, RAM* bus)
+    : cpu(cpu), bus(bus), blocks(constants::ADDRESS_SPACE_SIZE, nullptr), heat(constants::ADDRESS_SPACE_SIZE, 0)
+{
+    std::memset(&context, 0x00, sizeof(context));
+    context.read_pages = bus->read_pages;
+    context.write_pages = bus->write_pages;
+    context.write_chunks = bus->write_chunks;
+    context.dirty_chunks = bus->dirty_chunks;
+    context.nz_flags = nz_flag_table();
+
+    std::memset(code_pages, 0x00, sizeof(code_pages));
+    std::memset(code_memory, 0x00, sizeof(code_memory));
+    std::memset(&stats, 0x00, sizeof(stats));
+
+#ifdef NESEMU_JIT_X64
+    void* memory = mmap(nullptr, constants::JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory != MAP_FAILED)
+        code = static_cast<uint8_t*>(memory);
+    else
+        std::cout << "[JIT] ERROR! Could not map executable memory; running the interpreter only." << std::endl;
+#endif
+
+    bus->set_remap_listener(&JIT::pages_remapped, this);
+}
+
+JIT::~JIT()
+{
+    flush();
+    bus->set_remap_listener(nullptr, nullptr);
+
+#ifdef NESEMU_JIT_X64
+    if (code != nullptr)
+        munmap(code, constants::JIT_CODE_SIZE);
+#endif
+}
+
+bool JIT::is_supported()
+{
+#ifdef NESEMU_JIT_X64
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t JIT::run_until(uint64_t target_cycle)
+{
+    if (code == nullptr)
+        return cpu->run_until(target_cycle);
+
+#ifdef NESEMU_TRACE
+    // Traces are per instruction; compiled blocks don't produce them.
+    if (cpu->tracer != nullptr)
+        return cpu->run_until(target_cycle);
+#endif
+
+    // Neither do profiles, and they skip the debugger's per-instruction checks.
+    if (cpu->profiler != nullptr || cpu->debugger != nullptr)
+        return cpu->run_until(target_cycle);
+
+    const uint64_t start_cycle = cpu->cycles;
+
+    if (cpu->is_halted() || cpu->is_stopped())
+        return 0;
+
+    cpu->run_target = target_cycle;
+
+    // Idle loops compiled into a block spin inside it, so catch them as a run starts too.
+    if (cpu->idle_skip)
+        cpu->skip_idle_loop();
+
+    while (cpu->cycles < cpu->run_target)
+    {
+        const uint16_t pc = cpu->PC;
+        jit_block_t* block = blocks[pc];
+
+        if (block == nullptr && ++heat[pc] >= constants::JIT_HOT_THRESHOLD)
+        {
+            heat[pc] = 0;
+            block = compile(pc);
+        }
+
+        // A block that loops back to its start spins in compiled code until the run ends, so
+        // an idle loop has to be caught before going in.
+        if (block != nullptr && block->loops && cpu->idle_skip)
+        {
+            cpu->skip_idle_loop();
+
+            if (cpu->PC != pc || cpu->cycles >= cpu->run_target)
+                continue;
+        }
+
+        // A block only runs if it is sure to end before the target; near the end of a run
+        // the interpreter finishes off instruction by instruction.
+        if (block != nullptr && block->entry != nullptr && cpu->cycles + block->max_cycles <= cpu->run_target)
+        {
+            // A block whose first instruction has to be interpreted (an I/O access, say)
+            // comes straight back; the interpreter takes that instruction.
+            const uint64_t entry_cycle = cpu->cycles;
+            run_block(*block);
+            if (cpu->cycles == entry_cycle)
+                cpu->step();
+        }
+        else
+        {
+            cpu->step();
+        }
+
+        if (cpu->idle_skip && cpu->PC <= pc)
+            cpu->skip_idle_loop();
+    }
+
+    return cpu->cycles - start_cycle;
+}
+
+void JIT::run_block(const jit_block_t& block)
+{
+    context.cycles = cpu->cycles;
+    context.run_target = cpu->run_target;
+    context.PC = cpu->PC;
+    context.ACC = cpu->ACC; context.X = cpu->X; context.Y = cpu->Y; context.FLG = cpu->FLG; context.SP = cpu->SP;
+
+    block.entry(&context);
+
+    cpu->cycles = context.cycles;
+    cpu->PC = context.PC;
+    cpu->ACC = context.ACC; cpu->X = context.X; cpu->Y = context.Y; cpu->FLG = context.FLG; cpu->SP = context.SP;
+
+    stats.block_runs++;
+}
+
+jit_block_t* JIT::compile(uint16_t start)
+{
+    // Decode the basic block: up to the first jump, call or return, or the first instruction
+    // that has to be interpreted.
+    std::vector<insn_t> insns;
+    uint32_t pc = start;
+    uint32_t max_cycles = 0;
+    bool loops = false;
+
+    while (insns.size() < constants::JIT_MAX_BLOCK_INSTRUCTIONS)
+    {
+        if (bus->read_pages[(pc >> 8) & 0xFF] == nullptr)
+            break;
+
+        const uint8_t opcode = bus->read_pages[pc >> 8][pc & 0xFF];
+        const opcode_info_t& info = opcodes::OPCODE_TABLE[opcode];
+        const uint32_t length = opcodes::instruction_length(info.addrmode);
+
+        if (!is_compilable(info) || pc + length > constants::ADDRESS_SPACE_SIZE ||
+            bus->read_pages[(pc + length - 1) >> 8] == nullptr)
+            break;
+
+        insn_t insn = { (uint16_t)pc, opcode, 0 };
+        if (length >= 2)
+            insn.operand = bus->read_pages[(pc + 1) >> 8][(pc + 1) & 0xFF];
+        if (length == 3)
+            insn.operand |= bus->read_pages[(pc + 2) >> 8][(pc + 2) & 0xFF] << 8;
+        insns.push_back(insn);
+
+        if ((info.operation == O::JMP && insn.operand == start) ||
+            (is_branch(info.operation) && (uint16_t)(pc + length + (int8_t)insn.operand) == start))
+            loops = true;
+
+        // Worst case: a taken branch to another page, or a page-crossing index.
+        max_cycles += info.cycles + (is_branch(info.operation) ? 2 : pays_page_cross(info.operation) ? 1 : 0);
+        pc += length;
+
+        if (ends_block(info))
+            break;
+    }
+
+    if (insns.empty())
+    {
+        blocks[start] = &UNCOMPILABLE;
+        return blocks[start];
+    }
+
+    BlockCompiler compiler(start, max_cycles);
+    const std::vector<uint8_t>& machine_code = compiler.compile(insns, (uint16_t)pc);
+
+    jit_entry_t entry = nullptr;
+    if (!install(machine_code, entry))
+        return nullptr;
+
+    block_pool.push_back({ start, pc, max_cycles, entry, loops });
+    jit_block_t* block = &block_pool.back();
+    blocks[start] = block;
+
+    // Record the pages the code came from, and trap writes to any of them that are writable.
+    for (unsigned int page = start >> 8; page <= ((pc - 1) >> 8); page++)
+    {
+        page_blocks[page].push_back(start);
+        code_pages[page >> 6] |= 1ull << (page & 63);
+        code_memory[page] = bus->read_pages[page];
+
+        if (bus->write_pages[page] == bus->read_pages[page])
+            bus->trap_writes(code_memory[page], &JIT::code_written, this);
+    }
+
+    stats.blocks_compiled++;
+    return block;
+}
+
+bool JIT::install(const std::vector<uint8_t>& machine_code, jit_entry_t& entry)
+{
+#ifdef NESEMU_JIT_X64
+    if (machine_code.size() > constants::JIT_CODE_SIZE)
+        return false;
+
+    if (code_used + machine_code.size() > constants::JIT_CODE_SIZE)
+        flush();
+
+    // Only the pages the new block lands in are made writable, and only while it is copied.
+    static const std::size_t host_page_size = (std::size_t)sysconf(_SC_PAGESIZE);
+    const std::size_t first = code_used & ~(host_page_size - 1);
+    const std::size_t last = (code_used + machine_code.size() + host_page_size - 1) & ~(host_page_size - 1);
+
+    if (mprotect(code + first, last - first, PROT_READ | PROT_WRITE) != 0)
+        return false;
+
+    std::memcpy(code + code_used, machine_code.data(), machine_code.size());
+    entry = reinterpret_cast<jit_entry_t>(code + code_used);
+
+    // Keep blocks 16-byte aligned.
+    code_used = (code_used + machine_code.size() + 15) & ~(std::size_t)15;
+
+    return mprotect(code + first, last - first, PROT_READ | PROT_EXEC) == 0;
+#else
+    return false;
+#endif
+}
+
+// ===========================
+// INVALIDATION
+// ===========================
+
+void JIT::invalidate_block(uint16_t start)
+{
+    jit_block_t* block = blocks[start];
+    blocks[start] = nullptr;
+    heat[start] = 0;
+
+    if (block == nullptr || block->entry == nullptr)
+        return;
+
+    for (unsigned int page = start >> 8; page <= ((block->end - 1) >> 8); page++)
+    {
+        std::vector<uint16_t>& list = page_blocks[page];
+        for (std::size_t i = 0; i < list.size(); i++)
+        {
+            if (list[i] == start)
+            {
+                list[i] = list.back();
+                list.pop_back();
+                break;
+            }
+        }
+
+        if (list.empty())
+        {
+            code_pages[page >> 6] &= ~(1ull << (page & 63));
+            code_memory[page] = nullptr;
+        }
+    }
+
+    stats.blocks_invalidated++;
+}
+
+void JIT::invalidate_page(unsigned int page)
+{
+    while (!page_blocks[page].empty())
+        invalidate_block(page_blocks[page].back());
+
+    // Forget PCs that were found uncompilable too; the page now holds something else.
+    for (unsigned int offset = 0; offset < constants::PAGE_SIZE; offset++)
+    {
+        const unsigned int pc = (page << 8) | offset;
+        if (blocks[pc] == &UNCOMPILABLE)
+            blocks[pc] = nullptr;
+    }
+}
+
+void JIT::flush()
+{
+    for (unsigned int page = 0; page < constants::PAGE_COUNT; page++)
+    {
+        if (code_memory[page] != nullptr)
+            bus->untrap_writes(code_memory[page]);
+
+        page_blocks[page].clear();
+        code_memory[page] = nullptr;
+    }
+
+    std::fill(blocks.begin(), blocks.end(), nullptr);
+    std::fill(heat.begin(), heat.end(), 0);
+    std::memset(code_pages, 0x00, sizeof(code_pages));
+    block_pool.clear();
+    code_used = 0;
+
+    stats.flushes++;
+}
+
+void JIT::reset()
+{
+    flush();
+}
+
+void JIT::code_written(void* context, address_t addr, uint8_t value)
+{
+    JIT& jit = *static_cast<JIT*>(context);
+    const uint8_t* memory = jit.bus->trapped_pages[(addr >> 8) & 0xFF];
+    const unsigned int offset = addr & 0xFF;
+    bool still_code = false;
+
+    // Drop the blocks covering the written byte, through every page that maps that memory.
+    for (unsigned int page = 0; page < constants::PAGE_COUNT; page++)
+    {
+        if (jit.code_memory[page] != memory || memory == nullptr)
+            continue;
+
+        const uint32_t written = (page << 8) | offset;
+        const std::vector<uint16_t> list = jit.page_blocks[page];
+        for (uint16_t start : list)
+        {
+            const jit_block_t* block = jit.blocks[start];
+            if (block != nullptr && block->start <= written && written < block->end)
+                jit.invalidate_block(start);
+        }
+
+        if (jit.code_memory[page] != nullptr)
+            still_code = true;
+    }
+
+    jit.bus->write_through(addr, value);
+
+    if (!still_code && memory != nullptr)
+        jit.bus->untrap_writes(memory);
+}
+
+void JIT::pages_remapped(void* context, address_t addr_start, address_t addr_end)
+{
+    JIT& jit = *static_cast<JIT*>(context);
+    const unsigned int first_page = (addr_start >> 8) & 0xFF;
+    const unsigned int last_page = (addr_end >> 8) & 0xFF;
+
+    // The whole address space changed (snapshot restored, memory cleared): start over.
+    if (first_page == 0 && last_page == constants::PAGE_COUNT - 1)
+    {
+        jit.flush();
+        return;
+    }
+
+    for (unsigned int page = first_page; page <= last_page; page++)
+        jit.invalidate_page(page);
+
+    // A remapped page may now be another view of memory that still holds code: trap it too.
+    for (unsigned int page = first_page; page <= last_page; page++)
+    {
+        const uint8_t* memory = jit.bus->write_pages[page];
+        if (memory == nullptr)
+            continue;
+
+        for (unsigned int code_page = 0; code_page < constants::PAGE_COUNT; code_page++)
+        {
+            if (jit.code_memory[code_page] == memory)
+            {
+                jit.bus->trap_writes(memory, &JIT::code_written, &jit);
+                break;
+            }
+        }
+    }
+}
+
+jit_stats_t JIT::get_stats() const
+{
+    jit_stats_t result = stats;
+    result.code_bytes = code_used;
+    return result;
+}
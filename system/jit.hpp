@@ -0,0 +1,149 @@
+//
+// Dynamic recompiler: translates hot 6502 basic blocks into x86-64 code.
+//
+
+#ifndef NESEMULATOR_JIT_HPP
+#define NESEMULATOR_JIT_HPP
+
+#include "mos6502.hpp"
+#include "ram.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace constants
+{
+    const uint8_t JIT_HOT_THRESHOLD = 32;              // Executions of a PC before its block is compiled.
+    const unsigned int JIT_MAX_BLOCK_INSTRUCTIONS = 64;
+    const std::size_t JIT_CODE_SIZE = 4 * 1024 * 1024; // Code arena; flushed wholesale when full.
+} // namespace constants
+
+// What compiled code sees: the CPU registers and the bus's page tables. Compiled blocks load
+// the registers into host registers on entry and store them back at every exit.
+struct jit_context_t
+{
+    uint64_t cycles;
+    uint64_t run_target;
+
+    uint8_t* const* read_pages;
+    uint8_t* const* write_pages;
+    const uint16_t* write_chunks;
+    uint64_t* dirty_chunks;
+    const uint8_t* nz_flags;   // N and Z flags for each byte value.
+
+    uint16_t PC;
+    uint8_t ACC;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t FLG;
+    uint8_t SP;
+};
+
+typedef void (*jit_entry_t)(jit_context_t* context);
+
+// A compiled basic block: the 6502 code in [start, end).
+struct jit_block_t
+{
+    uint16_t start;
+    uint32_t end;
+    uint32_t max_cycles;       // Most cycles any path through the block can take.
+    jit_entry_t entry;         // Null for PCs that cannot be compiled.
+    bool loops;                // Jumps back to its start (and spins there without returning).
+};
+
+struct jit_stats_t
+{
+    uint64_t blocks_compiled;
+    uint64_t blocks_invalidated;
+    uint64_t flushes;
+    uint64_t block_runs;
+    std::size_t code_bytes;    // Arena space in use.
+};
+
+/**
+ * A second execution tier for a MOS6502. run_until() behaves exactly like
+ * MOS6502::run_until(), but PCs that are executed often get their basic block compiled to
+ * x86-64 code, which is then run instead of the interpreter.
+ *
+ * Compiled code keeps the 6502 registers in host registers and only settles the cycle
+ * counter at block exits. Anything it cannot do on plain memory (I/O registers, writes to
+ * pages holding compiled code, unmapped pages) makes it leave the block just before that
+ * instruction, which the interpreter then executes; devices therefore always see the exact
+ * cycle count. A block is only entered if it is sure to finish before the run's target cycle,
+ * so runs stop at the same instruction as the interpreter's. The two tiers produce identical
+ * machine states, which is how the recompiler is tested (see NESHeadless --verify-jit).
+ *
+ * Code is invalidated through a per-page code bitmap: writes to memory holding compiled code
+ * are trapped on the bus and drop the blocks they touch, and remapping pages (bank switches,
+ * loading a snapshot) drops every block in them.
+ *
+ * Only available on x86-64 Linux; elsewhere run_until() just runs the interpreter.
+ */
+class JIT
+{
+private:
+    MOS6502* cpu;
+    RAM* bus;
+
+    jit_context_t context;
+
+    // Executable memory.
+    uint8_t* code = nullptr;
+    std::size_t code_used = 0;
+
+    // Blocks by start address, and how often each PC without a block has been executed.
+    std::vector<jit_block_t*> blocks;
+    std::vector<uint8_t> heat;
+    std::deque<jit_block_t> block_pool;
+
+    // Per-page code bitmap, with the blocks whose code lies in each page and the memory the
+    // page was mapped to when they were compiled.
+    uint64_t code_pages[constants::PAGE_COUNT / 64];
+    std::vector<uint16_t> page_blocks[constants::PAGE_COUNT];
+    const uint8_t* code_memory[constants::PAGE_COUNT];
+
+    jit_stats_t stats;
+
+    jit_block_t* compile(uint16_t start);
+    bool install(const std::vector<uint8_t>& machine_code, jit_entry_t& entry);
+    void run_block(const jit_block_t& block);
+
+    void invalidate_block(uint16_t start);
+    void invalidate_page(unsigned int page);
+    void flush();
+
+    static void code_written(void* context, address_t addr, uint8_t value);
+    static void pages_remapped(void* context, address_t addr_start, address_t addr_end);
+public:
+    /**
+     * @param cpu CPU to run
+     * @param bus CPU's address space; the JIT watches it for writes to code and remapping
+     */
+    JIT(MOS6502* cpu, RAM* bus);
+    ~JIT();
+
+    JIT(const JIT&) = delete;
+    JIT& operator=(const JIT&) = delete;
+
+    /**
+     * Whether compiled code can run on this build and host.
+     */
+    static bool is_supported();
+
+    /**
+     * Same contract as MOS6502::run_until().
+     * @param target_cycle
+     */
+    uint64_t run_until(uint64_t target_cycle);
+
+    /**
+     * Drops all compiled code.
+     */
+    void reset();
+
+    jit_stats_t get_stats() const;
+};
+
+#endif //NESEMULATOR_JIT_HPP
@@ -0,0 +1,380 @@
+//
+// Cartridge mappers: bank switching boards as compile-time policies.
+//
+
+#include "mapper.hpp"
+
+// ===========================
+// BANK MAPPING
+// ===========================
+
+MapperBus::MapperBus()
+{
+    for (std::size_t& offset : prg_offsets)
+        offset = SIZE_MAX;
+}
+
+void MapperBus::attach_ram(RAM* bus, const uint8_t* rom, std::size_t rom_size, write_handler_t handler, void* context)
+{
+    ram = bus;
+    prg_rom = rom;
+    prg_rom_size = rom_size;
+    register_write = handler;
+    register_context = context;
+
+    // The page table may have been reset under us: map every slot afresh.
+    for (std::size_t& offset : prg_offsets)
+        offset = SIZE_MAX;
+}
+
+void MapperBus::attach_ppu(PPU* video)
+{
+    ppu = video;
+}
+
+void MapperBus::attach_cpu(MOS6502* processor)
+{
+    cpu = processor;
+}
+
+PPU* MapperBus::get_ppu() const
+{
+    return ppu;
+}
+
+std::size_t MapperBus::prg_bank_count(std::size_t bank_size) const
+{
+    const std::size_t count = prg_rom_size / bank_size;
+    return count > 0 ? count : 1;
+}
+
+void MapperBus::map_prg(address_t addr, std::size_t size, std::size_t bank)
+{
+    if (ram == nullptr || prg_rom_size == 0)
+        return;
+
+    const std::size_t offset = (bank % prg_bank_count(size)) * size;
+    const std::size_t slot_size = prg_rom_size < (std::size_t)constants::PRG_SLOT_SIZE ? prg_rom_size : constants::PRG_SLOT_SIZE;
+
+    for (std::size_t i = 0; i < size / constants::PRG_SLOT_SIZE; i++)
+    {
+        const unsigned int slot = (addr - 0x8000) / constants::PRG_SLOT_SIZE + i;
+        const std::size_t slot_offset = (offset + i * constants::PRG_SLOT_SIZE) % prg_rom_size;
+
+        if (prg_offsets[slot] == slot_offset)
+            continue;
+
+        const address_t start = 0x8000 + slot * constants::PRG_SLOT_SIZE;
+        ram->map_read_only(start, start + constants::PRG_SLOT_SIZE - 1, prg_rom + slot_offset, slot_size, register_write,
+                           register_context);
+        prg_offsets[slot] = slot_offset;
+    }
+}
+
+void MapperBus::map_chr(unsigned int slot, unsigned int count, std::size_t bank)
+{
+    if (ppu != nullptr)
+        ppu->map_pattern(slot, count, bank * count * constants::PATTERN_SLOT_SIZE);
+}
+
+void MapperBus::set_mirroring(mirroring_t mirroring)
+{
+    if (ppu != nullptr)
+        ppu->set_mirroring(mirroring);
+}
+
+void MapperBus::end_run()
+{
+    if (cpu != nullptr)
+        cpu->run_target = 0;
+}
+
+// ===========================
+// NROM
+// ===========================
+
+void NROM::power_on(const ines_header_t& header)
+{
+    registers.unused = 0;
+    mirroring = header.mirroring;
+}
+
+void NROM::apply(MapperBus& bus) const
+{
+    if (bus.prg_bank_count(constants::PRG_BANK_SIZE) <= 2)
+    {
+        bus.map_prg(0x8000, 0x8000, 0);
+    }
+    else
+    {
+        bus.map_prg(0x8000, constants::PRG_BANK_SIZE, 0);
+        bus.map_prg(0xC000, constants::PRG_BANK_SIZE, bus.prg_bank_count(constants::PRG_BANK_SIZE) - 1);
+    }
+
+    bus.map_chr(0, constants::PATTERN_SLOT_COUNT, 0);
+    bus.set_mirroring(mirroring);
+}
+
+void NROM::write(MapperBus&, address_t, uint8_t)
+{
+}
+
+// ===========================
+// UxROM
+// ===========================
+
+void UxROM::power_on(const ines_header_t& header)
+{
+    registers.bank = 0;
+    mirroring = header.mirroring;
+}
+
+void UxROM::apply(MapperBus& bus) const
+{
+    bus.map_prg(0x8000, constants::PRG_BANK_SIZE, registers.bank);
+    bus.map_prg(0xC000, constants::PRG_BANK_SIZE, bus.prg_bank_count(constants::PRG_BANK_SIZE) - 1);
+    bus.map_chr(0, constants::PATTERN_SLOT_COUNT, 0);
+    bus.set_mirroring(mirroring);
+}
+
+void UxROM::write(MapperBus& bus, address_t, uint8_t value)
+{
+    registers.bank = value;
+    bus.map_prg(0x8000, constants::PRG_BANK_SIZE, value);
+}
+
+// ===========================
+// MMC1
+// ===========================
+
+void MMC1::power_on(const ines_header_t&)
+{
+    std::memset(&registers, 0x00, sizeof(registers));
+    registers.control = 0x0C; // 16KiB PRG banks, the last one fixed at $C000.
+}
+
+void MMC1::apply(MapperBus& bus) const
+{
+    static const mirroring_t MIRRORING[4] = { mirroring_t::SINGLE_SCREEN_LOWER, mirroring_t::SINGLE_SCREEN_UPPER,
+                                              mirroring_t::VERTICAL, mirroring_t::HORIZONTAL };
+
+    bus.set_mirroring(MIRRORING[registers.control & 3]);
+
+    if (registers.control & 0x10)
+    {
+        bus.map_chr(0, 4, registers.chr_bank[0]);
+        bus.map_chr(4, 4, registers.chr_bank[1]);
+    }
+    else
+    {
+        bus.map_chr(0, 8, registers.chr_bank[0] >> 1);
+    }
+
+    // 512KiB boards: the first CHR register picks the 256KiB half of PRG-ROM.
+    const std::size_t outer = bus.prg_bank_count(constants::PRG_BANK_SIZE) > 16 ? registers.chr_bank[0] & 0x10 : 0;
+    const std::size_t bank = outer | (registers.prg_bank & 0x0F);
+
+    switch ((registers.control >> 2) & 3)
+    {
+        case 0: case 1: // 32KiB
+            bus.map_prg(0x8000, 0x8000, bank >> 1);
+            break;
+        case 2: // First bank fixed at $8000
+            bus.map_prg(0x8000, constants::PRG_BANK_SIZE, outer);
+            bus.map_prg(0xC000, constants::PRG_BANK_SIZE, bank);
+            break;
+        default: // Last bank fixed at $C000
+            bus.map_prg(0x8000, constants::PRG_BANK_SIZE, bank);
+            bus.map_prg(0xC000, constants::PRG_BANK_SIZE, outer | 0x0F);
+            break;
+    }
+}
+
+void MMC1::write(MapperBus& bus, address_t addr, uint8_t value)
+{
+    if (value & 0x80)
+    {
+        registers.shift = 0;
+        registers.shift_count = 0;
+        registers.control |= 0x0C;
+        apply(bus);
+        return;
+    }
+
+    registers.shift = (registers.shift >> 1) | ((value & 1) << 4);
+    if (++registers.shift_count < 5)
+        return;
+
+    switch ((addr >> 13) & 3)
+    {
+        case 0: registers.control = registers.shift; break;
+        case 1: registers.chr_bank[0] = registers.shift; break;
+        case 2: registers.chr_bank[1] = registers.shift; break;
+        default: registers.prg_bank = registers.shift; break;
+    }
+
+    registers.shift = 0;
+    registers.shift_count = 0;
+    apply(bus);
+}
+
+// ===========================
+// MMC3
+// ===========================
+
+void MMC3::power_on(const ines_header_t& header)
+{
+    static const uint8_t BANKS[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+
+    std::memset(&registers, 0x00, sizeof(registers));
+    std::memcpy(registers.banks, BANKS, sizeof(BANKS));
+    registers.mirroring = header.mirroring == mirroring_t::HORIZONTAL ? 1 : 0;
+    four_screen = header.mirroring == mirroring_t::FOUR_SCREEN;
+}
+
+void MMC3::apply(MapperBus& bus) const
+{
+    const std::size_t last = bus.prg_bank_count(constants::PRG_SLOT_SIZE) - 1;
+    const std::size_t second_last = last > 0 ? last - 1 : 0;
+    const uint8_t* banks = registers.banks;
+
+    // PRG mode (bit 6) swaps which of $8000 and $C000 is switchable.
+    const bool swapped = (registers.bank_select & 0x40) != 0;
+    bus.map_prg(0x8000, constants::PRG_SLOT_SIZE, swapped ? second_last : banks[6] & 0x3F);
+    bus.map_prg(0xA000, constants::PRG_SLOT_SIZE, banks[7] & 0x3F);
+    bus.map_prg(0xC000, constants::PRG_SLOT_SIZE, swapped ? banks[6] & 0x3F : second_last);
+    bus.map_prg(0xE000, constants::PRG_SLOT_SIZE, last);
+
+    // CHR mode (bit 7) swaps the 2KiB and 1KiB halves.
+    const unsigned int two_k = (registers.bank_select & 0x80) ? 4 : 0;
+    const unsigned int one_k = two_k ^ 4;
+    bus.map_chr(two_k + 0, 1, banks[0] & 0xFE);
+    bus.map_chr(two_k + 1, 1, banks[0] | 0x01);
+    bus.map_chr(two_k + 2, 1, banks[1] & 0xFE);
+    bus.map_chr(two_k + 3, 1, banks[1] | 0x01);
+    for (unsigned int i = 0; i < 4; i++)
+        bus.map_chr(one_k + i, 1, banks[2 + i]);
+
+    if (four_screen)
+        bus.set_mirroring(mirroring_t::FOUR_SCREEN);
+    else
+        bus.set_mirroring(registers.mirroring ? mirroring_t::HORIZONTAL : mirroring_t::VERTICAL);
+}
+
+void MMC3::write(MapperBus& bus, address_t addr, uint8_t value)
+{
+    // Even and odd addresses of each 8KiB range are two different registers.
+    switch (addr & 0xE001)
+    {
+        case 0x8000:
+            registers.bank_select = value;
+            apply(bus);
+            break;
+        case 0x8001:
+            registers.banks[registers.bank_select & 7] = value;
+            apply(bus);
+            break;
+        case 0xA000:
+            registers.mirroring = value & 1;
+            apply(bus);
+            break;
+        case 0xA001: // PRG-RAM protection; the RAM is left enabled and writable.
+            break;
+
+        // The scanline counter. Each change can bring the IRQ forward, so the CPU's run is
+        // ended for the next one to be scheduled.
+        case 0xC000:
+            registers.irq_latch = value;
+            bus.end_run();
+            break;
+        case 0xC001:
+            registers.irq_counter = 0;
+            registers.irq_reload = 1;
+            bus.end_run();
+            break;
+        case 0xE000:
+            registers.irq_enabled = 0;
+            registers.irq_flag = 0;
+            break;
+        default: // $E001
+            registers.irq_enabled = 1;
+            bus.end_run();
+            break;
+    }
+}
+
+void MMC3::clock_scanline(MapperBus& bus)
+{
+    if (registers.irq_counter == 0 || registers.irq_reload)
+    {
+        registers.irq_counter = registers.irq_latch;
+        registers.irq_reload = 0;
+    }
+    else
+    {
+        registers.irq_counter--;
+    }
+
+    if (registers.irq_counter == 0 && registers.irq_enabled && !registers.irq_flag)
+    {
+        registers.irq_flag = 1;
+        bus.end_run();
+    }
+}
+
+bool MMC3::irq_asserted() const
+{
+    return registers.irq_flag != 0;
+}
+
+unsigned int MMC3::clocks_until_irq() const
+{
+    if (!registers.irq_enabled || registers.irq_flag)
+        return 0;
+
+    // A counter at zero (or told to reload) takes the latch on the next clock.
+    if (registers.irq_counter == 0 || registers.irq_reload)
+        return registers.irq_latch + 1;
+
+    return registers.irq_counter;
+}
+
+// ===========================
+// BOARDS
+// ===========================
+
+Mapper::~Mapper() = default;
+
+void Mapper::attach_ram(RAM* ram, const uint8_t* prg_rom, std::size_t prg_rom_size)
+{
+    bus.attach_ram(ram, prg_rom, prg_rom_size, register_write(), this);
+    remap();
+}
+
+void Mapper::attach_ppu(PPU* ppu)
+{
+    bus.attach_ppu(ppu);
+    attached_ppu(ppu);
+    remap();
+}
+
+void Mapper::attach_cpu(MOS6502* cpu)
+{
+    bus.attach_cpu(cpu);
+}
+
+bool mappers::is_supported(uint16_t number)
+{
+    return number == NROM::NUMBER || number == MMC1::NUMBER || number == UxROM::NUMBER || number == MMC3::NUMBER;
+}
+
+std::unique_ptr<Mapper> mappers::create(const ines_header_t& header)
+{
+    switch (header.mapper)
+    {
+        case MMC1::NUMBER: return std::unique_ptr<Mapper>(new MapperBoard<MMC1>(header));
+        case UxROM::NUMBER: return std::unique_ptr<Mapper>(new MapperBoard<UxROM>(header));
+        case MMC3::NUMBER: return std::unique_ptr<Mapper>(new MapperBoard<MMC3>(header));
+        default: return std::unique_ptr<Mapper>(new MapperBoard<NROM>(header));
+    }
+}
@@ -0,0 +1,346 @@
+//
+// Cartridge mappers: bank switching boards as compile-time policies.
+//
+
+#ifndef NESEMULATOR_MAPPER_HPP
+#define NESEMULATOR_MAPPER_HPP
+
+#include "cartridge.hpp"
+#include "mos6502.hpp"
+#include "ppu.hpp"
+#include "ram.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+
+namespace constants
+{
+    const int PRG_SLOT_SIZE = 0x2000; // $8000-$FFFF is switched in 8KiB slots at the finest...
+    const int PRG_SLOT_COUNT = 4;     // ...so there are four of them.
+} // namespace constants
+
+/**
+ * What a board's banking logic acts on: the CPU's page table for PRG-ROM, the PPU's pattern
+ * slots for CHR and its nametable layout, and the CPU's run (to end it when an IRQ is due).
+ * Mapping a bank rewrites page pointers only, and only when the slot's bank changes.
+ */
+class MapperBus
+{
+private:
+    RAM* ram = nullptr;
+    PPU* ppu = nullptr;
+    MOS6502* cpu = nullptr;
+
+    const uint8_t* prg_rom = nullptr;
+    std::size_t prg_rom_size = 0;
+
+    // Writes to PRG-ROM go to the board's registers.
+    write_handler_t register_write = nullptr;
+    void* register_context = nullptr;
+
+    // PRG-ROM offset mapped at each 8KiB slot (SIZE_MAX: not mapped yet).
+    std::size_t prg_offsets[constants::PRG_SLOT_COUNT];
+public:
+    MapperBus();
+
+    void attach_ram(RAM* bus, const uint8_t* rom, std::size_t rom_size, write_handler_t handler, void* context);
+    void attach_ppu(PPU* video);
+    void attach_cpu(MOS6502* processor);
+    PPU* get_ppu() const;
+
+    /**
+     * Number of PRG-ROM banks of `bank_size' bytes (at least 1).
+     * @param bank_size
+     */
+    std::size_t prg_bank_count(std::size_t bank_size) const;
+
+    /**
+     * Maps PRG-ROM bank `bank' (in units of `size', wrapped to the ROM) at `addr'.
+     * @param addr $8000-$FFFF, aligned to `size'
+     * @param size a multiple of PRG_SLOT_SIZE
+     * @param bank
+     */
+    void map_prg(address_t addr, std::size_t size, std::size_t bank);
+
+    /**
+     * Maps CHR bank `bank' (in units of `count' KiB, wrapped to the CHR memory) at pattern
+     * slot `slot' onwards.
+     * @param slot
+     * @param count
+     * @param bank
+     */
+    void map_chr(unsigned int slot, unsigned int count, std::size_t bank);
+
+    void set_mirroring(mirroring_t mirroring);
+
+    /**
+     * Ends the CPU's current run, so whoever drives it looks at the IRQ line and the next
+     * IRQ cycle again.
+     */
+    void end_run();
+};
+
+/**
+ * Defaults for the parts of a mapper policy most boards don't have: IRQs and the scanline
+ * counter. A policy is a class with
+ *
+ *   static const uint16_t NUMBER;             iNES mapper number
+ *   static const bool SCANLINE_COUNTER;       whether the PPU has to call clock_scanline
+ *   struct registers_t { ... };               the board's registers, as plain data
+ *   registers_t registers;
+ *   void power_on(const ines_header_t&);      registers to their power-up values
+ *   void apply(MapperBus&) const;             maps every bank from the registers
+ *   void write(MapperBus&, address_t, uint8_t);   CPU write to $8000-$FFFF
+ *   void clock_scanline(MapperBus&);          one scanline counter clock
+ *   bool irq_asserted() const;
+ *   unsigned int clocks_until_irq() const;    scanline clocks until the IRQ fires (0: never)
+ *
+ * and is instantiated as MapperBoard<Policy>, so the register writes of each board compile
+ * to a direct call into its own code.
+ */
+class MapperPolicy
+{
+public:
+    static const bool SCANLINE_COUNTER = false;
+
+    void clock_scanline(MapperBus&) {}
+    bool irq_asserted() const { return false; }
+    unsigned int clocks_until_irq() const { return 0; }
+};
+
+// Mapper 0. No registers: 16KiB of PRG-ROM mirrored or 32KiB straight. Also stands in for
+// boards that aren't supported, with the first bank at $8000 and the last at $C000.
+class NROM : public MapperPolicy
+{
+public:
+    static const uint16_t NUMBER = 0;
+
+    struct registers_t
+    {
+        uint8_t unused;
+    };
+
+    registers_t registers;
+
+    void power_on(const ines_header_t& header);
+    void apply(MapperBus& bus) const;
+    void write(MapperBus& bus, address_t addr, uint8_t value);
+
+private:
+    mirroring_t mirroring = mirroring_t::HORIZONTAL;
+};
+
+// Mapper 2 (UNROM, UOROM): any write selects the 16KiB bank at $8000; $C000 is the last bank.
+class UxROM : public MapperPolicy
+{
+public:
+    static const uint16_t NUMBER = 2;
+
+    struct registers_t
+    {
+        uint8_t bank;
+    };
+
+    registers_t registers;
+
+    void power_on(const ines_header_t& header);
+    void apply(MapperBus& bus) const;
+    void write(MapperBus& bus, address_t addr, uint8_t value);
+
+private:
+    mirroring_t mirroring = mirroring_t::HORIZONTAL;
+};
+
+// Mapper 1 (SxROM). Registers are loaded a bit at a time through a 5-bit shift register;
+// the fifth write picks the register by address. 512KiB boards (SUROM) use CHR bank bit 4
+// to select the PRG-ROM half.
+class MMC1 : public MapperPolicy
+{
+public:
+    static const uint16_t NUMBER = 1;
+
+    struct registers_t
+    {
+        uint8_t shift;      // Bits shifted in so far, from the top.
+        uint8_t shift_count;
+        uint8_t control;    // Mirroring (bits 0-1), PRG mode (2-3), CHR mode (4).
+        uint8_t chr_bank[2];
+        uint8_t prg_bank;
+    };
+
+    registers_t registers;
+
+    void power_on(const ines_header_t& header);
+    void apply(MapperBus& bus) const;
+    void write(MapperBus& bus, address_t addr, uint8_t value);
+};
+
+// Mapper 4 (TxROM). Eight bank registers behind a select register, and a scanline counter
+// clocked by PPU A12 that raises an IRQ when it reaches zero.
+class MMC3 : public MapperPolicy
+{
+public:
+    static const uint16_t NUMBER = 4;
+    static const bool SCANLINE_COUNTER = true;
+
+    struct registers_t
+    {
+        uint8_t bank_select;    // Register to update (bits 0-2), PRG mode (6), CHR mode (7).
+        uint8_t banks[8];
+        uint8_t mirroring;      // 0: vertical, 1: horizontal.
+        uint8_t irq_latch;
+        uint8_t irq_counter;
+        uint8_t irq_reload;
+        uint8_t irq_enabled;
+        uint8_t irq_flag;
+    };
+
+    registers_t registers;
+
+    void power_on(const ines_header_t& header);
+    void apply(MapperBus& bus) const;
+    void write(MapperBus& bus, address_t addr, uint8_t value);
+
+    void clock_scanline(MapperBus& bus);
+    bool irq_asserted() const;
+    unsigned int clocks_until_irq() const;
+
+private:
+    bool four_screen = false; // The board wires its own nametable RAM; mirroring is fixed.
+};
+
+/**
+ * The cold side of a mapper, for the cartridge: everything but the register writes, which
+ * the bus hands straight to MapperBoard<Policy>::write_register.
+ */
+class Mapper
+{
+protected:
+    MapperBus bus;
+public:
+    virtual ~Mapper();
+
+    // Banks are (re)mapped as each side is attached.
+    void attach_ram(RAM* ram, const uint8_t* prg_rom, std::size_t prg_rom_size);
+    void attach_ppu(PPU* ppu);
+    void attach_cpu(MOS6502* cpu);
+
+    virtual void power_on() = 0;
+
+    /**
+     * Maps every bank from the current registers.
+     */
+    virtual void remap() = 0;
+
+    virtual bool irq_asserted() const = 0;
+    virtual uint64_t next_irq_cycle() const = 0;
+
+    virtual void save_state(mapper_state_t& state) const = 0;
+    virtual bool load_state(const mapper_state_t& state) = 0;
+protected:
+    virtual write_handler_t register_write() = 0;
+    virtual void attached_ppu(PPU* ppu) = 0;
+};
+
+template <typename Policy>
+class MapperBoard final : public Mapper
+{
+private:
+    Policy policy;
+    ines_header_t header;
+
+    static_assert(sizeof(typename Policy::registers_t) <= (std::size_t)constants::MAPPER_REGISTERS_STATE,
+                  "mapper registers do not fit in a save state");
+
+    static void write_register(void* context, address_t addr, uint8_t value)
+    {
+        MapperBoard& board = *static_cast<MapperBoard*>(context);
+        board.policy.write(board.bus, addr, value);
+    }
+
+    static void clock_scanline(void* context)
+    {
+        MapperBoard& board = *static_cast<MapperBoard*>(context);
+        board.policy.clock_scanline(board.bus);
+    }
+protected:
+    write_handler_t register_write() override
+    {
+        return &MapperBoard::write_register;
+    }
+
+    void attached_ppu(PPU* ppu) override
+    {
+        if (Policy::SCANLINE_COUNTER)
+            ppu->set_scanline_handler(&MapperBoard::clock_scanline, this);
+        else
+            ppu->set_scanline_handler(nullptr, nullptr);
+    }
+public:
+    explicit MapperBoard(const ines_header_t& header) : header(header)
+    {
+        policy.power_on(header);
+    }
+
+    void power_on() override
+    {
+        policy.power_on(header);
+        policy.apply(bus);
+    }
+
+    void remap() override
+    {
+        policy.apply(bus);
+    }
+
+    bool irq_asserted() const override
+    {
+        return policy.irq_asserted();
+    }
+
+    uint64_t next_irq_cycle() const override
+    {
+        const unsigned int clocks = policy.clocks_until_irq();
+
+        if (clocks == 0 || bus.get_ppu() == nullptr)
+            return std::numeric_limits<uint64_t>::max();
+
+        return bus.get_ppu()->scanline_clock_cycle(clocks);
+    }
+
+    void save_state(mapper_state_t& state) const override
+    {
+        std::memset(&state, 0x00, sizeof(state));
+        state.mapper = header.mapper;
+        std::memcpy(state.registers, &policy.registers, sizeof(policy.registers));
+    }
+
+    bool load_state(const mapper_state_t& state) override
+    {
+        if (state.mapper != header.mapper)
+            return false;
+
+        std::memcpy(&policy.registers, state.registers, sizeof(policy.registers));
+        policy.apply(bus);
+        return true;
+    }
+};
+
+namespace mappers
+{
+    /**
+     * Whether a board with this iNES mapper number can be emulated.
+     * @param number
+     */
+    bool is_supported(uint16_t number);
+
+    /**
+     * The board for `header'. Unsupported boards get NROM with the first and last PRG banks.
+     * @param header
+     */
+    std::unique_ptr<Mapper> create(const ines_header_t& header);
+} // namespace mappers
+
+#endif //NESEMULATOR_MAPPER_HPP
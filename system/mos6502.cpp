@@ -8,35 +8,19 @@
  */
 
 #include "mos6502.hpp"
+#include "debugger.hpp"
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 #include <bitset>
+#include <cstring>
+#include <limits>
 
 MOS6502::MOS6502(RAM* ram_ref) {
     // Bind this CPU to RAM
     NES_Ram = ram_ref;
 
-    // Create the lookup table. Thank you javidx9 (https://github.com/OneLoneCoder) for the hard work compiling this!
-    using a = MOS6502;
-    lookup_table =
-        {
-            { "BRK", &a::BRK, &a::IMM, 7 },{ "ORA", &a::ORA, &a::IZX, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 3 },{ "ORA", &a::ORA, &a::ZP0, 3 },{ "ASL", &a::ASL, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "PHP", &a::PHP, &a::IMP, 3 },{ "ORA", &a::ORA, &a::IMM, 2 },{ "ASL", &a::ASL, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::NOP, &a::IMP, 4 },{ "ORA", &a::ORA, &a::ABS, 4 },{ "ASL", &a::ASL, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-            { "BPL", &a::BPL, &a::REL, 2 },{ "ORA", &a::ORA, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "ORA", &a::ORA, &a::ZPX, 4 },{ "ASL", &a::ASL, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "CLC", &a::CLC, &a::IMP, 2 },{ "ORA", &a::ORA, &a::ABY, 4 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "ORA", &a::ORA, &a::ABX, 4 },{ "ASL", &a::ASL, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-            { "JSR", &a::JSR, &a::ABS, 6 },{ "AND", &a::AND, &a::IZX, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "BIT", &a::BIT, &a::ZP0, 3 },{ "AND", &a::AND, &a::ZP0, 3 },{ "ROL", &a::ROL, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "PLP", &a::PLP, &a::IMP, 4 },{ "AND", &a::AND, &a::IMM, 2 },{ "ROL", &a::ROL, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "BIT", &a::BIT, &a::ABS, 4 },{ "AND", &a::AND, &a::ABS, 4 },{ "ROL", &a::ROL, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-            { "BMI", &a::BMI, &a::REL, 2 },{ "AND", &a::AND, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "AND", &a::AND, &a::ZPX, 4 },{ "ROL", &a::ROL, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "SEC", &a::SEC, &a::IMP, 2 },{ "AND", &a::AND, &a::ABY, 4 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "AND", &a::AND, &a::ABX, 4 },{ "ROL", &a::ROL, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-            { "RTI", &a::RTI, &a::IMP, 6 },{ "EOR", &a::EOR, &a::IZX, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 3 },{ "EOR", &a::EOR, &a::ZP0, 3 },{ "LSR", &a::LSR, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "PHA", &a::PHA, &a::IMP, 3 },{ "EOR", &a::EOR, &a::IMM, 2 },{ "LSR", &a::LSR, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "JMP", &a::JMP, &a::ABS, 3 },{ "EOR", &a::EOR, &a::ABS, 4 },{ "LSR", &a::LSR, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-            { "BVC", &a::BVC, &a::REL, 2 },{ "EOR", &a::EOR, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "EOR", &a::EOR, &a::ZPX, 4 },{ "LSR", &a::LSR, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "CLI", &a::CLI, &a::IMP, 2 },{ "EOR", &a::EOR, &a::ABY, 4 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "EOR", &a::EOR, &a::ABX, 4 },{ "LSR", &a::LSR, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-            { "RTS", &a::RTS, &a::IMP, 6 },{ "ADC", &a::ADC, &a::IZX, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 3 },{ "ADC", &a::ADC, &a::ZP0, 3 },{ "ROR", &a::ROR, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "PLA", &a::PLA, &a::IMP, 4 },{ "ADC", &a::ADC, &a::IMM, 2 },{ "ROR", &a::ROR, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "JMP", &a::JMP, &a::IND, 5 },{ "ADC", &a::ADC, &a::ABS, 4 },{ "ROR", &a::ROR, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-            { "BVS", &a::BVS, &a::REL, 2 },{ "ADC", &a::ADC, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "ADC", &a::ADC, &a::ZPX, 4 },{ "ROR", &a::ROR, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "SEI", &a::SEI, &a::IMP, 2 },{ "ADC", &a::ADC, &a::ABY, 4 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "ADC", &a::ADC, &a::ABX, 4 },{ "ROR", &a::ROR, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-            { "???", &a::NOP, &a::IMP, 2 },{ "STA", &a::STA, &a::IZX, 6 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 6 },{ "STY", &a::STY, &a::ZP0, 3 },{ "STA", &a::STA, &a::ZP0, 3 },{ "STX", &a::STX, &a::ZP0, 3 },{ "???", &a::XXX, &a::IMP, 3 },{ "DEY", &a::DEY, &a::IMP, 2 },{ "???", &a::NOP, &a::IMP, 2 },{ "TXA", &a::TXA, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "STY", &a::STY, &a::ABS, 4 },{ "STA", &a::STA, &a::ABS, 4 },{ "STX", &a::STX, &a::ABS, 4 },{ "???", &a::XXX, &a::IMP, 4 },
-            { "BCC", &a::BCC, &a::REL, 2 },{ "STA", &a::STA, &a::IZY, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 6 },{ "STY", &a::STY, &a::ZPX, 4 },{ "STA", &a::STA, &a::ZPX, 4 },{ "STX", &a::STX, &a::ZPY, 4 },{ "???", &a::XXX, &a::IMP, 4 },{ "TYA", &a::TYA, &a::IMP, 2 },{ "STA", &a::STA, &a::ABY, 5 },{ "TXS", &a::TXS, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 5 },{ "???", &a::NOP, &a::IMP, 5 },{ "STA", &a::STA, &a::ABX, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "???", &a::XXX, &a::IMP, 5 },
-            { "LDY", &a::LDY, &a::IMM, 2 },{ "LDA", &a::LDA, &a::IZX, 6 },{ "LDX", &a::LDX, &a::IMM, 2 },{ "???", &a::XXX, &a::IMP, 6 },{ "LDY", &a::LDY, &a::ZP0, 3 },{ "LDA", &a::LDA, &a::ZP0, 3 },{ "LDX", &a::LDX, &a::ZP0, 3 },{ "???", &a::XXX, &a::IMP, 3 },{ "TAY", &a::TAY, &a::IMP, 2 },{ "LDA", &a::LDA, &a::IMM, 2 },{ "TAX", &a::TAX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "LDY", &a::LDY, &a::ABS, 4 },{ "LDA", &a::LDA, &a::ABS, 4 },{ "LDX", &a::LDX, &a::ABS, 4 },{ "???", &a::XXX, &a::IMP, 4 },
-            { "BCS", &a::BCS, &a::REL, 2 },{ "LDA", &a::LDA, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 5 },{ "LDY", &a::LDY, &a::ZPX, 4 },{ "LDA", &a::LDA, &a::ZPX, 4 },{ "LDX", &a::LDX, &a::ZPY, 4 },{ "???", &a::XXX, &a::IMP, 4 },{ "CLV", &a::CLV, &a::IMP, 2 },{ "LDA", &a::LDA, &a::ABY, 4 },{ "TSX", &a::TSX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 4 },{ "LDY", &a::LDY, &a::ABX, 4 },{ "LDA", &a::LDA, &a::ABX, 4 },{ "LDX", &a::LDX, &a::ABY, 4 },{ "???", &a::XXX, &a::IMP, 4 },
-            { "CPY", &a::CPY, &a::IMM, 2 },{ "CMP", &a::CMP, &a::IZX, 6 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "CPY", &a::CPY, &a::ZP0, 3 },{ "CMP", &a::CMP, &a::ZP0, 3 },{ "DEC", &a::DEC, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "INY", &a::INY, &a::IMP, 2 },{ "CMP", &a::CMP, &a::IMM, 2 },{ "DEX", &a::DEX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "CPY", &a::CPY, &a::ABS, 4 },{ "CMP", &a::CMP, &a::ABS, 4 },{ "DEC", &a::DEC, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-            { "BNE", &a::BNE, &a::REL, 2 },{ "CMP", &a::CMP, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "CMP", &a::CMP, &a::ZPX, 4 },{ "DEC", &a::DEC, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "CLD", &a::CLD, &a::IMP, 2 },{ "CMP", &a::CMP, &a::ABY, 4 },{ "NOP", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "CMP", &a::CMP, &a::ABX, 4 },{ "DEC", &a::DEC, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-            { "CPX", &a::CPX, &a::IMM, 2 },{ "SBC", &a::SBC, &a::IZX, 6 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "CPX", &a::CPX, &a::ZP0, 3 },{ "SBC", &a::SBC, &a::ZP0, 3 },{ "INC", &a::INC, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "INX", &a::INX, &a::IMP, 2 },{ "SBC", &a::SBC, &a::IMM, 2 },{ "NOP", &a::NOP, &a::IMP, 2 },{ "???", &a::SBC, &a::IMP, 2 },{ "CPX", &a::CPX, &a::ABS, 4 },{ "SBC", &a::SBC, &a::ABS, 4 },{ "INC", &a::INC, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-            { "BEQ", &a::BEQ, &a::REL, 2 },{ "SBC", &a::SBC, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "SBC", &a::SBC, &a::ZPX, 4 },{ "INC", &a::INC, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "SED", &a::SED, &a::IMP, 2 },{ "SBC", &a::SBC, &a::ABY, 4 },{ "NOP", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "SBC", &a::SBC, &a::ABX, 4 },{ "INC", &a::INC, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-        };
+    std::memset(idle_rejects, 0x00, sizeof(idle_rejects));
 }
 
 MOS6502::~MOS6502() = default;
@@ -46,6 +30,14 @@ void MOS6502::set_flag(flag_t flag)
     FLG = FLG | (1 << flag.bitshift);
 }
 
+void MOS6502::set_flag(flag_t flag, bool value)
+{
+    if (value)
+        FLG = FLG | flag.bitmask;
+    else
+        FLG = FLG & (~flag.bitmask);
+}
+
 void MOS6502::clear_flag(flag_t flag)
 {
     FLG = FLG & (~flag.bitmask);
@@ -71,10 +63,11 @@ void MOS6502::whoami() const
     std::cout << "===================================" << std::endl;
     std::cout << "MOS6502 EMULATED INSTANCE (status=" << status << ")" << std::endl;
     std::cout << "---REGISTERS---" << std::endl;
-    std::cout << "ACC=0d" << std::setw(4) << ACC << ";      RAX=0d" << std::setw(4) << X << "; RAY=0d" << std::setw(4) << Y << std::endl;
-    std::cout << "FLG=0b" << std::bitset<8> (FLG) << "; PC=$" << std::hex << std::setw(5) << PC << "; SP=$" << std::setw(5) << SP << std::dec << std::endl;
+    std::cout << "ACC=0d" << std::setw(4) << +ACC << ";      RAX=0d" << std::setw(4) << +X << "; RAY=0d" << std::setw(4) << +Y << std::endl;
+    std::cout << "FLG=0b" << std::bitset<8> (FLG) << "; PC=$" << std::hex << std::setw(5) << PC << "; SP=$" << std::setw(5) << +SP << std::dec << std::endl;
+    std::cout << "CYCLES=" << cycles << std::endl;
     std::cout << "---MISC---" << std::endl;
-    std::cout << "FETCH_DATA: " << fetched << std::endl;
+    std::cout << "FETCH_DATA: " << +fetched << std::endl;
     std::cout << "---FLAGS--- " << std::endl;
     std::cout << std::bitset<8> (FLG) << std::endl;
     std::cout << "NVssDIZC" << std::endl;
@@ -83,79 +76,562 @@ void MOS6502::whoami() const
 
 void MOS6502::reset()
 {
-    // Reset registers
-    ACC = 0; X = 0; Y = 0; FLG = 0; PC = 0; SP = 0;
+    // Reset registers. The reset sequence leaves the stack pointer at $FD and interrupts
+    // disabled.
+    ACC = 0; X = 0; Y = 0; SP = 0xFD;
+    FLG = FLAG_I_IRQD.bitmask | FLAG_s_UNUZ.bitmask;
+
+    // Execution starts at the address stored in the reset vector ($FFFC-$FFFD).
+    PC = (uint16_t)NES_Ram->read_byte(0xFFFC) | ((uint16_t)NES_Ram->read_byte(0xFFFD) << 8);
 
     // Reset pseudo-registers
     fetched = 0;
+
+    // The reset sequence takes 7 cycles.
+    cycles += 7;
+}
+
+void MOS6502::nmi()
+{
+    if (halted)
+        return;
+
+    // Like BRK, but the pushed flags have B clear and PC is not advanced.
+    push_byte((PC >> 8) & 0x00FF);
+    push_byte(PC & 0x00FF);
+    push_byte((FLG & ~FLAG_s_UNUS.bitmask) | FLAG_s_UNUZ.bitmask);
+
+    set_flag(FLAG_I_IRQD);
+
+    PC = (uint16_t)NES_Ram->read_byte(0xFFFA) | ((uint16_t)NES_Ram->read_byte(0xFFFB) << 8);
+
+    // The interrupt sequence takes 7 cycles.
+    cycles += 7;
+
+    if (profiler != nullptr)
+        profiler->interrupt(true, PC, SP, 7);
+}
+
+void MOS6502::irq()
+{
+    if (halted || get_flag(FLAG_I_IRQD))
+        return;
+
+    push_byte((PC >> 8) & 0x00FF);
+    push_byte(PC & 0x00FF);
+    push_byte((FLG & ~FLAG_s_UNUS.bitmask) | FLAG_s_UNUZ.bitmask);
+
+    set_flag(FLAG_I_IRQD);
+
+    PC = (uint16_t)NES_Ram->read_byte(0xFFFE) | ((uint16_t)NES_Ram->read_byte(0xFFFF) << 8);
+
+    cycles += 7;
+
+    if (profiler != nullptr)
+        profiler->interrupt(false, PC, SP, 7);
+}
+
+void MOS6502::power_on()
+{
+    cycles = 0;
+    run_target = 0;
+    halted = false;
+    stopped = false;
+    halt_address = 0x0000;
+    halt_opcode = 0x00;
+    status = "running";
+    idle_skipped_cycles = 0;
+    std::memset(idle_rejects, 0x00, sizeof(idle_rejects));
+
+    reset();
+}
+
+bool MOS6502::is_halted() const
+{
+    return halted;
+}
+
+void MOS6502::save_state(cpu_state_t& state) const
+{
+    state = cpu_state_t();
+    state.cycles = cycles;
+    state.PC = PC;
+    state.ACC = ACC; state.X = X; state.Y = Y; state.FLG = FLG; state.SP = SP;
+    state.halted = halted ? 1 : 0;
+    state.halt_address = halt_address;
+    state.halt_opcode = halt_opcode;
+}
+
+void MOS6502::load_state(const cpu_state_t& state)
+{
+    cycles = state.cycles;
+    PC = state.PC;
+    ACC = state.ACC; X = state.X; Y = state.Y; FLG = state.FLG; SP = state.SP;
+    halted = state.halted != 0;
+    halt_address = state.halt_address;
+    halt_opcode = state.halt_opcode;
+    status = halted ? "halted" : "running";
 }
 
-void MOS6502::fetch_data()
+inline uint8_t MOS6502::fetch_data()
 {
     fetched = NES_Ram->read_byte(fetch_address);
+    return fetched;
+}
+
+void MOS6502::interrupts_unmasked()
+{
+    if (irq_line && !get_flag(FLAG_I_IRQD))
+        run_target = 0;
+}
+
+void MOS6502::push_byte(uint8_t value)
+{
+    NES_Ram->write_byte(0x0100 + SP, value);
+    SP--;
+}
+
+uint8_t MOS6502::pop_byte()
+{
+    SP++;
+    return NES_Ram->read_byte(0x0100 + SP);
+}
+
+// ===========================
+// PREDECODE CACHE
+// ===========================
+
+inline const decoded_instruction_t* MOS6502::predecoded(uint16_t addr)
+{
+    const decoded_page_t* page = decoded_pages[addr >> 8].get();
+
+    if (page == nullptr || page->generation != NES_Ram->page_generation(addr))
+        page = refresh_page(addr >> 8);
+
+    if (!page->read_only)
+        return nullptr;
+
+    const decoded_instruction_t& instruction = page->instructions[addr & 0xFF];
+
+    if (instruction.state == decoded_instruction_t::DECODED)
+        return &instruction;
+    if (instruction.state == decoded_instruction_t::LIVE)
+        return nullptr;
+
+    return decode(addr);
+}
+
+decoded_page_t* MOS6502::refresh_page(unsigned int page)
+{
+    // The page is new to the cache, or was remapped since it was decoded: forget it all.
+    if (!decoded_pages[page])
+        decoded_pages[page].reset(new decoded_page_t());
+
+    decoded_page_t& cache = *decoded_pages[page];
+    cache.generation = NES_Ram->page_generation(page << 8);
+    cache.read_only = NES_Ram->is_read_only(page << 8);
+
+    if (cache.read_only)
+        std::memset(cache.instructions, 0x00, sizeof(cache.instructions));
+
+    return &cache;
+}
+
+const decoded_instruction_t* MOS6502::decode(uint16_t addr)
+{
+    decoded_instruction_t& instruction = decoded_pages[addr >> 8]->instructions[addr & 0xFF];
+
+    const uint8_t opcode = NES_Ram->read_byte(addr);
+    const opcode_info_t& info = opcodes::OPCODE_TABLE[opcode];
+    const uint8_t length = opcodes::instruction_length(info.addrmode);
+
+    // Operand bytes on the next page may be mapped differently from one run to the next.
+    if ((addr & 0xFF) + length > constants::PAGE_SIZE)
+    {
+        instruction.state = decoded_instruction_t::LIVE;
+        return nullptr;
+    }
+
+    instruction.operand = 0;
+    if (length >= 2)
+        instruction.operand = NES_Ram->read_byte(addr + 1);
+    if (length == 3)
+        instruction.operand |= (uint16_t)NES_Ram->read_byte(addr + 2) << 8;
+
+    instruction.opcode = opcode;
+    instruction.cycles = info.cycles;
+    instruction.length = length;
+    instruction.state = decoded_instruction_t::DECODED;
+
+    return &instruction;
+}
+
+// ===========================
+// EXECUTION
+// ===========================
+
+void MOS6502::attach_tracer(Tracer* trace_sink)
+{
+    tracer = trace_sink;
+}
+
+void MOS6502::attach_profiler(Profiler* profile_sink)
+{
+    profiler = profile_sink;
+}
+
+void MOS6502::attach_debugger(Debugger* instruction_debugger)
+{
+    debugger = instruction_debugger;
+}
+
+void MOS6502::request_stop()
+{
+    stopped = true;
+    run_target = 0;
+}
+
+void MOS6502::clear_stop()
+{
+    stopped = false;
+}
+
+bool MOS6502::is_stopped() const
+{
+    return stopped;
+}
+
+void MOS6502::set_idle_skip(bool enabled)
+{
+    idle_skip = enabled;
+}
+
+void MOS6502::set_poll_handler(poll_handler_t handler, void* context)
+{
+    poll_handler = handler;
+    poll_context = context;
+}
+
+uint64_t MOS6502::get_idle_skipped_cycles() const
+{
+    return idle_skipped_cycles;
+}
+
+void MOS6502::trace_instruction()
+{
+    trace_record_t record = {};
+
+    record.cycle = cycles;
+    record.PC = PC;
+    record.opcode = NES_Ram->peek_byte(PC);
+    record.operand_lo = NES_Ram->peek_byte((uint16_t)(PC + 1));
+    record.operand_hi = NES_Ram->peek_byte((uint16_t)(PC + 2));
+    record.ACC = ACC; record.X = X; record.Y = Y; record.FLG = FLG; record.SP = SP;
+
+    tracer->record(record);
+}
+
+uint8_t MOS6502::step()
+{
+    if (halted || stopped)
+        return 0;
+
+    if (debugger != nullptr && debugger->should_stop(PC))
+    {
+        request_stop();
+        return 0;
+    }
+
+#ifdef NESEMU_TRACE
+    if (tracer != nullptr)
+        trace_instruction();
+#endif
+
+    // The handler for the opcode runs its addressing mode and its operation and returns
+    // the number of cycles the instruction took. Code in ROM comes from the predecode
+    // cache; anything else is fetched from the bus as it executes.
+    uint8_t taken;
+    const uint16_t instruction_address = PC;
+    const decoded_instruction_t* decoded = predecoded(PC);
+
+    if (decoded != nullptr)
+    {
+        last_read_opcode = decoded->opcode;
+        PC += decoded->length;
+        instruction_cycles = decoded->cycles;
+        taken = decoded_dispatch_table[decoded->opcode](*this, decoded->operand);
+    }
+    else
+    {
+        // Load the next instruction, which should be at PC. Increment PC because we
+        // have read that byte.
+        last_read_opcode = NES_Ram->read_byte(PC++);
+        taken = dispatch_table[last_read_opcode](*this);
+    }
+
+    cycles += taken;
+
+    if (profiler != nullptr)
+        profiler->record(instruction_address, last_read_opcode, taken, PC, SP);
+
+    return taken;
+}
+
+uint64_t MOS6502::run_cycles(uint64_t budget)
+{
+    return run_until(cycles + budget);
+}
+
+uint64_t MOS6502::run_until(uint64_t target_cycle)
+{
+    // Instructions are never split: the last one may carry the counter a few
+    // cycles past `target_cycle', and callers should schedule against `cycles'.
+    // XXX() ends the loop by dropping `run_target' to 0 when the CPU halts.
+    const uint64_t start_cycle = cycles;
+
+    if (halted || stopped)
+        return 0;
+
+    run_target = target_cycle;
+
+    // A run often starts inside the loop the previous one stopped in.
+    if (idle_skip)
+        skip_idle_loop();
+
+    while (cycles < run_target)
+    {
+        const uint16_t from = PC;
+        step();
+
+        if (idle_skip && PC <= from)
+            skip_idle_loop();
+    }
+
+    return cycles - start_cycle;
 }
 
 // ===========================
-// CLOCK FUNCTION
+// IDLE LOOPS
 // ===========================
 
-void MOS6502::clock()
+namespace
+{
+    // Whether an instruction can be part of an idle loop: it writes nothing (memory, stack,
+    // the I flag), stays put or jumps within the loop, and anything it reads is at an address
+    // fixed by its operand.
+    bool is_idle_instruction(const opcode_info_t& info)
+    {
+        using O = operation_t;
+        using M = addr_mode_t;
+
+        if (info.addrmode != M::IMP && info.addrmode != M::IMM && info.addrmode != M::ZP0 &&
+            info.addrmode != M::ABS && info.addrmode != M::REL)
+            return false;
+
+        switch (info.operation)
+        {
+            case O::ADC: case O::AND: case O::BIT: case O::CMP: case O::CPX: case O::CPY: case O::EOR:
+            case O::LDA: case O::LDX: case O::LDY: case O::NOP: case O::ORA: case O::SBC:
+            case O::BCC: case O::BCS: case O::BEQ: case O::BMI: case O::BNE: case O::BPL: case O::BVC: case O::BVS:
+            case O::CLC: case O::CLD: case O::CLV: case O::SEC: case O::SED:
+            case O::DEX: case O::DEY: case O::INX: case O::INY:
+            case O::TAX: case O::TAY: case O::TSX: case O::TXA: case O::TYA:
+            case O::JMP:
+                return true;
+            case O::ASL: case O::LSR: case O::ROL: case O::ROR:
+                return info.addrmode == M::IMP; // On the accumulator only.
+            default:
+                return false;
+        }
+    }
+
+    bool is_branch(operation_t operation)
+    {
+        using O = operation_t;
+
+        return operation == O::BCC || operation == O::BCS || operation == O::BEQ || operation == O::BMI ||
+               operation == O::BNE || operation == O::BPL || operation == O::BVC || operation == O::BVS;
+    }
+} // namespace
+
+bool MOS6502::find_idle_loop(uint16_t head, idle_loop_t& loop) const
+{
+    // Straight-line code from the head up to the first jump or branch back to it, all on the
+    // head's page.
+    uint16_t pc = head;
+    loop.instruction_count = 0;
+    loop.read_count = 0;
+
+    while (loop.instruction_count < (unsigned int)constants::IDLE_LOOP_MAX_INSTRUCTIONS)
+    {
+        const uint8_t opcode = NES_Ram->peek_byte(pc);
+        const opcode_info_t& info = opcodes::OPCODE_TABLE[opcode];
+        const uint8_t length = opcodes::instruction_length(info.addrmode);
+
+        if (!is_idle_instruction(info) || (pc & 0xFF) + length > constants::PAGE_SIZE)
+            return false;
+
+        uint16_t operand = 0;
+        if (length >= 2)
+            operand = NES_Ram->peek_byte(pc + 1);
+        if (length == 3)
+            operand |= (uint16_t)NES_Ram->peek_byte(pc + 2) << 8;
+
+        loop.instructions[loop.instruction_count++] = pc;
+
+        if (info.operation == operation_t::JMP)
+            return operand == head;
+
+        if (is_branch(info.operation) && (uint16_t)(pc + length + (int8_t)operand) == head)
+            return true;
+
+        if (info.addrmode == addr_mode_t::ZP0 || info.addrmode == addr_mode_t::ABS)
+            loop.reads[loop.read_count++] = operand;
+
+        pc += length;
+    }
+
+    return false;
+}
+
+void MOS6502::skip_idle_loop()
 {
-    if (clock_cycles_remaining > 0)
+    if (!idle_skip || tracer != nullptr || profiler != nullptr || debugger != nullptr || cycles >= run_target)
+        return;
+
+    const uint16_t head = PC;
+    const uint32_t generation = NES_Ram->page_generation(head);
+    idle_reject_t& reject = idle_rejects[head % constants::IDLE_REJECT_CACHE_SIZE];
+
+    if (reject.generation != generation || reject.head != head)
+    {
+        reject.generation = generation;
+        reject.head = head;
+        reject.misses = 0;
+    }
+    else if (reject.misses >= constants::IDLE_LOOP_MAX_MISSES)
+    {
+        return;
+    }
+
+    // Only loops in ROM: their code can't change under them, and neither can the verdict.
+    idle_loop_t loop;
+    if (!NES_Ram->is_read_only(head) || !find_idle_loop(head, loop))
     {
-        std::cout << "[Clock] We are still processing an instruction; " << (int)clock_cycles_remaining << " cycle(s) left" << std::endl;
-        clock_cycles_remaining--;
-        return; // We are done for this clock cycle.
+        reject.misses = constants::IDLE_LOOP_MAX_MISSES;
+        return;
     }
 
-    // If we have gotten to this point, the last instruction has successfully
-    // completed. Let's load the next instruction, which now should be at PC.
-    // Increment PC because we have read that byte.
-    uint8_t instruction_opcode = this->NES_Ram->read_byte(PC++);
+    // Memory only changes when the CPU writes it, which the loop doesn't. Device registers
+    // keep the value they have now until their poll handler says; every iteration skipped
+    // must end before then, and before the run target.
+    uint64_t limit = std::numeric_limits<uint64_t>::max();
+
+    for (unsigned int i = 0; i < loop.read_count; i++)
+    {
+        const address_t addr = loop.reads[i];
+
+        if (NES_Ram->is_memory(addr))
+            continue;
 
-    // Retrieve information about this opcode, such as the addressing mode
-    // and minimum clock cycles.
-    clock_cycles_remaining = lookup_table[instruction_opcode].cycles;
-    std::cout << "[Clock] Read new opcode: " << lookup_table[instruction_opcode].name << std::endl;
-    last_read_opcode = instruction_opcode;
+        const uint64_t stable_until = poll_handler != nullptr ? poll_handler(poll_context, addr) : 0;
+        if (stable_until <= cycles)
+            return;
 
-    // Run the addressing mode function to retrieve the to-fetch address and
-    // run the operation function to actually perform the operation.
-    uint8_t adcycle_1 = (this->*lookup_table[instruction_opcode].addrmode)();
-    uint8_t adcycle_2 = (this->*lookup_table[instruction_opcode].operate)();
+        limit = std::min(limit, stable_until - 1);
+    }
 
-    // If both adcycle_1 and adcycle_2 are equal to 1, then add 1 to clock_cycles_remaining.
-    clock_cycles_remaining += (adcycle_1 & adcycle_2);
+    // Run one iteration for real. It has to go round the decoded instructions and come back
+    // to the head; anything else (an exit, an interrupt being due) ends the check.
+    const uint8_t registers[5] = { ACC, X, Y, FLG, SP };
+    const uint64_t start_cycle = cycles;
 
-    std::cout << "[Clock] Now faking this many clock cycles: " << (int)clock_cycles_remaining << std::endl;
+    while (cycles < run_target)
+    {
+        step();
 
-    clock_cycles_remaining--;
+        if (PC == head)
+            break;
+
+        const uint16_t* last = loop.instructions + loop.instruction_count;
+        if (std::find<const uint16_t*>(loop.instructions, last, PC) == last)
+            return;
+    }
+
+    if (PC != head)
+        return;
+
+    // Registers as they were: with nothing written and the same values read, every later
+    // iteration does exactly this one again.
+    if (ACC != registers[0] || X != registers[1] || Y != registers[2] || FLG != registers[3] || SP != registers[4])
+    {
+        reject.misses++;
+        return;
+    }
+
+    reject.misses = 0;
+
+    limit = std::min(limit, run_target);
+    if (limit <= cycles)
+        return;
+
+    const uint64_t period = cycles - start_cycle;
+    const uint64_t skipped = (limit - cycles) / period * period;
+
+    cycles += skipped;
+    idle_skipped_cycles += skipped;
 }
 
 // ===========================
 // HELPER FUNCTIONS
 // ===========================
 
-uint8_t MOS6502::decode_signed_byte(uint8_t byte)
+inline void MOS6502::branch(bool condition)
 {
-    bool is_negative = !!((byte & 0x80) >> 7); // Bool determines whether the rel addr is negative.
+    if (!condition)
+        return;
+
+    instruction_cycles++;
 
-    return (byte & 0x7f) * (is_negative ? -1 : 1);
+    uint16_t target = PC + branch_relative;
+
+    // Crossing a page boundary costs one more cycle.
+    if ((target & 0xFF00) != (PC & 0xFF00))
+        instruction_cycles++;
+
+    PC = target;
+}
+
+template <addr_mode_t MODE>
+inline uint8_t MOS6502::fetch_operand()
+{
+    return MODE == addr_mode_t::IMP ? ACC : fetch_data();
+}
+
+template <addr_mode_t MODE>
+inline void MOS6502::write_result(uint8_t value)
+{
+    if (MODE == addr_mode_t::IMP)
+        ACC = value;
+    else
+        NES_Ram->write_byte(fetch_address, value);
 }
 
 // ===========================
 // ADDRESSING MODES
 // ===========================
 
-// An addressing mode function retrieves data as implemented by that addressing mode.
-// It stores the data fetched in the `fetched' variable, which is then used by the operation
-// function. It returns an integer representing the additional number of cycles necessary
-// to emulate to faithfully reproduce the 6502's behavior.
+// An addressing mode function works out where the operand of an instruction lives and
+// stores that in `fetch_address' (implied mode stores the accumulator in `fetched' instead).
+// The operation function then fetches the data using fetch_data(). It returns 1 if the
+// addressing mode may need an additional clock cycle (page crossing), 0 otherwise.
+// By the time it runs, PC is past the whole instruction and its operand bytes (if any)
+// are in `operand'.
 
 /**
  * Addressing mode: implied.
  */
-uint8_t MOS6502::IMP()
+inline uint8_t MOS6502::IMP(uint16_t)
 {
     fetched = ACC;
     return 0;
@@ -164,13 +640,12 @@ uint8_t MOS6502::IMP()
 /**
  * Addressing mode: immediate.
  */
-uint8_t MOS6502::IMM()
+inline uint8_t MOS6502::IMM(uint16_t)
 {
-    // In this addressing mode, the address to fetch is immediately after the instruction
-    // (which is located @ PC). As such, increment PC and fetch the byte at PC -- this
-    // is the fetch address.
+    // In this addressing mode, the data is the byte immediately after the opcode, which
+    // is the byte just before PC.
 
-    fetch_address = NES_Ram->read_byte(PC++);
+    fetch_address = PC - 1;
 
     return 0;
 }
@@ -178,13 +653,13 @@ uint8_t MOS6502::IMM()
 /**
  * Addressing mode: zero-page.
  */
-uint8_t MOS6502::ZP0()
+inline uint8_t MOS6502::ZP0(uint16_t operand)
 {
     // A single byte is given after the opcode. This is the lo-byte.
     // The hi-byte is automatically set to 00 (hence the zero-page).
     // Eg: for argument FA, the read address is $00FA.
 
-    fetch_address = (NES_Ram->read_byte(PC++) & 0x00FF); // Take only the lo-byte.
+    fetch_address = operand & 0x00FF; // Take only the lo-byte.
 
     return 0;
 }
@@ -192,11 +667,12 @@ uint8_t MOS6502::ZP0()
 /**
  * Addressing mode: zero-page, x-offset.
  */
-uint8_t MOS6502::ZPX()
+inline uint8_t MOS6502::ZPX(uint16_t operand)
 {
-    // Same as ZP0, except that we add the X-register contents.
+    // Same as ZP0, except that we add the X-register contents. The result
+    // wraps around within the zero page.
 
-    fetch_address = (NES_Ram->read_byte(PC++) & 0x00FF) + X;
+    fetch_address = (operand + X) & 0x00FF;
 
     return 0;
 }
@@ -204,11 +680,12 @@ uint8_t MOS6502::ZPX()
 /**
  * Addressing mode: zero-page, y-offset.
  */
-uint8_t MOS6502::ZPY()
+inline uint8_t MOS6502::ZPY(uint16_t operand)
 {
-    // Same as ZP0, except that we add the Y-register contents.
+    // Same as ZP0, except that we add the Y-register contents. The result
+    // wraps around within the zero page.
 
-    fetch_address = (NES_Ram->read_byte(PC++) & 0x00FF) + Y;
+    fetch_address = (operand + Y) & 0x00FF;
 
     return 0;
 }
@@ -216,366 +693,876 @@ uint8_t MOS6502::ZPY()
 /**
  * Addressing mode: relative.
  */
-uint8_t MOS6502::REL()
+inline uint8_t MOS6502::REL(uint16_t operand)
 {
-    // Used for branching. The byte immediately after the instruction is fetched.
-    // This byte is treated as a signed value (that is, +- depending on bit 7).
-    // This value is written to `branch_relative'. The branching instruction should
-    // increment or decrement PC accordingly by `branch_relative'.
+    // Used for branching. The byte immediately after the instruction is
+    // treated as a signed (two's complement) value and sign-extended
+    // into `branch_relative'. The branching instruction then adds it to PC.
 
-    std::cout << "[Addressing] REL addressing invoked." << std::endl;
+    branch_relative = operand & 0x00FF;
 
-    branch_relative = decode_signed_byte(NES_Ram->read_byte(PC++));
+    if (branch_relative & 0x80)
+        branch_relative |= 0xFF00;
 
-    std::cout << std::dec << "[Addressing] Calculated jump = " << +branch_relative << std::endl;
+    return 0;
 }
 
 /**
  * Addressing mode: absolute.
  */
-uint8_t MOS6502::ABS()
+inline uint8_t MOS6502::ABS(uint16_t operand)
 {
+    // A full 16-bit address follows the opcode, lo-byte first.
 
+    fetch_address = operand;
+
+    return 0;
 }
 
 /**
  * Addressing mode: absolute, x-offset.
  */
-uint8_t MOS6502::ABX()
+inline uint8_t MOS6502::ABX(uint16_t operand)
 {
+    // Same as ABS, except that we add the X-register contents. If this crosses
+    // into another page, an additional clock cycle may be needed.
+
+    fetch_address = operand + X;
 
+    return (fetch_address & 0xFF00) != (operand & 0xFF00) ? 1 : 0;
 }
 
 /**
  * Addressing mode: absolute, y-offset.
  */
-uint8_t MOS6502::ABY()
+inline uint8_t MOS6502::ABY(uint16_t operand)
 {
+    // Same as ABX, with the Y-register.
 
+    fetch_address = operand + Y;
+
+    return (fetch_address & 0xFF00) != (operand & 0xFF00) ? 1 : 0;
 }
 
 /**
  * Addressing mode: indirect.
  */
-uint8_t MOS6502::IND()
+inline uint8_t MOS6502::IND(uint16_t operand)
 {
+    // The operand is a pointer to the actual address. Only JMP uses this mode.
+    // The hardware has a bug: if the pointer's lo-byte is $FF, the hi-byte of the
+    // target is read from the start of the same page instead of the next one.
+
+    uint16_t ptr = operand;
+    uint16_t ptr_next = (operand & 0xFF00) | ((operand + 1) & 0x00FF);
+
+    fetch_address = (NES_Ram->read_byte(ptr_next) << 8) | NES_Ram->read_byte(ptr);
 
+    return 0;
 }
 
 /**
  * Addressing mode: indirect, x-offset.
  */
-uint8_t MOS6502::IZX()
+inline uint8_t MOS6502::IZX(uint16_t operand)
 {
+    // The operand is a zero-page address, offset by X, at which a 16-bit pointer
+    // is stored. The pointer lookup wraps around within the zero page.
+
+    uint16_t t = operand & 0x00FF;
+
+    uint16_t lo = NES_Ram->read_byte((t + X) & 0x00FF);
+    uint16_t hi = NES_Ram->read_byte((t + X + 1) & 0x00FF);
 
+    fetch_address = (hi << 8) | lo;
+
+    return 0;
 }
 
 /**
  * Addressing mode: indirect, y-offset.
  */
-uint8_t MOS6502::IZY()
+inline uint8_t MOS6502::IZY(uint16_t operand)
 {
+    // The operand is a zero-page address at which a 16-bit pointer is stored. Y
+    // is added to the pointer; crossing a page may cost an additional clock cycle.
+
+    uint16_t t = operand & 0x00FF;
+
+    uint16_t lo = NES_Ram->read_byte(t & 0x00FF);
+    uint16_t hi = NES_Ram->read_byte((t + 1) & 0x00FF);
+
+    fetch_address = ((hi << 8) | lo) + Y;
 
+    return (fetch_address & 0xFF00) != (hi << 8) ? 1 : 0;
 }
 
 // ===========================
 // OPERATIONS
 // ===========================
 
-uint8_t MOS6502::ADC()
+// Operation functions return 1 if they are subject to the page-crossing penalty of
+// their addressing mode, 0 otherwise. The NES's 2A03 has no decimal mode, so the D
+// flag is stored but never affects arithmetic.
+
+inline uint8_t MOS6502::ADC()
 {
+    // Operation: Add Memory to Accumulator with Carry
+
+    fetch_data();
+
+    uint16_t temp = (uint16_t)ACC + (uint16_t)fetched + (uint16_t)get_flag(FLAG_C_CARRY);
 
+    set_flag(FLAG_C_CARRY, temp > 0x00FF);
+    set_flag(FLAG_Z_ZERO, (temp & 0x00FF) == 0);
+    set_flag(FLAG_V_OVERF, (~((uint16_t)ACC ^ (uint16_t)fetched) & ((uint16_t)ACC ^ temp)) & 0x0080);
+    set_flag(FLAG_N_NEGTV, temp & 0x0080);
+
+    ACC = temp & 0x00FF;
+
+    return 1;
 }
 
-uint8_t MOS6502::AND()
+inline uint8_t MOS6502::AND()
 {
+    // Operation: AND Memory with Accumulator
+
+    ACC = ACC & fetch_data();
 
+    set_flag(FLAG_Z_ZERO, ACC == 0x00);
+    set_flag(FLAG_N_NEGTV, ACC & 0x80);
+
+    return 1;
 }
 
-uint8_t MOS6502::ASL()
+template <addr_mode_t MODE>
+inline uint8_t MOS6502::ASL()
 {
+    // Operation: Shift Left One Bit (Memory or Accumulator)
+
+    uint16_t temp = (uint16_t)fetch_operand<MODE>() << 1;
+
+    set_flag(FLAG_C_CARRY, (temp & 0xFF00) > 0);
+    set_flag(FLAG_Z_ZERO, (temp & 0x00FF) == 0);
+    set_flag(FLAG_N_NEGTV, temp & 0x80);
 
+    write_result<MODE>(temp & 0x00FF);
+
+    return 0;
 }
 
-uint8_t MOS6502::BCC()
+inline uint8_t MOS6502::BCC()
 {
+    // Operation: Branch on Carry Clear
 
+    branch(!get_flag(FLAG_C_CARRY));
+    return 0;
 }
 
-uint8_t MOS6502::BCS()
+inline uint8_t MOS6502::BCS()
 {
+    // Operation: Branch on Carry Set
 
+    branch(get_flag(FLAG_C_CARRY));
+    return 0;
 }
 
-uint8_t MOS6502::BEQ()
+inline uint8_t MOS6502::BEQ()
 {
     // Operation: Branch on Result Zero
-    // Check whether the zero-flag is set. If so, invoke REL addressing mode,
-    // apply the offset that is the result of REL, and jump there. If not,
-    // do nothing.
-
-    if (get_flag(FLAG_Z_ZERO))
-    {
+    // Check whether the zero-flag is set. If so, apply the offset that is the
+    // result of REL and jump there. If not, do nothing.
 
-    }
+    branch(get_flag(FLAG_Z_ZERO));
+    return 0;
 }
 
-uint8_t MOS6502::BIT()
+inline uint8_t MOS6502::BIT()
 {
+    // Operation: Test Bits in Memory with Accumulator
+
+    fetch_data();
 
+    set_flag(FLAG_Z_ZERO, (ACC & fetched) == 0x00);
+    set_flag(FLAG_N_NEGTV, fetched & (1 << 7));
+    set_flag(FLAG_V_OVERF, fetched & (1 << 6));
+
+    return 0;
 }
 
-uint8_t MOS6502::BMI()
+inline uint8_t MOS6502::BMI()
 {
+    // Operation: Branch on Result Minus
 
+    branch(get_flag(FLAG_N_NEGTV));
+    return 0;
 }
 
-uint8_t MOS6502::BNE()
+inline uint8_t MOS6502::BNE()
 {
+    // Operation: Branch on Result not Zero
 
+    branch(!get_flag(FLAG_Z_ZERO));
+    return 0;
 }
 
-uint8_t MOS6502::BPL()
+inline uint8_t MOS6502::BPL()
 {
+    // Operation: Branch on Result Plus
 
+    branch(!get_flag(FLAG_N_NEGTV));
+    return 0;
 }
 
-uint8_t MOS6502::BRK()
+inline uint8_t MOS6502::BRK()
 {
+    // Operation: Force Break
+    // BRK is a two-byte instruction (the IMM addressing mode skipped the padding
+    // byte), so the pushed return address is the opcode address + 2.
 
+    push_byte((PC >> 8) & 0x00FF);
+    push_byte(PC & 0x00FF);
+    push_byte(FLG | FLAG_s_UNUS.bitmask | FLAG_s_UNUZ.bitmask);
+
+    set_flag(FLAG_I_IRQD);
+
+    PC = (uint16_t)NES_Ram->read_byte(0xFFFE) | ((uint16_t)NES_Ram->read_byte(0xFFFF) << 8);
+
+    return 0;
 }
 
-uint8_t MOS6502::BVC()
+inline uint8_t MOS6502::BVC()
 {
+    // Operation: Branch on Overflow Clear
 
+    branch(!get_flag(FLAG_V_OVERF));
+    return 0;
 }
 
-uint8_t MOS6502::BVS()
+inline uint8_t MOS6502::BVS()
 {
+    // Operation: Branch on Overflow Set
 
+    branch(get_flag(FLAG_V_OVERF));
+    return 0;
 }
 
-uint8_t MOS6502::CLC()
+inline uint8_t MOS6502::CLC()
 {
+    clear_flag(FLAG_C_CARRY);
+    return 0;
+}
 
+inline uint8_t MOS6502::CLD()
+{
+    clear_flag(FLAG_D_DECI);
+    return 0;
 }
 
-uint8_t MOS6502::CLD()
+inline uint8_t MOS6502::CLI()
 {
+    clear_flag(FLAG_I_IRQD);
+    interrupts_unmasked();
+    return 0;
+}
 
+inline uint8_t MOS6502::CLV()
+{
+    clear_flag(FLAG_V_OVERF);
+    return 0;
 }
 
-uint8_t MOS6502::CLI()
+inline uint8_t MOS6502::CMP()
 {
+    // Operation: Compare Memory with Accumulator
+
+    fetch_data();
 
+    uint16_t temp = (uint16_t)ACC - (uint16_t)fetched;
+
+    set_flag(FLAG_C_CARRY, ACC >= fetched);
+    set_flag(FLAG_Z_ZERO, (temp & 0x00FF) == 0x0000);
+    set_flag(FLAG_N_NEGTV, temp & 0x0080);
+
+    return 1;
 }
 
-uint8_t MOS6502::CLV()
+inline uint8_t MOS6502::CPX()
 {
+    // Operation: Compare Memory and Index X
+
+    fetch_data();
 
+    uint16_t temp = (uint16_t)X - (uint16_t)fetched;
+
+    set_flag(FLAG_C_CARRY, X >= fetched);
+    set_flag(FLAG_Z_ZERO, (temp & 0x00FF) == 0x0000);
+    set_flag(FLAG_N_NEGTV, temp & 0x0080);
+
+    return 0;
 }
 
-uint8_t MOS6502::CMP()
+inline uint8_t MOS6502::CPY()
 {
+    // Operation: Compare Memory and Index Y
+
+    fetch_data();
+
+    uint16_t temp = (uint16_t)Y - (uint16_t)fetched;
 
+    set_flag(FLAG_C_CARRY, Y >= fetched);
+    set_flag(FLAG_Z_ZERO, (temp & 0x00FF) == 0x0000);
+    set_flag(FLAG_N_NEGTV, temp & 0x0080);
+
+    return 0;
 }
 
-uint8_t MOS6502::CPX()
+inline uint8_t MOS6502::DEC()
 {
+    // Operation: Decrement Memory by One
+
+    uint8_t temp = fetch_data() - 1;
 
+    NES_Ram->write_byte(fetch_address, temp);
+
+    set_flag(FLAG_Z_ZERO, temp == 0x00);
+    set_flag(FLAG_N_NEGTV, temp & 0x80);
+
+    return 0;
 }
 
-uint8_t MOS6502::CPY()
+inline uint8_t MOS6502::DEX()
 {
+    X--;
 
+    set_flag(FLAG_Z_ZERO, X == 0x00);
+    set_flag(FLAG_N_NEGTV, X & 0x80);
+
+    return 0;
 }
 
-uint8_t MOS6502::DEC()
+inline uint8_t MOS6502::DEY()
 {
+    Y--;
+
+    set_flag(FLAG_Z_ZERO, Y == 0x00);
+    set_flag(FLAG_N_NEGTV, Y & 0x80);
 
+    return 0;
 }
 
-uint8_t MOS6502::DEX()
+inline uint8_t MOS6502::EOR()
 {
+    // Operation: Exclusive-OR Memory with Accumulator
+
+    ACC = ACC ^ fetch_data();
+
+    set_flag(FLAG_Z_ZERO, ACC == 0x00);
+    set_flag(FLAG_N_NEGTV, ACC & 0x80);
 
+    return 1;
 }
 
-uint8_t MOS6502::DEY()
+inline uint8_t MOS6502::INC()
 {
+    // Operation: Increment Memory by One
 
+    uint8_t temp = fetch_data() + 1;
+
+    NES_Ram->write_byte(fetch_address, temp);
+
+    set_flag(FLAG_Z_ZERO, temp == 0x00);
+    set_flag(FLAG_N_NEGTV, temp & 0x80);
+
+    return 0;
 }
 
-uint8_t MOS6502::EOR()
+inline uint8_t MOS6502::INX()
 {
+    X++;
+
+    set_flag(FLAG_Z_ZERO, X == 0x00);
+    set_flag(FLAG_N_NEGTV, X & 0x80);
 
+    return 0;
 }
 
-uint8_t MOS6502::INC()
+inline uint8_t MOS6502::INY()
 {
+    Y++;
 
+    set_flag(FLAG_Z_ZERO, Y == 0x00);
+    set_flag(FLAG_N_NEGTV, Y & 0x80);
+
+    return 0;
 }
 
-uint8_t MOS6502::INX()
+inline uint8_t MOS6502::JMP()
 {
+    // Operation: Jump to New Location
 
+    PC = fetch_address;
+    return 0;
 }
 
-uint8_t MOS6502::INY()
+inline uint8_t MOS6502::JSR()
 {
+    // Operation: Jump to New Location Saving Return Address
+    // The pushed address is that of the last byte of the JSR instruction; RTS adds one.
+
+    PC--;
+
+    push_byte((PC >> 8) & 0x00FF);
+    push_byte(PC & 0x00FF);
 
+    PC = fetch_address;
+    return 0;
 }
 
-uint8_t MOS6502::JMP()
+inline uint8_t MOS6502::LDA()
 {
+    ACC = fetch_data();
+
+    set_flag(FLAG_Z_ZERO, ACC == 0x00);
+    set_flag(FLAG_N_NEGTV, ACC & 0x80);
 
+    return 1;
 }
 
-uint8_t MOS6502::JSR()
+inline uint8_t MOS6502::LDX()
 {
+    X = fetch_data();
+
+    set_flag(FLAG_Z_ZERO, X == 0x00);
+    set_flag(FLAG_N_NEGTV, X & 0x80);
 
+    return 1;
 }
 
-uint8_t MOS6502::LDA()
+inline uint8_t MOS6502::LDY()
 {
+    Y = fetch_data();
 
+    set_flag(FLAG_Z_ZERO, Y == 0x00);
+    set_flag(FLAG_N_NEGTV, Y & 0x80);
+
+    return 1;
 }
 
-uint8_t MOS6502::LDX()
+template <addr_mode_t MODE>
+inline uint8_t MOS6502::LSR()
 {
+    // Operation: Shift One Bit Right (Memory or Accumulator)
+
+    uint8_t value = fetch_operand<MODE>();
+
+    set_flag(FLAG_C_CARRY, value & 0x01);
 
+    uint8_t temp = value >> 1;
+
+    set_flag(FLAG_Z_ZERO, temp == 0x00);
+    set_flag(FLAG_N_NEGTV, temp & 0x80);
+
+    write_result<MODE>(temp);
+
+    return 0;
 }
 
-uint8_t MOS6502::LDY()
+inline uint8_t MOS6502::NOP()
 {
-
+    return 0;
 }
 
-uint8_t MOS6502::LSR()
+inline uint8_t MOS6502::ORA()
 {
+    // Operation: OR Memory with Accumulator
 
+    ACC = ACC | fetch_data();
+
+    set_flag(FLAG_Z_ZERO, ACC == 0x00);
+    set_flag(FLAG_N_NEGTV, ACC & 0x80);
+
+    return 1;
 }
 
-uint8_t MOS6502::NOP()
+inline uint8_t MOS6502::PHA()
 {
-
+    push_byte(ACC);
+    return 0;
 }
 
-uint8_t MOS6502::ORA()
+inline uint8_t MOS6502::PHP()
 {
+    // The break and unused flags are always pushed as 1.
 
+    push_byte(FLG | FLAG_s_UNUS.bitmask | FLAG_s_UNUZ.bitmask);
+    return 0;
 }
 
-uint8_t MOS6502::PHA()
+inline uint8_t MOS6502::PLA()
 {
+    ACC = pop_byte();
+
+    set_flag(FLAG_Z_ZERO, ACC == 0x00);
+    set_flag(FLAG_N_NEGTV, ACC & 0x80);
 
+    return 0;
 }
 
-uint8_t MOS6502::PHP()
+inline uint8_t MOS6502::PLP()
 {
+    // The break flag does not physically exist in the status register and the
+    // unused flag always reads back as 1.
+
+    FLG = pop_byte();
+
+    clear_flag(FLAG_s_UNUS);
+    set_flag(FLAG_s_UNUZ);
+    interrupts_unmasked();
 
+    return 0;
 }
 
-uint8_t MOS6502::PLA()
+template <addr_mode_t MODE>
+inline uint8_t MOS6502::ROL()
 {
+    // Operation: Rotate One Bit Left (Memory or Accumulator)
+
+    uint16_t temp = (uint16_t)(fetch_operand<MODE>() << 1) | get_flag(FLAG_C_CARRY);
 
+    set_flag(FLAG_C_CARRY, temp & 0xFF00);
+    set_flag(FLAG_Z_ZERO, (temp & 0x00FF) == 0x0000);
+    set_flag(FLAG_N_NEGTV, temp & 0x0080);
+
+    write_result<MODE>(temp & 0x00FF);
+
+    return 0;
 }
 
-uint8_t MOS6502::PLP()
+template <addr_mode_t MODE>
+inline uint8_t MOS6502::ROR()
 {
+    // Operation: Rotate One Bit Right (Memory or Accumulator)
+
+    uint8_t value = fetch_operand<MODE>();
+
+    uint8_t temp = (uint8_t)(get_flag(FLAG_C_CARRY) << 7) | (value >> 1);
+
+    set_flag(FLAG_C_CARRY, value & 0x01);
+    set_flag(FLAG_Z_ZERO, temp == 0x00);
+    set_flag(FLAG_N_NEGTV, temp & 0x80);
 
+    write_result<MODE>(temp);
+
+    return 0;
 }
 
-uint8_t MOS6502::ROL()
+inline uint8_t MOS6502::RTI()
 {
+    // Operation: Return from Interrupt
+
+    FLG = pop_byte();
+
+    clear_flag(FLAG_s_UNUS);
+    set_flag(FLAG_s_UNUZ);
+
+    PC = (uint16_t)pop_byte();
+    PC |= (uint16_t)pop_byte() << 8;
+
+    interrupts_unmasked();
 
+    return 0;
 }
 
-uint8_t MOS6502::ROR()
+inline uint8_t MOS6502::RTS()
 {
+    // Operation: Return from Subroutine
+
+    PC = (uint16_t)pop_byte();
+    PC |= (uint16_t)pop_byte() << 8;
+
+    PC++;
 
+    return 0;
 }
 
-uint8_t MOS6502::RTI()
+inline uint8_t MOS6502::SBC()
 {
+    // Operation: Subtract Memory from Accumulator with Borrow
+    // A - M - (1 - C) is the same as A + ~M + C, so this is ADC with the operand inverted.
+
+    fetch_data();
+
+    uint16_t value = (uint16_t)fetched ^ 0x00FF;
+    uint16_t temp = (uint16_t)ACC + value + (uint16_t)get_flag(FLAG_C_CARRY);
 
+    set_flag(FLAG_C_CARRY, temp & 0xFF00);
+    set_flag(FLAG_Z_ZERO, (temp & 0x00FF) == 0);
+    set_flag(FLAG_V_OVERF, (temp ^ (uint16_t)ACC) & (temp ^ value) & 0x0080);
+    set_flag(FLAG_N_NEGTV, temp & 0x0080);
+
+    ACC = temp & 0x00FF;
+
+    return 1;
 }
 
-uint8_t MOS6502::RTS()
+inline uint8_t MOS6502::SEC()
 {
+    set_flag(FLAG_C_CARRY);
+    return 0;
+}
 
+inline uint8_t MOS6502::SED()
+{
+    set_flag(FLAG_D_DECI);
+    return 0;
 }
 
-uint8_t MOS6502::SBC()
+inline uint8_t MOS6502::SEI()
 {
+    set_flag(FLAG_I_IRQD);
+    return 0;
+}
 
+inline uint8_t MOS6502::STA()
+{
+    NES_Ram->write_byte(fetch_address, ACC);
+    return 0;
 }
 
-uint8_t MOS6502::SEC()
+inline uint8_t MOS6502::STX()
 {
+    NES_Ram->write_byte(fetch_address, X);
+    return 0;
+}
 
+inline uint8_t MOS6502::STY()
+{
+    NES_Ram->write_byte(fetch_address, Y);
+    return 0;
 }
 
-uint8_t MOS6502::SED()
+inline uint8_t MOS6502::TAX()
 {
+    X = ACC;
 
+    set_flag(FLAG_Z_ZERO, X == 0x00);
+    set_flag(FLAG_N_NEGTV, X & 0x80);
+
+    return 0;
 }
 
-uint8_t MOS6502::SEI()
+inline uint8_t MOS6502::TAY()
 {
+    Y = ACC;
+
+    set_flag(FLAG_Z_ZERO, Y == 0x00);
+    set_flag(FLAG_N_NEGTV, Y & 0x80);
 
+    return 0;
 }
 
-uint8_t MOS6502::STA()
+inline uint8_t MOS6502::TSX()
 {
+    X = SP;
+
+    set_flag(FLAG_Z_ZERO, X == 0x00);
+    set_flag(FLAG_N_NEGTV, X & 0x80);
 
+    return 0;
 }
 
-uint8_t MOS6502::STX()
+inline uint8_t MOS6502::TXA()
 {
+    ACC = X;
 
+    set_flag(FLAG_Z_ZERO, ACC == 0x00);
+    set_flag(FLAG_N_NEGTV, ACC & 0x80);
+
+    return 0;
 }
 
-uint8_t MOS6502::STY()
+inline uint8_t MOS6502::TXS()
 {
-
+    SP = X;
+    return 0;
 }
 
-uint8_t MOS6502::TAX()
+inline uint8_t MOS6502::TYA()
 {
+    ACC = Y;
+
+    set_flag(FLAG_Z_ZERO, ACC == 0x00);
+    set_flag(FLAG_N_NEGTV, ACC & 0x80);
 
+    return 0;
 }
 
-uint8_t MOS6502::TAY()
+uint8_t MOS6502::XXX()
 {
+    // Unimplemented opcode. Stop this CPU (and only this CPU) and leave a description of
+    // what happened for whoever is driving it.
+    halted = true;
+    halt_address = PC - 1;
+    halt_opcode = last_read_opcode;
+    status = "halted";
 
+    // The failed instruction doesn't execute, and doesn't take any time.
+    PC = halt_address;
+    run_target = 0;
+    instruction_cycles = 0;
+
+    return 0;
 }
 
-uint8_t MOS6502::TSX()
+// ===========================
+// OPCODE DISPATCH
+// ===========================
+
+// The switches below are on template parameters, so each instantiation folds down to a
+// single direct (and usually inlined) call.
+
+template <addr_mode_t MODE>
+inline uint8_t MOS6502::address(uint16_t operand)
 {
+    switch (MODE)
+    {
+        case addr_mode_t::IMP: return IMP(operand);
+        case addr_mode_t::IMM: return IMM(operand);
+        case addr_mode_t::ZP0: return ZP0(operand);
+        case addr_mode_t::ZPX: return ZPX(operand);
+        case addr_mode_t::ZPY: return ZPY(operand);
+        case addr_mode_t::REL: return REL(operand);
+        case addr_mode_t::ABS: return ABS(operand);
+        case addr_mode_t::ABX: return ABX(operand);
+        case addr_mode_t::ABY: return ABY(operand);
+        case addr_mode_t::IND: return IND(operand);
+        case addr_mode_t::IZX: return IZX(operand);
+        case addr_mode_t::IZY: return IZY(operand);
+    }
+    return 0;
+}
 
+template <operation_t OPERATION, addr_mode_t MODE>
+inline uint8_t MOS6502::operate()
+{
+    switch (OPERATION)
+    {
+        case operation_t::ADC: return ADC();
+        case operation_t::AND: return AND();
+        case operation_t::ASL: return ASL<MODE>();
+        case operation_t::BCC: return BCC();
+        case operation_t::BCS: return BCS();
+        case operation_t::BEQ: return BEQ();
+        case operation_t::BIT: return BIT();
+        case operation_t::BMI: return BMI();
+        case operation_t::BNE: return BNE();
+        case operation_t::BPL: return BPL();
+        case operation_t::BRK: return BRK();
+        case operation_t::BVC: return BVC();
+        case operation_t::BVS: return BVS();
+        case operation_t::CLC: return CLC();
+        case operation_t::CLD: return CLD();
+        case operation_t::CLI: return CLI();
+        case operation_t::CLV: return CLV();
+        case operation_t::CMP: return CMP();
+        case operation_t::CPX: return CPX();
+        case operation_t::CPY: return CPY();
+        case operation_t::DEC: return DEC();
+        case operation_t::DEX: return DEX();
+        case operation_t::DEY: return DEY();
+        case operation_t::EOR: return EOR();
+        case operation_t::INC: return INC();
+        case operation_t::INX: return INX();
+        case operation_t::INY: return INY();
+        case operation_t::JMP: return JMP();
+        case operation_t::JSR: return JSR();
+        case operation_t::LDA: return LDA();
+        case operation_t::LDX: return LDX();
+        case operation_t::LDY: return LDY();
+        case operation_t::LSR: return LSR<MODE>();
+        case operation_t::NOP: return NOP();
+        case operation_t::ORA: return ORA();
+        case operation_t::PHA: return PHA();
+        case operation_t::PHP: return PHP();
+        case operation_t::PLA: return PLA();
+        case operation_t::PLP: return PLP();
+        case operation_t::ROL: return ROL<MODE>();
+        case operation_t::ROR: return ROR<MODE>();
+        case operation_t::RTI: return RTI();
+        case operation_t::RTS: return RTS();
+        case operation_t::SBC: return SBC();
+        case operation_t::SEC: return SEC();
+        case operation_t::SED: return SED();
+        case operation_t::SEI: return SEI();
+        case operation_t::STA: return STA();
+        case operation_t::STX: return STX();
+        case operation_t::STY: return STY();
+        case operation_t::TAX: return TAX();
+        case operation_t::TAY: return TAY();
+        case operation_t::TSX: return TSX();
+        case operation_t::TXA: return TXA();
+        case operation_t::TXS: return TXS();
+        case operation_t::TYA: return TYA();
+        case operation_t::XXX: return XXX();
+    }
+    return 0;
 }
 
-uint8_t MOS6502::TXA()
+template <uint8_t OPCODE>
+uint8_t MOS6502::execute(MOS6502& cpu)
 {
+    constexpr opcode_info_t info = opcodes::OPCODE_TABLE[OPCODE];
+    constexpr uint8_t length = opcodes::instruction_length(info.addrmode);
+
+    cpu.instruction_cycles = info.cycles;
+
+    // Fetch the operand bytes, lo-byte first. Immediate mode reads its byte as data instead.
+    uint16_t operand = 0;
 
+    if (info.addrmode == addr_mode_t::IMM)
+        cpu.PC++;
+    else if (length >= 2)
+        operand = cpu.NES_Ram->read_byte(cpu.PC++);
+
+    if (length == 3)
+        operand |= (uint16_t)cpu.NES_Ram->read_byte(cpu.PC++) << 8;
+
+    return execute_decoded<OPCODE>(cpu, operand);
 }
 
-uint8_t MOS6502::TXS()
+// Runs an instruction whose opcode and operand have been fetched (PC is past them) and
+// whose base cycles are already in `instruction_cycles'.
+template <uint8_t OPCODE>
+uint8_t MOS6502::execute_decoded(MOS6502& cpu, uint16_t operand)
 {
+    constexpr opcode_info_t info = opcodes::OPCODE_TABLE[OPCODE];
+
+    // Run the addressing mode to work out the operand's address, then the operation.
+    uint8_t adcycle_1 = cpu.address<info.addrmode>(operand);
+    uint8_t adcycle_2 = cpu.operate<info.operation, info.addrmode>();
 
+    // If both adcycle_1 and adcycle_2 are equal to 1, then the instruction takes one more cycle.
+    // Branches account for their own extra cycles directly in `instruction_cycles'.
+    cpu.instruction_cycles += (adcycle_1 & adcycle_2);
+
+    return cpu.instruction_cycles;
 }
 
-uint8_t MOS6502::TYA()
+template <std::size_t... OPCODES>
+std::array<MOS6502::handler_t, 256> MOS6502::build_dispatch_table(std::index_sequence<OPCODES...>)
 {
-
+    return {{ &MOS6502::execute<OPCODES>... }};
 }
 
-uint8_t MOS6502::XXX() {
-    std::cout << "[6502] Hit an unimplemented opcode at $" << std::setw(4) << std::hex << PC - 1 << std::dec << "." << std::endl;
-    std::cout << "[6502] byte \"" << std::setw(2) << std::hex << +last_read_opcode << "\" at $" << std::setw(4) << PC - 1 << std::endl;
-    std::cout << "[6502] Halting execution" << std::endl;
+template <std::size_t... OPCODES>
+std::array<MOS6502::decoded_handler_t, 256> MOS6502::build_decoded_dispatch_table(std::index_sequence<OPCODES...>)
+{
+    return {{ &MOS6502::execute_decoded<OPCODES>... }};
+}
 
-    exit(0);
+const std::array<MOS6502::handler_t, 256> MOS6502::dispatch_table =
+    MOS6502::build_dispatch_table(std::make_index_sequence<256>());
 
-    return 0;
-}
\ No newline at end of file
+const std::array<MOS6502::decoded_handler_t, 256> MOS6502::decoded_dispatch_table =
+    MOS6502::build_decoded_dispatch_table(std::make_index_sequence<256>());
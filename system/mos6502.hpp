@@ -6,8 +6,26 @@
 #define NESEMULATOR_MOS6502_HPP
 
 #include "ram.hpp"
-#include <vector>
+#include "opcodes.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include <array>
+#include <memory>
 #include <string>
+#include <utility>
+
+class Debugger;
+
+namespace constants
+{
+    const int IDLE_LOOP_MAX_INSTRUCTIONS = 8; // Longest loop body taken for an idle loop.
+    const int IDLE_LOOP_MAX_MISSES = 4;       // Iterations that change registers before giving up on a loop.
+    const int IDLE_REJECT_CACHE_SIZE = 64;
+} // namespace constants
+
+// For a device register an idle loop polls: the first CPU cycle at which reading it may
+// return something else than reading it now, or 0 if the device cannot tell.
+typedef uint64_t (*poll_handler_t)(void* context, address_t addr);
 
 struct flag_t
 {
@@ -15,8 +33,6 @@ struct flag_t
     uint8_t bitshift;
 };
 
-struct instruction_t; // forward-declaration
-
 // Bitmasks for the 6502 microprocessor's status register.
 const flag_t FLAG_C_CARRY = {1 << 0, 0};
 const flag_t FLAG_Z_ZERO  = {1 << 1, 1};
@@ -27,6 +43,64 @@ const flag_t FLAG_s_UNUZ  = {1 << 5, 5};
 const flag_t FLAG_V_OVERF = {1 << 6, 6};
 const flag_t FLAG_N_NEGTV = {1 << 7, 7};
 
+// Snapshot of everything that defines the CPU's state. Fixed layout; part of savestate_t.
+struct cpu_state_t
+{
+    uint64_t cycles;
+    uint16_t PC;
+    uint8_t ACC;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t FLG;
+    uint8_t SP;
+    uint8_t halted;
+    uint16_t halt_address;
+    uint8_t halt_opcode;
+    uint8_t reserved[5];
+};
+
+// One instruction of read-only memory, decoded once (see MOS6502::step).
+struct decoded_instruction_t
+{
+    enum : uint8_t
+    {
+        PENDING, // Not decoded yet.
+        DECODED,
+        LIVE     // Runs over the end of its page; always decoded as it executes.
+    };
+
+    uint16_t operand;      // Operand bytes, lo-byte first.
+    uint8_t opcode;        // Index into the decoded dispatch table.
+    uint8_t cycles;        // Base cycles.
+    uint8_t length;        // In bytes, opcode included.
+    uint8_t state;
+};
+
+// Predecoded instructions of one page, valid for one mapping of it.
+struct decoded_page_t
+{
+    uint32_t generation;   // RAM::page_generation() the page was decoded under; 0 if never.
+    bool read_only;        // Only read-only pages are decoded; others always run live.
+    decoded_instruction_t instructions[constants::PAGE_SIZE];
+};
+
+// A loop that may spin without effect until an event (see MOS6502::skip_idle_loop).
+struct idle_loop_t
+{
+    uint16_t instructions[constants::IDLE_LOOP_MAX_INSTRUCTIONS]; // Addresses, head first.
+    unsigned int instruction_count;
+    address_t reads[constants::IDLE_LOOP_MAX_INSTRUCTIONS];       // Addresses read, fixed by operands.
+    unsigned int read_count;
+};
+
+// A loop head found not to be an idle loop, for the page generation it was looked at under.
+struct idle_reject_t
+{
+    uint32_t generation; // 0: empty slot.
+    uint16_t head;
+    uint8_t misses;      // IDLE_LOOP_MAX_MISSES once rejected.
+};
+
 class MOS6502
 {
 public: // TODO: FOR DEBUG REASONS, THIS IS INITIALLY PUBLIC. SET TO PRIVATE AFTER DEBUG
@@ -37,36 +111,117 @@ public: // TODO: FOR DEBUG REASONS, THIS IS INITIALLY PUBLIC. SET TO PRIVATE AFT
     RAM* NES_Ram;
 
     // CPU registers.
-    uint8_t ACC = 0; // Accumulator.
-    uint8_t X   = 0; // X-register.
-    uint8_t Y   = 0; // Y-register.
-    uint8_t FLG = 0; // Status flags, don't r/w to this directly, use set_flag/clear_flag/flip_flag
-    uint8_t PC  = 0; // Program counter.
-    uint8_t SP  = 0; // Stack pointer.
+    uint8_t  ACC = 0; // Accumulator.
+    uint8_t  X   = 0; // X-register.
+    uint8_t  Y   = 0; // Y-register.
+    uint8_t  FLG = 0; // Status flags, don't r/w to this directly, use set_flag/clear_flag/flip_flag
+    uint16_t PC  = 0; // Program counter.
+    uint8_t  SP  = 0; // Stack pointer.
+
+    // Total number of CPU cycles elapsed since power-on. This is the time base the rest of
+    // the system synchronises against.
+    uint64_t cycles = 0;
+
+    // Cycle at which the current run_until() call stops. Lowering it ends the run after the
+    // current instruction, without the run loop having to test anything else.
+    uint64_t run_target = 0;
+
+    // Level of the shared IRQ line, driven by the devices (APU frame counter, DMC, mappers).
+    // The CPU only samples it between run_until() calls; instructions that unmask interrupts
+    // while it is high end the run so the IRQ can be taken.
+    bool irq_line = false;
+
+    // Set when the CPU hits an opcode it cannot execute. A halted CPU executes nothing more
+    // until power_on(); the fields below describe what it tripped over.
+    bool halted = false;
+    uint16_t halt_address = 0x0000;
+    uint8_t halt_opcode = 0x00;
 
     // Other intermediate data.
-    uint8_t fetch_address = 0x0000;   // Where to fetch data (set by addressing mode function).
+    uint16_t fetch_address = 0x0000;   // Where to fetch data (set by addressing mode function).
 
-    uint8_t branch_relative = 0x0000; // A helper variable used for branching. The REL addressing mode
-                                      // writes to this variable; it is then used in branch instruction.
+    uint16_t branch_relative = 0x0000; // A helper variable used for branching. The REL addressing mode
+                                       // writes to this variable; it is then used in branch instruction.
 
     uint8_t last_read_opcode = 0x00;
 
     uint8_t fetched = 0b0000000; // Fetched data.
 
-    uint8_t clock_cycles_remaining = 0; // How many clock cycles are left to fake.
+    uint8_t instruction_cycles = 0; // Cycles taken by the instruction currently being executed.
+
+    // Where executed instructions are traced to. Only consulted when built with NESEMU_TRACE.
+    Tracer* tracer = nullptr;
+
+    // Counts executed instructions when set; see attach_profiler().
+    Profiler* profiler = nullptr;
+
+    // Consulted before every instruction when set; see attach_debugger().
+    Debugger* debugger = nullptr;
+
+    // Set by request_stop(). A stopped CPU executes nothing until clear_stop(); unlike
+    // `halted' this is not machine state, only a pause (a breakpoint was hit, ...).
+    bool stopped = false;
 
-    // Fetch function. Populates `fetched' using `fetch_address'.
-    void fetch_data();
+    // Idle loop skipping; see set_idle_skip(). Registers polled by idle loops are asked
+    // through `poll_handler' how long they keep their value.
+    bool idle_skip = false;
+    uint64_t idle_skipped_cycles = 0;
+    poll_handler_t poll_handler = nullptr;
+    void* poll_context = nullptr;
+    idle_reject_t idle_rejects[constants::IDLE_REJECT_CACHE_SIZE];
 
-    // Opcode table.
-    std::vector<instruction_t> lookup_table;
+    // Decodes the loop starting at `head' into `loop'. Returns false if it is not made of
+    // instructions that can idle (see is_idle_instruction in mos6502.cpp).
+    bool find_idle_loop(uint16_t head, idle_loop_t& loop) const;
+
+    // Queues a trace record for the instruction at PC.
+    void trace_instruction();
+
+    // Fetch function. Populates `fetched' using `fetch_address' and returns it.
+    uint8_t fetch_data();
+
+    // Called after an instruction may have cleared the I flag.
+    void interrupts_unmasked();
+
+    // Stack helpers. The 6502 stack lives in page one ($0100-$01FF).
+    void push_byte(uint8_t value);
+    uint8_t pop_byte();
+
+    // Opcode dispatch. Every opcode gets its own instantiation of execute<>, which fuses
+    // its addressing mode and its operation (both known at compile time from
+    // opcodes::OPCODE_TABLE) into a single function. step() makes one indirect call
+    // through `dispatch_table', or through `decoded_dispatch_table' for instructions taken
+    // from the predecode cache, whose handlers skip fetching the operand.
+    typedef uint8_t (*handler_t)(MOS6502& cpu);
+    typedef uint8_t (*decoded_handler_t)(MOS6502& cpu, uint16_t operand);
+
+    template <addr_mode_t MODE> uint8_t address(uint16_t operand);
+    template <operation_t OPERATION, addr_mode_t MODE> uint8_t operate();
+    template <uint8_t OPCODE> static uint8_t execute(MOS6502& cpu);
+    template <uint8_t OPCODE> static uint8_t execute_decoded(MOS6502& cpu, uint16_t operand);
+
+    template <std::size_t... OPCODES>
+    static std::array<handler_t, 256> build_dispatch_table(std::index_sequence<OPCODES...>);
+    template <std::size_t... OPCODES>
+    static std::array<decoded_handler_t, 256> build_decoded_dispatch_table(std::index_sequence<OPCODES...>);
+
+    static const std::array<handler_t, 256> dispatch_table;
+    static const std::array<decoded_handler_t, 256> decoded_dispatch_table;
+
+    // Predecode cache, by page. Pages are allocated the first time code runs in them, and
+    // redecoded lazily the first time code runs in them after they were remapped.
+    std::unique_ptr<decoded_page_t> decoded_pages[constants::PAGE_COUNT];
+
+    // The predecoded instruction at `addr', or nullptr if it has to be decoded live.
+    const decoded_instruction_t* predecoded(uint16_t addr);
+    decoded_page_t* refresh_page(unsigned int page);
+    const decoded_instruction_t* decode(uint16_t addr);
 
     // Opcode definitions. Thank you javidx9! These should return
     // 0 in most cases and return 1 when an additional clock cycle
     // is needed.
 
-    uint8_t ADC();	uint8_t AND();	uint8_t ASL();	uint8_t BCC();
+    uint8_t ADC();	uint8_t AND();	uint8_t BCC();
     uint8_t BCS();	uint8_t BEQ();	uint8_t BIT();	uint8_t BMI();
     uint8_t BNE();	uint8_t BPL();	uint8_t BRK();	uint8_t BVC();
     uint8_t BVS();	uint8_t CLC();	uint8_t CLD();	uint8_t CLI();
@@ -74,24 +229,41 @@ public: // TODO: FOR DEBUG REASONS, THIS IS INITIALLY PUBLIC. SET TO PRIVATE AFT
     uint8_t DEC();	uint8_t DEX();	uint8_t DEY();	uint8_t EOR();
     uint8_t INC();	uint8_t INX();	uint8_t INY();	uint8_t JMP();
     uint8_t JSR();	uint8_t LDA();	uint8_t LDX();	uint8_t LDY();
-    uint8_t LSR();	uint8_t NOP();	uint8_t ORA();	uint8_t PHA();
-    uint8_t PHP();	uint8_t PLA();	uint8_t PLP();	uint8_t ROL();
-    uint8_t ROR();	uint8_t RTI();	uint8_t RTS();	uint8_t SBC();
+    uint8_t NOP();	uint8_t ORA();	uint8_t PHA();	uint8_t PHP();
+    uint8_t PLA();	uint8_t PLP();	uint8_t RTI();	uint8_t RTS();
+    uint8_t SBC();
     uint8_t SEC();	uint8_t SED();	uint8_t SEI();	uint8_t STA();
     uint8_t STX();	uint8_t STY();	uint8_t TAX();	uint8_t TAY();
     uint8_t TSX();	uint8_t TXA();	uint8_t TXS();	uint8_t TYA();
 
-    uint8_t XXX(); // Functionally a nop
+    uint8_t XXX(); // Halts the CPU (see `halted')
+
+    // Shifts and rotates work either on the accumulator (implied mode) or on memory,
+    // so they are specialised on the addressing mode.
+    template <addr_mode_t MODE> uint8_t ASL();
+    template <addr_mode_t MODE> uint8_t LSR();
+    template <addr_mode_t MODE> uint8_t ROL();
+    template <addr_mode_t MODE> uint8_t ROR();
 
     // Addressing modes. Thank you javidx9! These functions return the
     // adjustment needed in the clock cycles (additional clock cycles
-    // that may be needed).
+    // that may be needed). `operand' holds the bytes after the opcode.
+
+    uint8_t IMP(uint16_t operand); uint8_t IMM(uint16_t operand); uint8_t ZP0(uint16_t operand);
+    uint8_t ZPX(uint16_t operand); uint8_t ZPY(uint16_t operand); uint8_t REL(uint16_t operand);
+    uint8_t ABS(uint16_t operand); uint8_t ABX(uint16_t operand); uint8_t ABY(uint16_t operand);
+    uint8_t IND(uint16_t operand); uint8_t IZX(uint16_t operand); uint8_t IZY(uint16_t operand);
 
-    uint8_t IMP(); uint8_t IMM(); uint8_t ZP0(); uint8_t ZPX();
-    uint8_t ZPY(); uint8_t REL(); uint8_t ABS(); uint8_t ABX();
-    uint8_t ABY(); uint8_t IND(); uint8_t IZX(); uint8_t IZY();
+    // Shared tail of every branch instruction: takes the branch computed by REL if `condition'
+    // holds, charging the extra cycle (and one more when the target is on another page).
+    void branch(bool condition);
 
-    uint8_t decode_signed_byte(uint8_t byte);
+    // Fetches the operand of a shift/rotate: the accumulator in implied mode, memory otherwise.
+    template <addr_mode_t MODE> uint8_t fetch_operand();
+
+    // Stores the result of a shift/rotate either back into the accumulator (implied mode)
+    // or into memory at `fetch_address'.
+    template <addr_mode_t MODE> void write_result(uint8_t value);
 public:
     explicit MOS6502(RAM* ram_ref);
     ~MOS6502();
@@ -99,6 +271,9 @@ public:
     // Sets a single flag (sets it to 1).
     void set_flag(flag_t flag);
 
+    // Sets a single flag to 1 if `value' is true, 0 otherwise.
+    void set_flag(flag_t flag, bool value);
+
     // Clears a single flag (sets it to 0).
     void clear_flag(flag_t flag);
 
@@ -114,27 +289,78 @@ public:
     // Print human-readable processor status.
     void whoami() const;
 
-    // Reset the processor.
+    // Reset the processor. PC is loaded from the reset vector at $FFFC.
     void reset();
 
-    // Run a single clock cycle.
-    void clock();
-};
+    // Take a non-maskable interrupt: push PC and the flags, then jump through the NMI
+    // vector at $FFFA. Called between instructions by whoever drives the CPU.
+    void nmi();
+
+    // Take an IRQ if interrupts are enabled: like nmi(), through the vector at $FFFE.
+    void irq();
+
+    // Put the processor in its power-up state (registers, cycle counter and halt state
+    // cleared), then run the reset sequence.
+    void power_on();
+
+    // Whether the CPU has stopped on an unimplemented opcode.
+    bool is_halted() const;
+
+    // Copy the CPU state out to / in from a snapshot.
+    void save_state(cpu_state_t& state) const;
+    void load_state(const cpu_state_t& state);
+
+    // Trace every instruction executed from now on into `trace_sink' (nullptr to stop).
+    // Has no effect unless built with NESEMU_TRACE.
+    void attach_tracer(Tracer* trace_sink);
+
+    // Count every instruction executed from now on into `profile_sink' (nullptr to stop).
+    // Unlike tracing this is always compiled in; without a profiler it costs one test of a
+    // pointer per instruction.
+    void attach_profiler(Profiler* profile_sink);
+
+    // Have `debugger' decide, before each instruction, whether to stop there (nullptr to
+    // detach). Without a debugger the CPU tests one pointer per instruction.
+    void attach_debugger(Debugger* instruction_debugger);
+
+    // Stop at the next instruction boundary: the current run ends once the instruction under
+    // way (if any) completes, and nothing more runs until clear_stop().
+    void request_stop();
+    void clear_stop();
+    bool is_stopped() const;
+
+    // Skip idle loops: loops that only read memory, or device registers whose value a
+    // poll handler can vouch for, until an interrupt or a register changes. Once an
+    // iteration is seen to leave the registers as they were, the following iterations
+    // would all be identical, so the cycle counter jumps over as many of them as end before
+    // the current run target (the next scheduled event) and the polled registers' next
+    // change. The machine state is exactly what executing them would have left. Off by
+    // default; tracing, profiling and debugging see every instruction regardless.
+    void set_idle_skip(bool enabled);
+
+    // Where to ask about device registers polled by idle loops (nullptr: only loops polling
+    // memory are skipped).
+    void set_poll_handler(poll_handler_t handler, void* context);
+
+    // Cycles skipped in idle loops since power-on.
+    uint64_t get_idle_skipped_cycles() const;
+
+    // Called by whoever runs instructions when PC has just jumped backwards to `PC': if a
+    // loop idles there, runs one iteration of it to check and skips the rest. Does nothing
+    // unless idle skipping is on.
+    void skip_idle_loop();
+
+    // Execute exactly one instruction. Returns the number of cycles it took (0 if halted).
+    uint8_t step();
+
+    // Execute whole instructions until at least `budget' cycles have elapsed. Returns the
+    // number of cycles actually executed, which may overshoot the budget by part of an
+    // instruction.
+    uint64_t run_cycles(uint64_t budget);
 
-/**
- * In the 6502, each instruction has an ADDRESSING MODE, an OPERATION, a BYTES value, and a CYCLES value.
- * In the INSTRUCTION LOOKUP TABLE, the relative position of each instruction_t struct is the actual opcode.
- * As such, there should be 256 values in the INSTRUCTION LOOKUP TABLE.
- *
- * The INSTRUCTION LOOKUP TABLE is populated when the CPU object is instantiated.
- *
- * Thank you javidx9 (OneLoneCoder) for the instruction lookup table (https://github.com/OneLoneCoder).
- */
-struct instruction_t {
-    std::string name;                               // Human-readable name of the instruction (mnemonic).
-    uint8_t (MOS6502::*operate)(void) = nullptr;    // Operation function for this instruction.
-    uint8_t (MOS6502::*addrmode)(void) = nullptr;   // Addressing mode function for this instruction.
-    uint8_t cycles = 0;                             // Number of clock cycles this instruction should 'fake'.
+    // Execute whole instructions until the cycle counter reaches `target_cycle' or the CPU
+    // halts. Returns the number of cycles executed.
+    uint64_t run_until(uint64_t target_cycle);
 };
 
 #endif //NESEMULATOR_MOS6502_HPP
@@ -0,0 +1,184 @@
+//
+// Input movies: recorded controller input, replayed deterministically.
+//
+
+#include "movie.hpp"
+#include <cstdio>
+#include <iostream>
+#include <utility>
+
+Movie::Movie() = default;
+
+Movie::~Movie() = default;
+
+bool Movie::begin(const NES& nes, uint32_t interval)
+{
+    runs.clear();
+    checkpoints.clear();
+    frame_count = 0;
+    checkpoint_interval = interval > 0 ? interval : 1;
+
+    if (!start)
+        start.reset(new savestate_t());
+
+    if (!nes.save_state(*start))
+    {
+        start.reset();
+        return false;
+    }
+
+    rom_hash = start->rom_hash;
+    return true;
+}
+
+void Movie::input_frame(NES& nes, uint8_t port0, uint8_t port1)
+{
+    if (runs.empty() || runs.back().frames == UINT16_MAX || runs.back().ports[0] != port0 ||
+        runs.back().ports[1] != port1)
+    {
+        runs.push_back(movie_run_t { 0, { port0, port1 } });
+    }
+
+    runs.back().frames++;
+    frame_count++;
+
+    nes.set_controller(0, port0);
+    nes.set_controller(1, port1);
+}
+
+void Movie::end_frame(const NES& nes)
+{
+    if (frame_count > 0 && frame_count % checkpoint_interval == 0 && checkpoints.size() < frame_count / checkpoint_interval)
+        checkpoints.push_back(nes.state_hash());
+}
+
+bool Movie::replay(NES& nes, movie_replay_result_t& result) const
+{
+    result = movie_replay_result_t();
+
+    if (!start || !nes.load_state(*start))
+        return false;
+
+    nes.set_output_enabled(false, false);
+    bool stopped = false;
+
+    for (std::size_t r = 0; r < runs.size() && !stopped; r++)
+    {
+        nes.set_controller(0, runs[r].ports[0]);
+        nes.set_controller(1, runs[r].ports[1]);
+
+        for (uint16_t i = 0; i < runs[r].frames && !stopped; i++)
+        {
+            nes.run_frames(1);
+            result.frames++;
+
+            const uint64_t checkpoint = result.frames / checkpoint_interval;
+            if (result.frames % checkpoint_interval == 0 && checkpoint <= checkpoints.size())
+            {
+                if (nes.state_hash() != checkpoints[checkpoint - 1])
+                    result.desync_frame = result.frames;
+                else
+                    result.checkpoints++;
+            }
+
+            stopped = result.desync_frame != 0 || nes.get_cpu().is_halted();
+        }
+    }
+
+    nes.set_output_enabled(true, true);
+    return true;
+}
+
+// ===========================
+// FILES
+// ===========================
+
+bool Movie::write_file(const std::string& path) const
+{
+    if (!start)
+        return false;
+
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        std::cout << "[Movie] ERROR! Could not open ``" << path << "'' for writing." << std::endl;
+        return false;
+    }
+
+    movie_header_t header = {};
+    header.magic = constants::MOVIE_MAGIC;
+    header.version = constants::MOVIE_VERSION;
+    header.rom_hash = rom_hash;
+    header.frame_count = frame_count;
+    header.run_count = (uint32_t)runs.size();
+    header.checkpoint_interval = checkpoint_interval;
+    header.checkpoint_count = (uint32_t)checkpoints.size();
+
+    bool written = std::fwrite(&header, sizeof(header), 1, file) == 1 && std::fwrite(start.get(), sizeof(*start), 1, file) == 1;
+    if (written && !runs.empty())
+        written = std::fwrite(runs.data(), sizeof(movie_run_t), runs.size(), file) == runs.size();
+    if (written && !checkpoints.empty())
+        written = std::fwrite(checkpoints.data(), sizeof(uint64_t), checkpoints.size(), file) == checkpoints.size();
+
+    return std::fclose(file) == 0 && written;
+}
+
+bool Movie::read_file(const std::string& path)
+{
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        std::cout << "[Movie] ERROR! Could not open ``" << path << "''." << std::endl;
+        return false;
+    }
+
+    // The file size must match what the header says, so a bad header can't make us allocate.
+    movie_header_t header = {};
+    std::fseek(file, 0, SEEK_END);
+    const long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+
+    bool valid = std::fread(&header, sizeof(header), 1, file) == 1 && header.magic == constants::MOVIE_MAGIC &&
+                 header.version == constants::MOVIE_VERSION && header.checkpoint_interval > 0 &&
+                 header.checkpoint_count == header.frame_count / header.checkpoint_interval &&
+                 (uint64_t)size == sizeof(header) + sizeof(savestate_t) + (uint64_t)header.run_count * sizeof(movie_run_t) +
+                                   (uint64_t)header.checkpoint_count * sizeof(uint64_t);
+
+    std::unique_ptr<savestate_t> snapshot(new savestate_t());
+    std::vector<movie_run_t> movie_runs(valid ? header.run_count : 0);
+    std::vector<uint64_t> movie_checkpoints(valid ? header.checkpoint_count : 0);
+
+    valid = valid && std::fread(snapshot.get(), sizeof(*snapshot), 1, file) == 1 &&
+            std::fread(movie_runs.data(), sizeof(movie_run_t), movie_runs.size(), file) == movie_runs.size() &&
+            std::fread(movie_checkpoints.data(), sizeof(uint64_t), movie_checkpoints.size(), file) == movie_checkpoints.size();
+    std::fclose(file);
+
+    uint64_t frames = 0;
+    for (const movie_run_t& run : movie_runs)
+        frames += run.frames;
+
+    if (!valid || frames != header.frame_count || snapshot->magic != constants::SAVESTATE_MAGIC ||
+        snapshot->version != constants::SAVESTATE_VERSION || snapshot->rom_hash != header.rom_hash)
+    {
+        std::cout << "[Movie] ERROR! ``" << path << "'' is not a valid movie of this version." << std::endl;
+        return false;
+    }
+
+    start = std::move(snapshot);
+    rom_hash = header.rom_hash;
+    frame_count = header.frame_count;
+    checkpoint_interval = header.checkpoint_interval;
+    runs = std::move(movie_runs);
+    checkpoints = std::move(movie_checkpoints);
+    return true;
+}
+
+uint64_t Movie::get_frame_count() const
+{
+    return frame_count;
+}
+
+uint64_t Movie::get_rom_hash() const
+{
+    return rom_hash;
+}
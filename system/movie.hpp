@@ -0,0 +1,127 @@
+//
+// Input movies: recorded controller input, replayed deterministically.
+//
+
+#ifndef NESEMULATOR_MOVIE_HPP
+#define NESEMULATOR_MOVIE_HPP
+
+#include "nes.hpp"
+#include "savestate.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace constants
+{
+    const uint32_t MOVIE_MAGIC = 0x4D53454E;          // "NESM", little-endian.
+    const uint32_t MOVIE_VERSION = 1;
+    const uint32_t MOVIE_CHECKPOINT_INTERVAL = 60;    // Frames between state hash checkpoints (1 s).
+} // namespace constants
+
+// File header. The body follows: the starting savestate_t, `run_count' movie_run_t and
+// `checkpoint_count' 64-bit state hashes. Like save states, host byte order.
+struct movie_header_t
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rom_hash;
+    uint64_t frame_count;
+    uint32_t run_count;
+    uint32_t checkpoint_interval;
+    uint32_t checkpoint_count;
+    uint32_t reserved;
+};
+
+// `frames' consecutive frames with the same buttons held on both controllers.
+struct movie_run_t
+{
+    uint16_t frames;
+    uint8_t ports[2];
+};
+
+struct movie_replay_result_t
+{
+    uint64_t frames = 0;          // Frames replayed.
+    uint64_t checkpoints = 0;     // Checkpoints that matched.
+    uint64_t desync_frame = 0;    // Frame after which the first mismatching checkpoint was taken (0 = none).
+};
+
+/**
+ * An input movie: a snapshot to start from, the controller input of every frame after it
+ * and, every `checkpoint_interval' frames, the hash of the machine state (NES::state_hash)
+ * at the end of that frame. Since the console is deterministic, loading the snapshot and
+ * feeding the same input reproduces the recording exactly; a checkpoint that doesn't match
+ * means the emulator has changed behaviour (a desync).
+ *
+ * Input is stored run-length coded: a run per change of buttons, so a movie costs a few
+ * bytes per second of play on top of the snapshot.
+ *
+ * Recording, around each frame the console runs:
+ *
+ *   movie.begin(nes);
+ *   ...
+ *   movie.input_frame(nes, port0, port1);
+ *   nes.run_frames(1);
+ *   movie.end_frame(nes);
+ */
+class Movie
+{
+private:
+    std::unique_ptr<savestate_t> start;
+    uint64_t rom_hash = 0;
+    uint64_t frame_count = 0;
+    uint32_t checkpoint_interval = constants::MOVIE_CHECKPOINT_INTERVAL;
+    std::vector<movie_run_t> runs;
+    std::vector<uint64_t> checkpoints;
+public:
+    Movie();
+    ~Movie();
+
+    Movie(const Movie&) = delete;
+    Movie& operator=(const Movie&) = delete;
+
+    /**
+     * Discards any previous content and starts a recording from the console's current state.
+     * Returns false if the state cannot be captured.
+     * @param nes
+     * @param checkpoint_interval
+     */
+    bool begin(const NES& nes, uint32_t checkpoint_interval = constants::MOVIE_CHECKPOINT_INTERVAL);
+
+    /**
+     * Records the buttons held during the next frame and sets them on the console.
+     * @param nes
+     * @param port0
+     * @param port1
+     */
+    void input_frame(NES& nes, uint8_t port0, uint8_t port1);
+
+    /**
+     * Call after each recorded frame has run; takes the checkpoints.
+     * @param nes
+     */
+    void end_frame(const NES& nes);
+
+    /**
+     * Loads the starting snapshot into `nes' (which must have the movie's ROM loaded) and
+     * replays every frame as fast as possible, with video and audio output off, checking
+     * each checkpoint. Stops at the first desync, or if the CPU halts. Output is switched back
+     * on afterwards. Returns false if the snapshot could not be loaded.
+     * @param nes
+     * @param result
+     */
+    bool replay(NES& nes, movie_replay_result_t& result) const;
+
+    /**
+     * Returns false if the file could not be written, or read back as a valid movie.
+     * @param path
+     */
+    bool write_file(const std::string& path) const;
+    bool read_file(const std::string& path);
+
+    uint64_t get_frame_count() const;
+    uint64_t get_rom_hash() const;
+};
+
+#endif //NESEMULATOR_MOVIE_HPP
@@ -0,0 +1,394 @@
+//
+// The console: CPU, address space and cartridge wired together.
+//
+
+#include "nes.hpp"
+#include "hash.hpp"
+#include <memory>
+#include <vector>
+
+NES::NES() : cpu(&ram), ppu(&cpu, &ram), apu(&cpu, &ram), scheduler(&cpu)
+{
+    map_devices();
+    cartridge.connect_irq(cpu);
+    cpu.set_poll_handler(&NES::poll_register, this);
+}
+
+NES::~NES() = default;
+
+void NES::map_devices()
+{
+    ram.map_nes_layout();
+    ppu.map_into(ram);
+    ram.map_handlers(0x4000, 0x40FF, &NES::read_io, &NES::write_io, nullptr, this);
+}
+
+uint8_t NES::read_io(void* context, address_t addr)
+{
+    NES& nes = *static_cast<NES*>(context);
+
+    addr &= 0xFFFF;
+
+    if (addr == 0x4015)
+    {
+        // Acknowledging the frame IRQ lets the next one be scheduled.
+        const uint8_t value = nes.apu.read(addr);
+        nes.schedule_apu_events();
+        return value;
+    }
+
+    // Controllers drive bit 0; the upper bits are open bus, normally the $40 of the address.
+    if (addr == 0x4016 || addr == 0x4017)
+        return 0x40 | nes.controllers[addr - 0x4016].read();
+
+    // Nothing else readable here yet: open bus.
+    return 0x00;
+}
+
+void NES::write_io(void* context, address_t addr, uint8_t value)
+{
+    NES& nes = *static_cast<NES*>(context);
+
+    addr &= 0xFFFF;
+
+    if (addr == 0x4014)
+    {
+        nes.ppu.oam_dma(value);
+    }
+    else if (addr == 0x4016)
+    {
+        nes.controllers[0].write_strobe(value);
+        nes.controllers[1].write_strobe(value);
+    }
+    else if (addr <= 0x4017)
+    {
+        nes.apu.write(addr, value);
+        nes.schedule_apu_events();
+    }
+}
+
+uint64_t NES::poll_register(void* context, address_t addr)
+{
+    NES& nes = *static_cast<NES*>(context);
+
+    addr &= 0xFFFF;
+
+    if (addr >= 0x2000 && addr <= 0x3FFF && (addr & 7) == 2)
+    {
+        nes.ppu.catch_up();
+        return nes.ppu.next_status_change_cycle();
+    }
+
+    return 0;
+}
+
+bool NES::load_rom(const std::string& path)
+{
+    map_devices();
+    fork_origin.reset();
+
+    if (!cartridge.load_file(path))
+        return false;
+
+    insert_cartridge();
+    return true;
+}
+
+bool NES::load_rom(const uint8_t* data, std::size_t size)
+{
+    map_devices();
+    fork_origin.reset();
+
+    if (!cartridge.load_memory(data, size))
+        return false;
+
+    insert_cartridge();
+    return true;
+}
+
+void NES::insert_cartridge()
+{
+    cartridge.map_into(ram);
+    cartridge.map_into(ppu);
+    power_on();
+}
+
+void NES::power_on()
+{
+    ram.clear_address_space();
+    ppu.power_on();
+    apu.power_on();
+    controllers[0].power_on();
+    controllers[1].power_on();
+    cartridge.power_on();
+    cpu.power_on();
+}
+
+void NES::set_controller(unsigned int port, uint8_t held)
+{
+    controllers[port & 1].set_buttons(held);
+}
+
+void NES::set_idle_skip_enabled(bool enabled)
+{
+    cpu.set_idle_skip(enabled);
+}
+
+void NES::set_output_enabled(bool video, bool audio)
+{
+    ppu.set_video_output(video);
+    apu.set_audio_output(audio);
+}
+
+bool NES::set_jit_enabled(bool enabled)
+{
+    if (!enabled || !JIT::is_supported())
+    {
+        jit.reset();
+        return false;
+    }
+
+    if (!jit)
+        jit.reset(new JIT(&cpu, &ram));
+
+    return true;
+}
+
+void NES::run_cpu_until(uint64_t target_cycle)
+{
+    if (jit)
+        jit->run_until(target_cycle);
+    else
+        cpu.run_until(target_cycle);
+}
+
+void NES::schedule_events()
+{
+    scheduler.schedule(event_t::VBLANK, ppu.next_vblank_cycle());
+    scheduler.schedule(event_t::MAPPER_IRQ, cartridge.next_irq_cycle());
+    schedule_apu_events();
+}
+
+void NES::schedule_apu_events()
+{
+    scheduler.schedule(event_t::APU_IRQ, apu.next_irq_cycle());
+    scheduler.schedule(event_t::DMC_FETCH, apu.next_dmc_fetch_cycle());
+}
+
+void NES::handle_event(event_t event)
+{
+    switch (event)
+    {
+        // The scanline counter is clocked as the PPU renders.
+        case event_t::VBLANK:
+        case event_t::MAPPER_IRQ:
+            ppu.catch_up();
+            break;
+
+        // A DMC fetch adds its stall to the CPU's cycles here, right after the instruction
+        // it interrupted.
+        case event_t::APU_IRQ:
+        case event_t::DMC_FETCH:
+            apu.catch_up();
+            break;
+
+        default:
+            break;
+    }
+}
+
+uint64_t NES::run_frames(uint64_t count)
+{
+    // The CPU runs uninterrupted until the earliest scheduled event: vertical blank, an APU
+    // or cartridge IRQ, or a DMC fetch. Only the devices whose events are due are brought up
+    // to date there; register accesses in between do that on their own. A device can also
+    // cut the run short to deliver an interrupt (e.g. NMIs were enabled during vertical
+    // blank, or interrupts were unmasked with the IRQ line held), having just caught up.
+    // OAM DMA needs no event: the CPU is stalled by the write that starts it.
+    const uint64_t start_cycle = cpu.cycles;
+    const uint64_t target_frame = ppu.get_frame() + count;
+
+    while (ppu.get_frame() < target_frame && !cpu.is_halted() && !cpu.is_stopped())
+    {
+        schedule_events();
+        run_cpu_until(scheduler.next_cycle());
+
+        // Stopped by a debugger: interrupts due now are delivered when the run resumes, so
+        // the CPU stays exactly where it stopped.
+        if (cpu.is_stopped())
+            break;
+
+        event_t event;
+        while (scheduler.take_due(event))
+            handle_event(event);
+
+        if (ppu.take_nmi())
+            cpu.nmi();
+
+        cpu.irq_line = apu.irq_asserted() || cartridge.irq_asserted();
+        if (cpu.irq_line)
+            cpu.irq();
+    }
+
+    apu.catch_up();
+
+    return cpu.cycles - start_cycle;
+}
+
+bool NES::save_state(savestate_t& state) const
+{
+    state.magic = constants::SAVESTATE_MAGIC;
+    state.version = constants::SAVESTATE_VERSION;
+    state.rom_hash = cartridge.get_content_hash();
+
+    cpu.save_state(state.cpu);
+    ram.snapshot_into(state.memory);
+    ppu.save_state(state.ppu);
+    apu.save_state(state.apu);
+    controllers[0].save_state(state.controllers[0]);
+    controllers[1].save_state(state.controllers[1]);
+
+    return cartridge.save_state(state.cartridge);
+}
+
+bool NES::load_state(const savestate_t& state)
+{
+    if (state.magic != constants::SAVESTATE_MAGIC || state.version != constants::SAVESTATE_VERSION ||
+        state.rom_hash != cartridge.get_content_hash())
+        return false;
+
+    if (!cartridge.load_state(state.cartridge))
+        return false;
+
+    cpu.load_state(state.cpu);
+    ram.restore_from(state.memory);
+    ppu.load_state(state.ppu);
+    apu.load_state(state.apu);
+    controllers[0].load_state(state.controllers[0]);
+    controllers[1].load_state(state.controllers[1]);
+    cpu.irq_line = apu.irq_asserted() || cartridge.irq_asserted();
+
+    return true;
+}
+
+std::shared_ptr<const fork_point_t> NES::make_fork_point() const
+{
+    if (!cartridge.get_image())
+        return nullptr;
+
+    std::shared_ptr<fork_point_t> point = std::make_shared<fork_point_t>();
+    point->image = cartridge.get_image();
+
+    if (!save_state(point->state))
+        return nullptr;
+
+    return point;
+}
+
+bool NES::fork(const std::shared_ptr<const fork_point_t>& point)
+{
+    if (!point)
+        return false;
+
+    // Another ROM (or none): take the point's image, as load_rom would the file.
+    if (cartridge.get_image() != point->image)
+    {
+        map_devices();
+        fork_origin.reset();
+
+        if (!cartridge.load_image(point->image))
+            return false;
+
+        insert_cartridge();
+    }
+
+    const savestate_t& state = point->state;
+
+    if (fork_origin != point || ram.get_dirty_epoch() != fork_epoch)
+    {
+        if (!load_state(state))
+            return false;
+    }
+    else
+    {
+        // Everything RAM hasn't seen written still matches the point. PRG-RAM writes are
+        // counted under the untracked chunk; the PPU keeps track of CHR-RAM.
+        const bool prg_ram_written = ram.is_chunk_dirty(RAM::UNTRACKED_CHUNK);
+        const bool chr_ram_written = ppu.take_chr_ram_written();
+
+        if (!cartridge.load_state(state.cartridge, prg_ram_written, chr_ram_written))
+            return false;
+
+        cpu.load_state(state.cpu);
+        ram.restore_dirty_from(state.memory);
+        ppu.load_state(state.ppu, chr_ram_written);
+        apu.load_state(state.apu);
+        controllers[0].load_state(state.controllers[0]);
+        controllers[1].load_state(state.controllers[1]);
+        cpu.irq_line = apu.irq_asserted() || cartridge.irq_asserted();
+    }
+
+    ram.clear_dirty();
+    ppu.take_chr_ram_written();
+    fork_origin = point;
+    fork_epoch = ram.get_dirty_epoch();
+
+    return true;
+}
+
+uint64_t NES::state_hash() const
+{
+    uint8_t registers[] = { cpu.ACC, cpu.X, cpu.Y, cpu.FLG, cpu.SP,
+                            (uint8_t)(cpu.PC & 0xFF), (uint8_t)(cpu.PC >> 8), (uint8_t)cpu.halted };
+
+    uint64_t hash = hashing::fnv1a_64(registers, sizeof(registers));
+    hash = hashing::fnv1a_64(&cpu.cycles, sizeof(cpu.cycles), hash);
+
+    std::vector<uint8_t> memory(constants::RAM_SNAPSHOT_SIZE);
+    ram.snapshot_into(memory.data());
+    hash = hashing::fnv1a_64(memory.data(), memory.size(), hash);
+
+    std::unique_ptr<ppu_state_t> video(new ppu_state_t());
+    ppu.save_state(*video);
+    hash = hashing::fnv1a_64(video.get(), sizeof(ppu_state_t), hash);
+
+    apu_state_t audio;
+    apu.save_state(audio);
+    hash = hashing::fnv1a_64(&audio, sizeof(audio), hash);
+
+    controller_state_t ports[2];
+    controllers[0].save_state(ports[0]);
+    controllers[1].save_state(ports[1]);
+    hash = hashing::fnv1a_64(ports, sizeof(ports), hash);
+
+    mapper_state_t board;
+    cartridge.save_mapper_state(board);
+    hash = hashing::fnv1a_64(&board, sizeof(board), hash);
+
+    return hashing::fnv1a_64(cartridge.get_prg_ram(), cartridge.get_prg_ram_size(), hash);
+}
+
+MOS6502& NES::get_cpu()
+{
+    return cpu;
+}
+
+RAM& NES::get_ram()
+{
+    return ram;
+}
+
+PPU& NES::get_ppu()
+{
+    return ppu;
+}
+
+APU& NES::get_apu()
+{
+    return apu;
+}
+
+Cartridge& NES::get_cartridge()
+{
+    return cartridge;
+}
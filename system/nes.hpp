@@ -0,0 +1,192 @@
+//
+// The console: CPU, address space and cartridge wired together.
+//
+
+#ifndef NESEMULATOR_NES_HPP
+#define NESEMULATOR_NES_HPP
+
+#include "apu.hpp"
+#include "cartridge.hpp"
+#include "controller.hpp"
+#include "jit.hpp"
+#include "mos6502.hpp"
+#include "ppu.hpp"
+#include "ram.hpp"
+#include "savestate.hpp"
+#include "scheduler.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * A frozen machine state that consoles fork from (see NES::fork). Immutable once made, so
+ * any number of consoles, on any threads, can share one by reference. Holds the ROM image
+ * too, so a console can fork from it without loading anything.
+ */
+struct fork_point_t
+{
+    std::shared_ptr<const rom_image_t> image;
+    savestate_t state;
+};
+
+/**
+ * One emulated console. Everything an instance needs lives in this object, so any number of
+ * them can run side by side on different threads. An instance can be reused for another ROM
+ * by calling load_rom() again.
+ */
+class NES
+{
+private:
+    RAM ram;
+    MOS6502 cpu;
+    PPU ppu;
+    APU apu;
+    Cartridge cartridge;
+    Controller controllers[2];
+
+    // When the CPU next has to stop for a device (see run_frames).
+    Scheduler scheduler;
+
+    // Recompiler tier; null when running on the interpreter alone.
+    std::unique_ptr<JIT> jit;
+
+    // The point this console last forked from, and RAM's dirty epoch as it left it. While
+    // both still hold, only what was written since differs from the point.
+    std::shared_ptr<const fork_point_t> fork_origin;
+    uint64_t fork_epoch = 0;
+
+    // $4000-$40FF: APU and I/O registers, OAM DMA, controller ports.
+    static uint8_t read_io(void* context, address_t addr);
+    static void write_io(void* context, address_t addr, uint8_t value);
+
+    // How long a device register polled by an idle loop keeps its value (see
+    // MOS6502::set_poll_handler). Only PPUSTATUS can tell.
+    static uint64_t poll_register(void* context, address_t addr);
+
+    void map_devices();
+    void run_cpu_until(uint64_t target_cycle);
+
+    // Refreshes the scheduler's events from the devices' next timestamps.
+    void schedule_events();
+    void schedule_apu_events();
+
+    // Brings the device behind a due event up to the CPU.
+    void handle_event(event_t event);
+
+    // Maps the freshly loaded cartridge and powers on.
+    void insert_cartridge();
+public:
+    NES();
+    ~NES();
+
+    NES(const NES&) = delete;
+    NES& operator=(const NES&) = delete;
+
+    /**
+     * Loads an iNES image, maps it and powers the console on. Any previous state is
+     * discarded. Returns false (leaving the console without a cartridge) on failure.
+     * @param path
+     */
+    bool load_rom(const std::string& path);
+
+    /**
+     * Same as above, for an image held in memory (see Cartridge::load_memory).
+     * @param data
+     * @param size
+     */
+    bool load_rom(const uint8_t* data, std::size_t size);
+
+    /**
+     * Clears memory and puts the CPU in its power-up state.
+     */
+    void power_on();
+
+    /**
+     * Freezes the current state into a point other consoles (this one included) can fork
+     * from. Costs one save state. Returns null if no ROM is loaded or the state does not fit
+     * in a save state.
+     */
+    std::shared_ptr<const fork_point_t> make_fork_point() const;
+
+    /**
+     * Puts this console in the state of `point', sharing its ROM image (loaded first if this
+     * console runs another ROM or none). Forking again from the point this console last
+     * forked from only copies back the memory pages, PRG-RAM and CHR-RAM written since, plus
+     * the devices' registers, so a search that branches from one root over and over costs
+     * what each branch dirtied, not a full state load. Returns false if `point' is null.
+     * @param point
+     */
+    bool fork(const std::shared_ptr<const fork_point_t>& point);
+
+    /**
+     * Switches the recompiler tier on or off. Machine state is identical either way; only
+     * speed differs. Returns whether compiled code will actually run (false if the host is
+     * not supported).
+     * @param enabled
+     */
+    bool set_jit_enabled(bool enabled);
+
+    /**
+     * Switches idle loop skipping on or off (see MOS6502::set_idle_skip). Machine state is
+     * identical either way; loops that wait for vertical blank or an interrupt just cost
+     * next to nothing. Takes effect from the next run.
+     * @param enabled
+     */
+    void set_idle_skip_enabled(bool enabled);
+
+    /**
+     * Sets the buttons held on a controller (see the `buttons' namespace) from now on.
+     * @param port 0 for $4016, 1 for $4017
+     * @param held
+     */
+    void set_controller(unsigned int port, uint8_t held);
+
+    /**
+     * Switches the picture and the sound on or off. Switched off, the PPU only works out what
+     * the CPU can see (sprite 0 hits, sprite overflow) and the APU only what affects the
+     * machine (length counters, IRQs, DMC fetches), so frames run much faster; the machine
+     * state is the same either way.
+     * @param video
+     * @param audio
+     */
+    void set_output_enabled(bool video, bool audio);
+
+    /**
+     * Runs until the PPU has completed `count' more frames (each ends when vertical blank
+     * begins), delivering NMIs and IRQs on the way. The CPU runs uninterrupted from one
+     * scheduled device event to the next (see Scheduler). Stops early if the CPU halts or is stopped
+     * (see MOS6502::request_stop). Returns the number of cycles executed.
+     * @param count
+     */
+    uint64_t run_frames(uint64_t count);
+
+    /**
+     * Captures the whole machine state into `state'. Only memcpys; nothing is allocated.
+     * Returns false if the cartridge has more RAM than a snapshot can hold.
+     * @param state
+     */
+    bool save_state(savestate_t& state) const;
+
+    /**
+     * Restores a snapshot taken with save_state. The same ROM must be loaded; returns false
+     * (leaving the console untouched) if the snapshot is for another ROM or version.
+     * @param state
+     */
+    bool load_state(const savestate_t& state);
+
+    /**
+     * Hash of the whole machine state (CPU registers, cycle counter, memory, PPU, APU,
+     * controllers and mapper registers). Two instances that ran the same ROM identically
+     * have the same hash.
+     */
+    uint64_t state_hash() const;
+
+    MOS6502& get_cpu();
+    RAM& get_ram();
+    PPU& get_ppu();
+    APU& get_apu();
+    Cartridge& get_cartridge();
+};
+
+#endif //NESEMULATOR_NES_HPP
@@ -0,0 +1,101 @@
+//
+// Static opcode tables for the 6502 core.
+//
+
+#ifndef NESEMULATOR_OPCODES_HPP
+#define NESEMULATOR_OPCODES_HPP
+
+#include <cstdint>
+
+// Addressing modes of the 6502.
+enum class addr_mode_t : uint8_t
+{
+    IMP, IMM, ZP0, ZPX, ZPY, REL, ABS, ABX, ABY, IND, IZX, IZY
+};
+
+// Operations of the 6502. XXX stands for every opcode that is not implemented.
+enum class operation_t : uint8_t
+{
+    ADC, AND, ASL, BCC, BCS, BEQ, BIT, BMI,
+    BNE, BPL, BRK, BVC, BVS, CLC, CLD, CLI,
+    CLV, CMP, CPX, CPY, DEC, DEX, DEY, EOR,
+    INC, INX, INY, JMP, JSR, LDA, LDX, LDY,
+    LSR, NOP, ORA, PHA, PHP, PLA, PLP, ROL,
+    ROR, RTI, RTS, SBC, SEC, SED, SEI, STA,
+    STX, STY, TAX, TAY, TSX, TXA, TXS, TYA,
+    XXX,
+};
+
+/**
+ * In the 6502, each instruction has an ADDRESSING MODE, an OPERATION, a BYTES value, and a CYCLES value.
+ * In the OPCODE TABLE, the relative position of each opcode_info_t struct is the actual opcode.
+ * As such, there are 256 values in the OPCODE TABLE.
+ *
+ * The OPCODE TABLE is a compile-time constant: the CPU instantiates one fused handler per opcode
+ * from it (see MOS6502::execute), so nothing is built when a CPU object is created.
+ *
+ * Thank you javidx9 (OneLoneCoder) for the instruction lookup table (https://github.com/OneLoneCoder).
+ */
+struct opcode_info_t
+{
+    operation_t operation; // Operation performed by this opcode.
+    addr_mode_t addrmode;  // Addressing mode used by this opcode.
+    uint8_t cycles;        // Base number of clock cycles this opcode takes.
+};
+
+namespace opcodes
+{
+    using O = operation_t;
+    using M = addr_mode_t;
+
+    constexpr opcode_info_t OPCODE_TABLE[256] =
+    {
+        { O::BRK, M::IMM, 7 },{ O::ORA, M::IZX, 6 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::NOP, M::IMP, 3 },{ O::ORA, M::ZP0, 3 },{ O::ASL, M::ZP0, 5 },{ O::XXX, M::IMP, 5 },{ O::PHP, M::IMP, 3 },{ O::ORA, M::IMM, 2 },{ O::ASL, M::IMP, 2 },{ O::XXX, M::IMP, 2 },{ O::NOP, M::IMP, 4 },{ O::ORA, M::ABS, 4 },{ O::ASL, M::ABS, 6 },{ O::XXX, M::IMP, 6 },
+        { O::BPL, M::REL, 2 },{ O::ORA, M::IZY, 5 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::NOP, M::IMP, 4 },{ O::ORA, M::ZPX, 4 },{ O::ASL, M::ZPX, 6 },{ O::XXX, M::IMP, 6 },{ O::CLC, M::IMP, 2 },{ O::ORA, M::ABY, 4 },{ O::NOP, M::IMP, 2 },{ O::XXX, M::IMP, 7 },{ O::NOP, M::IMP, 4 },{ O::ORA, M::ABX, 4 },{ O::ASL, M::ABX, 7 },{ O::XXX, M::IMP, 7 },
+        { O::JSR, M::ABS, 6 },{ O::AND, M::IZX, 6 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::BIT, M::ZP0, 3 },{ O::AND, M::ZP0, 3 },{ O::ROL, M::ZP0, 5 },{ O::XXX, M::IMP, 5 },{ O::PLP, M::IMP, 4 },{ O::AND, M::IMM, 2 },{ O::ROL, M::IMP, 2 },{ O::XXX, M::IMP, 2 },{ O::BIT, M::ABS, 4 },{ O::AND, M::ABS, 4 },{ O::ROL, M::ABS, 6 },{ O::XXX, M::IMP, 6 },
+        { O::BMI, M::REL, 2 },{ O::AND, M::IZY, 5 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::NOP, M::IMP, 4 },{ O::AND, M::ZPX, 4 },{ O::ROL, M::ZPX, 6 },{ O::XXX, M::IMP, 6 },{ O::SEC, M::IMP, 2 },{ O::AND, M::ABY, 4 },{ O::NOP, M::IMP, 2 },{ O::XXX, M::IMP, 7 },{ O::NOP, M::IMP, 4 },{ O::AND, M::ABX, 4 },{ O::ROL, M::ABX, 7 },{ O::XXX, M::IMP, 7 },
+        { O::RTI, M::IMP, 6 },{ O::EOR, M::IZX, 6 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::NOP, M::IMP, 3 },{ O::EOR, M::ZP0, 3 },{ O::LSR, M::ZP0, 5 },{ O::XXX, M::IMP, 5 },{ O::PHA, M::IMP, 3 },{ O::EOR, M::IMM, 2 },{ O::LSR, M::IMP, 2 },{ O::XXX, M::IMP, 2 },{ O::JMP, M::ABS, 3 },{ O::EOR, M::ABS, 4 },{ O::LSR, M::ABS, 6 },{ O::XXX, M::IMP, 6 },
+        { O::BVC, M::REL, 2 },{ O::EOR, M::IZY, 5 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::NOP, M::IMP, 4 },{ O::EOR, M::ZPX, 4 },{ O::LSR, M::ZPX, 6 },{ O::XXX, M::IMP, 6 },{ O::CLI, M::IMP, 2 },{ O::EOR, M::ABY, 4 },{ O::NOP, M::IMP, 2 },{ O::XXX, M::IMP, 7 },{ O::NOP, M::IMP, 4 },{ O::EOR, M::ABX, 4 },{ O::LSR, M::ABX, 7 },{ O::XXX, M::IMP, 7 },
+        { O::RTS, M::IMP, 6 },{ O::ADC, M::IZX, 6 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::NOP, M::IMP, 3 },{ O::ADC, M::ZP0, 3 },{ O::ROR, M::ZP0, 5 },{ O::XXX, M::IMP, 5 },{ O::PLA, M::IMP, 4 },{ O::ADC, M::IMM, 2 },{ O::ROR, M::IMP, 2 },{ O::XXX, M::IMP, 2 },{ O::JMP, M::IND, 5 },{ O::ADC, M::ABS, 4 },{ O::ROR, M::ABS, 6 },{ O::XXX, M::IMP, 6 },
+        { O::BVS, M::REL, 2 },{ O::ADC, M::IZY, 5 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::NOP, M::IMP, 4 },{ O::ADC, M::ZPX, 4 },{ O::ROR, M::ZPX, 6 },{ O::XXX, M::IMP, 6 },{ O::SEI, M::IMP, 2 },{ O::ADC, M::ABY, 4 },{ O::NOP, M::IMP, 2 },{ O::XXX, M::IMP, 7 },{ O::NOP, M::IMP, 4 },{ O::ADC, M::ABX, 4 },{ O::ROR, M::ABX, 7 },{ O::XXX, M::IMP, 7 },
+        { O::NOP, M::IMP, 2 },{ O::STA, M::IZX, 6 },{ O::NOP, M::IMP, 2 },{ O::XXX, M::IMP, 6 },{ O::STY, M::ZP0, 3 },{ O::STA, M::ZP0, 3 },{ O::STX, M::ZP0, 3 },{ O::XXX, M::IMP, 3 },{ O::DEY, M::IMP, 2 },{ O::NOP, M::IMP, 2 },{ O::TXA, M::IMP, 2 },{ O::XXX, M::IMP, 2 },{ O::STY, M::ABS, 4 },{ O::STA, M::ABS, 4 },{ O::STX, M::ABS, 4 },{ O::XXX, M::IMP, 4 },
+        { O::BCC, M::REL, 2 },{ O::STA, M::IZY, 6 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 6 },{ O::STY, M::ZPX, 4 },{ O::STA, M::ZPX, 4 },{ O::STX, M::ZPY, 4 },{ O::XXX, M::IMP, 4 },{ O::TYA, M::IMP, 2 },{ O::STA, M::ABY, 5 },{ O::TXS, M::IMP, 2 },{ O::XXX, M::IMP, 5 },{ O::NOP, M::IMP, 5 },{ O::STA, M::ABX, 5 },{ O::XXX, M::IMP, 5 },{ O::XXX, M::IMP, 5 },
+        { O::LDY, M::IMM, 2 },{ O::LDA, M::IZX, 6 },{ O::LDX, M::IMM, 2 },{ O::XXX, M::IMP, 6 },{ O::LDY, M::ZP0, 3 },{ O::LDA, M::ZP0, 3 },{ O::LDX, M::ZP0, 3 },{ O::XXX, M::IMP, 3 },{ O::TAY, M::IMP, 2 },{ O::LDA, M::IMM, 2 },{ O::TAX, M::IMP, 2 },{ O::XXX, M::IMP, 2 },{ O::LDY, M::ABS, 4 },{ O::LDA, M::ABS, 4 },{ O::LDX, M::ABS, 4 },{ O::XXX, M::IMP, 4 },
+        { O::BCS, M::REL, 2 },{ O::LDA, M::IZY, 5 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 5 },{ O::LDY, M::ZPX, 4 },{ O::LDA, M::ZPX, 4 },{ O::LDX, M::ZPY, 4 },{ O::XXX, M::IMP, 4 },{ O::CLV, M::IMP, 2 },{ O::LDA, M::ABY, 4 },{ O::TSX, M::IMP, 2 },{ O::XXX, M::IMP, 4 },{ O::LDY, M::ABX, 4 },{ O::LDA, M::ABX, 4 },{ O::LDX, M::ABY, 4 },{ O::XXX, M::IMP, 4 },
+        { O::CPY, M::IMM, 2 },{ O::CMP, M::IZX, 6 },{ O::NOP, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::CPY, M::ZP0, 3 },{ O::CMP, M::ZP0, 3 },{ O::DEC, M::ZP0, 5 },{ O::XXX, M::IMP, 5 },{ O::INY, M::IMP, 2 },{ O::CMP, M::IMM, 2 },{ O::DEX, M::IMP, 2 },{ O::XXX, M::IMP, 2 },{ O::CPY, M::ABS, 4 },{ O::CMP, M::ABS, 4 },{ O::DEC, M::ABS, 6 },{ O::XXX, M::IMP, 6 },
+        { O::BNE, M::REL, 2 },{ O::CMP, M::IZY, 5 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::NOP, M::IMP, 4 },{ O::CMP, M::ZPX, 4 },{ O::DEC, M::ZPX, 6 },{ O::XXX, M::IMP, 6 },{ O::CLD, M::IMP, 2 },{ O::CMP, M::ABY, 4 },{ O::NOP, M::IMP, 2 },{ O::XXX, M::IMP, 7 },{ O::NOP, M::IMP, 4 },{ O::CMP, M::ABX, 4 },{ O::DEC, M::ABX, 7 },{ O::XXX, M::IMP, 7 },
+        { O::CPX, M::IMM, 2 },{ O::SBC, M::IZX, 6 },{ O::NOP, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::CPX, M::ZP0, 3 },{ O::SBC, M::ZP0, 3 },{ O::INC, M::ZP0, 5 },{ O::XXX, M::IMP, 5 },{ O::INX, M::IMP, 2 },{ O::SBC, M::IMM, 2 },{ O::NOP, M::IMP, 2 },{ O::SBC, M::IMM, 2 },{ O::CPX, M::ABS, 4 },{ O::SBC, M::ABS, 4 },{ O::INC, M::ABS, 6 },{ O::XXX, M::IMP, 6 },
+        { O::BEQ, M::REL, 2 },{ O::SBC, M::IZY, 5 },{ O::XXX, M::IMP, 2 },{ O::XXX, M::IMP, 8 },{ O::NOP, M::IMP, 4 },{ O::SBC, M::ZPX, 4 },{ O::INC, M::ZPX, 6 },{ O::XXX, M::IMP, 6 },{ O::SED, M::IMP, 2 },{ O::SBC, M::ABY, 4 },{ O::NOP, M::IMP, 2 },{ O::XXX, M::IMP, 7 },{ O::NOP, M::IMP, 4 },{ O::SBC, M::ABX, 4 },{ O::INC, M::ABX, 7 },{ O::XXX, M::IMP, 7 },
+    };
+
+    // Human-readable mnemonics, indexed by opcode. Only used for debugging output.
+    constexpr const char* OPCODE_NAMES[256] =
+    {
+        "BRK", "ORA", "???", "???", "???", "ORA", "ASL", "???", "PHP", "ORA", "ASL", "???", "???", "ORA", "ASL", "???",
+        "BPL", "ORA", "???", "???", "???", "ORA", "ASL", "???", "CLC", "ORA", "???", "???", "???", "ORA", "ASL", "???",
+        "JSR", "AND", "???", "???", "BIT", "AND", "ROL", "???", "PLP", "AND", "ROL", "???", "BIT", "AND", "ROL", "???",
+        "BMI", "AND", "???", "???", "???", "AND", "ROL", "???", "SEC", "AND", "???", "???", "???", "AND", "ROL", "???",
+        "RTI", "EOR", "???", "???", "???", "EOR", "LSR", "???", "PHA", "EOR", "LSR", "???", "JMP", "EOR", "LSR", "???",
+        "BVC", "EOR", "???", "???", "???", "EOR", "LSR", "???", "CLI", "EOR", "???", "???", "???", "EOR", "LSR", "???",
+        "RTS", "ADC", "???", "???", "???", "ADC", "ROR", "???", "PLA", "ADC", "ROR", "???", "JMP", "ADC", "ROR", "???",
+        "BVS", "ADC", "???", "???", "???", "ADC", "ROR", "???", "SEI", "ADC", "???", "???", "???", "ADC", "ROR", "???",
+        "???", "STA", "???", "???", "STY", "STA", "STX", "???", "DEY", "???", "TXA", "???", "STY", "STA", "STX", "???",
+        "BCC", "STA", "???", "???", "STY", "STA", "STX", "???", "TYA", "STA", "TXS", "???", "???", "STA", "???", "???",
+        "LDY", "LDA", "LDX", "???", "LDY", "LDA", "LDX", "???", "TAY", "LDA", "TAX", "???", "LDY", "LDA", "LDX", "???",
+        "BCS", "LDA", "???", "???", "LDY", "LDA", "LDX", "???", "CLV", "LDA", "TSX", "???", "LDY", "LDA", "LDX", "???",
+        "CPY", "CMP", "???", "???", "CPY", "CMP", "DEC", "???", "INY", "CMP", "DEX", "???", "CPY", "CMP", "DEC", "???",
+        "BNE", "CMP", "???", "???", "???", "CMP", "DEC", "???", "CLD", "CMP", "NOP", "???", "???", "CMP", "DEC", "???",
+        "CPX", "SBC", "???", "???", "CPX", "SBC", "INC", "???", "INX", "SBC", "NOP", "???", "CPX", "SBC", "INC", "???",
+        "BEQ", "SBC", "???", "???", "???", "SBC", "INC", "???", "SED", "SBC", "NOP", "???", "???", "SBC", "INC", "???",
+    };
+
+    // Number of bytes an instruction using the addressing mode occupies, opcode included.
+    constexpr uint8_t instruction_length(addr_mode_t mode)
+    {
+        return mode == M::IMP ? 1
+             : (mode == M::ABS || mode == M::ABX || mode == M::ABY || mode == M::IND) ? 3
+             : 2;
+    }
+} // namespace opcodes
+
+#endif //NESEMULATOR_OPCODES_HPP
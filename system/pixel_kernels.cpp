@@ -0,0 +1,297 @@
+//
+// Pixel kernels for the PPU: tile decoding and palette expansion, with SIMD versions.
+//
+
+#include "pixel_kernels.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NESEMU_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// ===========================
+// SCALAR
+// ===========================
+
+void pixel_kernels::decode_row(uint8_t low, uint8_t high, uint8_t* pixels)
+{
+    for (unsigned int x = 0; x < 8; x++)
+    {
+        const unsigned int bit = 7 - x;
+        pixels[x] = ((low >> bit) & 1) | (((high >> bit) & 1) << 1);
+    }
+}
+
+void pixel_kernels::make_palette_lut(const uint32_t* colours, palette_lut_t& palette)
+{
+    for (unsigned int i = 0; i < 64; i++)
+    {
+        palette.colours[i] = colours[i];
+
+        for (unsigned int plane = 0; plane < 4; plane++)
+            palette.planes[plane][i] = (colours[i] >> (plane * 8)) & 0xFF;
+    }
+}
+
+namespace
+{
+    void decode_tiles_scalar(const uint8_t* tiles, std::size_t count, uint8_t* pixels)
+    {
+        for (std::size_t tile = 0; tile < count; tile++)
+        {
+            for (unsigned int row = 0; row < 8; row++)
+                pixel_kernels::decode_row(tiles[tile * 16 + row], tiles[tile * 16 + row + 8], &pixels[tile * 64 + row * 8]);
+        }
+    }
+
+    void expand_palette_scalar(const uint8_t* indices, std::size_t count, const palette_lut_t& palette, uint32_t* colours)
+    {
+        for (std::size_t i = 0; i < count; i++)
+            colours[i] = palette.colours[indices[i] & 0x3F];
+    }
+
+    const pixel_kernels_t SCALAR_KERNELS = { kernel_isa_t::SCALAR, "scalar", &decode_tiles_scalar, &expand_palette_scalar };
+} // namespace
+
+// ===========================
+// SSSE3 / AVX2
+// ===========================
+
+#ifdef NESEMU_X86_KERNELS
+namespace
+{
+    // Tile decoding. For each pair of rows, a byte shuffle spreads each row's plane byte over
+    // the eight pixel positions of that row; masking each copy with its pixel's bit and
+    // clamping to 1 leaves one bit per byte. The high plane's bit is then doubled and added.
+    //
+    // Shuffle controls: pick low-plane bytes 2r, 2r+1 (eight copies each) for row pair r.
+    // The high plane is 8 bytes further on.
+    alignas(16) const uint8_t ROW_PAIR_CONTROL[4][16] = {
+        { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1 },
+        { 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3 },
+        { 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5 },
+        { 6, 6, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7 }
+    };
+
+    // Bit of the plane byte that holds each pixel: the leftmost pixel is bit 7.
+    alignas(16) const uint8_t PIXEL_BITS[16] = {
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+    };
+
+    __attribute__((target("ssse3")))
+    void decode_tiles_ssse3(const uint8_t* tiles, std::size_t count, uint8_t* pixels)
+    {
+        const __m128i bits = _mm_load_si128(reinterpret_cast<const __m128i*>(PIXEL_BITS));
+        const __m128i one = _mm_set1_epi8(1);
+        const __m128i high_offset = _mm_set1_epi8(8);
+
+        for (std::size_t tile = 0; tile < count; tile++)
+        {
+            const __m128i planes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tiles + tile * 16));
+
+            for (unsigned int pair = 0; pair < 4; pair++)
+            {
+                const __m128i control = _mm_load_si128(reinterpret_cast<const __m128i*>(ROW_PAIR_CONTROL[pair]));
+                const __m128i low = _mm_shuffle_epi8(planes, control);
+                const __m128i high = _mm_shuffle_epi8(planes, _mm_add_epi8(control, high_offset));
+
+                const __m128i low_bits = _mm_min_epu8(_mm_and_si128(low, bits), one);
+                const __m128i high_bits = _mm_min_epu8(_mm_and_si128(high, bits), one);
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + tile * 64 + pair * 16),
+                                 _mm_add_epi8(low_bits, _mm_add_epi8(high_bits, high_bits)));
+            }
+        }
+    }
+
+    __attribute__((target("avx2")))
+    void decode_tiles_avx2(const uint8_t* tiles, std::size_t count, uint8_t* pixels)
+    {
+        const __m256i bits = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(PIXEL_BITS)));
+        const __m256i one = _mm256_set1_epi8(1);
+        const __m256i high_offset = _mm256_set1_epi8(8);
+
+        // Rows 0-3 in the first half, rows 4-7 in the second.
+        __m256i controls[2];
+        for (unsigned int half = 0; half < 2; half++)
+        {
+            const __m128i first = _mm_load_si128(reinterpret_cast<const __m128i*>(ROW_PAIR_CONTROL[half * 2]));
+            const __m128i second = _mm_load_si128(reinterpret_cast<const __m128i*>(ROW_PAIR_CONTROL[half * 2 + 1]));
+            controls[half] = _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+        }
+
+        for (std::size_t tile = 0; tile < count; tile++)
+        {
+            const __m256i planes = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tiles + tile * 16)));
+
+            for (unsigned int half = 0; half < 2; half++)
+            {
+                const __m256i low = _mm256_shuffle_epi8(planes, controls[half]);
+                const __m256i high = _mm256_shuffle_epi8(planes, _mm256_add_epi8(controls[half], high_offset));
+
+                const __m256i low_bits = _mm256_min_epu8(_mm256_and_si256(low, bits), one);
+                const __m256i high_bits = _mm256_min_epu8(_mm256_and_si256(high, bits), one);
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + tile * 64 + half * 32),
+                                    _mm256_add_epi8(low_bits, _mm256_add_epi8(high_bits, high_bits)));
+            }
+        }
+    }
+
+    // Palette expansion. pshufb is a 16-entry byte table lookup, so each byte plane of the
+    // 64-colour palette is four tables. For each quarter of the palette, indices outside it
+    // get bit 7 set, which makes pshufb return 0, and the four lookups are ORed together.
+    // The four planes are then interleaved back into 32-bit colours.
+
+    __attribute__((target("ssse3")))
+    void expand_palette_ssse3(const uint8_t* indices, std::size_t count, const palette_lut_t& palette, uint32_t* colours)
+    {
+        __m128i tables[4][4];
+        for (unsigned int plane = 0; plane < 4; plane++)
+        {
+            for (unsigned int quarter = 0; quarter < 4; quarter++)
+                tables[plane][quarter] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&palette.planes[plane][quarter * 16]));
+        }
+
+        const __m128i index_mask = _mm_set1_epi8(0x3F);
+        const __m128i low_mask = _mm_set1_epi8(0x0F);
+        const __m128i quarter_mask = _mm_set1_epi8(0x03);
+        const __m128i miss = _mm_set1_epi8((char)0x80);
+
+        std::size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i index = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i)), index_mask);
+            const __m128i low = _mm_and_si128(index, low_mask);
+            const __m128i quarter = _mm_and_si128(_mm_srli_epi16(index, 4), quarter_mask);
+
+            __m128i lookup[4];
+            for (unsigned int q = 0; q < 4; q++)
+                lookup[q] = _mm_or_si128(low, _mm_andnot_si128(_mm_cmpeq_epi8(quarter, _mm_set1_epi8(q)), miss));
+
+            __m128i planes[4];
+            for (unsigned int plane = 0; plane < 4; plane++)
+            {
+                planes[plane] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(tables[plane][0], lookup[0]), _mm_shuffle_epi8(tables[plane][1], lookup[1])),
+                                             _mm_or_si128(_mm_shuffle_epi8(tables[plane][2], lookup[2]), _mm_shuffle_epi8(tables[plane][3], lookup[3])));
+            }
+
+            const __m128i low_pairs = _mm_unpacklo_epi8(planes[0], planes[1]);
+            const __m128i high_pairs = _mm_unpackhi_epi8(planes[0], planes[1]);
+            const __m128i low_pairs_top = _mm_unpacklo_epi8(planes[2], planes[3]);
+            const __m128i high_pairs_top = _mm_unpackhi_epi8(planes[2], planes[3]);
+
+            __m128i* out = reinterpret_cast<__m128i*>(colours + i);
+            _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(low_pairs, low_pairs_top));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low_pairs, low_pairs_top));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high_pairs, high_pairs_top));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high_pairs, high_pairs_top));
+        }
+
+        expand_palette_scalar(indices + i, count - i, palette, colours + i);
+    }
+
+    __attribute__((target("avx2")))
+    void expand_palette_avx2(const uint8_t* indices, std::size_t count, const palette_lut_t& palette, uint32_t* colours)
+    {
+        // vpshufb looks up within each 128-bit half, so both halves get the same tables.
+        __m256i tables[4][4];
+        for (unsigned int plane = 0; plane < 4; plane++)
+        {
+            for (unsigned int quarter = 0; quarter < 4; quarter++)
+                tables[plane][quarter] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&palette.planes[plane][quarter * 16])));
+        }
+
+        const __m256i index_mask = _mm256_set1_epi8(0x3F);
+        const __m256i low_mask = _mm256_set1_epi8(0x0F);
+        const __m256i quarter_mask = _mm256_set1_epi8(0x03);
+        const __m256i miss = _mm256_set1_epi8((char)0x80);
+
+        std::size_t i = 0;
+        for (; i + 32 <= count; i += 32)
+        {
+            const __m256i index = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i)), index_mask);
+            const __m256i low = _mm256_and_si256(index, low_mask);
+            const __m256i quarter = _mm256_and_si256(_mm256_srli_epi16(index, 4), quarter_mask);
+
+            __m256i lookup[4];
+            for (unsigned int q = 0; q < 4; q++)
+                lookup[q] = _mm256_or_si256(low, _mm256_andnot_si256(_mm256_cmpeq_epi8(quarter, _mm256_set1_epi8(q)), miss));
+
+            __m256i planes[4];
+            for (unsigned int plane = 0; plane < 4; plane++)
+            {
+                planes[plane] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(tables[plane][0], lookup[0]), _mm256_shuffle_epi8(tables[plane][1], lookup[1])),
+                                                _mm256_or_si256(_mm256_shuffle_epi8(tables[plane][2], lookup[2]), _mm256_shuffle_epi8(tables[plane][3], lookup[3])));
+            }
+
+            // Unpacking also works per 128-bit half: the first half holds colours 0-15, the
+            // second 16-31, and the permutes put the quarters back in order.
+            const __m256i low_pairs = _mm256_unpacklo_epi8(planes[0], planes[1]);
+            const __m256i high_pairs = _mm256_unpackhi_epi8(planes[0], planes[1]);
+            const __m256i low_pairs_top = _mm256_unpacklo_epi8(planes[2], planes[3]);
+            const __m256i high_pairs_top = _mm256_unpackhi_epi8(planes[2], planes[3]);
+
+            const __m256i colours_0_3 = _mm256_unpacklo_epi16(low_pairs, low_pairs_top);   // and 16-19
+            const __m256i colours_4_7 = _mm256_unpackhi_epi16(low_pairs, low_pairs_top);   // and 20-23
+            const __m256i colours_8_11 = _mm256_unpacklo_epi16(high_pairs, high_pairs_top); // and 24-27
+            const __m256i colours_12_15 = _mm256_unpackhi_epi16(high_pairs, high_pairs_top); // and 28-31
+
+            __m256i* out = reinterpret_cast<__m256i*>(colours + i);
+            _mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(colours_0_3, colours_4_7, 0x20));
+            _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(colours_8_11, colours_12_15, 0x20));
+            _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(colours_0_3, colours_4_7, 0x31));
+            _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(colours_8_11, colours_12_15, 0x31));
+        }
+
+        expand_palette_scalar(indices + i, count - i, palette, colours + i);
+    }
+
+    const pixel_kernels_t SSSE3_KERNELS = { kernel_isa_t::SSSE3, "ssse3", &decode_tiles_ssse3, &expand_palette_ssse3 };
+    const pixel_kernels_t AVX2_KERNELS = { kernel_isa_t::AVX2, "avx2", &decode_tiles_avx2, &expand_palette_avx2 };
+} // namespace
+#endif
+
+// ===========================
+// SELECTION
+// ===========================
+
+bool pixel_kernels::is_supported(kernel_isa_t isa)
+{
+    switch (isa)
+    {
+        case kernel_isa_t::SCALAR:
+            return true;
+#ifdef NESEMU_X86_KERNELS
+        case kernel_isa_t::SSSE3:
+            return __builtin_cpu_supports("ssse3");
+        case kernel_isa_t::AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+const pixel_kernels_t& pixel_kernels::get(kernel_isa_t isa)
+{
+    if (!is_supported(isa))
+        return SCALAR_KERNELS;
+
+#ifdef NESEMU_X86_KERNELS
+    if (isa == kernel_isa_t::AVX2)
+        return AVX2_KERNELS;
+    if (isa == kernel_isa_t::SSSE3)
+        return SSSE3_KERNELS;
+#endif
+
+    return SCALAR_KERNELS;
+}
+
+const pixel_kernels_t& pixel_kernels::best()
+{
+    static const pixel_kernels_t& chosen = is_supported(kernel_isa_t::AVX2)    ? get(kernel_isa_t::AVX2)
+                                         : is_supported(kernel_isa_t::SSSE3) ? get(kernel_isa_t::SSSE3)
+                                                                               : get(kernel_isa_t::SCALAR);
+    return chosen;
+}
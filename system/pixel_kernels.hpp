@@ -0,0 +1,81 @@
+//
+// Pixel kernels for the PPU: tile decoding and palette expansion, with SIMD versions.
+//
+
+#ifndef NESEMULATOR_PIXEL_KERNELS_HPP
+#define NESEMULATOR_PIXEL_KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// Instruction set a kernel set is written for.
+enum class kernel_isa_t
+{
+    SCALAR, // Plain C++; works everywhere.
+    SSSE3,  // SSE2 bit tricks for decoding, SSSE3 byte shuffles (pshufb) for palette lookups.
+    AVX2    // The same, 32 bytes at a time.
+};
+
+// A 64-colour palette in the forms the kernels want: whole colours, and split into byte
+// planes (plane 0 is the lowest byte of each colour) for shuffle-based lookups.
+struct palette_lut_t
+{
+    uint32_t colours[64];
+    uint8_t planes[4][64];
+};
+
+// One implementation of each kernel.
+struct pixel_kernels_t
+{
+    kernel_isa_t isa;
+    const char* name;
+
+    /**
+     * Decodes `count' 16-byte 2bpp tiles (8 low-plane bytes, then 8 high-plane bytes) into 64
+     * bytes each: one pixel value (0-3) per byte, row by row, leftmost pixel first.
+     */
+    void (*decode_tiles)(const uint8_t* tiles, std::size_t count, uint8_t* pixels);
+
+    /**
+     * Maps `count' colour indices (the low 6 bits are used) to 32-bit colours through a
+     * palette.
+     */
+    void (*expand_palette)(const uint8_t* indices, std::size_t count, const palette_lut_t& palette, uint32_t* colours);
+};
+
+namespace pixel_kernels
+{
+    /**
+     * Whether the host CPU can run the kernels for `isa'.
+     * @param isa
+     */
+    bool is_supported(kernel_isa_t isa);
+
+    /**
+     * The kernels for `isa', or the scalar ones if this build or host can't run them.
+     * @param isa
+     */
+    const pixel_kernels_t& get(kernel_isa_t isa);
+
+    /**
+     * The fastest kernels the host supports. Chosen once, on first use.
+     */
+    const pixel_kernels_t& best();
+
+    /**
+     * Builds the lookup tables for a 64-entry palette.
+     * @param colours
+     * @param palette
+     */
+    void make_palette_lut(const uint32_t* colours, palette_lut_t& palette);
+
+    /**
+     * Decodes a single tile row from its two bit planes into eight pixels.
+     * @param low
+     * @param high
+     * @param pixels
+     */
+    void decode_row(uint8_t low, uint8_t high, uint8_t* pixels);
+} // namespace pixel_kernels
+
+#endif //NESEMULATOR_PIXEL_KERNELS_HPP
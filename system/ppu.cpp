@@ -0,0 +1,944 @@
+//
+// The picture processing unit (2C02).
+//
+
+#include "ppu.hpp"
+#include "pixel_kernels.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+    // PPUCTRL ($2000)
+    const uint8_t CTRL_INCREMENT_32 = 0x04;
+    const uint8_t CTRL_SPRITE_TABLE = 0x08;
+    const uint8_t CTRL_BACKGROUND_TABLE = 0x10;
+    const uint8_t CTRL_SPRITE_8X16 = 0x20;
+    const uint8_t CTRL_NMI_ENABLE = 0x80;
+
+    // PPUMASK ($2001)
+    const uint8_t MASK_GREYSCALE = 0x01;
+    const uint8_t MASK_BACKGROUND_LEFT = 0x02;
+    const uint8_t MASK_SPRITES_LEFT = 0x04;
+    const uint8_t MASK_BACKGROUND = 0x08;
+    const uint8_t MASK_SPRITES = 0x10;
+
+    // PPUSTATUS ($2002)
+    const uint8_t STATUS_SPRITE_OVERFLOW = 0x20;
+    const uint8_t STATUS_SPRITE_ZERO_HIT = 0x40;
+    const uint8_t STATUS_VBLANK = 0x80;
+
+    const unsigned int MAX_SPRITES_PER_LINE = 8;
+
+    // The 2C02's 64 colours as 0xAARRGGBB.
+    const uint32_t SYSTEM_PALETTE[64] = {
+        0xFF666666, 0xFF002A88, 0xFF1412A7, 0xFF3B00A4, 0xFF5C007E, 0xFF6E0040, 0xFF6C0600, 0xFF561D00,
+        0xFF333500, 0xFF0B4800, 0xFF005200, 0xFF004F08, 0xFF00404D, 0xFF000000, 0xFF000000, 0xFF000000,
+        0xFFADADAD, 0xFF155FD9, 0xFF4240FF, 0xFF7527FE, 0xFFA01ACC, 0xFFB71E7B, 0xFFB53120, 0xFF994E00,
+        0xFF6B6D00, 0xFF388700, 0xFF0C9300, 0xFF008F32, 0xFF007C8D, 0xFF000000, 0xFF000000, 0xFF000000,
+        0xFFFFFEFF, 0xFF64B0FF, 0xFF9290FF, 0xFFC676FF, 0xFFF36AFF, 0xFFFE6ECC, 0xFFFE8170, 0xFFEA9E22,
+        0xFFBCBE00, 0xFF88D800, 0xFF5CE430, 0xFF45E082, 0xFF48CDDE, 0xFF4F4F4F, 0xFF000000, 0xFF000000,
+        0xFFFFFEFF, 0xFFC0DFFF, 0xFFD3D2FF, 0xFFE8C8FF, 0xFFFBC2FF, 0xFFFEC4EA, 0xFFFECCC5, 0xFFF7D8A5,
+        0xFFE4E594, 0xFFCFEF96, 0xFFBDF4AB, 0xFFB3F3CC, 0xFFB5EBF2, 0xFFB8B8B8, 0xFF000000, 0xFF000000
+    };
+
+    // Row of zero pixels for pattern slots with no CHR memory behind them.
+    const uint8_t BLANK_ROW[8] = {};
+
+    const palette_lut_t& system_palette()
+    {
+        static const palette_lut_t lut = []() {
+            palette_lut_t palette;
+            pixel_kernels::make_palette_lut(SYSTEM_PALETTE, palette);
+            return palette;
+        }();
+
+        return lut;
+    }
+
+    // Offset of the decoded pixels of the row whose low plane byte is at `offset' in CHR.
+    std::size_t decoded_offset(std::size_t offset)
+    {
+        return (offset >> 4) * 64 + (offset & 7) * 8;
+    }
+} // namespace
+
+PPU::PPU(MOS6502* cpu, RAM* bus) : cpu(cpu), bus(bus), kernels(&pixel_kernels::best())
+{
+    for (unsigned int slot = 0; slot < constants::PATTERN_SLOT_COUNT; slot++)
+        pattern_offsets[slot] = slot * constants::PATTERN_SLOT_SIZE;
+
+    set_mirroring(mirroring_t::HORIZONTAL);
+    power_on();
+}
+
+PPU::~PPU() = default;
+
+void PPU::map_into(RAM& ram)
+{
+    ram.map_handlers(0x2000, 0x3FFF, &PPU::read_register, &PPU::write_register, &PPU::peek_register, this);
+}
+
+void PPU::attach_chr_rom(const uint8_t* data, std::size_t size)
+{
+    chr = data;
+    chr_ram = nullptr;
+    chr_size = data != nullptr ? size : 0;
+    decode_chr();
+}
+
+void PPU::attach_chr_ram(uint8_t* data, std::size_t size)
+{
+    chr = data;
+    chr_ram = data;
+    chr_size = data != nullptr ? size : 0;
+    chr_ram_written = true;
+    decode_chr();
+}
+
+void PPU::map_pattern(unsigned int slot, unsigned int count, std::size_t offset)
+{
+    for (unsigned int i = 0; i < count && slot + i < constants::PATTERN_SLOT_COUNT; i++)
+    {
+        const std::size_t page_offset = offset + i * constants::PATTERN_SLOT_SIZE;
+        pattern_offsets[slot + i] = chr_size > 0 ? page_offset % chr_size : page_offset;
+    }
+}
+
+void PPU::set_mirroring(mirroring_t mirroring)
+{
+    static const unsigned int LAYOUTS[5][4] = {
+        { 0, 0, 1, 1 }, // HORIZONTAL: $2000 = $2400, $2800 = $2C00
+        { 0, 1, 0, 1 }, // VERTICAL:   $2000 = $2800, $2400 = $2C00
+        { 0, 1, 2, 3 }, // FOUR_SCREEN
+        { 0, 0, 0, 0 }, // SINGLE_SCREEN_LOWER
+        { 1, 1, 1, 1 }  // SINGLE_SCREEN_UPPER
+    };
+
+    std::memcpy(nametable_pages, LAYOUTS[(unsigned int)mirroring], sizeof(nametable_pages));
+}
+
+void PPU::set_scanline_handler(scanline_handler_t handler, void* context)
+{
+    scanline_handler = handler;
+    scanline_context = context;
+}
+
+void PPU::power_on()
+{
+    dots = 0;
+    frame = 0;
+    scanline = 0;
+    dot = 0;
+
+    v = 0;
+    t = 0;
+    fine_x = 0;
+    write_toggle = false;
+    ctrl = 0;
+    mask = 0;
+    status = 0;
+    oam_addr = 0;
+    read_buffer = 0;
+    io_latch = 0;
+    nmi_pending = false;
+    sprite_zero_hit_dot = 0;
+
+    std::memset(oam, 0x00, sizeof(oam));
+    std::memset(palette, 0x00, sizeof(palette));
+    std::memset(vram, 0x00, sizeof(vram));
+    std::memset(frame_buffer, 0x00, sizeof(frame_buffer));
+
+    rebuild_attribute_cache();
+}
+
+// ===========================
+// TIMING
+// ===========================
+
+bool PPU::rendering_enabled() const
+{
+    return (mask & (MASK_BACKGROUND | MASK_SPRITES)) != 0;
+}
+
+unsigned int PPU::scanline_length() const
+{
+    // The pre-render line of every other frame is one dot short while rendering.
+    if (scanline == constants::PRERENDER_SCANLINE && (frame & 1) && rendering_enabled())
+        return constants::DOTS_PER_SCANLINE - 1;
+
+    return constants::DOTS_PER_SCANLINE;
+}
+
+void PPU::catch_up()
+{
+    run_to(cpu->cycles * 3);
+}
+
+unsigned int PPU::next_event_dot() const
+{
+    // Events of each kind of scanline, in order; the end of the line is always the last.
+    unsigned int next = scanline_length();
+
+    if (scanline < (unsigned int)constants::SCREEN_HEIGHT)
+    {
+        if (dot < 257)
+            next = 257; // Vertical scroll increment, horizontal scroll reload.
+        else if (dot < constants::SCANLINE_CLOCK_DOT && scanline_handler != nullptr)
+            next = constants::SCANLINE_CLOCK_DOT;
+        if (sprite_zero_hit_dot > dot && sprite_zero_hit_dot < next)
+            next = sprite_zero_hit_dot;
+    }
+    else if (scanline == (unsigned int)constants::VBLANK_SCANLINE)
+    {
+        if (dot < 1)
+            next = 1;
+    }
+    else if (scanline == (unsigned int)constants::PRERENDER_SCANLINE)
+    {
+        if (dot < 1)
+            next = 1;
+        else if (dot < 257)
+            next = 257;
+        else if (dot < constants::SCANLINE_CLOCK_DOT && scanline_handler != nullptr)
+            next = constants::SCANLINE_CLOCK_DOT;
+        else if (dot < 304)
+            next = 304; // End of the vertical scroll reload (dots 280-304).
+    }
+
+    return next;
+}
+
+void PPU::run_to(uint64_t target)
+{
+    while (dots < target)
+    {
+        const unsigned int next = next_event_dot();
+
+        if (dots + (next - dot) > target)
+        {
+            dot += target - dots;
+            dots = target;
+            return;
+        }
+
+        dots += next - dot;
+        dot = next;
+        handle_event();
+    }
+}
+
+void PPU::handle_event()
+{
+    if (dot >= scanline_length())
+    {
+        dot = 0;
+        scanline++;
+        sprite_zero_hit_dot = 0;
+
+        if (scanline == (unsigned int)constants::SCANLINES_PER_FRAME)
+            scanline = 0;
+
+        if (scanline < (unsigned int)constants::SCREEN_HEIGHT)
+        {
+            if (video_output)
+                render_scanline();
+            else
+                evaluate_scanline();
+        }
+
+        return;
+    }
+
+    if (scanline < (unsigned int)constants::SCREEN_HEIGHT)
+    {
+        if (dot == sprite_zero_hit_dot)
+            status |= STATUS_SPRITE_ZERO_HIT;
+
+        if (dot == 257 && rendering_enabled())
+        {
+            increment_y();
+            copy_x();
+        }
+        else if (dot == constants::SCANLINE_CLOCK_DOT && scanline_handler != nullptr && rendering_enabled())
+        {
+            scanline_handler(scanline_context);
+        }
+    }
+    else if (scanline == (unsigned int)constants::VBLANK_SCANLINE)
+    {
+        status |= STATUS_VBLANK;
+        frame++;
+
+        if (ctrl & CTRL_NMI_ENABLE)
+            raise_nmi();
+    }
+    else if (scanline == (unsigned int)constants::PRERENDER_SCANLINE)
+    {
+        if (dot == 1)
+            status &= ~(STATUS_VBLANK | STATUS_SPRITE_ZERO_HIT | STATUS_SPRITE_OVERFLOW);
+        else if (dot == 257 && rendering_enabled())
+            copy_x();
+        else if (dot == constants::SCANLINE_CLOCK_DOT && scanline_handler != nullptr && rendering_enabled())
+            scanline_handler(scanline_context);
+        else if (dot == 304 && rendering_enabled())
+            copy_y();
+    }
+}
+
+uint64_t PPU::next_vblank_cycle() const
+{
+    const uint64_t line = constants::DOTS_PER_SCANLINE;
+    const uint64_t position = scanline * line + dot;
+    const uint64_t vblank = constants::VBLANK_SCANLINE * line + 1;
+    uint64_t remaining;
+
+    if (position < vblank)
+    {
+        remaining = vblank - position;
+    }
+    else
+    {
+        // Rest of this frame (including a possibly shortened pre-render line), then into the next.
+        const uint64_t frame_length = constants::SCANLINES_PER_FRAME * line - ((frame & 1) && rendering_enabled() ? 1 : 0);
+        remaining = frame_length - position + vblank;
+    }
+
+    return (dots + remaining + 2) / 3;
+}
+
+uint64_t PPU::scanline_clock_cycle(unsigned int count) const
+{
+    // Walk forward line by line, with every pre-render line of an odd frame one dot short
+    // as it is while rendering.
+    const unsigned int clock_dot = constants::SCANLINE_CLOCK_DOT;
+    uint64_t position = dots;
+    uint64_t line_frame = frame + (scanline == (unsigned int)constants::VBLANK_SCANLINE && dot < 1 ? 1 : 0);
+    unsigned int line = scanline;
+    unsigned int at = dot;
+
+    while (true)
+    {
+        const bool clocked = line < (unsigned int)constants::SCREEN_HEIGHT || line == (unsigned int)constants::PRERENDER_SCANLINE;
+
+        if (clocked && at < clock_dot && --count == 0)
+            return (position + (clock_dot - at) + 2) / 3;
+
+        const unsigned int length = line == (unsigned int)constants::PRERENDER_SCANLINE && (line_frame & 1)
+                                  ? constants::DOTS_PER_SCANLINE - 1 : constants::DOTS_PER_SCANLINE;
+
+        position += length - at;
+        at = 0;
+
+        if (++line == (unsigned int)constants::VBLANK_SCANLINE)
+            line_frame++;
+        else if (line == (unsigned int)constants::SCANLINES_PER_FRAME)
+            line = 0;
+    }
+}
+
+uint64_t PPU::cycle_at(unsigned int line, unsigned int at_dot) const
+{
+    const uint64_t length = constants::DOTS_PER_SCANLINE;
+    const uint64_t position = scanline * length + dot;
+    const uint64_t target = line * length + at_dot;
+
+    // Past it this frame: next frame's, one dot early in case this frame's pre-render line is
+    // the short one.
+    const uint64_t remaining = position < target ? target - position
+                                                 : constants::SCANLINES_PER_FRAME * length - position + target - 1;
+
+    return (dots + remaining) / 3;
+}
+
+uint64_t PPU::next_status_change_cycle() const
+{
+    const uint8_t sprite_flags = STATUS_SPRITE_ZERO_HIT | STATUS_SPRITE_OVERFLOW;
+    uint64_t next = next_vblank_cycle();
+
+    // Every flag still set is cleared on the pre-render line.
+    if (status & (STATUS_VBLANK | sprite_flags))
+        next = std::min(next, cycle_at(constants::PRERENDER_SCANLINE, 1));
+
+    // While rendering, sprite overflow can be set as a visible line starts, and sprite 0 hit
+    // where the line has it.
+    if (rendering_enabled() && (status & sprite_flags) != sprite_flags)
+    {
+        if (scanline >= (unsigned int)constants::SCREEN_HEIGHT)
+            next = std::min(next, cycle_at(0, 0));
+        else if (sprite_zero_hit_dot > dot)
+            next = std::min(next, cycle_at(scanline, sprite_zero_hit_dot));
+        else
+            next = std::min(next, cycle_at(scanline + 1, 0));
+    }
+
+    return next;
+}
+
+void PPU::raise_nmi()
+{
+    nmi_pending = true;
+
+    // Make the CPU stop after the current instruction so the NMI is taken on time.
+    cpu->run_target = 0;
+}
+
+bool PPU::take_nmi()
+{
+    const bool pending = nmi_pending;
+    nmi_pending = false;
+    return pending;
+}
+
+uint64_t PPU::get_frame() const
+{
+    return frame;
+}
+
+const uint32_t* PPU::get_frame_buffer() const
+{
+    return frame_buffer;
+}
+
+void PPU::set_video_output(bool enabled)
+{
+    video_output = enabled;
+}
+
+// ===========================
+// SCROLLING
+// ===========================
+
+void PPU::increment_y()
+{
+    if ((v & 0x7000) != 0x7000)
+    {
+        v += 0x1000; // Fine Y
+        return;
+    }
+
+    v &= ~0x7000;
+    unsigned int coarse_y = (v & 0x03E0) >> 5;
+
+    if (coarse_y == 29)
+    {
+        coarse_y = 0;
+        v ^= 0x0800; // Next nametable down.
+    }
+    else if (coarse_y == 31)
+    {
+        coarse_y = 0; // Scrolled into the attribute table: wraps without switching nametables.
+    }
+    else
+    {
+        coarse_y++;
+    }
+
+    v = (v & ~0x03E0) | (coarse_y << 5);
+}
+
+void PPU::copy_x()
+{
+    v = (v & ~0x041F) | (t & 0x041F);
+}
+
+void PPU::copy_y()
+{
+    v = (v & ~0x7BE0) | (t & 0x7BE0);
+}
+
+// ===========================
+// PPU ADDRESS SPACE
+// ===========================
+
+unsigned int PPU::palette_index(uint16_t addr)
+{
+    // $3F10/$3F14/$3F18/$3F1C are mirrors of $3F00/$3F04/$3F08/$3F0C.
+    unsigned int index = addr & 0x1F;
+    if ((index & 0x13) == 0x10)
+        index &= ~0x10;
+
+    return index;
+}
+
+uint8_t PPU::ppu_read(uint16_t addr) const
+{
+    addr &= 0x3FFF;
+
+    if (addr < 0x2000)
+    {
+        if (chr_size == 0)
+            return 0x00;
+
+        return chr[pattern_offsets[addr >> 10] + (addr & 0x3FF)];
+    }
+
+    if (addr < 0x3F00)
+        return vram[nametable_pages[(addr >> 10) & 3] * 0x400 + (addr & 0x3FF)];
+
+    return palette[palette_index(addr)] & ((mask & MASK_GREYSCALE) ? 0x30 : 0x3F);
+}
+
+void PPU::ppu_write(uint16_t addr, uint8_t value)
+{
+    addr &= 0x3FFF;
+
+    if (addr < 0x2000)
+    {
+        if (chr_ram == nullptr)
+            return;
+
+        const std::size_t offset = pattern_offsets[addr >> 10] + (addr & 0x3FF);
+        chr_ram[offset] = value;
+        chr_ram_written = true;
+
+        // Keep the decoded copy of this row in sync.
+        const std::size_t low = offset & ~(std::size_t)0x08;
+        pixel_kernels::decode_row(chr_ram[low], chr_ram[low + 8], &decoded_chr[decoded_offset(low)]);
+        return;
+    }
+
+    if (addr < 0x3F00)
+    {
+        const unsigned int page = nametable_pages[(addr >> 10) & 3];
+        vram[page * 0x400 + (addr & 0x3FF)] = value;
+
+        if ((addr & 0x3FF) >= 0x3C0)
+            update_attributes(page, addr & 0x3FF);
+        return;
+    }
+
+    palette[palette_index(addr)] = value & 0x3F;
+}
+
+const uint8_t* PPU::pattern_row(uint16_t addr) const
+{
+    if (chr_size == 0)
+        return BLANK_ROW;
+
+    return &decoded_chr[decoded_offset(pattern_offsets[(addr >> 10) & 7] + (addr & 0x3FF))];
+}
+
+void PPU::decode_chr()
+{
+    decoded_chr.assign(chr_size * 4, 0x00);
+    kernels->decode_tiles(chr, chr_size / 16, decoded_chr.data());
+}
+
+void PPU::update_attributes(unsigned int page, unsigned int offset)
+{
+    // Each attribute byte covers 4x4 tiles, two bits per 2x2 quadrant.
+    const unsigned int index = offset - 0x3C0;
+    const uint8_t attributes = vram[page * 0x400 + offset];
+    const unsigned int top = (index >> 3) * 4;
+    const unsigned int left = (index & 7) * 4;
+
+    for (unsigned int coarse_y = top; coarse_y < top + 4; coarse_y++)
+    {
+        for (unsigned int coarse_x = left; coarse_x < left + 4; coarse_x++)
+        {
+            const unsigned int shift = ((coarse_y & 2) << 1) | (coarse_x & 2);
+            attribute_cache[page][coarse_y * 32 + coarse_x] = (attributes >> shift) & 3;
+        }
+    }
+}
+
+void PPU::rebuild_attribute_cache()
+{
+    for (unsigned int page = 0; page < 4; page++)
+    {
+        for (unsigned int offset = 0x3C0; offset < 0x400; offset++)
+            update_attributes(page, offset);
+    }
+}
+
+// ===========================
+// RENDERING
+// ===========================
+
+void PPU::render_scanline()
+{
+    // Pixels as palette RAM indices (0-31). The low two bits are 0 for transparent pixels.
+    uint8_t background[constants::SCREEN_WIDTH + 16] = {};
+    uint8_t sprites[constants::SCREEN_WIDTH] = {};
+    bool sprite_behind[constants::SCREEN_WIDTH] = {};
+    bool sprite_zero[constants::SCREEN_WIDTH] = {};
+    uint8_t line[constants::SCREEN_WIDTH];
+
+    const bool show_background = (mask & MASK_BACKGROUND) != 0;
+    const bool show_sprites = (mask & MASK_SPRITES) != 0;
+
+    if (show_background)
+    {
+        // 33 tiles, so the line is covered at any fine X scroll.
+        uint16_t address = v;
+        const uint16_t table = (ctrl & CTRL_BACKGROUND_TABLE) ? 0x1000 : 0x0000;
+        const unsigned int fine_y = (v >> 12) & 7;
+
+        for (unsigned int tile = 0; tile < 33; tile++)
+        {
+            const unsigned int page = nametable_pages[(address >> 10) & 3];
+            const unsigned int cell = address & 0x3FF;
+            const uint8_t tile_index = vram[page * 0x400 + cell];
+            const uint8_t tile_palette = attribute_cache[page][cell] << 2;
+            const uint8_t* pixels = pattern_row(table + tile_index * 16 + fine_y);
+            uint8_t* out = &background[tile * 8];
+
+            for (unsigned int x = 0; x < 8; x++)
+                out[x] = pixels[x] ? (tile_palette | pixels[x]) : 0;
+
+            // Coarse X increment, wrapping into the horizontally adjacent nametable.
+            if ((address & 0x1F) == 31)
+                address = (address & ~0x1F) ^ 0x400;
+            else
+                address++;
+        }
+
+        if (!(mask & MASK_BACKGROUND_LEFT))
+            std::memset(background + fine_x, 0x00, 8);
+    }
+
+    if (rendering_enabled() && scanline > 0)
+    {
+        // Sprite evaluation. OAM Y is one less than the first scanline a sprite appears on.
+        const unsigned int height = (ctrl & CTRL_SPRITE_8X16) ? 16 : 8;
+        unsigned int found = 0;
+
+        for (unsigned int sprite = 0; sprite < 64; sprite++)
+        {
+            const uint8_t* entry = &oam[sprite * 4];
+            const unsigned int row = scanline - 1 - entry[0];
+
+            if (row >= height)
+                continue;
+
+            if (found == MAX_SPRITES_PER_LINE)
+            {
+                status |= STATUS_SPRITE_OVERFLOW;
+                break;
+            }
+            found++;
+
+            if (!show_sprites)
+                continue;
+
+            const uint8_t attributes = entry[2];
+            const unsigned int flipped_row = (attributes & 0x80) ? height - 1 - row : row;
+            uint16_t address;
+
+            if (height == 16)
+                address = ((entry[1] & 1) ? 0x1000 : 0x0000) + ((entry[1] & 0xFE) + (flipped_row >> 3)) * 16 + (flipped_row & 7);
+            else
+                address = ((ctrl & CTRL_SPRITE_TABLE) ? 0x1000 : 0x0000) + entry[1] * 16 + flipped_row;
+
+            const uint8_t* pixels = pattern_row(address);
+            const uint8_t sprite_palette = 0x10 | ((attributes & 3) << 2);
+
+            for (unsigned int i = 0; i < 8; i++)
+            {
+                const unsigned int x = entry[3] + i;
+                const uint8_t pixel = pixels[(attributes & 0x40) ? 7 - i : i];
+
+                // Lower OAM indices win, so skip pixels an earlier sprite already covered.
+                if (x >= (unsigned int)constants::SCREEN_WIDTH || pixel == 0 || sprites[x] != 0)
+                    continue;
+
+                sprites[x] = sprite_palette | pixel;
+                sprite_behind[x] = (attributes & 0x20) != 0;
+                sprite_zero[x] = sprite == 0;
+            }
+        }
+
+        if (!(mask & MASK_SPRITES_LEFT))
+            std::memset(sprites, 0x00, 8);
+    }
+
+    // Combine the layers.
+    const uint8_t* back = background + fine_x;
+    const uint8_t colour_mask = (mask & MASK_GREYSCALE) ? 0x30 : 0x3F;
+
+    for (unsigned int x = 0; x < (unsigned int)constants::SCREEN_WIDTH; x++)
+    {
+        uint8_t index = back[x];
+
+        if (sprites[x] != 0)
+        {
+            if (back[x] != 0 && sprite_zero[x] && x != 255 && sprite_zero_hit_dot == 0 && show_background)
+                sprite_zero_hit_dot = x + 1;
+
+            if (back[x] == 0 || !sprite_behind[x])
+                index = sprites[x];
+        }
+
+        line[x] = palette[index & 0x03 ? index : 0] & colour_mask;
+    }
+
+    kernels->expand_palette(line, constants::SCREEN_WIDTH, system_palette(), &frame_buffer[scanline * constants::SCREEN_WIDTH]);
+}
+
+void PPU::evaluate_scanline()
+{
+    if (!rendering_enabled() || scanline == 0)
+        return;
+
+    // Sprite evaluation, as in render_scanline(), only counting.
+    const unsigned int height = (ctrl & CTRL_SPRITE_8X16) ? 16 : 8;
+    unsigned int found = 0;
+
+    for (unsigned int sprite = 0; sprite < 64; sprite++)
+    {
+        if (scanline - 1 - oam[sprite * 4] >= height)
+            continue;
+
+        if (found == MAX_SPRITES_PER_LINE)
+        {
+            status |= STATUS_SPRITE_OVERFLOW;
+            break;
+        }
+        found++;
+    }
+
+    // Sprite 0 hit: the first opaque pixel of sprite 0 over an opaque background pixel.
+    // Sprite 0 is never covered by another sprite, so only its own pixels matter.
+    const uint8_t* entry = oam;
+    const unsigned int row = scanline - 1 - entry[0];
+
+    if (!(mask & MASK_BACKGROUND) || !(mask & MASK_SPRITES) || row >= height)
+        return;
+
+    const uint8_t attributes = entry[2];
+    const unsigned int flipped_row = (attributes & 0x80) ? height - 1 - row : row;
+    uint16_t address;
+
+    if (height == 16)
+        address = ((entry[1] & 1) ? 0x1000 : 0x0000) + ((entry[1] & 0xFE) + (flipped_row >> 3)) * 16 + (flipped_row & 7);
+    else
+        address = ((ctrl & CTRL_SPRITE_TABLE) ? 0x1000 : 0x0000) + entry[1] * 16 + flipped_row;
+
+    const uint8_t* sprite_pixels = pattern_row(address);
+    const uint16_t table = (ctrl & CTRL_BACKGROUND_TABLE) ? 0x1000 : 0x0000;
+    const unsigned int fine_y = (v >> 12) & 7;
+    const unsigned int left = (mask & MASK_BACKGROUND_LEFT) && (mask & MASK_SPRITES_LEFT) ? 0 : 8;
+
+    for (unsigned int i = 0; i < 8; i++)
+    {
+        const unsigned int x = entry[3] + i;
+
+        // No hit at x = 255.
+        if (x >= (unsigned int)constants::SCREEN_WIDTH - 1)
+            break;
+
+        if (x < left || sprite_pixels[(attributes & 0x40) ? 7 - i : i] == 0)
+            continue;
+
+        // The background tile under x, coarse X wrapping into the adjacent nametable.
+        const unsigned int position = fine_x + x;
+        const unsigned int coarse_x = (v & 0x1F) + (position >> 3);
+        const uint16_t tile_address = coarse_x < 32 ? (v & ~0x1F) | coarse_x : ((v & ~0x1F) ^ 0x400) | (coarse_x - 32);
+        const uint8_t tile_index = vram[nametable_pages[(tile_address >> 10) & 3] * 0x400 + (tile_address & 0x3FF)];
+
+        if (pattern_row(table + tile_index * 16 + fine_y)[position & 7] != 0)
+        {
+            sprite_zero_hit_dot = x + 1;
+            return;
+        }
+    }
+}
+
+// ===========================
+// CPU INTERFACE
+// ===========================
+
+uint8_t PPU::read_register(void* context, address_t addr)
+{
+    PPU& ppu = *static_cast<PPU*>(context);
+    ppu.catch_up();
+
+    uint8_t value = ppu.io_latch;
+
+    switch (addr & 7)
+    {
+        case 2: // PPUSTATUS
+            value = (ppu.status & 0xE0) | (ppu.io_latch & 0x1F);
+            ppu.status &= ~STATUS_VBLANK;
+            ppu.write_toggle = false;
+            break;
+        case 4: // OAMDATA
+            value = ppu.oam[ppu.oam_addr];
+            break;
+        case 7: // PPUDATA. Reads below the palette come from a one-byte buffer.
+            if ((ppu.v & 0x3FFF) < 0x3F00)
+            {
+                value = ppu.read_buffer;
+                ppu.read_buffer = ppu.ppu_read(ppu.v);
+            }
+            else
+            {
+                value = ppu.ppu_read(ppu.v);
+                ppu.read_buffer = ppu.ppu_read(ppu.v - 0x1000); // The nametable byte "under" the palette.
+            }
+            ppu.v += (ppu.ctrl & CTRL_INCREMENT_32) ? 32 : 1;
+            break;
+        default: // Write-only registers read back the bus latch.
+            break;
+    }
+
+    ppu.io_latch = value;
+    return value;
+}
+
+uint8_t PPU::peek_register(void* context, address_t addr)
+{
+    const PPU& ppu = *static_cast<const PPU*>(context);
+
+    switch (addr & 7)
+    {
+        case 2: return (ppu.status & 0xE0) | (ppu.io_latch & 0x1F);
+        case 4: return ppu.oam[ppu.oam_addr];
+        case 7: return ppu.read_buffer;
+        default: return ppu.io_latch;
+    }
+}
+
+void PPU::write_register(void* context, address_t addr, uint8_t value)
+{
+    PPU& ppu = *static_cast<PPU*>(context);
+    ppu.catch_up();
+
+    ppu.io_latch = value;
+
+    switch (addr & 7)
+    {
+        case 0: // PPUCTRL
+        {
+            // Enabling NMIs during vertical blank fires one straight away.
+            const bool enabling = !(ppu.ctrl & CTRL_NMI_ENABLE) && (value & CTRL_NMI_ENABLE);
+
+            ppu.ctrl = value;
+            ppu.t = (ppu.t & ~0x0C00) | ((value & 0x03) << 10);
+
+            if (enabling && (ppu.status & STATUS_VBLANK))
+                ppu.raise_nmi();
+            break;
+        }
+        case 1: // PPUMASK
+            ppu.mask = value;
+            break;
+        case 3: // OAMADDR
+            ppu.oam_addr = value;
+            break;
+        case 4: // OAMDATA
+            ppu.oam[ppu.oam_addr++] = value;
+            break;
+        case 5: // PPUSCROLL
+            if (!ppu.write_toggle)
+            {
+                ppu.t = (ppu.t & ~0x001F) | (value >> 3);
+                ppu.fine_x = value & 7;
+            }
+            else
+            {
+                ppu.t = (ppu.t & ~0x73E0) | ((value & 0x07) << 12) | ((value & 0xF8) << 2);
+            }
+            ppu.write_toggle = !ppu.write_toggle;
+            break;
+        case 6: // PPUADDR
+            if (!ppu.write_toggle)
+            {
+                ppu.t = (ppu.t & 0x00FF) | ((value & 0x3F) << 8);
+            }
+            else
+            {
+                ppu.t = (ppu.t & 0xFF00) | value;
+                ppu.v = ppu.t;
+            }
+            ppu.write_toggle = !ppu.write_toggle;
+            break;
+        case 7: // PPUDATA
+            ppu.ppu_write(ppu.v, value);
+            ppu.v += (ppu.ctrl & CTRL_INCREMENT_32) ? 32 : 1;
+            break;
+        default: // PPUSTATUS is read-only.
+            break;
+    }
+}
+
+void PPU::oam_dma(uint8_t page)
+{
+    // Sprites drawn before the transfer use the old OAM.
+    catch_up();
+
+    for (unsigned int i = 0; i < constants::OAM_SIZE; i++)
+        oam[(oam_addr + i) & 0xFF] = bus->read_byte((page << 8) | i);
+
+    cpu->cycles += constants::OAM_DMA_CYCLES + (cpu->cycles & 1);
+}
+
+// ===========================
+// SAVE STATES
+// ===========================
+
+void PPU::save_state(ppu_state_t& state) const
+{
+    state.dots = dots;
+    state.frame = frame;
+    state.scanline = scanline;
+    state.dot = dot;
+    state.sprite_zero_hit_dot = sprite_zero_hit_dot;
+    state.v = v;
+    state.t = t;
+    state.fine_x = fine_x;
+    state.write_toggle = write_toggle;
+    state.ctrl = ctrl;
+    state.mask = mask;
+    state.status = status;
+    state.oam_addr = oam_addr;
+    state.read_buffer = read_buffer;
+    state.io_latch = io_latch;
+    state.nmi_pending = nmi_pending;
+    std::memset(state.reserved, 0x00, sizeof(state.reserved));
+
+    std::memcpy(state.oam, oam, sizeof(oam));
+    std::memcpy(state.palette, palette, sizeof(palette));
+    std::memcpy(state.vram, vram, sizeof(vram));
+}
+
+void PPU::load_state(const ppu_state_t& state, bool chr_ram_restored)
+{
+    dots = state.dots;
+    frame = state.frame;
+    scanline = state.scanline;
+    dot = state.dot;
+    v = state.v;
+    t = state.t;
+    fine_x = state.fine_x;
+    write_toggle = state.write_toggle != 0;
+    ctrl = state.ctrl;
+    mask = state.mask;
+    status = state.status;
+    oam_addr = state.oam_addr;
+    read_buffer = state.read_buffer;
+    io_latch = state.io_latch;
+    nmi_pending = state.nmi_pending != 0;
+    sprite_zero_hit_dot = state.sprite_zero_hit_dot;
+
+    std::memcpy(oam, state.oam, sizeof(oam));
+    std::memcpy(palette, state.palette, sizeof(palette));
+    std::memcpy(vram, state.vram, sizeof(vram));
+
+    rebuild_attribute_cache();
+
+    // CHR-RAM contents come back with the cartridge state.
+    if (chr_ram != nullptr && chr_ram_restored)
+    {
+        chr_ram_written = true;
+        decode_chr();
+    }
+}
+
+bool PPU::take_chr_ram_written()
+{
+    const bool written = chr_ram_written;
+    chr_ram_written = false;
+    return written;
+}
@@ -0,0 +1,298 @@
+//
+// The picture processing unit (2C02).
+//
+
+#ifndef NESEMULATOR_PPU_HPP
+#define NESEMULATOR_PPU_HPP
+
+#include "cartridge.hpp"
+#include "mos6502.hpp"
+#include "pixel_kernels.hpp"
+#include "ram.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace constants
+{
+    const int SCREEN_WIDTH = 256;
+    const int SCREEN_HEIGHT = 240;
+
+    const int DOTS_PER_SCANLINE = 341;  // PPU clocks per scanline; three per CPU cycle.
+    const int SCANLINES_PER_FRAME = 262;
+    const int VBLANK_SCANLINE = 241;    // Vertical blank (and the NMI) starts at dot 1 of this line.
+    const int PRERENDER_SCANLINE = 261;
+
+    const int PPU_VRAM_SIZE = 0x1000;   // Four 1KiB nametables (four-screen boards use all of them).
+    const int PALETTE_RAM_SIZE = 0x20;
+    const int OAM_SIZE = 0x100;         // 64 sprites of 4 bytes.
+    const int PATTERN_SLOT_SIZE = 0x400; // Pattern tables are mapped in 1KiB slots...
+    const int PATTERN_SLOT_COUNT = 8;    // ...eight of them, $0000-$1FFF.
+
+    const int OAM_DMA_CYCLES = 513;     // CPU cycles stolen by a $4014 write (plus one on odd cycles).
+    const int SCANLINE_CLOCK_DOT = 260; // Where a scanline's sprite fetches first raise PPU A12.
+} // namespace constants
+
+// Called once per rendered scanline (see PPU::set_scanline_handler).
+typedef void (*scanline_handler_t)(void* context);
+
+// Snapshot of the PPU. Fixed layout without padding; part of savestate_t.
+struct ppu_state_t
+{
+    uint64_t dots;  // PPU clocks since power-on.
+    uint64_t frame; // Frames completed (counted at the start of vertical blank).
+    uint16_t scanline;
+    uint16_t dot;
+    uint16_t sprite_zero_hit_dot; // Dot of this scanline at which sprite 0 hits; 0: none.
+    uint16_t v;     // Current VRAM address.
+    uint16_t t;     // Temporary VRAM address (the top-left of the screen).
+    uint8_t fine_x;
+    uint8_t write_toggle;
+    uint8_t ctrl;
+    uint8_t mask;
+    uint8_t status;
+    uint8_t oam_addr;
+    uint8_t read_buffer;
+    uint8_t io_latch;
+    uint8_t nmi_pending;
+    uint8_t reserved[5];
+    uint8_t oam[constants::OAM_SIZE];
+    uint8_t palette[constants::PALETTE_RAM_SIZE];
+    uint8_t vram[constants::PPU_VRAM_SIZE];
+};
+
+/**
+ * The PPU, attached to the CPU bus at $2000-$3FFF (eight registers, mirrored).
+ *
+ * The PPU is run lazily: it only catches up to the CPU's cycle counter when the CPU touches
+ * one of its registers, or when whoever drives the CPU asks it to (at the frame / NMI
+ * deadline from next_vblank_cycle()). Catching up jumps from one event of the scanline to
+ * the next instead of stepping dot by dot.
+ *
+ * Each visible scanline is rendered in one go when the PPU reaches it, from the registers as
+ * they are at that point. Pattern tables are kept pre-decoded (one byte per pixel) and the
+ * palette of every nametable tile is cached, so drawing a tile is a lookup and an 8-byte copy.
+ * Register writes in the middle of a scanline take effect from the next scanline.
+ */
+class PPU
+{
+private:
+    MOS6502* cpu;
+    RAM* bus;
+
+    // Position. `dots' runs at three times the CPU cycle counter once caught up.
+    uint64_t dots = 0;
+    uint64_t frame = 0;
+    unsigned int scanline = 0;
+    unsigned int dot = 0;
+
+    // Registers and internal latches ("loopy" v/t/x/w).
+    uint16_t v = 0;
+    uint16_t t = 0;
+    uint8_t fine_x = 0;
+    bool write_toggle = false;
+    uint8_t ctrl = 0;
+    uint8_t mask = 0;
+    uint8_t status = 0;
+    uint8_t oam_addr = 0;
+    uint8_t read_buffer = 0;
+    uint8_t io_latch = 0;
+    bool nmi_pending = false;
+
+    uint8_t oam[constants::OAM_SIZE];
+    uint8_t palette[constants::PALETTE_RAM_SIZE];
+    uint8_t vram[constants::PPU_VRAM_SIZE];
+
+    // Which 1KiB page of `vram' each of the four logical nametables uses.
+    unsigned int nametable_pages[4];
+
+    // Palette (0-3) of every tile of each physical nametable, indexed by the low 10 bits of
+    // v, kept in sync with the attribute bytes.
+    uint8_t attribute_cache[4][constants::PATTERN_SLOT_SIZE];
+
+    // Pattern memory: CHR-ROM or CHR-RAM, and a copy decoded to one byte (0-3) per pixel,
+    // 64 bytes per tile. `chr_ram' is null for CHR-ROM.
+    const uint8_t* chr = nullptr;
+    uint8_t* chr_ram = nullptr;
+    std::size_t chr_size = 0;
+    std::vector<uint8_t> decoded_chr;
+    std::size_t pattern_offsets[constants::PATTERN_SLOT_COUNT]; // CHR offset of each 1KiB slot.
+    bool chr_ram_written = false; // Since the last take_chr_ram_written().
+
+    // Tile decoding and palette expansion, vectorised where the host allows.
+    const pixel_kernels_t* kernels;
+
+    // Where sprite 0 hits the background on the scanline being drawn (0 = no hit).
+    unsigned int sprite_zero_hit_dot = 0;
+
+    // Cartridge scanline counter, if the board has one. Not part of the emulated state.
+    scanline_handler_t scanline_handler = nullptr;
+    void* scanline_context = nullptr;
+
+    uint32_t frame_buffer[constants::SCREEN_WIDTH * constants::SCREEN_HEIGHT];
+
+    // Off: scanlines are only evaluated, not drawn. Not part of the emulated state.
+    bool video_output = true;
+
+    bool rendering_enabled() const;
+    unsigned int scanline_length() const;
+
+    // The CPU cycle by which the PPU next reaches dot `at_dot' of `line', rounded down: no
+    // read before it sees what happens there.
+    uint64_t cycle_at(unsigned int line, unsigned int at_dot) const;
+
+    // Advances the PPU to `target' dots since power-on.
+    void run_to(uint64_t target);
+    unsigned int next_event_dot() const;
+    void handle_event();
+
+    void raise_nmi();
+
+    void increment_y();
+    void copy_x();
+    void copy_y();
+
+    // PPU address space ($0000-$3FFF).
+    uint8_t ppu_read(uint16_t addr) const;
+    void ppu_write(uint16_t addr, uint8_t value);
+    static unsigned int palette_index(uint16_t addr);
+
+    // Decoded pixels of one pattern table row (`addr' is the address of its low plane byte).
+    const uint8_t* pattern_row(uint16_t addr) const;
+
+    void update_attributes(unsigned int page, unsigned int offset);
+    void rebuild_attribute_cache();
+    void decode_chr();
+
+    void render_scanline();
+
+    // What render_scanline() works out that the CPU can see (sprite overflow, sprite 0 hit),
+    // without drawing anything.
+    void evaluate_scanline();
+
+    static uint8_t read_register(void* context, address_t addr);
+    static void write_register(void* context, address_t addr, uint8_t value);
+    static uint8_t peek_register(void* context, address_t addr);
+public:
+    /**
+     * @param cpu CPU whose cycle counter the PPU follows and which receives its NMIs
+     * @param bus CPU address space, read by OAM DMA
+     */
+    PPU(MOS6502* cpu, RAM* bus);
+    ~PPU();
+
+    PPU(const PPU&) = delete;
+    PPU& operator=(const PPU&) = delete;
+
+    /**
+     * Maps the PPU registers at $2000-$3FFF.
+     * @param ram
+     */
+    void map_into(RAM& ram);
+
+    /**
+     * Installs the cartridge's pattern memory. All slots are mapped to its start; use
+     * map_pattern() to bank-switch.
+     * @param data
+     * @param size a whole number of 1KiB slots; the cartridge rounds up or rejects others
+     */
+    void attach_chr_rom(const uint8_t* data, std::size_t size);
+    void attach_chr_ram(uint8_t* data, std::size_t size);
+
+    /**
+     * Maps `count' 1KiB pattern slots, starting at `slot', to consecutive 1KiB pages of the
+     * attached CHR memory starting at `offset' (taken modulo its size).
+     * @param slot
+     * @param count
+     * @param offset
+     */
+    void map_pattern(unsigned int slot, unsigned int count, std::size_t offset);
+
+    void set_mirroring(mirroring_t mirroring);
+
+    /**
+     * Calls `handler' at dot SCANLINE_CLOCK_DOT of every visible and pre-render scanline while
+     * rendering is enabled, which is when a board watching PPU address line A12 (MMC3) sees it
+     * rise with the standard pattern table layout. nullptr removes it.
+     * @param handler
+     * @param context
+     */
+    void set_scanline_handler(scanline_handler_t handler, void* context);
+
+    /**
+     * Clears the PPU's memory and registers and puts it at the start of a frame.
+     */
+    void power_on();
+
+    /**
+     * Runs the PPU up to the CPU's current cycle.
+     */
+    void catch_up();
+
+    /**
+     * The CPU cycle at which the next vertical blank (end of frame, and NMI if enabled)
+     * begins. The CPU can run freely until then.
+     */
+    uint64_t next_vblank_cycle() const;
+
+    /**
+     * The CPU cycle at which the scanline handler will be called for the `count'th time from
+     * now (count >= 1), if rendering stays enabled: the earliest it can happen.
+     * @param count
+     */
+    uint64_t scanline_clock_cycle(unsigned int count) const;
+
+    /**
+     * The earliest CPU cycle at which reading PPUSTATUS may return something other than
+     * reading it now would, as long as no PPU register is written: a loop polling $2002 can
+     * be skipped up to then. Call after catch_up().
+     */
+    uint64_t next_status_change_cycle() const;
+
+    /**
+     * Returns true, once, if an NMI has been raised since the last call.
+     */
+    bool take_nmi();
+
+    /**
+     * Copies 256 bytes from CPU page `page' into OAM and charges the CPU for it ($4014).
+     * @param page
+     */
+    void oam_dma(uint8_t page);
+
+    /**
+     * Number of frames completed. A frame completes when vertical blank begins, at which
+     * point get_frame_buffer() holds the whole picture.
+     */
+    uint64_t get_frame() const;
+
+    /**
+     * The picture, SCREEN_WIDTH x SCREEN_HEIGHT pixels in 0xAARRGGBB format (Allegro's
+     * ALLEGRO_PIXEL_FORMAT_ARGB_8888), row by row with no padding.
+     */
+    const uint32_t* get_frame_buffer() const;
+
+    /**
+     * Switches drawing on or off. While off the frame buffer is left as it is, but sprite 0
+     * hits and sprite overflow still happen exactly as when drawing.
+     * @param enabled
+     */
+    void set_video_output(bool enabled);
+
+    /**
+     * Whether CHR-RAM may have changed (written through $2007, attached or restored) since
+     * the last call.
+     */
+    bool take_chr_ram_written();
+
+    /**
+     * Copies the PPU's registers and memories out to / in from a snapshot. CHR-RAM comes
+     * back with the cartridge; load_state re-decodes it unless told it was left as it was.
+     * @param state
+     * @param chr_ram_restored
+     */
+    void save_state(ppu_state_t& state) const;
+    void load_state(const ppu_state_t& state, bool chr_ram_restored = true);
+};
+
+#endif //NESEMULATOR_PPU_HPP
@@ -0,0 +1,234 @@
+//
+// Guest code profiler for the 6502 core.
+//
+
+#include "profiler.hpp"
+#include "opcodes.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+namespace
+{
+    double percent(uint64_t part, uint64_t whole)
+    {
+        return whole == 0 ? 0.0 : 100.0 * part / whole;
+    }
+} // namespace
+
+Profiler::Profiler() : pc_counters(0x10000), pc_opcodes(0x10000)
+{
+    clear();
+}
+
+void Profiler::clear()
+{
+    std::fill(opcode_counters, opcode_counters + 256, profile_counter_t{});
+    std::fill(pc_counters.begin(), pc_counters.end(), profile_counter_t{});
+    std::fill(pc_opcodes.begin(), pc_opcodes.end(), 0);
+
+    nodes.assign(1, call_node_t{ 0, 0, ROOT, 0 });
+    children.clear();
+    frames.clear();
+    current = 0;
+}
+
+// ===========================
+// CALL TREE
+// ===========================
+
+void Profiler::enter(uint16_t address, call_kind_t kind, uint8_t return_sp)
+{
+    if (frames.size() >= constants::PROFILER_MAX_DEPTH)
+    {
+        // Keep returns balanced, but stop growing the tree (runaway recursion).
+        frames.push_back({ current, return_sp });
+        return;
+    }
+
+    const uint64_t key = ((uint64_t)current << 24) | ((uint64_t)kind << 16) | address;
+    auto found = children.find(key);
+
+    if (found == children.end())
+    {
+        nodes.push_back({ current, address, kind, 0 });
+        found = children.emplace(key, (uint32_t)(nodes.size() - 1)).first;
+    }
+
+    current = found->second;
+    frames.push_back({ current, return_sp });
+}
+
+void Profiler::leave(uint8_t sp)
+{
+    // Every frame whose caller's stack level has been reached again has returned.
+    while (!frames.empty() && frames.back().return_sp <= sp)
+        frames.pop_back();
+
+    current = frames.empty() ? 0 : frames.back().node;
+}
+
+void Profiler::interrupt(bool nmi, uint16_t handler, uint8_t sp, uint8_t cycles)
+{
+    enter(handler, nmi ? NMI : IRQ, (uint8_t)(sp + 3));
+    nodes[current].cycles += cycles;
+}
+
+std::string Profiler::node_name(uint32_t node) const
+{
+    const call_node_t& entry = nodes[node];
+    char name[16];
+
+    switch (entry.kind)
+    {
+        case ROOT: return "reset";
+        case CALL: std::snprintf(name, sizeof(name), "$%04X", entry.address); break;
+        case NMI:  std::snprintf(name, sizeof(name), "NMI:$%04X", entry.address); break;
+        case IRQ:  std::snprintf(name, sizeof(name), "IRQ:$%04X", entry.address); break;
+        case BRK:  std::snprintf(name, sizeof(name), "BRK:$%04X", entry.address); break;
+    }
+
+    return name;
+}
+
+// ===========================
+// RESULTS
+// ===========================
+
+const profile_counter_t& Profiler::opcode_counter(uint8_t opcode) const
+{
+    return opcode_counters[opcode];
+}
+
+const profile_counter_t& Profiler::pc_counter(uint16_t pc) const
+{
+    return pc_counters[pc];
+}
+
+profile_counter_t Profiler::totals() const
+{
+    profile_counter_t total = {};
+
+    for (const profile_counter_t& counter : opcode_counters)
+        total.executions += counter.executions;
+
+    // Interrupt entry cycles are only charged to the call tree, which therefore has the total.
+    for (const call_node_t& node : nodes)
+        total.cycles += node.cycles;
+
+    return total;
+}
+
+void Profiler::write_report(std::ostream& output, std::size_t top) const
+{
+    const profile_counter_t total = totals();
+    char line[128];
+
+    std::snprintf(line, sizeof(line), "%llu instructions, %llu cycles",
+                  (unsigned long long)total.executions, (unsigned long long)total.cycles);
+    output << line << std::endl;
+
+    // Hottest PCs.
+    std::vector<uint32_t> pcs;
+    for (uint32_t pc = 0; pc < pc_counters.size(); pc++)
+    {
+        if (pc_counters[pc].executions != 0)
+            pcs.push_back(pc);
+    }
+
+    std::sort(pcs.begin(), pcs.end(), [this](uint32_t a, uint32_t b) {
+        return pc_counters[a].cycles > pc_counters[b].cycles;
+    });
+
+    output << std::endl << "PC     OP   executions        cycles       %" << std::endl;
+    for (std::size_t i = 0; i < pcs.size() && i < top; i++)
+    {
+        const profile_counter_t& counter = pc_counters[pcs[i]];
+        std::snprintf(line, sizeof(line), "$%04X  %s %12llu  %12llu  %6.2f", pcs[i], opcodes::OPCODE_NAMES[pc_opcodes[pcs[i]]],
+                      (unsigned long long)counter.executions, (unsigned long long)counter.cycles,
+                      percent(counter.cycles, total.cycles));
+        output << line << std::endl;
+    }
+
+    // Opcodes.
+    std::vector<unsigned int> ops;
+    for (unsigned int opcode = 0; opcode < 256; opcode++)
+    {
+        if (opcode_counters[opcode].executions != 0)
+            ops.push_back(opcode);
+    }
+
+    std::sort(ops.begin(), ops.end(), [this](unsigned int a, unsigned int b) {
+        return opcode_counters[a].cycles > opcode_counters[b].cycles;
+    });
+
+    output << std::endl << "OPCODE     executions        cycles       %" << std::endl;
+    for (std::size_t i = 0; i < ops.size() && i < top; i++)
+    {
+        const profile_counter_t& counter = opcode_counters[ops[i]];
+        std::snprintf(line, sizeof(line), "$%02X %s %12llu  %12llu  %6.2f", ops[i], opcodes::OPCODE_NAMES[ops[i]],
+                      (unsigned long long)counter.executions, (unsigned long long)counter.cycles,
+                      percent(counter.cycles, total.cycles));
+        output << line << std::endl;
+    }
+
+    // Functions, by self cycles over every call path.
+    std::map<std::string, uint64_t> functions;
+    for (uint32_t node = 0; node < nodes.size(); node++)
+        functions[node_name(node)] += nodes[node].cycles;
+
+    std::vector<std::pair<std::string, uint64_t>> sorted(functions.begin(), functions.end());
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, uint64_t>& a,
+                                               const std::pair<std::string, uint64_t>& b) {
+        return a.second > b.second;
+    });
+
+    output << std::endl << "FUNCTION       self cycles       %" << std::endl;
+    for (std::size_t i = 0; i < sorted.size() && i < top; i++)
+    {
+        std::snprintf(line, sizeof(line), "%-10s  %12llu  %6.2f", sorted[i].first.c_str(),
+                      (unsigned long long)sorted[i].second, percent(sorted[i].second, total.cycles));
+        output << line << std::endl;
+    }
+}
+
+bool Profiler::write_report(const std::string& path, std::size_t top) const
+{
+    std::ofstream file(path);
+    if (!file)
+    {
+        std::cout << "[Profiler] ERROR! Could not open ``" << path << "'' for writing." << std::endl;
+        return false;
+    }
+
+    write_report(file, top);
+    return true;
+}
+
+bool Profiler::write_folded(const std::string& path) const
+{
+    std::ofstream file(path);
+    if (!file)
+    {
+        std::cout << "[Profiler] ERROR! Could not open ``" << path << "'' for writing." << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> names(nodes.size());
+    for (uint32_t node = 0; node < nodes.size(); node++)
+        names[node] = node_name(node);
+
+    // Parents are always created before their children, so each stack is its parent's plus one.
+    std::vector<std::string> stacks(nodes.size());
+    for (uint32_t node = 0; node < nodes.size(); node++)
+    {
+        stacks[node] = node == 0 ? names[0] : stacks[nodes[node].parent] + ";" + names[node];
+
+        if (nodes[node].cycles != 0)
+            file << stacks[node] << " " << nodes[node].cycles << "\n";
+    }
+
+    return true;
+}
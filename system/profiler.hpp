@@ -0,0 +1,160 @@
+//
+// Guest code profiler for the 6502 core.
+//
+
+#ifndef NESEMULATOR_PROFILER_HPP
+#define NESEMULATOR_PROFILER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace constants
+{
+    const std::size_t PROFILER_MAX_DEPTH = 256; // Calls nested deeper are charged to the deepest frame.
+} // namespace constants
+
+struct profile_counter_t
+{
+    uint64_t executions;
+    uint64_t cycles;
+};
+
+/**
+ * Counts where guest time goes: executions and cycles per opcode and per PC, in flat arrays
+ * indexed by the opcode and the address, plus a call tree built from JSR/RTS, interrupts and
+ * RTI that gives each function's own cycles.
+ *
+ * Attach one to a CPU with MOS6502::attach_profiler(). A CPU without a profiler only tests one
+ * pointer per instruction. Compiled blocks are not profiled, so the recompiler steps aside
+ * while a profiler is attached.
+ *
+ * The call tree follows the stack pointer rather than pairing calls and returns one to one:
+ * a frame ends when the stack is back above where its caller left it. Code that returns
+ * through a pushed address (jump tables) or discards return addresses therefore doesn't
+ * desynchronise it.
+ */
+class Profiler
+{
+private:
+    enum call_kind_t : uint8_t
+    {
+        ROOT,
+        CALL,
+        NMI,
+        IRQ,
+        BRK
+    };
+
+    struct call_node_t
+    {
+        uint32_t parent;
+        uint16_t address;    // Entry point.
+        call_kind_t kind;
+        uint64_t cycles;     // Self cycles.
+    };
+
+    struct frame_t
+    {
+        uint32_t node;
+        uint8_t return_sp;   // Stack pointer once the frame has returned.
+    };
+
+    profile_counter_t opcode_counters[256];
+    std::vector<profile_counter_t> pc_counters;
+    std::vector<uint8_t> pc_opcodes;              // Last opcode seen at each PC, for the report.
+
+    std::vector<call_node_t> nodes;               // Node 0 is the root.
+    std::unordered_map<uint64_t, uint32_t> children;
+    std::vector<frame_t> frames;
+    uint32_t current = 0;
+
+    void enter(uint16_t address, call_kind_t kind, uint8_t return_sp);
+    void leave(uint8_t sp);
+
+    // Name of a call tree node in reports, e.g. "$C123" or "NMI:$C0A0".
+    std::string node_name(uint32_t node) const;
+public:
+    Profiler();
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    /**
+     * Counts one executed instruction. Called by the CPU after the instruction ran.
+     * @param pc address of the opcode
+     * @param opcode
+     * @param cycles cycles the instruction took
+     * @param next_pc PC after the instruction
+     * @param sp stack pointer after the instruction
+     */
+    inline void record(uint16_t pc, uint8_t opcode, uint8_t cycles, uint16_t next_pc, uint8_t sp);
+
+    /**
+     * Counts an interrupt being taken. Called by the CPU once PC holds the handler's address.
+     * @param nmi true for NMI, false for IRQ
+     * @param handler
+     * @param sp stack pointer after the return address and flags were pushed
+     * @param cycles
+     */
+    void interrupt(bool nmi, uint16_t handler, uint8_t sp, uint8_t cycles);
+
+    /**
+     * Forgets everything counted so far.
+     */
+    void clear();
+
+    const profile_counter_t& opcode_counter(uint8_t opcode) const;
+    const profile_counter_t& pc_counter(uint16_t pc) const;
+
+    /**
+     * Totals over everything counted.
+     */
+    profile_counter_t totals() const;
+
+    /**
+     * Writes a human-readable report: the `top' hottest PCs, opcodes and functions by cycles.
+     * @param output
+     * @param top
+     */
+    void write_report(std::ostream& output, std::size_t top = 50) const;
+
+    /**
+     * Same as above, into a file. Returns false if it cannot be written.
+     */
+    bool write_report(const std::string& path, std::size_t top = 50) const;
+
+    /**
+     * Writes the call tree in folded-stack format ("reset;$C123;$C456 1234" per line, cycles
+     * as the weight), which flamegraph.pl and compatible viewers read directly. Returns false
+     * if the file cannot be written.
+     * @param path
+     */
+    bool write_folded(const std::string& path) const;
+};
+
+inline void Profiler::record(uint16_t pc, uint8_t opcode, uint8_t cycles, uint16_t next_pc, uint8_t sp)
+{
+    opcode_counters[opcode].executions++;
+    opcode_counters[opcode].cycles += cycles;
+    pc_counters[pc].executions++;
+    pc_counters[pc].cycles += cycles;
+    pc_opcodes[pc] = opcode;
+
+    // The calling instruction itself is charged to the caller.
+    nodes[current].cycles += cycles;
+
+    switch (opcode)
+    {
+        case 0x20: enter(next_pc, CALL, (uint8_t)(sp + 2)); break; // JSR
+        case 0x00: enter(next_pc, BRK, (uint8_t)(sp + 3)); break;  // BRK
+        case 0x40:                                                  // RTI
+        case 0x60: leave(sp); break;                                // RTS
+        default: break;
+    }
+}
+
+#endif //NESEMULATOR_PROFILER_HPP
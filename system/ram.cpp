@@ -3,6 +3,7 @@
 //
 
 #include "ram.hpp"
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <cstring>
@@ -11,54 +12,503 @@
 RAM::RAM()
 {
     // Zero-fill the RAM bank
-    ram_data.clear();
+    std::memset(internal_ram, 0x00, sizeof(internal_ram));
+    std::memset(open_memory, 0x00, sizeof(open_memory));
+    std::memset(trapped_pages, 0x00, sizeof(trapped_pages));
+    std::memset(watch_flags, 0x00, sizeof(watch_flags));
+    std::fill(page_generations, page_generations + constants::PAGE_COUNT, 1);
+    mark_all_dirty();
 
-    for (unsigned int i = 0; i < constants::MAX_ADDRESS_SIZE; i++)
+    map_nes_layout();
+}
+RAM::~RAM() = default;
+
+uint8_t RAM::unmapped_read(void*, address_t)
+{
+    return 0x00;
+}
+
+void RAM::ignore_write(void*, address_t, uint8_t)
+{
+}
+
+unsigned int RAM::chunk_of(const uint8_t* memory) const
+{
+    if (memory >= internal_ram && memory < internal_ram + sizeof(internal_ram))
+        return (memory - internal_ram) / constants::PAGE_SIZE;
+
+    if (memory >= open_memory && memory < open_memory + sizeof(open_memory))
+        return (sizeof(internal_ram) + (memory - open_memory)) / constants::PAGE_SIZE;
+
+    return UNTRACKED_CHUNK;
+}
+
+void RAM::mark_all_dirty()
+{
+    std::memset(dirty_chunks, 0xFF, sizeof(dirty_chunks));
+}
+
+bool RAM::is_chunk_dirty(unsigned int chunk) const
+{
+    return (dirty_chunks[chunk >> 6] >> (chunk & 63)) & 1;
+}
+
+void RAM::clear_dirty()
+{
+    std::memset(dirty_chunks, 0x00, sizeof(dirty_chunks));
+    dirty_epoch++;
+}
+
+uint64_t RAM::get_dirty_epoch() const
+{
+    return dirty_epoch;
+}
+
+uint8_t RAM::peek_byte(address_t addr) const
+{
+    const unsigned int page = (addr >> 8) & 0xFF;
+
+    if (read_pages[page] != nullptr)
+        return read_pages[page][addr & 0xFF];
+
+    return peek_handlers[page](handler_contexts[page], addr & 0xFFFF);
+}
+
+void RAM::map_memory(address_t addr_start, address_t addr_end, uint8_t* memory, unsigned int memory_size, bool writable)
+{
+    const unsigned int first_page = (addr_start >> 8) & 0xFF;
+    const unsigned int last_page = (addr_end >> 8) & 0xFF;
+
+    for (unsigned int page = first_page; page <= last_page; page++)
     {
-        ram_data.push_back(0x00);
+        // Mirror the backing memory if the mapped range is bigger than it.
+        uint8_t* page_memory = memory + (((page - first_page) * constants::PAGE_SIZE) % memory_size);
+
+        read_pages[page] = page_memory;
+        write_pages[page] = writable ? page_memory : nullptr;
+        write_chunks[page] = chunk_of(page_memory);
+        read_handlers[page] = &RAM::unmapped_read;
+        write_handlers[page] = &RAM::ignore_write;
+        peek_handlers[page] = &RAM::unmapped_read;
+        handler_contexts[page] = nullptr;
+        trapped_pages[page] = nullptr;
+
+        resume_watch(page);
     }
+
+    notify_remap(addr_start, addr_end);
 }
-RAM::~RAM() = default;
 
-void RAM::write_byte(address_t addr, uint8_t value)
+void RAM::map_handlers(address_t addr_start, address_t addr_end, read_handler_t read_handler,
+                       write_handler_t write_handler, read_handler_t peek_handler, void* context)
 {
-    // Write the data ``value'' to the memory address ``addr''.
-    // Deny the write if it is out-of-bounds.
-    if (addr > constants::MAX_ADDRESS_SIZE || addr < 0x0000)
+    const unsigned int first_page = (addr_start >> 8) & 0xFF;
+    const unsigned int last_page = (addr_end >> 8) & 0xFF;
+
+    for (unsigned int page = first_page; page <= last_page; page++)
     {
-        std::cout << "ERROR! Illegal write at $" << std::hex << addr << "attempted! (write " << value << ")" << std::endl;
-        return;
+        read_pages[page] = nullptr;
+        write_pages[page] = nullptr;
+        write_chunks[page] = UNTRACKED_CHUNK;
+        read_handlers[page] = read_handler != nullptr ? read_handler : &RAM::unmapped_read;
+        write_handlers[page] = write_handler != nullptr ? write_handler : &RAM::ignore_write;
+        peek_handlers[page] = peek_handler != nullptr ? peek_handler : &RAM::unmapped_read;
+        handler_contexts[page] = context;
+        trapped_pages[page] = nullptr;
+
+        resume_watch(page);
     }
 
-    ram_data[addr] = value; // I don't see anything wrong with just... doing this...
+    notify_remap(addr_start, addr_end);
 }
 
-uint8_t RAM::read_byte(address_t addr)
+void RAM::map_read_only(address_t addr_start, address_t addr_end, const uint8_t* memory, unsigned int memory_size,
+                        write_handler_t write_handler, void* context)
 {
-    // Read the data at the memory address ``addr'' and return it.
-    if (addr > constants::MAX_ADDRESS_SIZE || addr < 0x0000)
+    // Read-only pages never get a write pointer, so the memory is never written through.
+    map_memory(addr_start, addr_end, const_cast<uint8_t*>(memory), memory_size, false);
+
+    const unsigned int first_page = (addr_start >> 8) & 0xFF;
+    const unsigned int last_page = (addr_end >> 8) & 0xFF;
+
+    for (unsigned int page = first_page; page <= last_page; page++)
     {
-        std::cout << "ERROR! Illegal read at $" << std::hex << addr << " attempted! " << std::endl;
-        return 0xAA;
+        suspend_watch(page);
+        write_handlers[page] = write_handler != nullptr ? write_handler : &RAM::ignore_write;
+        handler_contexts[page] = context;
+        resume_watch(page);
     }
-    return ram_data[addr];
 }
 
-void RAM::write_byte_range(address_t addr_start, address_t addr_stop, uint8_t value) {
-    // Write a single value into a byte range.
-    for (address_t addr = addr_start; addr < addr_stop; addr++)
+void RAM::trap_writes(const uint8_t* memory, write_handler_t handler, void* context)
+{
+    for (unsigned int page = 0; page < constants::PAGE_COUNT; page++)
+    {
+        suspend_watch(page);
+
+        if (write_pages[page] == memory)
+        {
+            trapped_pages[page] = write_pages[page];
+            write_pages[page] = nullptr;
+            write_handlers[page] = handler;
+            handler_contexts[page] = context;
+        }
+
+        resume_watch(page);
+    }
+}
+
+void RAM::untrap_writes(const uint8_t* memory)
+{
+    for (unsigned int page = 0; page < constants::PAGE_COUNT; page++)
+    {
+        if (trapped_pages[page] != memory)
+            continue;
+
+        suspend_watch(page);
+        write_pages[page] = trapped_pages[page];
+        write_handlers[page] = &RAM::ignore_write;
+        handler_contexts[page] = nullptr;
+        trapped_pages[page] = nullptr;
+        resume_watch(page);
+    }
+}
+
+void RAM::write_through(address_t addr, uint8_t value)
+{
+    const unsigned int page = (addr >> 8) & 0xFF;
+    uint8_t* memory = trapped_pages[page];
+
+    if (memory == nullptr)
     {
         write_byte(addr, value);
+        return;
+    }
+
+    memory[addr & 0xFF] = value;
+
+    const unsigned int chunk = write_chunks[page];
+    dirty_chunks[chunk >> 6] |= 1ull << (chunk & 63);
+}
+
+void RAM::set_remap_listener(remap_listener_t listener, void* context)
+{
+    remap_listener = listener;
+    remap_context = context;
+}
+
+void RAM::notify_remap(address_t addr_start, address_t addr_end)
+{
+    for (unsigned int page = (addr_start >> 8) & 0xFF; page <= ((addr_end >> 8) & 0xFF); page++)
+    {
+        if (++page_generations[page] == 0)
+            page_generations[page] = 1;
+    }
+
+    if (remap_listener != nullptr)
+        remap_listener(remap_context, addr_start, addr_end);
+}
+
+// ===========================
+// WATCHES
+// ===========================
+
+void RAM::set_watch_handler(watch_handler_t handler, void* context)
+{
+    watch_handler = handler;
+    watch_context = context;
+}
+
+void RAM::watch_pages(address_t addr_start, address_t addr_end, uint8_t flags)
+{
+    const unsigned int first_page = (addr_start >> 8) & 0xFF;
+    const unsigned int last_page = (addr_end >> 8) & 0xFF;
+
+    for (unsigned int page = first_page; page <= last_page; page++)
+    {
+        if (watch_flags[page] == flags)
+            continue;
+
+        suspend_watch(page);
+        watch_flags[page] = flags;
+        resume_watch(page);
+
+        // What the page reads is now seen differently (e.g. it stops being read-only).
+        notify_remap(page << 8, (page << 8) | 0xFF);
+    }
+}
+
+uint8_t RAM::page_watch(address_t addr) const
+{
+    return watch_flags[(addr >> 8) & 0xFF];
+}
+
+void RAM::suspend_watch(unsigned int page)
+{
+    if (watch_flags[page] == 0)
+        return;
+
+    read_pages[page] = watched_read_pages[page];
+    write_pages[page] = watched_write_pages[page];
+    read_handlers[page] = watched_read_handlers[page];
+    write_handlers[page] = watched_write_handlers[page];
+    peek_handlers[page] = watched_peek_handlers[page];
+    handler_contexts[page] = watched_contexts[page];
+}
+
+void RAM::resume_watch(unsigned int page)
+{
+    if (watch_flags[page] == 0)
+        return;
+
+    watched_read_pages[page] = read_pages[page];
+    watched_write_pages[page] = write_pages[page];
+    watched_read_handlers[page] = read_handlers[page];
+    watched_write_handlers[page] = write_handlers[page];
+    watched_peek_handlers[page] = peek_handlers[page];
+    watched_contexts[page] = handler_contexts[page];
+
+    // Every access to the page now takes the handler path.
+    read_pages[page] = nullptr;
+    write_pages[page] = nullptr;
+    read_handlers[page] = &RAM::watched_read;
+    write_handlers[page] = &RAM::watched_write;
+    peek_handlers[page] = &RAM::watched_peek;
+    handler_contexts[page] = this;
+}
+
+uint8_t RAM::watched_read(void* context, address_t addr)
+{
+    RAM& ram = *static_cast<RAM*>(context);
+    const unsigned int page = (addr >> 8) & 0xFF;
+
+    const uint8_t* memory = ram.watched_read_pages[page];
+    const uint8_t value = memory != nullptr ? memory[addr & 0xFF]
+                                            : ram.watched_read_handlers[page](ram.watched_contexts[page], addr);
+
+    if ((ram.watch_flags[page] & WATCH_READ) && ram.watch_handler != nullptr)
+        ram.watch_handler(ram.watch_context, addr, value, false);
+
+    return value;
+}
+
+void RAM::watched_write(void* context, address_t addr, uint8_t value)
+{
+    RAM& ram = *static_cast<RAM*>(context);
+    const unsigned int page = (addr >> 8) & 0xFF;
+
+    if ((ram.watch_flags[page] & WATCH_WRITE) && ram.watch_handler != nullptr)
+        ram.watch_handler(ram.watch_context, addr, value, true);
+
+    uint8_t* memory = ram.watched_write_pages[page];
+
+    if (memory != nullptr)
+    {
+        memory[addr & 0xFF] = value;
+
+        const unsigned int chunk = ram.write_chunks[page];
+        ram.dirty_chunks[chunk >> 6] |= 1ull << (chunk & 63);
+    }
+    else
+    {
+        ram.watched_write_handlers[page](ram.watched_contexts[page], addr, value);
+    }
+}
+
+uint8_t RAM::watched_peek(void* context, address_t addr)
+{
+    const RAM& ram = *static_cast<const RAM*>(context);
+    const unsigned int page = (addr >> 8) & 0xFF;
+
+    const uint8_t* memory = ram.watched_read_pages[page];
+    return memory != nullptr ? memory[addr & 0xFF] : ram.watched_peek_handlers[page](ram.watched_contexts[page], addr);
+}
+
+bool RAM::is_read_only(address_t addr) const
+{
+    const unsigned int page = (addr >> 8) & 0xFF;
+
+    // Writes go to a handler (not a trap on writable memory): nothing on the bus can change
+    // what this page reads.
+    return read_pages[page] != nullptr && write_pages[page] == nullptr && trapped_pages[page] == nullptr;
+}
+
+bool RAM::is_memory(address_t addr) const
+{
+    return read_pages[(addr >> 8) & 0xFF] != nullptr;
+}
+
+void RAM::map_nes_layout()
+{
+    // $0000-$1FFF: 2KiB internal RAM, mirrored four times.
+    map_memory(0x0000, 0x1FFF, internal_ram, sizeof(internal_ram), true);
+
+    // $2000-$FFFF: plain memory until devices and the cartridge are mapped over it.
+    map_memory(0x2000, 0xFFFF, open_memory + 0x2000, sizeof(open_memory) - 0x2000, true);
+}
+
+void RAM::map_flat()
+{
+    map_memory(0x0000, 0xFFFF, open_memory, sizeof(open_memory), true);
+}
+
+std::size_t RAM::contiguous_run(uint8_t* const* table, address_t addr, std::size_t max_length) const
+{
+    unsigned int page = (addr >> 8) & 0xFF;
+    const uint8_t* expected = table[page];
+
+    if (expected == nullptr)
+        return 0;
+
+    // Bytes left in the first page, then whole pages for as long as the next page's memory
+    // directly follows the current one's.
+    std::size_t length = constants::PAGE_SIZE - (addr & 0xFF);
+
+    while (length < max_length && page < constants::PAGE_COUNT - 1)
+    {
+        expected += constants::PAGE_SIZE;
+        page++;
+
+        if (table[page] != expected)
+            break;
+
+        length += constants::PAGE_SIZE;
     }
+
+    return length < max_length ? length : max_length;
 }
 
-void RAM::write_byte_vector(address_t addr_start, std::vector<uint8_t>& byte_vector)
+void RAM::mark_dirty_range(address_t addr, std::size_t length)
 {
-    address_t current_addr = addr_start;
-    for (auto it = std::begin(byte_vector); it != std::end(byte_vector); ++it)
+    // `addr' .. `addr + length' is a contiguous run of memory-backed pages.
+    for (unsigned int page = (addr >> 8) & 0xFF; page <= ((addr + length - 1) >> 8) && page < constants::PAGE_COUNT; page++)
     {
-        write_byte(current_addr, *it);
-        current_addr++;
+        const unsigned int chunk = write_chunks[page];
+        dirty_chunks[chunk >> 6] |= 1ull << (chunk & 63);
+    }
+}
+
+void RAM::load(const uint8_t* data, std::size_t length, address_t addr_start)
+{
+    address_t addr = addr_start & 0xFFFF;
+
+    while (length > 0)
+    {
+        // Don't let a run go past $FFFF; the address wraps around to $0000 instead.
+        std::size_t max_length = constants::ADDRESS_SPACE_SIZE - addr;
+        if (max_length > length)
+            max_length = length;
+
+        std::size_t run = contiguous_run(write_pages, addr, max_length);
+
+        if (run > 0)
+        {
+            std::memcpy(write_pages[addr >> 8] + (addr & 0xFF), data, run);
+            mark_dirty_range(addr, run);
+        }
+        else
+        {
+            // Handler-backed page: write byte by byte up to the end of the page.
+            run = constants::PAGE_SIZE - (addr & 0xFF);
+            if (run > max_length)
+                run = max_length;
+
+            for (std::size_t i = 0; i < run; i++)
+                write_byte(addr + i, data[i]);
+        }
+
+        data += run;
+        length -= run;
+        addr = (addr + run) & 0xFFFF;
+    }
+}
+
+void RAM::load(const std::vector<uint8_t>& bytes, address_t addr_start)
+{
+    load(bytes.data(), bytes.size(), addr_start);
+}
+
+void RAM::fill(address_t addr_start, address_t addr_stop, uint8_t value)
+{
+    address_t addr = addr_start;
+
+    while (addr < addr_stop)
+    {
+        std::size_t max_length = addr_stop - addr;
+        std::size_t run = contiguous_run(write_pages, addr, max_length);
+
+        if (run > 0)
+        {
+            std::memset(write_pages[(addr >> 8) & 0xFF] + (addr & 0xFF), value, run);
+            mark_dirty_range(addr, run);
+        }
+        else
+        {
+            run = constants::PAGE_SIZE - (addr & 0xFF);
+            if (run > max_length)
+                run = max_length;
+
+            for (std::size_t i = 0; i < run; i++)
+                write_byte(addr + i, value);
+        }
+
+        addr += run;
+    }
+}
+
+void RAM::write_byte_range(address_t addr_start, address_t addr_stop, uint8_t value) {
+    // Write a single value into a byte range.
+    fill(addr_start, addr_stop, value);
+}
+
+void RAM::write_byte_vector(address_t addr_start, const std::vector<uint8_t>& byte_vector)
+{
+    load(byte_vector, addr_start);
+}
+
+void RAM::snapshot_into(uint8_t* buffer) const
+{
+    std::memcpy(buffer, internal_ram, sizeof(internal_ram));
+    std::memcpy(buffer + sizeof(internal_ram), open_memory, sizeof(open_memory));
+}
+
+void RAM::restore_from(const uint8_t* buffer)
+{
+    std::memcpy(internal_ram, buffer, sizeof(internal_ram));
+    std::memcpy(open_memory, buffer + sizeof(internal_ram), sizeof(open_memory));
+    mark_all_dirty();
+    notify_remap(0x0000, constants::MAX_ADDRESS_SIZE);
+}
+
+void RAM::restore_dirty_from(const uint8_t* buffer)
+{
+    for (unsigned int chunk = 0; chunk < (unsigned int)constants::RAM_CHUNK_COUNT; chunk++)
+    {
+        if (!is_chunk_dirty(chunk))
+            continue;
+
+        uint8_t* memory = chunk < sizeof(internal_ram) / constants::PAGE_SIZE
+                              ? internal_ram + chunk * constants::PAGE_SIZE
+                              : open_memory + chunk * constants::PAGE_SIZE - sizeof(internal_ram);
+        std::memcpy(memory, buffer + chunk * constants::PAGE_SIZE, constants::PAGE_SIZE);
+    }
+
+    // Tell caches about every view of what changed (mirrors included), and nothing else.
+    for (unsigned int page = 0; page < constants::PAGE_COUNT; page++)
+    {
+        const bool watched = watch_flags[page] != 0;
+        const uint8_t* memory = watched ? watched_read_pages[page] : read_pages[page];
+        const uint8_t* writes = watched ? watched_write_pages[page] : write_pages[page];
+
+        if (memory == nullptr)
+            continue;
+
+        const unsigned int chunk = chunk_of(memory);
+        if (chunk == UNTRACKED_CHUNK && writes == nullptr)
+            continue; // ROM.
+
+        if (is_chunk_dirty(chunk))
+            notify_remap(page << 8, (page << 8) | 0xFF);
     }
 }
 
@@ -78,7 +528,7 @@ void RAM::hexdump_bytes(address_t addr_start, unsigned int bytes_to_read, unsign
         // Start printing n=row_width bytes
         for (unsigned int byte_id = 0; byte_id < row_width; byte_id++)
         {
-            std::cout << std::hex << std::setw(2) << int(read_byte(row_base_address + byte_id)) << std::dec << " ";
+            std::cout << std::hex << std::setw(2) << int(peek_byte(row_base_address + byte_id)) << std::dec << " ";
         }
     }
 
@@ -92,12 +542,13 @@ void RAM::hexdump_range(address_t addr_start, address_t addr_end, unsigned int r
 void RAM::clear_address_space()
 {
     // Zero-fill the RAM bank
-    ram_data.clear();
-
-    for (unsigned int i = 0; i < constants::MAX_ADDRESS_SIZE; i++)
-    {
-        ram_data.push_back(0x00);
-    }
+    std::memset(internal_ram, 0x00, sizeof(internal_ram));
+    std::memset(open_memory, 0x00, sizeof(open_memory));
+    mark_all_dirty();
+    notify_remap(0x0000, constants::MAX_ADDRESS_SIZE);
 }
 
-
+const uint8_t* RAM::get_internal_ram() const
+{
+    return internal_ram;
+}
@@ -5,6 +5,7 @@
 #ifndef NESEMULATOR_RAM_HPP
 #define NESEMULATOR_RAM_HPP
 
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 
@@ -15,29 +16,292 @@ namespace constants
 {
     const int NES_RAM_SIZE = 0x0800; // Historically, the NES has had 2KiB of RAM.
     const int MAX_ADDRESS_SIZE = 0xffff; // $FFFF is the maximum addressable memory address.
+    const int ADDRESS_SPACE_SIZE = 0x10000; // 64KiB of addressable memory.
+    const int PAGE_SIZE = 0x100; // The bus maps memory in 256-byte pages...
+    const int PAGE_COUNT = 0x100; // ...so there are 256 of them.
+    const int RAM_SNAPSHOT_SIZE = NES_RAM_SIZE + ADDRESS_SPACE_SIZE; // Bytes written by RAM::snapshot_into.
+    const int RAM_CHUNK_COUNT = RAM_SNAPSHOT_SIZE / PAGE_SIZE; // 256-byte chunks of that snapshot.
 } // namespace constants
 
+// Handlers for pages that are backed by device registers rather than memory. `context' is
+// whatever pointer was given when the handler was mapped (usually the device object).
+typedef uint8_t (*read_handler_t)(void* context, address_t addr);
+typedef void (*write_handler_t)(void* context, address_t addr, uint8_t value);
+
+// Told about the pages covering [addr_start, addr_end] whenever what they map to, or the
+// memory behind them, changes wholesale (remapping, clearing, restoring a snapshot).
+typedef void (*remap_listener_t)(void* context, address_t addr_start, address_t addr_end);
+
+// Told about every access to a watched page (see RAM::watch_pages): writes before they happen,
+// reads once the value is known.
+typedef void (*watch_handler_t)(void* context, address_t addr, uint8_t value, bool write);
+
+/**
+ * The CPU's view of the address space. RAM also contains ROM. Ha!
+ *
+ * Memory is mapped in 256-byte pages through a page table. Each page points either straight
+ * at backing memory (internal RAM, cartridge memory) or, when its pointer is null, at a
+ * read/write handler (I/O registers, mapper registers, read-only memory). Most accesses are
+ * therefore a single indexed load, and remapping a bank only rewrites page pointers.
+ *
+ * By default the internal 2KiB RAM is mirrored through $1FFF, and the rest of the address
+ * space ($2000-$FFFF) is backed by plain memory until a device or cartridge is mapped over it.
+ */
 class RAM
 {
 private:
-    std::vector<uint8_t> ram_data;
+    // Page table. A null pointer means "use the handler for this page".
+    uint8_t* read_pages[constants::PAGE_COUNT];
+    uint8_t* write_pages[constants::PAGE_COUNT];
+
+    read_handler_t read_handlers[constants::PAGE_COUNT];
+    write_handler_t write_handlers[constants::PAGE_COUNT];
+    read_handler_t peek_handlers[constants::PAGE_COUNT];
+    void* handler_contexts[constants::PAGE_COUNT];
+
+    // Write traps (see trap_writes): the memory each trapped page writes to, null otherwise.
+    uint8_t* trapped_pages[constants::PAGE_COUNT];
+
+    // Watched pages (see watch_pages): the mapping each one really has while its table entries
+    // are pointed at the watch handlers.
+    uint8_t watch_flags[constants::PAGE_COUNT];
+    uint8_t* watched_read_pages[constants::PAGE_COUNT];
+    uint8_t* watched_write_pages[constants::PAGE_COUNT];
+    read_handler_t watched_read_handlers[constants::PAGE_COUNT];
+    write_handler_t watched_write_handlers[constants::PAGE_COUNT];
+    read_handler_t watched_peek_handlers[constants::PAGE_COUNT];
+    void* watched_contexts[constants::PAGE_COUNT];
+
+    watch_handler_t watch_handler = nullptr;
+    void* watch_context = nullptr;
+
+    // Bumped for a page whenever it is remapped or its memory is replaced wholesale, so caches
+    // of what a page holds can check they are still current (see page_generation).
+    uint32_t page_generations[constants::PAGE_COUNT];
+
+    remap_listener_t remap_listener = nullptr;
+    void* remap_context = nullptr;
+
+    // Backing memory.
+    uint8_t internal_ram[constants::NES_RAM_SIZE];
+    uint8_t open_memory[constants::ADDRESS_SPACE_SIZE]; // Everything not mapped elsewhere.
+
+    // Dirty tracking. Each writable page knows which 256-byte chunk of the snapshot_into()
+    // layout it writes to; a write sets that chunk's bit. Pages backed by memory outside this
+    // object (e.g. cartridge PRG-RAM) all report to one spare "untracked" bit at the end.
+    uint16_t write_chunks[constants::PAGE_COUNT];
+    uint64_t dirty_chunks[(constants::RAM_CHUNK_COUNT + 1 + 63) / 64];
+
+    // Bumped by clear_dirty(), so each user of the dirty bits can tell whether another has
+    // cleared them since it did.
+    uint64_t dirty_epoch = 0;
+
+    // Chunk index of a page of backing memory, or UNTRACKED_CHUNK.
+    unsigned int chunk_of(const uint8_t* memory) const;
+
+    // Marks chunks dirty after bulk changes that bypass write_byte.
+    void mark_all_dirty();
+    void mark_dirty_range(address_t addr, std::size_t length);
+
+    void notify_remap(address_t addr_start, address_t addr_end);
+
+    // Put a watched page's real mapping back in the tables, and reinstall the watch on top of
+    // whatever the page maps to now. Anything that edits a page's mapping in place brackets
+    // the edit with these; both do nothing on unwatched pages.
+    void suspend_watch(unsigned int page);
+    void resume_watch(unsigned int page);
+
+    static uint8_t watched_read(void* context, address_t addr);
+    static void watched_write(void* context, address_t addr, uint8_t value);
+    static uint8_t watched_peek(void* context, address_t addr);
+
+    // Default handlers: unmapped reads see open bus (0), writes are dropped.
+    static uint8_t unmapped_read(void* context, address_t addr);
+    static void ignore_write(void* context, address_t addr, uint8_t value);
+
+    // Number of bytes from `addr' onwards that are backed by one contiguous block of memory
+    // in `table' (at most `max_length'), following adjacent pages that map to adjacent memory.
+    // Returns 0 if the page at `addr' goes through a handler.
+    std::size_t contiguous_run(uint8_t* const* table, address_t addr, std::size_t max_length) const;
+
+    // The recompiler generates code that walks the page tables itself.
+    friend class JIT;
 public:
+    static const uint8_t WATCH_READ = 1 << 0;
+    static const uint8_t WATCH_WRITE = 1 << 1;
+
+    // The chunk that writes to memory outside this object (e.g. PRG-RAM) are counted under.
+    static const unsigned int UNTRACKED_CHUNK = constants::RAM_CHUNK_COUNT;
+
     RAM();
     ~RAM();
 
+    // The page table points into this object, so it cannot be copied.
+    RAM(const RAM&) = delete;
+    RAM& operator=(const RAM&) = delete;
+
     /**
      * Writes a single byte to a memory address.
      * @param addr
      * @param value
      */
-    void write_byte(address_t addr, uint8_t value);
+    inline void write_byte(address_t addr, uint8_t value);
 
     /**
      * Reads a single byte from a memory address, returning it.
      * @param addr
      * @return data at address
      */
-    uint8_t read_byte(address_t addr);
+    inline uint8_t read_byte(address_t addr);
+
+    /**
+     * Reads a single byte without side effects (I/O registers are not triggered). Meant for
+     * debuggers, tracers and dumps.
+     * @param addr
+     * @return data at address, or open bus (0) for registers that cannot be peeked
+     */
+    uint8_t peek_byte(address_t addr) const;
+
+    /**
+     * Maps the pages covering [addr_start, addr_end] onto backing memory. If the range is
+     * larger than the backing memory, the memory is mirrored through it.
+     * @param addr_start first address; must be page-aligned
+     * @param addr_end last address (inclusive)
+     * @param memory backing memory
+     * @param memory_size size of `memory' in bytes; must be a multiple of the page size
+     * @param writable if false, writes to these pages are dropped
+     */
+    void map_memory(address_t addr_start, address_t addr_end, uint8_t* memory, unsigned int memory_size, bool writable);
+
+    /**
+     * Maps the pages covering [addr_start, addr_end] onto device handlers. Any of the
+     * handlers may be null: reads then see open bus, writes are dropped, peeks return 0.
+     * @param addr_start first address; must be page-aligned
+     * @param addr_end last address (inclusive)
+     */
+    void map_handlers(address_t addr_start, address_t addr_end, read_handler_t read_handler,
+                      write_handler_t write_handler, read_handler_t peek_handler, void* context);
+
+    /**
+     * Maps the pages covering [addr_start, addr_end] for reads from `memory', while writes go
+     * to `write_handler' (e.g. cartridge ROM whose writes hit mapper registers).
+     */
+    void map_read_only(address_t addr_start, address_t addr_end, const uint8_t* memory, unsigned int memory_size,
+                       write_handler_t write_handler, void* context);
+
+    /**
+     * Routes writes to every page that currently writes straight to `memory' (one page of
+     * backing memory, so mirrors are caught too) through `handler', leaving reads alone. The
+     * handler can complete the write with write_through(). Remapping a page drops its trap.
+     * Used to notice writes to memory that holds compiled code.
+     * @param memory
+     * @param handler
+     * @param context
+     */
+    void trap_writes(const uint8_t* memory, write_handler_t handler, void* context);
+
+    /**
+     * Removes the traps set on `memory' by trap_writes.
+     * @param memory
+     */
+    void untrap_writes(const uint8_t* memory);
+
+    /**
+     * Performs a write on a trapped page as if it were not trapped. Same as write_byte on
+     * any other page.
+     * @param addr
+     * @param value
+     */
+    void write_through(address_t addr, uint8_t value);
+
+    /**
+     * Sets the single listener told about remapped or wholesale-changed pages (nullptr to
+     * remove it).
+     * @param listener
+     * @param context
+     */
+    void set_remap_listener(remap_listener_t listener, void* context);
+
+    /**
+     * Sets the single handler told about accesses to watched pages (nullptr to remove it).
+     * @param handler
+     * @param context
+     */
+    void set_watch_handler(watch_handler_t handler, void* context);
+
+    /**
+     * Sets the watch flags (WATCH_READ, WATCH_WRITE, or 0 to stop watching) of the pages
+     * covering [addr_start, addr_end]. Accesses to watched pages leave the fast path and go
+     * through the watch handler, whatever the page is mapped to; other pages are unaffected.
+     * Watches survive remapping. Instruction fetches are bus reads too, and are reported.
+     * @param addr_start
+     * @param addr_end
+     * @param flags
+     */
+    void watch_pages(address_t addr_start, address_t addr_end, uint8_t flags);
+
+    /**
+     * Watch flags of the page covering `addr'.
+     * @param addr
+     */
+    uint8_t page_watch(address_t addr) const;
+
+    /**
+     * Changes whenever the page covering `addr' is remapped or its memory replaced, never
+     * otherwise. Never 0, so 0 can mean "not yet seen" to a cache.
+     * @param addr
+     */
+    inline uint32_t page_generation(address_t addr) const;
+
+    /**
+     * Whether the page covering `addr' reads straight from memory that the bus never writes
+     * to (ROM): its contents only change when the page is remapped.
+     * @param addr
+     */
+    bool is_read_only(address_t addr) const;
+
+    /**
+     * Whether the page covering `addr' reads straight from memory rather than through a
+     * device handler, so that a read has no effect and returns what was last written.
+     * @param addr
+     */
+    bool is_memory(address_t addr) const;
+
+    /**
+     * Restores the default NES layout: internal RAM mirrored through $1FFF, plain memory above.
+     */
+    void map_nes_layout();
+
+    /**
+     * Maps the whole 64KiB address space onto plain memory, with no mirroring. Useful for
+     * running bare 6502 programs such as CPU test suites.
+     */
+    void map_flat();
+
+    /**
+     * Copies a block of bytes into memory starting at `addr_start', exactly as if the CPU had
+     * written them one by one (the address wraps at $FFFF). Runs of memory-backed pages are
+     * copied with a single memcpy; only handler-backed pages are written byte by byte.
+     * @param data
+     * @param length
+     * @param addr_start
+     */
+    void load(const uint8_t* data, std::size_t length, address_t addr_start);
+
+    /**
+     * Same as above, for a whole vector.
+     * @param bytes
+     * @param addr_start
+     */
+    void load(const std::vector<uint8_t>& bytes, address_t addr_start);
+
+    /**
+     * Fills [addr_start, addr_stop) with `value', memset-ing memory-backed pages.
+     * @param addr_start
+     * @param addr_stop
+     * @param value
+     */
+    void fill(address_t addr_start, address_t addr_stop, uint8_t value);
 
     /**
      * Fills the provided value over a range specified by a start and stop address.
@@ -52,13 +316,64 @@ public:
      * @param addr_start
      * @param byte_vector
      */
-    void write_byte_vector(address_t addr_start, std::vector<uint8_t>& byte_vector);
+    void write_byte_vector(address_t addr_start, const std::vector<uint8_t>& byte_vector);
+
+    /**
+     * Copies all backing memory (internal RAM, then the rest of the address space) into
+     * `buffer', which must hold constants::RAM_SNAPSHOT_SIZE bytes. Independent of the
+     * current mapping, and free of I/O side effects.
+     * @param buffer
+     */
+    void snapshot_into(uint8_t* buffer) const;
+
+    /**
+     * Restores backing memory from a buffer filled by snapshot_into.
+     * @param buffer
+     */
+    void restore_from(const uint8_t* buffer);
+
+    /**
+     * Restores only the dirty chunks from a buffer filled by snapshot_into, for when the rest
+     * of memory is known to match it already (memory was restored from the same buffer at
+     * the last clear_dirty()). Only the pages mapping restored chunks are reported remapped,
+     * plus the pages backed by memory outside this object if UNTRACKED_CHUNK is dirty (the
+     * caller restores that memory itself). The dirty bits are left alone.
+     * @param buffer
+     */
+    void restore_dirty_from(const uint8_t* buffer);
+
+    /**
+     * Whether the given 256-byte chunk of the snapshot_into() layout (or UNTRACKED_CHUNK) may
+     * have been written since the last clear_dirty(). Conservative: a set bit may still hold
+     * the old data.
+     * @param chunk
+     */
+    bool is_chunk_dirty(unsigned int chunk) const;
+
+    /**
+     * Forgets which chunks have been written.
+     */
+    void clear_dirty();
+
+    /**
+     * Changes on every clear_dirty(). Whoever clears the dirty bits keeps the epoch that
+     * left; if it has moved on, someone else cleared them and they no longer cover
+     * everything written since.
+     */
+    uint64_t get_dirty_epoch() const;
 
     /**
      * Clears all RAM.
      */
     void clear_address_space();
 
+    /**
+     * The 2KiB of internal RAM ($0000-$07FF, as mirrored). The pointer stays valid, and keeps
+     * seeing the current contents, for the object's lifetime; restoring snapshots copies
+     * into it. For viewing only: writing through it bypasses dirty tracking and caches.
+     */
+    const uint8_t* get_internal_ram() const;
+
     /**
      * Outputs a human-readable hexdump.
      * @param addr_start
@@ -76,4 +391,38 @@ public:
     void hexdump_range(address_t addr_start, address_t addr_end, unsigned int row_width);
 };
 
+inline void RAM::write_byte(address_t addr, uint8_t value)
+{
+    const unsigned int page = (addr >> 8) & 0xFF;
+    uint8_t* memory = write_pages[page];
+
+    if (memory != nullptr)
+    {
+        memory[addr & 0xFF] = value;
+
+        const unsigned int chunk = write_chunks[page];
+        dirty_chunks[chunk >> 6] |= 1ull << (chunk & 63);
+    }
+    else
+    {
+        write_handlers[page](handler_contexts[page], addr & 0xFFFF, value);
+    }
+}
+
+inline uint32_t RAM::page_generation(address_t addr) const
+{
+    return page_generations[(addr >> 8) & 0xFF];
+}
+
+inline uint8_t RAM::read_byte(address_t addr)
+{
+    const unsigned int page = (addr >> 8) & 0xFF;
+    const uint8_t* memory = read_pages[page];
+
+    if (memory != nullptr)
+        return memory[addr & 0xFF];
+
+    return read_handlers[page](handler_contexts[page], addr & 0xFFFF);
+}
+
 #endif //NESEMULATOR_RAM_HPP
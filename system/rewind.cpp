@@ -0,0 +1,269 @@
+//
+// Rewind: a ring of recent frame snapshots, stored as deltas against keyframes.
+//
+
+#include "rewind.hpp"
+#include <cstddef>
+#include <cstring>
+
+namespace
+{
+    // Snapshot images are split into blocks starting at the memory field, so that block i
+    // (for i < RAM_CHUNK_COUNT) is exactly RAM's dirty-tracking chunk i. Everything before
+    // the memory field (header and CPU registers) is small and stored verbatim in every delta.
+    const std::size_t IMAGE_SIZE = sizeof(savestate_t);
+    const std::size_t HEAD_SIZE = offsetof(savestate_t, memory);
+    const std::size_t BLOCK_SIZE = constants::PAGE_SIZE;
+    const std::size_t BLOCK_COUNT = (IMAGE_SIZE - HEAD_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    std::size_t block_length(std::size_t block)
+    {
+        std::size_t start = HEAD_SIZE + block * BLOCK_SIZE;
+        return IMAGE_SIZE - start < BLOCK_SIZE ? IMAGE_SIZE - start : BLOCK_SIZE;
+    }
+
+    // Zero-run-length coder: a sequence of [zero count][literal count][literals...] tokens,
+    // each count at most 255. A literal run ends at the first pair of zero bytes.
+    void pack(const uint8_t* input, std::size_t length, std::vector<uint8_t>& output)
+    {
+        output.clear();
+        std::size_t i = 0;
+
+        while (i < length)
+        {
+            uint8_t zeros = 0;
+            while (i < length && input[i] == 0 && zeros < 255)
+            {
+                zeros++;
+                i++;
+            }
+
+            std::size_t literal_start = i;
+            uint8_t literals = 0;
+            while (i < length && literals < 255 && !(input[i] == 0 && (i + 1 == length || input[i + 1] == 0)))
+            {
+                literals++;
+                i++;
+            }
+
+            output.push_back(zeros);
+            output.push_back(literals);
+            output.insert(output.end(), input + literal_start, input + literal_start + literals);
+        }
+    }
+
+    // Returns the number of bytes written to `output'.
+    std::size_t unpack(const std::vector<uint8_t>& input, uint8_t* output, std::size_t length)
+    {
+        std::size_t out = 0;
+        std::size_t i = 0;
+
+        while (i + 1 < input.size() && out < length)
+        {
+            uint8_t zeros = input[i];
+            uint8_t literals = input[i + 1];
+            i += 2;
+
+            std::memset(output + out, 0, zeros);
+            out += zeros;
+
+            std::memcpy(output + out, &input[i], literals);
+            out += literals;
+            i += literals;
+        }
+
+        return out;
+    }
+
+    // Delta layout: [head bytes][u16 block][block XOR bytes][u16 block][...]
+    void append_u16(std::vector<uint8_t>& output, uint16_t value)
+    {
+        output.push_back(value & 0xFF);
+        output.push_back(value >> 8);
+    }
+} // namespace
+
+RewindBuffer::RewindBuffer(NES& nes, std::size_t capacity_frames, uint32_t keyframe_interval, bool compress)
+    : nes(nes), capacity(capacity_frames > 0 ? capacity_frames : 1),
+      keyframe_interval(keyframe_interval > 0 ? keyframe_interval : 1), compress(compress), scratch(new savestate_t())
+{
+    keyframe_image.resize(IMAGE_SIZE);
+}
+
+RewindBuffer::~RewindBuffer() = default;
+
+std::size_t RewindBuffer::entry_bytes(const entry_t& entry) const
+{
+    return entry.delta.size() + (entry.ordinal == 0 ? entry.keyframe->stored.size() : 0);
+}
+
+void RewindBuffer::push_keyframe(const uint8_t* image)
+{
+    std::shared_ptr<keyframe_t> keyframe = std::make_shared<keyframe_t>();
+
+    if (compress)
+        pack(image, IMAGE_SIZE, keyframe->stored);
+    else
+        keyframe->stored.assign(image, image + IMAGE_SIZE);
+
+    std::memcpy(keyframe_image.data(), image, IMAGE_SIZE);
+    current_keyframe = keyframe;
+    frames_since_keyframe = 0;
+
+    // From here on, RAM tells us which blocks may differ from this keyframe.
+    nes.get_ram().clear_dirty();
+    keyframe_epoch = nes.get_ram().get_dirty_epoch();
+
+    entries.push_back({ current_keyframe, std::vector<uint8_t>(), 0 });
+}
+
+void RewindBuffer::push_delta(const uint8_t* image)
+{
+    const RAM& ram = nes.get_ram();
+    std::vector<uint8_t> delta(image, image + HEAD_SIZE);
+
+    // Unless someone else (e.g. NES::fork) cleared the dirty bits in the meantime.
+    const bool tracked = ram.get_dirty_epoch() == keyframe_epoch;
+
+    for (std::size_t block = 0; block < BLOCK_COUNT; block++)
+    {
+        if (tracked && block < (std::size_t)constants::RAM_CHUNK_COUNT && !ram.is_chunk_dirty(block))
+            continue;
+
+        const std::size_t offset = HEAD_SIZE + block * BLOCK_SIZE;
+        const std::size_t length = block_length(block);
+
+        if (std::memcmp(image + offset, &keyframe_image[offset], length) == 0)
+            continue;
+
+        append_u16(delta, block);
+        for (std::size_t i = 0; i < length; i++)
+            delta.push_back(image[offset + i] ^ keyframe_image[offset + i]);
+    }
+
+    frames_since_keyframe++;
+
+    entry_t entry = { current_keyframe, std::vector<uint8_t>(), frames_since_keyframe };
+    if (compress)
+        pack(delta.data(), delta.size(), entry.delta);
+    else
+        entry.delta.swap(delta);
+
+    entries.push_back(std::move(entry));
+}
+
+bool RewindBuffer::push()
+{
+    if (!nes.save_state(*scratch))
+        return false;
+
+    const uint8_t* image = reinterpret_cast<const uint8_t*>(scratch.get());
+
+    if (!current_keyframe || frames_since_keyframe + 1 >= keyframe_interval)
+        push_keyframe(image);
+    else
+        push_delta(image);
+
+    stored_bytes += entry_bytes(entries.back());
+
+    // Drop the oldest frames. Deltas hold a reference to their keyframe, so evicting a
+    // keyframe's own entry doesn't invalidate the frames after it.
+    while (entries.size() > capacity)
+    {
+        stored_bytes -= entry_bytes(entries.front());
+        entries.pop_front();
+    }
+
+    return true;
+}
+
+void RewindBuffer::select_keyframe(const std::shared_ptr<const keyframe_t>& keyframe)
+{
+    if (keyframe == current_keyframe)
+        return;
+
+    if (compress)
+        unpack(keyframe->stored, keyframe_image.data(), IMAGE_SIZE);
+    else
+        std::memcpy(keyframe_image.data(), keyframe->stored.data(), IMAGE_SIZE);
+
+    current_keyframe = keyframe;
+}
+
+bool RewindBuffer::restore(const entry_t& entry)
+{
+    select_keyframe(entry.keyframe);
+
+    uint8_t* image = reinterpret_cast<uint8_t*>(scratch.get());
+    std::memcpy(image, keyframe_image.data(), IMAGE_SIZE);
+
+    if (entry.ordinal > 0)
+    {
+        std::vector<uint8_t> unpacked;
+        const std::vector<uint8_t>* delta = &entry.delta;
+
+        if (compress)
+        {
+            // The unpacked size isn't stored; the head plus every block is an upper bound.
+            unpacked.resize(HEAD_SIZE + BLOCK_COUNT * (2 + BLOCK_SIZE));
+            unpacked.resize(unpack(entry.delta, unpacked.data(), unpacked.size()));
+            delta = &unpacked;
+        }
+
+        std::memcpy(image, delta->data(), HEAD_SIZE);
+
+        std::size_t i = HEAD_SIZE;
+        while (i + 2 <= delta->size())
+        {
+            std::size_t block = (*delta)[i] | ((*delta)[i + 1] << 8);
+            const std::size_t offset = HEAD_SIZE + block * BLOCK_SIZE;
+            const std::size_t length = block_length(block);
+            i += 2;
+
+            for (std::size_t b = 0; b < length; b++)
+                image[offset + b] ^= (*delta)[i + b];
+            i += length;
+        }
+    }
+
+    if (!nes.load_state(*scratch))
+        return false;
+
+    // New frames continue as deltas against the same keyframe.
+    frames_since_keyframe = entry.ordinal;
+    return true;
+}
+
+bool RewindBuffer::step_back(std::size_t frames)
+{
+    if (frames == 0 || frames >= entries.size())
+        return false;
+
+    for (std::size_t i = 0; i < frames; i++)
+    {
+        stored_bytes -= entry_bytes(entries.back());
+        entries.pop_back();
+    }
+
+    return restore(entries.back());
+}
+
+std::size_t RewindBuffer::size() const
+{
+    return entries.size();
+}
+
+std::size_t RewindBuffer::memory_usage() const
+{
+    // Count the keyframe of the oldest frame too if its own entry was already evicted.
+    std::size_t orphaned = (!entries.empty() && entries.front().ordinal > 0) ? entries.front().keyframe->stored.size() : 0;
+    return stored_bytes + orphaned;
+}
+
+void RewindBuffer::clear()
+{
+    entries.clear();
+    current_keyframe.reset();
+    frames_since_keyframe = 0;
+    stored_bytes = 0;
+}
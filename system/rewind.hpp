@@ -0,0 +1,106 @@
+//
+// Rewind: a ring of recent frame snapshots, stored as deltas against keyframes.
+//
+
+#ifndef NESEMULATOR_REWIND_HPP
+#define NESEMULATOR_REWIND_HPP
+
+#include "nes.hpp"
+#include "savestate.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+/**
+ * Keeps the last N frames of machine state so emulation can be stepped backwards.
+ *
+ * Every `keyframe_interval' frames a full snapshot (keyframe) is stored. The frames in
+ * between store only the 256-byte blocks of the snapshot that differ from their keyframe,
+ * XORed against it. RAM reports which blocks were written since the keyframe, so unchanged
+ * memory is not even compared. With compression on, keyframes and deltas are additionally
+ * packed with a zero-run-length coder, which does well on both (snapshots are mostly empty
+ * memory, XOR deltas mostly zero bytes).
+ *
+ * Stepping back one frame costs one keyframe copy plus applying one delta.
+ */
+class RewindBuffer
+{
+private:
+    struct keyframe_t
+    {
+        std::vector<uint8_t> stored; // The snapshot image, compressed if enabled.
+    };
+
+    struct entry_t
+    {
+        std::shared_ptr<const keyframe_t> keyframe;
+        std::vector<uint8_t> delta; // Empty for the keyframe's own entry.
+        uint32_t ordinal;           // Frames since the keyframe (0 for the keyframe itself).
+    };
+
+    NES& nes;
+    std::size_t capacity;
+    uint32_t keyframe_interval;
+    bool compress;
+
+    std::deque<entry_t> entries;
+
+    // The keyframe new deltas are taken against, and its uncompressed image.
+    std::shared_ptr<const keyframe_t> current_keyframe;
+    std::vector<uint8_t> keyframe_image;
+    uint32_t frames_since_keyframe = 0;
+    uint64_t keyframe_epoch = 0; // RAM's dirty epoch once the keyframe was taken.
+
+    std::size_t stored_bytes = 0;
+
+    std::unique_ptr<savestate_t> scratch;
+
+    void push_keyframe(const uint8_t* image);
+    void push_delta(const uint8_t* image);
+
+    // Loads the uncompressed image of `keyframe' into `keyframe_image'.
+    void select_keyframe(const std::shared_ptr<const keyframe_t>& keyframe);
+
+    // Rebuilds the state of `entry' and loads it into the console.
+    bool restore(const entry_t& entry);
+
+    std::size_t entry_bytes(const entry_t& entry) const;
+public:
+    /**
+     * @param nes console to snapshot and restore
+     * @param capacity_frames how many frames can be stepped back
+     * @param keyframe_interval frames between full snapshots
+     * @param compress pack keyframes and deltas with the zero-run coder
+     */
+    RewindBuffer(NES& nes, std::size_t capacity_frames, uint32_t keyframe_interval = 60, bool compress = true);
+    ~RewindBuffer();
+
+    /**
+     * Records the current state. Call once per emulated frame. Returns false if the state
+     * could not be captured (see NES::save_state).
+     */
+    bool push();
+
+    /**
+     * Restores the state recorded `frames' pushes before the latest one and forgets
+     * everything newer. Returns false if not that much history is available.
+     * @param frames
+     */
+    bool step_back(std::size_t frames = 1);
+
+    /**
+     * Number of frames currently recorded.
+     */
+    std::size_t size() const;
+
+    /**
+     * Bytes of snapshot data held (keyframes and deltas, after compression).
+     */
+    std::size_t memory_usage() const;
+
+    void clear();
+};
+
+#endif //NESEMULATOR_REWIND_HPP
@@ -0,0 +1,28 @@
+//
+// Save states: complete machine snapshots.
+//
+
+#include "savestate.hpp"
+#include <cstdio>
+
+bool savestate::write_file(const std::string& path, const savestate_t& state)
+{
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    bool written = std::fwrite(&state, sizeof(state), 1, file) == 1;
+    return std::fclose(file) == 0 && written;
+}
+
+bool savestate::read_file(const std::string& path, savestate_t& state)
+{
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        return false;
+
+    bool read = std::fread(&state, sizeof(state), 1, file) == 1;
+    std::fclose(file);
+
+    return read && state.magic == constants::SAVESTATE_MAGIC && state.version == constants::SAVESTATE_VERSION;
+}
@@ -0,0 +1,63 @@
+//
+// Save states: complete machine snapshots.
+//
+
+#ifndef NESEMULATOR_SAVESTATE_HPP
+#define NESEMULATOR_SAVESTATE_HPP
+
+#include "apu.hpp"
+#include "cartridge.hpp"
+#include "controller.hpp"
+#include "mos6502.hpp"
+#include "ppu.hpp"
+#include "ram.hpp"
+#include <cstdint>
+#include <string>
+
+namespace constants
+{
+    const uint32_t SAVESTATE_MAGIC = 0x5353454E; // "NESS", little-endian.
+    const uint32_t SAVESTATE_VERSION = 6;        // Bump whenever the layout below changes.
+} // namespace constants
+
+/**
+ * A complete machine snapshot. The layout is fixed (no pointers, no variable-length fields),
+ * so saving and restoring is a handful of memcpys and the struct can be written to disk as-is.
+ * Save files are only meant to be read back on the same kind of host (byte order and struct
+ * padding are not normalised).
+ *
+ * Allocate these on the heap or keep them around: they are too big for a small stack.
+ */
+struct savestate_t
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rom_hash; // Content hash of the cartridge the state belongs to (0 = none).
+
+    cpu_state_t cpu;
+    uint8_t memory[constants::RAM_SNAPSHOT_SIZE]; // As written by RAM::snapshot_into.
+    cartridge_state_t cartridge;
+    ppu_state_t ppu;
+    apu_state_t apu;
+    controller_state_t controllers[2];
+};
+
+namespace savestate
+{
+    /**
+     * Writes a snapshot to disk. Returns false if the file could not be written.
+     * @param path
+     * @param state
+     */
+    bool write_file(const std::string& path, const savestate_t& state);
+
+    /**
+     * Reads a snapshot from disk. Returns false if the file could not be read or is not a
+     * save state of this version.
+     * @param path
+     * @param state
+     */
+    bool read_file(const std::string& path, savestate_t& state);
+} // namespace savestate
+
+#endif //NESEMULATOR_SAVESTATE_HPP
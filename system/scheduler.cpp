@@ -0,0 +1,71 @@
+//
+// Event scheduler: the CPU cycles at which devices need the CPU to stop.
+//
+
+#include "scheduler.hpp"
+#include <limits>
+
+Scheduler::Scheduler(MOS6502* cpu) : cpu(cpu)
+{
+}
+
+void Scheduler::schedule(event_t event, uint64_t cycle)
+{
+    cancel(event);
+
+    if (cycle == std::numeric_limits<uint64_t>::max())
+        return;
+
+    // A handful of entries: insertion keeps them sorted for less than a heap would cost.
+    std::size_t at = pending;
+    while (at > 0 && queue[at - 1].cycle > cycle)
+    {
+        queue[at] = queue[at - 1];
+        at--;
+    }
+
+    queue[at].cycle = cycle;
+    queue[at].event = event;
+    pending++;
+
+    if (cycle < cpu->run_target)
+        cpu->run_target = cycle;
+}
+
+void Scheduler::cancel(event_t event)
+{
+    for (std::size_t i = 0; i < pending; i++)
+    {
+        if (queue[i].event != event)
+            continue;
+
+        for (pending--; i < pending; i++)
+            queue[i] = queue[i + 1];
+
+        return;
+    }
+}
+
+void Scheduler::clear()
+{
+    pending = 0;
+}
+
+uint64_t Scheduler::next_cycle() const
+{
+    return pending > 0 ? queue[0].cycle : std::numeric_limits<uint64_t>::max();
+}
+
+bool Scheduler::take_due(event_t& event)
+{
+    if (pending == 0 || queue[0].cycle > cpu->cycles)
+        return false;
+
+    event = queue[0].event;
+
+    pending--;
+    for (std::size_t i = 0; i < pending; i++)
+        queue[i] = queue[i + 1];
+
+    return true;
+}
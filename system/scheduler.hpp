@@ -0,0 +1,71 @@
+//
+// Event scheduler: the CPU cycles at which devices need the CPU to stop.
+//
+
+#ifndef NESEMULATOR_SCHEDULER_HPP
+#define NESEMULATOR_SCHEDULER_HPP
+
+#include "mos6502.hpp"
+#include <cstddef>
+#include <cstdint>
+
+// Things that happen at a known cycle and need the driver loop's attention.
+enum class event_t : uint8_t
+{
+    VBLANK,     // The PPU enters vertical blank: the frame ends, an NMI may be due.
+    APU_IRQ,    // The frame counter or the DMC raises its IRQ.
+    DMC_FETCH,  // The DMC reads its next sample byte, stalling the CPU.
+    MAPPER_IRQ, // The cartridge's scanline counter raises its IRQ.
+    COUNT
+};
+
+/**
+ * Pending events, one per kind at most, kept in order of the cycle they fall on. The CPU
+ * runs uninterrupted up to the earliest of them; nothing polls interrupt lines in between.
+ *
+ * An event scheduled earlier than the CPU's current run target pulls the target in, so a
+ * register write that moves a device's next event forward (say, clearing the frame counter's
+ * IRQ inhibit) stops the current run on time rather than at the next scheduled stop.
+ */
+class Scheduler
+{
+private:
+    struct entry_t
+    {
+        uint64_t cycle;
+        event_t event;
+    };
+
+    MOS6502* cpu;
+
+    entry_t queue[(std::size_t)event_t::COUNT];
+    std::size_t pending = 0;
+public:
+    explicit Scheduler(MOS6502* cpu);
+
+    /**
+     * Sets the cycle `event' falls on, replacing any earlier schedule for it. Events at the
+     * same cycle are taken in the order they were scheduled.
+     * @param event
+     * @param cycle UINT64_MAX: not pending
+     */
+    void schedule(event_t event, uint64_t cycle);
+
+    void cancel(event_t event);
+
+    void clear();
+
+    /**
+     * Cycle of the earliest pending event, or UINT64_MAX if none is.
+     */
+    uint64_t next_cycle() const;
+
+    /**
+     * Removes the earliest event if the CPU has reached its cycle. Returns false (leaving
+     * `event' untouched) if no event is due.
+     * @param event
+     */
+    bool take_due(event_t& event);
+};
+
+#endif //NESEMULATOR_SCHEDULER_HPP
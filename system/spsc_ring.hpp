@@ -0,0 +1,126 @@
+//
+// Lock-free single-producer/single-consumer ring buffer.
+//
+
+#ifndef NESEMULATOR_SPSC_RING_HPP
+#define NESEMULATOR_SPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * A bounded FIFO that one thread pushes into and one other thread pops from, with no locks.
+ * The capacity is rounded up to a power of two so that indices wrap with a mask. Head and
+ * tail are padded a cache line apart, from each other and from their neighbours, so the two
+ * threads do not false-share. (Padding rather than alignas: an over-aligned member would make
+ * every class holding a ring over-aligned, which plain `new' does not honour before C++17.)
+ */
+template <typename T>
+class SpscRing
+{
+private:
+    static const std::size_t CACHE_LINE = 64;
+
+    std::vector<T> slots;
+    std::size_t mask;
+
+    char head_padding[CACHE_LINE];
+    std::atomic<std::size_t> head; // Next slot to write. Owned by the producer.
+    char tail_padding[CACHE_LINE - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> tail; // Next slot to read. Owned by the consumer.
+    char end_padding[CACHE_LINE - sizeof(std::atomic<std::size_t>)];
+public:
+    explicit SpscRing(std::size_t min_capacity) : head(0), tail(0)
+    {
+        std::size_t capacity = 1;
+        while (capacity < min_capacity)
+            capacity <<= 1;
+
+        slots.resize(capacity);
+        mask = capacity - 1;
+    }
+
+    std::size_t capacity() const
+    {
+        return mask + 1;
+    }
+
+    /**
+     * Number of items currently queued. Exact only when called from either endpoint.
+     */
+    std::size_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Producer side. Returns false (and drops nothing) if the ring is full.
+     * @param item
+     */
+    bool try_push(const T& item)
+    {
+        const std::size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) > mask)
+            return false;
+
+        slots[h & mask] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Producer side. Pushes as many of `count' items as fit; returns how many were pushed.
+     * @param items
+     * @param count
+     */
+    std::size_t push_bulk(const T* items, std::size_t count)
+    {
+        const std::size_t h = head.load(std::memory_order_relaxed);
+        const std::size_t free_slots = capacity() - (h - tail.load(std::memory_order_acquire));
+        if (count > free_slots)
+            count = free_slots;
+
+        for (std::size_t i = 0; i < count; i++)
+            slots[(h + i) & mask] = items[i];
+
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * Consumer side. Returns false if the ring is empty.
+     * @param item
+     */
+    bool try_pop(T& item)
+    {
+        const std::size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return false;
+
+        item = slots[t & mask];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Consumer side. Pops up to `count' items into `items'; returns how many were popped.
+     * @param items
+     * @param count
+     */
+    std::size_t pop_bulk(T* items, std::size_t count)
+    {
+        const std::size_t t = tail.load(std::memory_order_relaxed);
+        const std::size_t available = head.load(std::memory_order_acquire) - t;
+        if (count > available)
+            count = available;
+
+        for (std::size_t i = 0; i < count; i++)
+            items[i] = slots[(t + i) & mask];
+
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+};
+
+#endif //NESEMULATOR_SPSC_RING_HPP
@@ -0,0 +1,127 @@
+//
+// Work-stealing thread pool.
+//
+
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(std::size_t thread_count) : pending(0), queued(0)
+{
+    if (thread_count == 0)
+        thread_count = std::thread::hardware_concurrency();
+    if (thread_count == 0)
+        thread_count = 1;
+
+    for (std::size_t i = 0; i < thread_count; i++)
+        queues.emplace_back(new worker_queue_t());
+
+    for (std::size_t i = 0; i < thread_count; i++)
+        workers.emplace_back(&ThreadPool::worker_loop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    wait();
+
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+std::size_t ThreadPool::size() const
+{
+    return workers.size();
+}
+
+void ThreadPool::submit(task_t task)
+{
+    std::size_t index;
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        index = next_queue;
+        next_queue = (next_queue + 1) % queues.size();
+        pending++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+
+    // Publish the task under the state lock so a worker can't miss the wake-up between
+    // checking for work and going to sleep.
+    std::lock_guard<std::mutex> lock(state_mutex);
+    queued++;
+    work_available.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(state_mutex);
+    all_done.wait(lock, [this] { return pending.load() == 0; });
+}
+
+bool ThreadPool::take_task(std::size_t index, task_t& task)
+{
+    // Own queue first, oldest task first.
+    {
+        worker_queue_t& own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+
+    // Then steal the newest task from someone else, starting with our neighbour so that
+    // thieves spread out over the victims.
+    for (std::size_t offset = 1; offset < queues.size(); offset++)
+    {
+        worker_queue_t& victim = *queues[(index + offset) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::worker_loop(std::size_t index)
+{
+    while (true)
+    {
+        task_t task;
+
+        if (take_task(index, task))
+        {
+            task(index);
+
+            if (pending.fetch_sub(1) == 1)
+            {
+                std::lock_guard<std::mutex> lock(state_mutex);
+                all_done.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(state_mutex);
+        if (stopping)
+            return;
+
+        // Sleep until something is queued. `queued' is only raised once the task is in a
+        // deque, so a wake-up always finds (or races another worker for) a real task.
+        work_available.wait(lock, [this] { return stopping || queued.load() > 0; });
+    }
+}
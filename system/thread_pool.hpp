@@ -0,0 +1,82 @@
+//
+// Work-stealing thread pool.
+//
+
+#ifndef NESEMULATOR_THREAD_POOL_HPP
+#define NESEMULATOR_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads, each with its own task deque. Workers take tasks from the
+ * front of their own deque and, when it runs dry, steal from the back of the others', so a
+ * few long jobs don't leave the other cores idle.
+ *
+ * Tasks receive the index of the worker running them (0 .. size()-1), which lets callers keep
+ * per-worker state (e.g. one reusable emulator instance per thread) without locking.
+ */
+class ThreadPool
+{
+public:
+    typedef std::function<void(std::size_t worker_index)> task_t;
+private:
+    struct worker_queue_t
+    {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<worker_queue_t>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex state_mutex;
+    std::condition_variable work_available;
+    std::condition_variable all_done;
+
+    std::atomic<std::size_t> pending; // Submitted but not yet finished.
+    std::atomic<std::size_t> queued;  // Sitting in a deque, not yet taken by a worker.
+    std::size_t next_queue = 0;        // Round-robin target for submit().
+    bool stopping = false;
+
+    void worker_loop(std::size_t index);
+
+    // Pops from our own queue, else steals from another one. Returns false if all are empty.
+    bool take_task(std::size_t index, task_t& task);
+public:
+    /**
+     * Starts `thread_count' workers (0 means one per hardware thread).
+     * @param thread_count
+     */
+    explicit ThreadPool(std::size_t thread_count = 0);
+
+    /**
+     * Waits for every submitted task, then stops the workers.
+     */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    std::size_t size() const;
+
+    /**
+     * Queues a task.
+     * @param task
+     */
+    void submit(task_t task);
+
+    /**
+     * Blocks until every task submitted so far has finished.
+     */
+    void wait();
+};
+
+#endif //NESEMULATOR_THREAD_POOL_HPP
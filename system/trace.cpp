@@ -0,0 +1,171 @@
+//
+// Instruction tracing for the 6502 core.
+//
+
+#include "trace.hpp"
+#include "opcodes.hpp"
+#include <chrono>
+#include <iostream>
+
+namespace
+{
+    // Records moved per ring access on the writer side.
+    const std::size_t WRITER_BATCH = 1024;
+
+    // Writes the operand of an instruction in assembler syntax, e.g. "#$10" or "($20),Y".
+    void format_operand(const trace_record_t& record, char* buffer, std::size_t size)
+    {
+        const opcode_info_t& info = opcodes::OPCODE_TABLE[record.opcode];
+        const unsigned int byte = record.operand_lo;
+        const unsigned int word = record.operand_lo | (record.operand_hi << 8);
+
+        switch (info.addrmode)
+        {
+            case addr_mode_t::IMP:
+            {
+                bool accumulator = info.operation == operation_t::ASL || info.operation == operation_t::LSR ||
+                                   info.operation == operation_t::ROL || info.operation == operation_t::ROR;
+                std::snprintf(buffer, size, "%s", accumulator ? "A" : "");
+                break;
+            }
+            case addr_mode_t::IMM: std::snprintf(buffer, size, "#$%02X", byte); break;
+            case addr_mode_t::ZP0: std::snprintf(buffer, size, "$%02X", byte); break;
+            case addr_mode_t::ZPX: std::snprintf(buffer, size, "$%02X,X", byte); break;
+            case addr_mode_t::ZPY: std::snprintf(buffer, size, "$%02X,Y", byte); break;
+            case addr_mode_t::REL:
+                std::snprintf(buffer, size, "$%04X", (unsigned int)(uint16_t)(record.PC + 2 + (int8_t)record.operand_lo));
+                break;
+            case addr_mode_t::ABS: std::snprintf(buffer, size, "$%04X", word); break;
+            case addr_mode_t::ABX: std::snprintf(buffer, size, "$%04X,X", word); break;
+            case addr_mode_t::ABY: std::snprintf(buffer, size, "$%04X,Y", word); break;
+            case addr_mode_t::IND: std::snprintf(buffer, size, "($%04X)", word); break;
+            case addr_mode_t::IZX: std::snprintf(buffer, size, "($%02X,X)", byte); break;
+            case addr_mode_t::IZY: std::snprintf(buffer, size, "($%02X),Y", byte); break;
+        }
+    }
+} // namespace
+
+Tracer::Tracer(const std::string& path, trace_format_t format, std::size_t ring_capacity)
+    : ring(ring_capacity), format(format), running(true)
+{
+    output = std::fopen(path.c_str(), format == trace_format_t::BINARY ? "wb" : "w");
+    if (output == nullptr)
+    {
+        std::cout << "[Trace] ERROR! Could not open ``" << path << "'' for writing; trace records will be discarded." << std::endl;
+    }
+
+    writer = std::thread(&Tracer::writer_loop, this);
+}
+
+Tracer::~Tracer()
+{
+    running.store(false, std::memory_order_release);
+    writer.join();
+
+    if (output != nullptr)
+        std::fclose(output);
+}
+
+void Tracer::writer_loop()
+{
+    trace_record_t batch[WRITER_BATCH];
+
+    while (true)
+    {
+        // Read the flag before draining, so that a stop request is only honoured once
+        // everything pushed before it has been written.
+        bool stopping = !running.load(std::memory_order_acquire);
+
+        std::size_t count = ring.pop_bulk(batch, WRITER_BATCH);
+        if (count > 0)
+        {
+            write_records(batch, count);
+            continue;
+        }
+
+        if (stopping)
+            break;
+
+        if (output != nullptr)
+            std::fflush(output);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void Tracer::write_records(const trace_record_t* records, std::size_t count)
+{
+    if (output == nullptr)
+        return;
+
+    if (format == trace_format_t::BINARY)
+    {
+        std::fwrite(records, sizeof(trace_record_t), count, output);
+        return;
+    }
+
+    char line[128];
+    for (std::size_t i = 0; i < count; i++)
+    {
+        format_record(records[i], line, sizeof(line));
+        std::fputs(line, output);
+        std::fputc('\n', output);
+    }
+}
+
+void Tracer::format_record(const trace_record_t& record, char* buffer, std::size_t size)
+{
+    const opcode_info_t& info = opcodes::OPCODE_TABLE[record.opcode];
+    const uint8_t length = opcodes::instruction_length(info.addrmode);
+
+    // Raw instruction bytes, e.g. "4C F5 C5".
+    char bytes[9];
+    if (length == 1)
+        std::snprintf(bytes, sizeof(bytes), "%02X", record.opcode);
+    else if (length == 2)
+        std::snprintf(bytes, sizeof(bytes), "%02X %02X", record.opcode, record.operand_lo);
+    else
+        std::snprintf(bytes, sizeof(bytes), "%02X %02X %02X", record.opcode, record.operand_lo, record.operand_hi);
+
+    char operand[16];
+    format_operand(record, operand, sizeof(operand));
+
+    char disassembly[32];
+    std::snprintf(disassembly, sizeof(disassembly), "%s %s", opcodes::OPCODE_NAMES[record.opcode], operand);
+
+    std::snprintf(buffer, size, "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu",
+                  record.PC, bytes, disassembly, record.ACC, record.X, record.Y, record.FLG, record.SP,
+                  (unsigned long long)record.cycle);
+}
+
+bool Tracer::format_file(const std::string& binary_path, const std::string& text_path)
+{
+    std::FILE* input = std::fopen(binary_path.c_str(), "rb");
+    if (input == nullptr)
+        return false;
+
+    std::FILE* text = std::fopen(text_path.c_str(), "w");
+    if (text == nullptr)
+    {
+        std::fclose(input);
+        return false;
+    }
+
+    trace_record_t batch[WRITER_BATCH];
+    char line[128];
+    std::size_t count;
+
+    while ((count = std::fread(batch, sizeof(trace_record_t), WRITER_BATCH, input)) > 0)
+    {
+        for (std::size_t i = 0; i < count; i++)
+        {
+            format_record(batch[i], line, sizeof(line));
+            std::fputs(line, text);
+            std::fputc('\n', text);
+        }
+    }
+
+    std::fclose(input);
+    std::fclose(text);
+    return true;
+}
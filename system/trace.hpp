@@ -0,0 +1,107 @@
+//
+// Instruction tracing for the 6502 core.
+//
+
+#ifndef NESEMULATOR_TRACE_HPP
+#define NESEMULATOR_TRACE_HPP
+
+#include "spsc_ring.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+// Tracing is compiled in only when NESEMU_TRACE is defined (CMake does this for Debug
+// builds). Without it the CPU never looks at its tracer, so release builds pay nothing.
+
+// One executed instruction, captured just before it runs. The record has a fixed size
+// so it can be copied through the ring and written to disk as-is.
+struct trace_record_t
+{
+    uint64_t cycle;      // CPU cycle counter when the instruction started.
+    uint16_t PC;         // Address of the opcode.
+    uint8_t opcode;
+    uint8_t operand_lo;  // The two bytes after the opcode (not all instructions use them).
+    uint8_t operand_hi;
+    uint8_t ACC;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t FLG;
+    uint8_t SP;
+    uint8_t reserved[6];
+};
+
+static_assert(sizeof(trace_record_t) == 24, "trace_record_t is written to disk and must stay 24 bytes");
+
+enum class trace_format_t
+{
+    BINARY, // Raw trace_record_t structs. Cheapest; format later with NESTraceFormat.
+    TEXT    // nestest-style log lines, formatted on the writer thread.
+};
+
+class Tracer
+{
+private:
+    SpscRing<trace_record_t> ring;
+    std::FILE* output = nullptr;
+    trace_format_t format;
+
+    std::atomic<bool> running;
+    std::thread writer;
+
+    // Writer thread body: drains the ring into `output' until stopped.
+    void writer_loop();
+
+    // Writes a batch of records in the configured format.
+    void write_records(const trace_record_t* records, std::size_t count);
+public:
+    /**
+     * Opens `path' for writing and starts the writer thread. If the file cannot be opened,
+     * an error is printed and records are discarded.
+     * @param path
+     * @param format
+     * @param ring_capacity number of records buffered between the CPU and the writer.
+     */
+    Tracer(const std::string& path, trace_format_t format, std::size_t ring_capacity = 1 << 16);
+
+    /**
+     * Drains every outstanding record, stops the writer thread and closes the file.
+     */
+    ~Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    /**
+     * Queues one record. Called from the emulation thread only. Never takes a lock; if the
+     * writer has fallen a whole ring behind, this yields until a slot frees up so that no
+     * record is ever lost.
+     * @param record
+     */
+    void record(const trace_record_t& record)
+    {
+        while (!ring.try_push(record))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     * Formats a record as a nestest-style log line (without trailing newline).
+     * @param record
+     * @param buffer
+     * @param size
+     */
+    static void format_record(const trace_record_t& record, char* buffer, std::size_t size);
+
+    /**
+     * Converts a BINARY trace file into a TEXT one. Returns false if either file could not
+     * be opened.
+     * @param binary_path
+     * @param text_path
+     */
+    static bool format_file(const std::string& binary_path, const std::string& text_path);
+};
+
+#endif //NESEMULATOR_TRACE_HPP
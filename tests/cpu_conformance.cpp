@@ -0,0 +1,1193 @@
+/**
+ * CPU conformance suites, run against MOS6502 (and, optionally, the recompiler tier).
+ *
+ * Usage: NESCpuTests nestest ROM LOG
+ *        NESCpuTests klaus BINARY [SUCCESS_ADDRESS] [--jit]
+ *        NESCpuTests harte DIRECTORY [--threads N]
+ *        NESCpuTests selftest
+ *
+ * nestest: runs nestest.nes in automation mode ($C000) one instruction at a time, comparing
+ * the registers and cycle counter with each line of the reference nestest.log. Stops at the
+ * first unofficial opcode, which this CPU does not implement.
+ *
+ * klaus: runs Klaus Dormann's 6502 functional test (a 64KiB image started at $0400) until it
+ * traps in a jump or branch to itself; it passes if that happens at SUCCESS_ADDRESS (default
+ * $3469, the end of the standard build). The 2A03 has no decimal mode, so use an image
+ * assembled with disable_decimal = 1, or give the address of the decimal test's start.
+ *
+ * harte: runs Tom Harte's single-step tests (the nes6502 set: one JSON file of cases per
+ * opcode, e.g. "a9.json") for every official opcode. Files run in parallel; each stops at its
+ * first failing case and no new files start once one has failed.
+ *
+ * selftest: needs no data. Runs a handful of single-step cases and a small program (checking
+ * what it computes) on the interpreter, the same program on the recompiler in lockstep with the
+ * interpreter, a tiny NROM game with and without idle loop skipping on both tiers, rewinding
+ * and forking that game, and the cartridge loader on malformed headers.
+ *
+ * Every suite stops at the first divergence and prints it. The exit status is 0 on success,
+ * 1 on a divergence and 77 (ctest's "skipped") if the test data is missing.
+ */
+
+#include "../system/cartridge.hpp"
+#include "../system/jit.hpp"
+#include "../system/mos6502.hpp"
+#include "../system/nes.hpp"
+#include "../system/ram.hpp"
+#include "../system/rewind.hpp"
+#include "../system/thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static const int EXIT_PASSED = 0;
+static const int EXIT_DIVERGED = 1;
+static const int EXIT_SKIPPED = 77;
+
+static bool read_file(const std::string& path, std::string& contents)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    contents = buffer.str();
+    return true;
+}
+
+// Whether the interpreter implements the opcode as the official instruction.
+static bool is_official(uint8_t opcode)
+{
+    const opcode_info_t& info = opcodes::OPCODE_TABLE[opcode];
+    return info.operation != operation_t::XXX && (info.operation != operation_t::NOP || opcode == 0xEA);
+}
+
+// Runs until the CPU halts, passes `max_cycles' or traps in a jump or branch to itself (how
+// test programs stop). Branches to themselves that are not taken are everywhere in Klaus's
+// test (its error checks), so a trap is only seen by executing it: each chunk ends with one
+// more instruction, and the CPU is trapped if that one left PC where it was.
+static void run_to_trap(MOS6502& cpu, JIT* jit, uint64_t max_cycles)
+{
+    const uint64_t CHUNK_CYCLES = 100000;
+    bool trapped = false;
+
+    while (!trapped && !cpu.is_halted() && cpu.cycles < max_cycles)
+    {
+        if (jit != nullptr)
+            jit->run_until(cpu.cycles + CHUNK_CYCLES);
+        else
+            cpu.run_until(cpu.cycles + CHUNK_CYCLES);
+
+        const uint16_t pc = cpu.PC;
+        trapped = cpu.step() > 0 && cpu.PC == pc;
+    }
+}
+
+// ===========================
+// NESTEST
+// ===========================
+
+struct log_line_t
+{
+    uint16_t PC;
+    uint8_t ACC, X, Y, FLG, SP;
+    uint64_t cycles;
+    bool official;
+};
+
+static bool parse_log_line(const std::string& line, log_line_t& out)
+{
+    // C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+    const std::size_t registers = line.find("A:");
+    const std::size_t cycles = line.find("CYC:");
+    if (line.size() < 16 || registers == std::string::npos || cycles == std::string::npos)
+        return false;
+
+    unsigned int pc, a, x, y, p, sp;
+    if (std::sscanf(line.c_str(), "%4x", &pc) != 1 ||
+        std::sscanf(line.c_str() + registers, "A:%2x X:%2x Y:%2x P:%2x SP:%2x", &a, &x, &y, &p, &sp) != 5)
+        return false;
+
+    out.PC = pc;
+    out.ACC = a; out.X = x; out.Y = y; out.FLG = p; out.SP = sp;
+    out.cycles = std::strtoull(line.c_str() + cycles + 4, nullptr, 10);
+    out.official = line[15] != '*'; // Unofficial opcodes are marked with a star.
+    return true;
+}
+
+static int run_nestest(const std::string& rom_path, const std::string& log_path)
+{
+    std::ifstream log(log_path);
+    std::ifstream rom_check(rom_path);
+    if (!log || !rom_check)
+    {
+        std::cout << "nestest: ``" << rom_path << "'' or ``" << log_path << "'' not found; skipping." << std::endl;
+        return EXIT_SKIPPED;
+    }
+
+    std::unique_ptr<NES> nes(new NES());
+    if (!nes->load_rom(rom_path))
+        return EXIT_DIVERGED;
+
+    // Automation mode: start at $C000 with the documented power-up state.
+    MOS6502& cpu = nes->get_cpu();
+    cpu.PC = 0xC000;
+    cpu.SP = 0xFD;
+    cpu.FLG = 0x24;
+    cpu.cycles = 7;
+
+    std::string line;
+    unsigned int line_number = 0;
+
+    while (std::getline(log, line))
+    {
+        line_number++;
+
+        log_line_t expected;
+        if (!parse_log_line(line, expected))
+            continue;
+
+        if (!expected.official || !is_official(nes->get_ram().peek_byte(cpu.PC)))
+            break;
+
+        if (cpu.PC != expected.PC || cpu.ACC != expected.ACC || cpu.X != expected.X || cpu.Y != expected.Y ||
+            cpu.FLG != expected.FLG || cpu.SP != expected.SP || cpu.cycles != expected.cycles)
+        {
+            char state[96];
+            std::snprintf(state, sizeof(state), "%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu", cpu.PC, cpu.ACC,
+                          cpu.X, cpu.Y, cpu.FLG, cpu.SP, (unsigned long long)cpu.cycles);
+
+            std::cout << "nestest: diverged at log line " << line_number << "." << std::endl
+                      << "  expected: " << line << std::endl
+                      << "  got:      " << state << std::endl;
+            return EXIT_DIVERGED;
+        }
+
+        cpu.step();
+    }
+
+    std::cout << "nestest: " << line_number - 1 << " instructions match the log." << std::endl;
+    return EXIT_PASSED;
+}
+
+// ===========================
+// KLAUS DORMANN FUNCTIONAL TEST
+// ===========================
+
+static int run_klaus(const std::string& path, uint16_t success_address, bool use_jit)
+{
+    std::string image;
+    if (!read_file(path, image))
+    {
+        std::cout << "klaus: ``" << path << "'' not found; skipping." << std::endl;
+        return EXIT_SKIPPED;
+    }
+
+    if (image.size() != constants::ADDRESS_SPACE_SIZE)
+    {
+        std::cout << "klaus: ``" << path << "'' is not a 64KiB memory image." << std::endl;
+        return EXIT_DIVERGED;
+    }
+
+    if (use_jit && !JIT::is_supported())
+    {
+        std::cout << "klaus: the recompiler is not available on this platform; skipping." << std::endl;
+        return EXIT_SKIPPED;
+    }
+
+    std::unique_ptr<RAM> ram(new RAM());
+    ram->map_flat();
+    ram->load(reinterpret_cast<const uint8_t*>(image.data()), image.size(), 0x0000);
+
+    MOS6502 cpu(ram.get());
+    std::unique_ptr<JIT> jit(use_jit ? new JIT(&cpu, ram.get()) : nullptr);
+    cpu.PC = 0x0400;
+    cpu.SP = 0xFD;
+    cpu.FLG = 0x24;
+
+    // The whole test takes about 100 million cycles.
+    const uint64_t MAX_CYCLES = 500000000;
+
+    auto start = std::chrono::steady_clock::now();
+
+    run_to_trap(cpu, jit.get(), MAX_CYCLES);
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    char summary[128];
+    std::snprintf(summary, sizeof(summary), "%s at $%04X after %llu cycles (%.2f s%s).",
+                  cpu.is_halted() ? "halted" : "stopped", cpu.PC, (unsigned long long)cpu.cycles, seconds,
+                  use_jit ? ", recompiled" : "");
+
+    if (cpu.is_halted() || cpu.PC != success_address)
+    {
+        std::cout << "klaus: failed: " << summary << std::endl;
+        return EXIT_DIVERGED;
+    }
+
+    std::cout << "klaus: passed: " << summary << std::endl;
+    return EXIT_PASSED;
+}
+
+// ===========================
+// TOM HARTE SINGLE-STEP TESTS
+// ===========================
+
+// Just enough JSON for the test files: objects, arrays, strings and non-negative integers.
+struct json_t
+{
+    enum type_t { NONE, NUMBER, STRING, ARRAY, OBJECT };
+
+    type_t type = NONE;
+    uint64_t number = 0;
+    std::string string;
+    std::vector<json_t> items;
+    std::vector<std::pair<std::string, json_t>> members;
+
+    const json_t* member(const char* name) const
+    {
+        for (const auto& entry : members)
+        {
+            if (entry.first == name)
+                return &entry.second;
+        }
+        return nullptr;
+    }
+
+    uint64_t get(const char* name) const
+    {
+        const json_t* value = member(name);
+        return value != nullptr ? value->number : 0;
+    }
+};
+
+class JsonParser
+{
+private:
+    const char* position;
+    const char* end;
+
+    void skip_space()
+    {
+        while (position < end && (*position == ' ' || *position == '\n' || *position == '\r' || *position == '\t'))
+            position++;
+    }
+
+    bool expect(char c)
+    {
+        skip_space();
+        if (position >= end || *position != c)
+            return false;
+        position++;
+        return true;
+    }
+
+    bool parse_string(std::string& out)
+    {
+        if (!expect('"'))
+            return false;
+
+        const char* start = position;
+        while (position < end && *position != '"')
+            position += *position == '\\' ? 2 : 1;
+
+        if (position >= end)
+            return false;
+
+        out.assign(start, position);
+        position++;
+        return true;
+    }
+public:
+    JsonParser(const std::string& text) : position(text.data()), end(text.data() + text.size()) {}
+
+    bool parse(json_t& out)
+    {
+        skip_space();
+        if (position >= end)
+            return false;
+
+        if (*position == '{')
+        {
+            out.type = json_t::OBJECT;
+            position++;
+            if (expect('}'))
+                return true;
+
+            do
+            {
+                out.members.emplace_back();
+                if (!parse_string(out.members.back().first) || !expect(':') || !parse(out.members.back().second))
+                    return false;
+            } while (expect(','));
+
+            return expect('}');
+        }
+
+        if (*position == '[')
+        {
+            out.type = json_t::ARRAY;
+            position++;
+            if (expect(']'))
+                return true;
+
+            do
+            {
+                out.items.emplace_back();
+                if (!parse(out.items.back()))
+                    return false;
+            } while (expect(','));
+
+            return expect(']');
+        }
+
+        if (*position == '"')
+        {
+            out.type = json_t::STRING;
+            return parse_string(out.string);
+        }
+
+        out.type = json_t::NUMBER;
+        char* number_end = nullptr;
+        out.number = std::strtoull(position, &number_end, 10);
+        if (number_end == position)
+            return false;
+        position = number_end;
+        return true;
+    }
+};
+
+struct harte_result_t
+{
+    uint8_t opcode = 0;
+    bool ran = false;
+    std::size_t cases = 0;
+    std::string failure;   // Empty if every case passed.
+};
+
+static void load_harte_state(const json_t& state, MOS6502& cpu, RAM& ram)
+{
+    cpu.PC = state.get("pc");
+    cpu.SP = state.get("s");
+    cpu.ACC = state.get("a");
+    cpu.X = state.get("x");
+    cpu.Y = state.get("y");
+    cpu.FLG = state.get("p");
+
+    const json_t* memory = state.member("ram");
+    if (memory != nullptr)
+    {
+        for (const json_t& entry : memory->items)
+            ram.write_byte(entry.items[0].number, entry.items[1].number);
+    }
+}
+
+// Compares the CPU with a test's final state. Returns a description of the first difference.
+static std::string compare_harte_state(const json_t& state, uint64_t expected_cycles, const MOS6502& cpu,
+                                       const RAM& ram)
+{
+    char difference[96] = "";
+
+    if (cpu.PC != state.get("pc") || cpu.SP != state.get("s") || cpu.ACC != state.get("a") ||
+        cpu.X != state.get("x") || cpu.Y != state.get("y") || cpu.FLG != state.get("p"))
+    {
+        std::snprintf(difference, sizeof(difference),
+                      "registers: expected PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X, got PC:%04X A:%02X X:%02X "
+                      "Y:%02X P:%02X SP:%02X",
+                      (unsigned int)state.get("pc"), (unsigned int)state.get("a"), (unsigned int)state.get("x"),
+                      (unsigned int)state.get("y"), (unsigned int)state.get("p"), (unsigned int)state.get("s"),
+                      cpu.PC, cpu.ACC, cpu.X, cpu.Y, cpu.FLG, cpu.SP);
+        return difference;
+    }
+
+    if (cpu.cycles != expected_cycles)
+    {
+        std::snprintf(difference, sizeof(difference), "cycles: expected %llu, got %llu",
+                      (unsigned long long)expected_cycles, (unsigned long long)cpu.cycles);
+        return difference;
+    }
+
+    const json_t* memory = state.member("ram");
+    if (memory != nullptr)
+    {
+        for (const json_t& entry : memory->items)
+        {
+            const uint8_t value = ram.peek_byte(entry.items[0].number);
+            if (value != entry.items[1].number)
+            {
+                std::snprintf(difference, sizeof(difference), "memory: expected $%04X = %02X, got %02X",
+                              (unsigned int)entry.items[0].number, (unsigned int)entry.items[1].number, value);
+                return difference;
+            }
+        }
+    }
+
+    return difference;
+}
+
+static void run_harte_file(const std::string& path, MOS6502& cpu, RAM& ram, const std::atomic<bool>& stop,
+                           harte_result_t& result)
+{
+    std::string text;
+    json_t cases;
+    if (!read_file(path, text) || !JsonParser(text).parse(cases) || cases.type != json_t::ARRAY)
+    {
+        result.ran = true;
+        result.failure = "could not parse " + path;
+        return;
+    }
+
+    result.ran = true;
+
+    for (const json_t& test : cases.items)
+    {
+        if (stop)
+            return;
+
+        const json_t* initial = test.member("initial");
+        const json_t* final_state = test.member("final");
+        const json_t* bus_cycles = test.member("cycles");
+        if (initial == nullptr || final_state == nullptr || bus_cycles == nullptr)
+        {
+            result.failure = "malformed test case in " + path;
+            return;
+        }
+
+        load_harte_state(*initial, cpu, ram);
+        cpu.cycles = 0;
+        cpu.step();
+        result.cases++;
+
+        const std::string difference = compare_harte_state(*final_state, bus_cycles->items.size(), cpu, ram);
+        if (!difference.empty())
+        {
+            const json_t* name = test.member("name");
+            result.failure = "case \"" + (name != nullptr ? name->string : std::string("?")) + "\": " + difference;
+            return;
+        }
+    }
+}
+
+static int run_harte(const std::string& directory, std::size_t thread_count)
+{
+    std::vector<std::pair<uint8_t, std::string>> files;
+
+    for (unsigned int opcode = 0; opcode < 256; opcode++)
+    {
+        if (!is_official(opcode))
+            continue;
+
+        char name[8];
+        std::snprintf(name, sizeof(name), "%02x.json", opcode);
+        const std::string path = directory + "/" + name;
+
+        if (std::ifstream(path))
+            files.emplace_back(opcode, path);
+    }
+
+    if (files.empty())
+    {
+        std::cout << "harte: no test files in ``" << directory << "''; skipping." << std::endl;
+        return EXIT_SKIPPED;
+    }
+
+    std::vector<harte_result_t> results(files.size());
+    std::atomic<bool> stop(false);
+    auto start = std::chrono::steady_clock::now();
+
+    {
+        ThreadPool pool(thread_count);
+
+        // One flat 64KiB machine per worker.
+        std::vector<std::unique_ptr<RAM>> rams(pool.size());
+        std::vector<std::unique_ptr<MOS6502>> cpus(pool.size());
+
+        for (std::size_t i = 0; i < files.size(); i++)
+        {
+            pool.submit([&, i](std::size_t worker) {
+                if (stop)
+                    return;
+
+                if (!cpus[worker])
+                {
+                    rams[worker].reset(new RAM());
+                    rams[worker]->map_flat();
+                    cpus[worker].reset(new MOS6502(rams[worker].get()));
+                }
+
+                results[i].opcode = files[i].first;
+                run_harte_file(files[i].second, *cpus[worker], *rams[worker], stop, results[i]);
+
+                if (!results[i].failure.empty())
+                    stop = true;
+            });
+        }
+
+        pool.wait();
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::size_t cases = 0, opcodes_run = 0;
+    int status = EXIT_PASSED;
+
+    for (const harte_result_t& result : results)
+    {
+        cases += result.cases;
+        opcodes_run += result.ran ? 1 : 0;
+
+        if (!result.failure.empty())
+        {
+            std::printf("harte: opcode %02X diverged: %s\n", result.opcode, result.failure.c_str());
+            status = EXIT_DIVERGED;
+        }
+    }
+
+    std::printf("harte: %zu cases over %zu of %zu opcode files in %.2f s, %s.\n", cases, opcodes_run, files.size(),
+                seconds, status == EXIT_PASSED ? "all passed" : "stopped at the first divergence");
+    return status;
+}
+
+// ===========================
+// SELF-TEST
+// ===========================
+
+// One instruction from a known state: the registers before and after, with one byte of memory
+// set beforehand and one checked afterwards (address 0: none). SP starts at $FD, cycles at 0.
+struct step_case_t
+{
+    const char* name;
+    uint16_t pc;
+    uint8_t code[3];
+    uint8_t a, x, y, p;
+    uint16_t poke_address;
+    uint8_t poke_value;
+    uint16_t expected_pc;
+    uint8_t expected_a, expected_x, expected_y, expected_p, expected_sp;
+    uint64_t expected_cycles;
+    uint16_t check_address;
+    uint8_t check_value;
+};
+
+static const step_case_t STEP_CASES[] = {
+    {"LDA #$80",                    0x0200, {0xA9, 0x80},       0x00, 0x00, 0x00, 0x24, 0x0000, 0x00,
+                                    0x0202, 0x80, 0x00, 0x00, 0xA4, 0xFD, 2, 0x0000, 0x00},
+    {"ADC #$50 overflows",          0x0200, {0x69, 0x50},       0x50, 0x00, 0x00, 0x24, 0x0000, 0x00,
+                                    0x0202, 0xA0, 0x00, 0x00, 0xE4, 0xFD, 2, 0x0000, 0x00},
+    {"SBC #$01 borrows",            0x0200, {0xE9, 0x01},       0x00, 0x00, 0x00, 0x25, 0x0000, 0x00,
+                                    0x0202, 0xFF, 0x00, 0x00, 0xA4, 0xFD, 2, 0x0000, 0x00},
+    {"LDA abs,X crossing a page",   0x0200, {0xBD, 0xF0, 0x12}, 0x55, 0x20, 0x00, 0x24, 0x1310, 0x00,
+                                    0x0203, 0x00, 0x20, 0x00, 0x26, 0xFD, 5, 0x0000, 0x00},
+    {"BNE taken across a page",     0x02F0, {0xD0, 0x20},       0x00, 0x00, 0x00, 0x24, 0x0000, 0x00,
+                                    0x0312, 0x00, 0x00, 0x00, 0x24, 0xFD, 4, 0x0000, 0x00},
+    {"BEQ not taken",               0x0200, {0xF0, 0x10},       0x00, 0x00, 0x00, 0x24, 0x0000, 0x00,
+                                    0x0202, 0x00, 0x00, 0x00, 0x24, 0xFD, 2, 0x0000, 0x00},
+    {"JSR",                         0x0200, {0x20, 0x34, 0x12}, 0x00, 0x00, 0x00, 0x24, 0x0000, 0x00,
+                                    0x1234, 0x00, 0x00, 0x00, 0x24, 0xFB, 6, 0x01FC, 0x02},
+    {"ROR A through carry",         0x0200, {0x6A},             0x01, 0x00, 0x00, 0x25, 0x0000, 0x00,
+                                    0x0201, 0x80, 0x00, 0x00, 0xA5, 0xFD, 2, 0x0000, 0x00},
+    {"INC zp wraps",                0x0200, {0xE6, 0x10},       0x00, 0x00, 0x00, 0x24, 0x0010, 0xFF,
+                                    0x0202, 0x00, 0x00, 0x00, 0x26, 0xFD, 5, 0x0010, 0x00},
+    {"PLA",                         0x0200, {0x68},             0x55, 0x00, 0x00, 0x24, 0x01FE, 0x00,
+                                    0x0201, 0x00, 0x00, 0x00, 0x26, 0xFE, 4, 0x0000, 0x00},
+    // The pointer's high byte comes from $0200, not $0300: the opcode itself.
+    {"JMP ($02FF) wraps in the page", 0x0200, {0x6C, 0xFF, 0x02}, 0x00, 0x00, 0x00, 0x24, 0x02FF, 0x34,
+                                    0x6C34, 0x00, 0x00, 0x00, 0x24, 0xFD, 5, 0x0000, 0x00},
+};
+
+// Fills $0300-$03FF with a permutation of 0-255 and bubble sorts it through ($10),Y, copies
+// it reversed to $0600 with a store whose operand the loop rewrites, adds it up into $12-$14
+// and ends with a BRK whose handler counts itself in $15.
+static const uint8_t SELFTEST_PROGRAM[] = {
+    0xA2, 0xFF,        // $0400  LDX #$FF
+    0x9A,              // $0402  TXS
+    0xA2, 0x00,        // $0403  LDX #$00
+    0xA9, 0x0B,        // $0405  LDA #$0B
+    0x9D, 0x00, 0x03,  // $0407  fill: STA $0300,X
+    0x18,              // $040A  CLC
+    0x69, 0x25,        // $040B  ADC #$25
+    0xE8,              // $040D  INX
+    0xD0, 0xF7,        // $040E  BNE fill
+    0x20, 0x1E, 0x04,  // $0410  JSR sort
+    0x20, 0x45, 0x04,  // $0413  JSR reverse
+    0x20, 0x57, 0x04,  // $0416  JSR sum
+    0x00, 0xEA,        // $0419  BRK
+    0x4C, 0x1B, 0x04,  // $041B  done: JMP done
+    0xA9, 0x00,        // $041E  sort: LDA #$00
+    0x85, 0x10,        // $0420  STA $10
+    0xA9, 0x03,        // $0422  LDA #$03
+    0x85, 0x11,        // $0424  STA $11
+    0xA0, 0x00,        // $0426  pass: LDY #$00
+    0xA2, 0x00,        // $0428  LDX #$00
+    0xB1, 0x10,        // $042A  compare: LDA ($10),Y
+    0xC8,              // $042C  INY
+    0xD1, 0x10,        // $042D  CMP ($10),Y
+    0x90, 0x0C,        // $042F  BCC next
+    0x48,              // $0431  PHA
+    0xB1, 0x10,        // $0432  LDA ($10),Y
+    0x88,              // $0434  DEY
+    0x91, 0x10,        // $0435  STA ($10),Y
+    0xC8,              // $0437  INY
+    0x68,              // $0438  PLA
+    0x91, 0x10,        // $0439  STA ($10),Y
+    0xA2, 0x01,        // $043B  LDX #$01
+    0xC0, 0xFF,        // $043D  next: CPY #$FF
+    0xD0, 0xE9,        // $043F  BNE compare
+    0x8A,              // $0441  TXA
+    0xD0, 0xE2,        // $0442  BNE pass
+    0x60,              // $0444  RTS
+    0xA2, 0x00,        // $0445  reverse: LDX #$00
+    0x8A,              // $0447  copy: TXA
+    0x49, 0xFF,        // $0448  EOR #$FF
+    0x8D, 0x51, 0x04,  // $044A  STA store+1
+    0xBD, 0x00, 0x03,  // $044D  LDA $0300,X
+    0x8D, 0x00, 0x06,  // $0450  store: STA $0600
+    0xE8,              // $0453  INX
+    0xD0, 0xF1,        // $0454  BNE copy
+    0x60,              // $0456  RTS
+    0xA2, 0x00,        // $0457  sum: LDX #$00
+    0x18,              // $0459  add: CLC
+    0xA5, 0x12,        // $045A  LDA $12
+    0x7D, 0x00, 0x06,  // $045C  ADC $0600,X
+    0x85, 0x12,        // $045F  STA $12
+    0xA5, 0x13,        // $0461  LDA $13
+    0x69, 0x00,        // $0463  ADC #$00
+    0x85, 0x13,        // $0465  STA $13
+    0x38,              // $0467  SEC
+    0xA5, 0x14,        // $0468  LDA $14
+    0xFD, 0x00, 0x03,  // $046A  SBC $0300,X
+    0x4A,              // $046D  LSR A
+    0x85, 0x14,        // $046E  STA $14
+    0xE8,              // $0470  INX
+    0xD0, 0xE6,        // $0471  BNE add
+    0x60,              // $0473  RTS
+    0xE6, 0x15,        // $0474  irq: INC $15
+    0x40,              // $0476  RTI
+};
+
+static const uint16_t SELFTEST_START = 0x0400;
+static const uint16_t SELFTEST_END = 0x041B;
+static const uint16_t SELFTEST_IRQ = 0x0474;
+
+// A 16KiB NROM game that waits for NMIs in a loop on RAM, and every fourth frame switches
+// NMIs off and polls $2002 for vertical blank instead: the two kinds of idle loop.
+static const uint8_t IDLE_PROGRAM[] = {
+    0x78,              // $C000  SEI
+    0xA2, 0xFF,        // $C001  LDX #$FF
+    0x9A,              // $C003  TXS
+    0x2C, 0x02, 0x20,  // $C004  warm: BIT $2002
+    0x10, 0xFB,        // $C007  BPL warm
+    0xA9, 0x80,        // $C009  LDA #$80
+    0x8D, 0x00, 0x20,  // $C00B  STA $2000
+    0xA5, 0x10,        // $C00E  main: LDA $10
+    0xC5, 0x10,        // $C010  wait: CMP $10
+    0xF0, 0xFC,        // $C012  BEQ wait
+    0xE6, 0x11,        // $C014  INC $11
+    0x29, 0x03,        // $C016  AND #$03
+    0xD0, 0xF4,        // $C018  BNE main
+    0x8D, 0x00, 0x20,  // $C01A  STA $2000 (A = 0)
+    0xAD, 0x02, 0x20,  // $C01D  poll: LDA $2002
+    0x10, 0xFB,        // $C020  BPL poll
+    0xE6, 0x10,        // $C022  INC $10
+    0xA9, 0x80,        // $C024  LDA #$80
+    0x8D, 0x00, 0x20,  // $C026  STA $2000
+    0x4C, 0x0E, 0xC0,  // $C029  JMP main
+    0xE6, 0x10,        // $C02C  nmi: INC $10
+    0x40,              // $C02E  RTI
+};
+
+static const uint16_t IDLE_NMI = 0xC02C;
+
+static std::string describe_registers(const MOS6502& cpu)
+{
+    char registers[64];
+    std::snprintf(registers, sizeof(registers), "PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu", cpu.PC,
+                  cpu.ACC, cpu.X, cpu.Y, cpu.FLG, cpu.SP, (unsigned long long)cpu.cycles);
+    return registers;
+}
+
+static bool run_step_cases()
+{
+    for (const step_case_t& test : STEP_CASES)
+    {
+        std::unique_ptr<RAM> ram(new RAM());
+        ram->map_flat();
+        ram->load(test.code, sizeof(test.code), test.pc);
+        if (test.poke_address != 0)
+            ram->write_byte(test.poke_address, test.poke_value);
+
+        MOS6502 cpu(ram.get());
+        cpu.PC = test.pc;
+        cpu.ACC = test.a;
+        cpu.X = test.x;
+        cpu.Y = test.y;
+        cpu.FLG = test.p;
+        cpu.SP = 0xFD;
+        cpu.step();
+
+        MOS6502 expected(ram.get());
+        expected.PC = test.expected_pc;
+        expected.ACC = test.expected_a;
+        expected.X = test.expected_x;
+        expected.Y = test.expected_y;
+        expected.FLG = test.expected_p;
+        expected.SP = test.expected_sp;
+        expected.cycles = test.expected_cycles;
+
+        const std::string got = describe_registers(cpu);
+        const std::string wanted = describe_registers(expected);
+
+        if (got != wanted || (test.check_address != 0 && ram->peek_byte(test.check_address) != test.check_value))
+        {
+            std::cout << "selftest: step \"" << test.name << "\" diverged." << std::endl
+                      << "  expected: " << wanted << std::endl
+                      << "  got:      " << got << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "selftest: " << sizeof(STEP_CASES) / sizeof(STEP_CASES[0]) << " single steps match." << std::endl;
+    return true;
+}
+
+static void load_selftest_program(RAM& ram, MOS6502& cpu)
+{
+    ram.map_flat();
+    ram.load(SELFTEST_PROGRAM, sizeof(SELFTEST_PROGRAM), SELFTEST_START);
+    ram.write_byte(0xFFFE, SELFTEST_IRQ & 0xFF);
+    ram.write_byte(0xFFFF, SELFTEST_IRQ >> 8);
+
+    cpu.PC = SELFTEST_START;
+    cpu.SP = 0xFD;
+    cpu.FLG = 0x24;
+}
+
+// Checks what the program leaves behind. Returns a description of the first difference.
+static std::string check_selftest_program(const MOS6502& cpu, const RAM& ram)
+{
+    char difference[64] = "";
+
+    if (cpu.is_halted() || cpu.PC != SELFTEST_END)
+    {
+        std::snprintf(difference, sizeof(difference), "stopped at $%04X", cpu.PC);
+        return difference;
+    }
+
+    for (unsigned int i = 0; i < 0x100; i++)
+    {
+        if (ram.peek_byte(0x0300 + i) != i || ram.peek_byte(0x0600 + i) != 0xFF - i)
+        {
+            std::snprintf(difference, sizeof(difference), "$%04X = %02X, $%04X = %02X", 0x0300 + i,
+                          ram.peek_byte(0x0300 + i), 0x0600 + i, ram.peek_byte(0x0600 + i));
+            return difference;
+        }
+    }
+
+    // The sum of 0-255 is $7F80.
+    if (ram.peek_byte(0x12) != 0x80 || ram.peek_byte(0x13) != 0x7F || ram.peek_byte(0x14) != 0x01 ||
+        ram.peek_byte(0x15) != 0x01)
+    {
+        std::snprintf(difference, sizeof(difference), "$12-$15 = %02X %02X %02X %02X", ram.peek_byte(0x12),
+                      ram.peek_byte(0x13), ram.peek_byte(0x14), ram.peek_byte(0x15));
+        return difference;
+    }
+
+    return difference;
+}
+
+// Runs the program on the interpreter, then on the interpreter and the recompiler side by side
+// in slices of a few hundred cycles: both tiers have to stop at the same instruction in the
+// same state every time.
+static bool run_selftest_program()
+{
+    std::unique_ptr<RAM> ram(new RAM());
+    MOS6502 cpu(ram.get());
+    load_selftest_program(*ram, cpu);
+    run_to_trap(cpu, nullptr, 10000000);
+
+    const std::string difference = check_selftest_program(cpu, *ram);
+    if (!difference.empty())
+    {
+        std::cout << "selftest: program diverged: " << difference << "." << std::endl;
+        return false;
+    }
+
+    std::cout << "selftest: program ran in " << cpu.cycles << " cycles." << std::endl;
+
+    if (!JIT::is_supported())
+    {
+        std::cout << "selftest: the recompiler is not available on this platform; not compared." << std::endl;
+        return true;
+    }
+
+    std::unique_ptr<RAM> interpreted_ram(new RAM()), compiled_ram(new RAM());
+    MOS6502 interpreted(interpreted_ram.get()), compiled(compiled_ram.get());
+    JIT jit(&compiled, compiled_ram.get());
+    load_selftest_program(*interpreted_ram, interpreted);
+    load_selftest_program(*compiled_ram, compiled);
+
+    for (uint64_t slice = 0; interpreted.cycles < cpu.cycles; slice++)
+    {
+        const uint64_t target = interpreted.cycles + 200 + slice % 300;
+        interpreted.run_until(target);
+        jit.run_until(target);
+
+        if (describe_registers(interpreted) != describe_registers(compiled))
+        {
+            std::cout << "selftest: recompiled program diverged." << std::endl
+                      << "  interpreted: " << describe_registers(interpreted) << std::endl
+                      << "  recompiled:  " << describe_registers(compiled) << std::endl;
+            return false;
+        }
+    }
+
+    for (unsigned int addr = 0; addr < constants::ADDRESS_SPACE_SIZE; addr++)
+    {
+        if (interpreted_ram->peek_byte(addr) != compiled_ram->peek_byte(addr))
+        {
+            std::printf("selftest: recompiled program left $%04X = %02X, interpreted %02X.\n", addr,
+                        compiled_ram->peek_byte(addr), interpreted_ram->peek_byte(addr));
+            return false;
+        }
+    }
+
+    const jit_stats_t stats = jit.get_stats();
+    if (stats.blocks_compiled == 0 || stats.blocks_invalidated == 0)
+    {
+        std::cout << "selftest: the recompiler compiled " << stats.blocks_compiled << " and invalidated "
+                  << stats.blocks_invalidated << " blocks; expected both." << std::endl;
+        return false;
+    }
+
+    std::cout << "selftest: recompiled program matches in lockstep (" << stats.blocks_compiled << " blocks, "
+              << stats.blocks_invalidated << " invalidated)." << std::endl;
+    return true;
+}
+
+// The idle loop game as an iNES image: 16KiB of PRG-ROM and 8KiB of blank CHR-ROM.
+static std::vector<uint8_t> make_idle_rom()
+{
+    std::vector<uint8_t> rom(16 + 0x4000 + 0x2000, 0x00);
+    const uint8_t header[] = {'N', 'E', 'S', 0x1A, 0x01, 0x01};
+    std::copy(header, header + sizeof(header), rom.begin());
+    std::copy(IDLE_PROGRAM, IDLE_PROGRAM + sizeof(IDLE_PROGRAM), rom.begin() + 16);
+
+    uint8_t* vectors = &rom[16 + 0x3FFA];
+    vectors[0] = IDLE_NMI & 0xFF;  // NMI
+    vectors[1] = IDLE_NMI >> 8;
+    vectors[2] = 0x00;             // RESET
+    vectors[3] = 0xC0;
+    vectors[4] = 0x00;             // IRQ
+    vectors[5] = 0xC0;
+
+    return rom;
+}
+
+// Runs the idle loop game with and without idle loop skipping, interpreted and recompiled:
+// every frame, all four consoles have to be in the same state.
+static bool run_selftest_idle_skip()
+{
+    const std::vector<uint8_t> rom = make_idle_rom();
+    const bool jit_supported = JIT::is_supported();
+    std::vector<std::unique_ptr<NES>> consoles;
+
+    for (int variant = 0; variant < (jit_supported ? 4 : 2); variant++)
+    {
+        consoles.emplace_back(new NES());
+        if (!consoles.back()->load_rom(rom.data(), rom.size()))
+            return false;
+
+        consoles.back()->set_output_enabled(false, false);
+        consoles.back()->set_idle_skip_enabled(variant & 1);
+        consoles.back()->set_jit_enabled(variant & 2);
+    }
+
+    const uint64_t FRAMES = 60;
+
+    for (uint64_t frame = 1; frame <= FRAMES; frame++)
+    {
+        for (auto& nes : consoles)
+            nes->run_frames(1);
+
+        for (std::size_t variant = 1; variant < consoles.size(); variant++)
+        {
+            if (consoles[variant]->state_hash() != consoles[0]->state_hash())
+            {
+                std::cout << "selftest: idle loop skipping diverged in frame " << frame << "." << std::endl
+                          << "  plain:   " << describe_registers(consoles[0]->get_cpu()) << std::endl
+                          << "  variant " << variant << ": " << describe_registers(consoles[variant]->get_cpu())
+                          << std::endl;
+                return false;
+            }
+        }
+    }
+
+    const uint64_t skipped = consoles[1]->get_cpu().get_idle_skipped_cycles();
+    const uint8_t frames_seen = consoles[0]->get_ram().peek_byte(0x11);
+
+    if (skipped == 0 || frames_seen < FRAMES / 2)
+    {
+        std::cout << "selftest: the idle loop game saw " << (unsigned int)frames_seen << " frames and " << skipped
+                  << " cycles were skipped." << std::endl;
+        return false;
+    }
+
+    std::cout << "selftest: idle loop skipping matches over " << FRAMES << " frames (" << skipped << " of "
+              << consoles[1]->get_cpu().cycles << " cycles skipped)." << std::endl;
+    return true;
+}
+
+// Runs the idle loop game for a while, scribbling over work RAM and PRG-RAM every frame the
+// way a real game would, and records the state after each frame. Stepping back has to land
+// on exactly the recorded states, and running on from one has to retrace the recording.
+static bool run_selftest_rewind()
+{
+    const std::vector<uint8_t> rom = make_idle_rom();
+    const std::size_t FRAMES = 100;
+
+    for (int compress = 0; compress < 2; compress++)
+    {
+        std::unique_ptr<NES> nes(new NES());
+        if (!nes->load_rom(rom.data(), rom.size()))
+            return false;
+
+        nes->set_output_enabled(false, false);
+
+        RewindBuffer rewind(*nes, 64, 16, compress != 0);
+        std::vector<uint64_t> hashes;
+
+        for (std::size_t frame = 0; frame < FRAMES; frame++)
+        {
+            nes->run_frames(1);
+            for (unsigned int i = 0; i < 8; i++)
+                nes->get_ram().write_byte(0x0300 + i * 0x31 + frame, frame * 7 + i);
+            nes->get_ram().write_byte(0x6000 + frame * 0x41, frame);
+
+            if (!rewind.push())
+                return false;
+            hashes.push_back(nes->state_hash());
+        }
+
+        // From the latest frame: within a keyframe's run, across keyframes, then too far.
+        const std::size_t STEPS[] = {1, 5, 20, 30};
+        std::size_t latest = FRAMES - 1;
+
+        for (std::size_t step : STEPS)
+        {
+            latest -= step;
+            if (!rewind.step_back(step) || nes->state_hash() != hashes[latest])
+            {
+                std::cout << "selftest: stepping back " << step << " frames to frame " << latest + 1 << " ("
+                          << (compress ? "compressed" : "uncompressed") << ") did not restore its state." << std::endl;
+                return false;
+            }
+        }
+
+        if (rewind.step_back(rewind.size()))
+        {
+            std::cout << "selftest: rewind stepped back past its history." << std::endl;
+            return false;
+        }
+
+        nes->run_frames(1);
+        for (unsigned int i = 0; i < 8; i++)
+            nes->get_ram().write_byte(0x0300 + i * 0x31 + latest + 1, (latest + 1) * 7 + i);
+        nes->get_ram().write_byte(0x6000 + (latest + 1) * 0x41, latest + 1);
+
+        if (nes->state_hash() != hashes[latest + 1])
+        {
+            std::cout << "selftest: running on from a rewound state left the recording." << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "selftest: rewind restores recorded frames, compressed and not." << std::endl;
+    return true;
+}
+
+// Forks the idle loop game over and over from one point, running each fork somewhere else
+// first: only the RAM a run dirtied is copied back on a re-fork, so every one of them has to
+// land on the point's state again, and play on from it like the console it was taken from.
+static bool run_selftest_fork()
+{
+    const std::vector<uint8_t> rom = make_idle_rom();
+    const uint64_t LEAD_IN = 10;
+    const uint64_t FOLLOW_ON = 7;
+
+    std::unique_ptr<NES> nes(new NES());
+    std::unique_ptr<NES> reference(new NES());
+    if (!nes->load_rom(rom.data(), rom.size()) || !reference->load_rom(rom.data(), rom.size()))
+        return false;
+
+    nes->set_output_enabled(false, false);
+    reference->set_output_enabled(false, false);
+    nes->run_frames(LEAD_IN);
+    reference->run_frames(LEAD_IN + FOLLOW_ON);
+
+    const std::shared_ptr<const fork_point_t> root = nes->make_fork_point();
+    const uint64_t root_hash = nes->state_hash();
+    if (!root)
+    {
+        std::cout << "selftest: could not take a fork point." << std::endl;
+        return false;
+    }
+
+    const unsigned int FORKS = 20;
+
+    for (unsigned int fork = 0; fork < FORKS; fork++)
+    {
+        if (!nes->fork(root) || nes->state_hash() != root_hash)
+        {
+            std::cout << "selftest: fork " << fork << " did not restore the fork point." << std::endl;
+            return false;
+        }
+
+        // Diverge: a few frames, a pressed button and writes across work RAM and PRG-RAM.
+        nes->set_controller(0, fork & 0xFF);
+        nes->run_frames(fork % 5 + 1);
+        for (unsigned int i = 0; i < 8; i++)
+            nes->get_ram().write_byte((fork * 0x95 + i * 0x101) & 0x07FF, fork + i);
+        nes->get_ram().write_byte(0x6000 + fork * 0x183, fork);
+        nes->set_controller(0, 0x00);
+    }
+
+    if (!nes->fork(root) || nes->state_hash() != root_hash)
+    {
+        std::cout << "selftest: the last fork did not restore the fork point." << std::endl;
+        return false;
+    }
+
+    nes->run_frames(FOLLOW_ON);
+    if (nes->state_hash() != reference->state_hash())
+    {
+        std::cout << "selftest: a fork ran off from the console it was taken from." << std::endl
+                  << "  console: " << describe_registers(reference->get_cpu()) << std::endl
+                  << "  fork:    " << describe_registers(nes->get_cpu()) << std::endl;
+        return false;
+    }
+
+    // A fresh console takes the point's cartridge image and state whole.
+    std::unique_ptr<NES> other(new NES());
+    other->set_output_enabled(false, false);
+    if (!other->fork(root) || other->state_hash() != root_hash)
+    {
+        std::cout << "selftest: a second console did not fork to the fork point." << std::endl;
+        return false;
+    }
+
+    std::cout << "selftest: " << FORKS << " re-forks from one point restore its state." << std::endl;
+    return true;
+}
+
+// An iNES header (bytes 4-11; the rest is "NES\x1A" and zeroes) on an image of `image_size'
+// bytes, and whether the loader should accept it.
+struct header_case_t
+{
+    const char* name;
+    uint8_t bytes[8];
+    std::size_t image_size;
+    bool valid;
+};
+
+static const header_case_t HEADER_CASES[] = {
+    {"iNES, 16KiB PRG-ROM and 8KiB CHR-ROM",  {0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, 16 + 0x6000, true},
+    {"iNES, PRG-ROM past the end",            {0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, 16 + 0x4000, false},
+    {"NES 2.0, 8KiB PRG-ROM as 2^13",         {0x34, 0x00, 0x00, 0x08, 0x00, 0x0F, 0x00, 0x00}, 16 + 0x2000, true},
+    {"NES 2.0, PRG-ROM exponent of 63",       {0xFC, 0x00, 0x00, 0x08, 0x00, 0x0F, 0x00, 0x00}, 48, false},
+    {"NES 2.0, 1-byte PRG-ROM",               {0x00, 0x00, 0x00, 0x08, 0x00, 0x0F, 0x00, 0x00}, 16 + 64, false},
+    {"NES 2.0, 128 bytes of PRG-RAM",         {0x01, 0x00, 0x00, 0x08, 0x00, 0x00, 0x01, 0x00}, 16 + 0x4000, true},
+    {"NES 2.0, 512-byte CHR-ROM",             {0x01, 0x24, 0x00, 0x08, 0x00, 0xF0, 0x00, 0x00}, 16 + 0x4200, false},
+    {"NES 2.0, 128 bytes of CHR-RAM",         {0x01, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x01}, 16 + 0x4000, true},
+};
+
+// Parses malformed and unusual headers, and checks that RAM sizes the bus cannot map in whole
+// pages come out rounded up.
+static bool run_selftest_headers()
+{
+    for (const header_case_t& test : HEADER_CASES)
+    {
+        std::vector<uint8_t> image(test.image_size, 0x00);
+        const uint8_t magic[] = {'N', 'E', 'S', 0x1A};
+        std::copy(magic, magic + sizeof(magic), image.begin());
+        std::copy(test.bytes, test.bytes + sizeof(test.bytes), image.begin() + 4);
+
+        ines_header_t header;
+        if (Cartridge::parse_header(image.data(), image.size(), header) != test.valid)
+        {
+            std::cout << "selftest: header \"" << test.name << "\" was " << (test.valid ? "rejected" : "accepted")
+                      << "." << std::endl;
+            return false;
+        }
+
+        if (!test.valid)
+            continue;
+
+        std::unique_ptr<Cartridge> cartridge(new Cartridge());
+        if (!cartridge->load_memory(image.data(), image.size()) ||
+            cartridge->get_prg_ram_size() % constants::DEFAULT_PRG_RAM_SIZE != 0 ||
+            cartridge->get_chr_ram_size() % constants::CHR_BANK_SIZE != 0)
+        {
+            std::cout << "selftest: header \"" << test.name << "\" loaded with " << cartridge->get_prg_ram_size()
+                      << " bytes of PRG-RAM and " << cartridge->get_chr_ram_size() << " of CHR-RAM." << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "selftest: " << sizeof(HEADER_CASES) / sizeof(HEADER_CASES[0]) << " headers parse as expected."
+              << std::endl;
+    return true;
+}
+
+static int run_selftest()
+{
+    const bool passed = run_step_cases() && run_selftest_program() && run_selftest_idle_skip() &&
+                        run_selftest_rewind() && run_selftest_fork() && run_selftest_headers();
+    return passed ? EXIT_PASSED : EXIT_DIVERGED;
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> arguments;
+    bool use_jit = false;
+    std::size_t thread_count = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+
+        if (argument == "--jit")
+            use_jit = true;
+        else if (argument == "--threads" && i + 1 < argc)
+            thread_count = std::stoul(argv[++i]);
+        else
+            arguments.push_back(argument);
+    }
+
+    if (arguments.size() == 3 && arguments[0] == "nestest")
+        return run_nestest(arguments[1], arguments[2]);
+
+    if ((arguments.size() == 2 || arguments.size() == 3) && arguments[0] == "klaus")
+    {
+        const uint16_t success_address = arguments.size() == 3 ? std::stoul(arguments[2], nullptr, 16) : 0x3469;
+        return run_klaus(arguments[1], success_address, use_jit);
+    }
+
+    if (arguments.size() == 2 && arguments[0] == "harte")
+        return run_harte(arguments[1], thread_count);
+
+    if (arguments.size() == 1 && arguments[0] == "selftest")
+        return run_selftest();
+
+    std::cout << "Usage: " << argv[0] << " nestest ROM LOG" << std::endl
+              << "       " << argv[0] << " klaus BINARY [SUCCESS_ADDRESS] [--jit]" << std::endl
+              << "       " << argv[0] << " harte DIRECTORY [--threads N]" << std::endl
+              << "       " << argv[0] << " selftest" << std::endl;
+    return 2;
+}
@@ -0,0 +1,520 @@
+/**
+ * Google Benchmark suite for the emulation core's hot paths: instructions per second on
+ * synthetic loops (ALU, branches, zero page, absolute and indirect indexed memory traffic),
+ * the cost of single bus accesses, CPU construction and ROM loading, and re-forking a console
+ * from a fork point compared with a full state restore.
+ *
+ * Usage: NESCoreBench [--perf-counters] [Google Benchmark flags]
+ *
+ * Use --benchmark_format=json (or --benchmark_out=FILE --benchmark_out_format=json) to keep
+ * results for regression tracking. --perf-counters adds host cycles and host instructions per
+ * emulated instruction to the CPU benchmarks, read from the hardware counters through
+ * perf_event_open (Linux only; needs perf_event_paranoid <= 2 or CAP_PERFMON).
+ */
+
+#include "../system/jit.hpp"
+#include "../system/mos6502.hpp"
+#include "../system/nes.hpp"
+#include "../system/ram.hpp"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+namespace
+{
+    // ===========================
+    // HARDWARE COUNTERS
+    // ===========================
+
+    bool use_perf_counters = false;
+
+    // Host CPU cycles and instructions retired by this thread, counted as one group.
+    class PerfCounters
+    {
+    private:
+        int cycles_fd = -1;
+        int instructions_fd = -1;
+
+#ifdef __linux__
+        static int open_counter(uint64_t config, int group_fd)
+        {
+            perf_event_attr attributes;
+            std::memset(&attributes, 0x00, sizeof(attributes));
+            attributes.type = PERF_TYPE_HARDWARE;
+            attributes.size = sizeof(attributes);
+            attributes.config = config;
+            attributes.disabled = group_fd == -1 ? 1 : 0;
+            attributes.exclude_kernel = 1;
+            attributes.exclude_hv = 1;
+
+            return (int)syscall(__NR_perf_event_open, &attributes, 0, -1, group_fd, 0);
+        }
+#endif
+
+        static uint64_t read_counter(int fd)
+        {
+            uint64_t value = 0;
+            if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+                return 0;
+            return value;
+        }
+    public:
+        PerfCounters()
+        {
+#ifdef __linux__
+            cycles_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+            if (cycles_fd >= 0)
+                instructions_fd = open_counter(PERF_COUNT_HW_INSTRUCTIONS, cycles_fd);
+#endif
+        }
+
+        ~PerfCounters()
+        {
+            if (instructions_fd >= 0)
+                close(instructions_fd);
+            if (cycles_fd >= 0)
+                close(cycles_fd);
+        }
+
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        bool is_open() const
+        {
+            return cycles_fd >= 0 && instructions_fd >= 0;
+        }
+
+        void start()
+        {
+#ifdef __linux__
+            ioctl(cycles_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+        }
+
+        void stop(uint64_t& cycles, uint64_t& instructions)
+        {
+#ifdef __linux__
+            ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+            cycles = read_counter(cycles_fd);
+            instructions = read_counter(instructions_fd);
+        }
+    };
+
+    // ===========================
+    // SYNTHETIC PROGRAMS
+    // ===========================
+
+    // Each program is an endless loop assembled at $8000.
+    const std::vector<uint8_t> ALU_LOOP = {
+        0x18,             // CLC
+        0x69, 0x01,       // ADC #$01
+        0x49, 0x5A,       // EOR #$5A
+        0x29, 0xF7,       // AND #$F7
+        0x09, 0x10,       // ORA #$10
+        0x0A,             // ASL A
+        0x38,             // SEC
+        0xE9, 0x03,       // SBC #$03
+        0xAA,             // TAX
+        0xE8,             // INX
+        0x8A,             // TXA
+        0x4A,             // LSR A
+        0x2A,             // ROL A
+        0x4C, 0x00, 0x80, // JMP $8000
+    };
+
+    const std::vector<uint8_t> BRANCH_LOOP = {
+        0xA0, 0x00,       // LDY #$00
+        0xC8,             // INY
+        0x98,             // TYA
+        0x29, 0x01,       // AND #$01
+        0xF0, 0x02,       // BEQ +2
+        0xD0, 0x00,       // BNE +0
+        0xC0, 0x40,       // CPY #$40
+        0xD0, 0xF4,       // BNE -12 (INY)
+        0x4C, 0x00, 0x80, // JMP $8000
+    };
+
+    const std::vector<uint8_t> ZERO_PAGE_LOOP = {
+        0xA5, 0x10,       // LDA $10
+        0x65, 0x11,       // ADC $11
+        0x85, 0x12,       // STA $12
+        0xE6, 0x13,       // INC $13
+        0xA6, 0x14,       // LDX $14
+        0x95, 0x20,       // STA $20,X
+        0xB5, 0x21,       // LDA $21,X
+        0x4C, 0x00, 0x80, // JMP $8000
+    };
+
+    const std::vector<uint8_t> ABSOLUTE_LOOP = {
+        0xAD, 0x00, 0x03, // LDA $0300
+        0x6D, 0x01, 0x03, // ADC $0301
+        0x8D, 0x02, 0x03, // STA $0302
+        0xEE, 0x03, 0x03, // INC $0303
+        0xAE, 0x04, 0x03, // LDX $0304
+        0x9D, 0x00, 0x04, // STA $0400,X
+        0xBD, 0x00, 0x05, // LDA $0500,X
+        0x4C, 0x00, 0x80, // JMP $8000
+    };
+
+    const std::vector<uint8_t> INDIRECT_INDEXED_LOOP = {
+        0xA0, 0x00,       // LDY #$00
+        0xB1, 0x10,       // LDA ($10),Y
+        0x91, 0x12,       // STA ($12),Y
+        0xC8,             // INY
+        0xD0, 0xF9,       // BNE -7 (LDA)
+        0x4C, 0x00, 0x80, // JMP $8000
+    };
+
+    const std::size_t PRG_SIZE = 0x8000;
+
+    // A CPU on the NES memory layout, running `program' either from read-only memory mapped
+    // at $8000 (like cartridge ROM; predecoded) or from writable memory (decoded live).
+    struct machine_t
+    {
+        RAM ram;
+        MOS6502 cpu;
+        std::vector<uint8_t> prg;
+
+        machine_t(const std::vector<uint8_t>& program, bool code_in_rom) : cpu(&ram), prg(PRG_SIZE, 0xEA)
+        {
+            std::copy(program.begin(), program.end(), prg.begin());
+            prg[0x7FFC] = 0x00; // Reset vector: $8000.
+            prg[0x7FFD] = 0x80;
+
+            if (code_in_rom)
+                ram.map_read_only(0x8000, 0xFFFF, prg.data(), PRG_SIZE, nullptr, nullptr);
+            else
+                ram.load(prg, 0x8000);
+
+            // Pointers for the indirect indexed loop.
+            ram.write_byte(0x0010, 0x00); ram.write_byte(0x0011, 0x03);
+            ram.write_byte(0x0012, 0x00); ram.write_byte(0x0013, 0x04);
+
+            cpu.power_on();
+        }
+    };
+
+    const uint64_t STEPS_PER_ITERATION = 10000;
+
+    void report_perf_counters(benchmark::State& state, PerfCounters& counters, uint64_t instructions)
+    {
+        uint64_t host_cycles = 0, host_instructions = 0;
+        counters.stop(host_cycles, host_instructions);
+
+        if (instructions > 0)
+        {
+            state.counters["host_cycles_per_instruction"] = (double)host_cycles / instructions;
+            state.counters["host_instructions_per_instruction"] = (double)host_instructions / instructions;
+        }
+    }
+
+    // ===========================
+    // CPU BENCHMARKS
+    // ===========================
+
+    // Interpreter. Argument: 0 runs the program from ROM, 1 from RAM.
+    void BM_Interpreter(benchmark::State& state, const std::vector<uint8_t>& program)
+    {
+        std::unique_ptr<machine_t> machine(new machine_t(program, state.range(0) == 0));
+        MOS6502& cpu = machine->cpu;
+
+        PerfCounters counters;
+        const bool counting = use_perf_counters && counters.is_open();
+        if (use_perf_counters && !counting)
+        {
+            state.SkipWithError("perf_event_open failed; hardware counters are not available");
+            return;
+        }
+
+        const uint64_t start_cycle = cpu.cycles;
+        if (counting)
+            counters.start();
+
+        for (auto _ : state)
+        {
+            for (uint64_t i = 0; i < STEPS_PER_ITERATION; i++)
+                cpu.step();
+        }
+
+        const uint64_t instructions = state.iterations() * STEPS_PER_ITERATION;
+        if (counting)
+            report_perf_counters(state, counters, instructions);
+
+        state.SetItemsProcessed(instructions);
+        state.counters["emulated_cycles_per_instruction"] = (double)(cpu.cycles - start_cycle) / instructions;
+    }
+
+    // Recompiler tier, on the same programs from ROM. Compiled blocks don't count instructions,
+    // so the count is derived from the cycles run and the program's cycles per instruction
+    // (measured on the interpreter first).
+    void BM_Recompiled(benchmark::State& state, const std::vector<uint8_t>& program)
+    {
+        if (!JIT::is_supported())
+        {
+            state.SkipWithError("the recompiler is not available on this platform");
+            return;
+        }
+
+        std::unique_ptr<machine_t> machine(new machine_t(program, true));
+        MOS6502& cpu = machine->cpu;
+        JIT jit(&cpu, &machine->ram);
+
+        const uint64_t calibration_start = cpu.cycles;
+        for (uint64_t i = 0; i < STEPS_PER_ITERATION; i++)
+            cpu.step();
+        const double cycles_per_instruction = (double)(cpu.cycles - calibration_start) / STEPS_PER_ITERATION;
+        const uint64_t cycles_per_iteration = (uint64_t)(cycles_per_instruction * STEPS_PER_ITERATION);
+
+        PerfCounters counters;
+        const bool counting = use_perf_counters && counters.is_open();
+        if (use_perf_counters && !counting)
+        {
+            state.SkipWithError("perf_event_open failed; hardware counters are not available");
+            return;
+        }
+
+        const uint64_t start_cycle = cpu.cycles;
+        if (counting)
+            counters.start();
+
+        for (auto _ : state)
+            jit.run_until(cpu.cycles + cycles_per_iteration);
+
+        const uint64_t instructions = (uint64_t)((cpu.cycles - start_cycle) / cycles_per_instruction);
+        if (counting)
+            report_perf_counters(state, counters, instructions);
+
+        state.SetItemsProcessed(instructions);
+        state.counters["emulated_cycles_per_instruction"] = cycles_per_instruction;
+    }
+
+    // ===========================
+    // BUS AND SETUP BENCHMARKS
+    // ===========================
+
+    const std::size_t BUS_ACCESSES = 4096;
+
+    void BM_RamReadByte(benchmark::State& state)
+    {
+        std::unique_ptr<machine_t> machine(new machine_t(ALU_LOOP, true));
+        RAM& ram = machine->ram;
+
+        for (auto _ : state)
+        {
+            // Internal RAM (through its mirrors) and cartridge ROM.
+            unsigned int sum = 0;
+            for (address_t addr = 0; addr < BUS_ACCESSES; addr++)
+                sum += ram.read_byte((addr * 0x0F1D) & 0x1FFF) + ram.read_byte(0x8000 | ((addr * 0x13) & 0x7FFF));
+            benchmark::DoNotOptimize(sum);
+        }
+
+        state.SetItemsProcessed(state.iterations() * BUS_ACCESSES * 2);
+    }
+
+    void BM_RamWriteByte(benchmark::State& state)
+    {
+        std::unique_ptr<machine_t> machine(new machine_t(ALU_LOOP, true));
+        RAM& ram = machine->ram;
+
+        for (auto _ : state)
+        {
+            for (address_t addr = 0; addr < BUS_ACCESSES; addr++)
+                ram.write_byte((addr * 0x0F1D) & 0x1FFF, addr & 0xFF);
+            benchmark::ClobberMemory();
+        }
+
+        state.SetItemsProcessed(state.iterations() * BUS_ACCESSES);
+    }
+
+    // The opcode dispatch tables are built at compile time, so this is the cost of the
+    // object itself.
+    void BM_Mos6502Construction(benchmark::State& state)
+    {
+        std::unique_ptr<RAM> ram(new RAM());
+
+        for (auto _ : state)
+        {
+            MOS6502 cpu(ram.get());
+            benchmark::DoNotOptimize(&cpu);
+        }
+    }
+
+    // Loading a 32KiB PRG / 8KiB CHR NROM image from disk, mapping it and powering on.
+    void BM_RomLoad(benchmark::State& state)
+    {
+        char path[] = "/tmp/nesemu-bench-XXXXXX";
+        const int fd = mkstemp(path);
+        if (fd < 0)
+        {
+            state.SkipWithError("could not create a temporary ROM file");
+            return;
+        }
+        close(fd);
+
+        {
+            std::vector<uint8_t> image(16 + PRG_SIZE + 0x2000, 0xEA);
+            const uint8_t header[16] = { 'N', 'E', 'S', 0x1A, 2, 1 };
+            std::copy(header, header + sizeof(header), image.begin());
+            std::ofstream file(path, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(image.data()), image.size());
+        }
+
+        std::unique_ptr<NES> nes(new NES());
+
+        for (auto _ : state)
+        {
+            if (!nes->load_rom(path))
+            {
+                state.SkipWithError("could not load the temporary ROM");
+                break;
+            }
+        }
+
+        std::remove(path);
+    }
+
+    // ===========================
+    // FORK BENCHMARKS
+    // ===========================
+
+    // A console 10 frames into the ALU loop, as a 32KiB PRG / 8KiB CHR NROM image in memory.
+    std::unique_ptr<NES> make_forking_console(benchmark::State& state)
+    {
+        std::vector<uint8_t> image(16 + PRG_SIZE + 0x2000, 0xEA);
+        const uint8_t header[16] = { 'N', 'E', 'S', 0x1A, 2, 1 };
+        std::copy(header, header + sizeof(header), image.begin());
+        std::copy(ALU_LOOP.begin(), ALU_LOOP.end(), image.begin() + 16);
+        image[16 + 0x7FFC] = 0x00; // Reset vector: $8000.
+        image[16 + 0x7FFD] = 0x80;
+
+        std::unique_ptr<NES> nes(new NES());
+        if (!nes->load_rom(image.data(), image.size()))
+        {
+            state.SkipWithError("could not load the fork benchmark ROM");
+            return nullptr;
+        }
+
+        nes->set_output_enabled(false, false);
+        nes->run_frames(10);
+        return nes;
+    }
+
+    // Forking again from the point last forked from, after writes to `range(0)' of the eight
+    // 256-byte chunks of work RAM and (for range(1) = 1) to PRG-RAM: only those are copied back.
+    void BM_Refork(benchmark::State& state)
+    {
+        std::unique_ptr<NES> nes = make_forking_console(state);
+        if (!nes)
+            return;
+
+        const std::shared_ptr<const fork_point_t> point = nes->make_fork_point();
+        if (!point || !nes->fork(point))
+        {
+            state.SkipWithError("could not fork");
+            return;
+        }
+
+        RAM& ram = nes->get_ram();
+        const address_t dirty_chunks = (address_t)state.range(0);
+        const bool dirty_prg_ram = state.range(1) != 0;
+        uint8_t value = 0;
+
+        for (auto _ : state)
+        {
+            value++;
+            for (address_t chunk = 0; chunk < dirty_chunks; chunk++)
+                ram.write_byte(chunk * 0x100 + 0x80, value);
+            if (dirty_prg_ram)
+                ram.write_byte(0x6000, value);
+
+            if (!nes->fork(point))
+            {
+                state.SkipWithError("could not fork");
+                break;
+            }
+        }
+    }
+
+    // Forking alternately from two points, so every fork restores the whole state.
+    void BM_ForkFull(benchmark::State& state)
+    {
+        std::unique_ptr<NES> nes = make_forking_console(state);
+        if (!nes)
+            return;
+
+        const std::shared_ptr<const fork_point_t> first = nes->make_fork_point();
+        nes->run_frames(1);
+        const std::shared_ptr<const fork_point_t> second = nes->make_fork_point();
+        if (!first || !second)
+        {
+            state.SkipWithError("could not take the fork points");
+            return;
+        }
+
+        bool use_first = true;
+
+        for (auto _ : state)
+        {
+            if (!nes->fork(use_first ? first : second))
+            {
+                state.SkipWithError("could not fork");
+                break;
+            }
+            use_first = !use_first;
+        }
+    }
+} // namespace
+
+BENCHMARK_CAPTURE(BM_Interpreter, alu, ALU_LOOP)->ArgName("code_in_ram")->Arg(0)->Arg(1);
+BENCHMARK_CAPTURE(BM_Interpreter, branch, BRANCH_LOOP)->ArgName("code_in_ram")->Arg(0)->Arg(1);
+BENCHMARK_CAPTURE(BM_Interpreter, zero_page, ZERO_PAGE_LOOP)->ArgName("code_in_ram")->Arg(0)->Arg(1);
+BENCHMARK_CAPTURE(BM_Interpreter, absolute, ABSOLUTE_LOOP)->ArgName("code_in_ram")->Arg(0)->Arg(1);
+BENCHMARK_CAPTURE(BM_Interpreter, indirect_indexed, INDIRECT_INDEXED_LOOP)->ArgName("code_in_ram")->Arg(0)->Arg(1);
+
+BENCHMARK_CAPTURE(BM_Recompiled, alu, ALU_LOOP);
+BENCHMARK_CAPTURE(BM_Recompiled, branch, BRANCH_LOOP);
+BENCHMARK_CAPTURE(BM_Recompiled, zero_page, ZERO_PAGE_LOOP);
+BENCHMARK_CAPTURE(BM_Recompiled, absolute, ABSOLUTE_LOOP);
+BENCHMARK_CAPTURE(BM_Recompiled, indirect_indexed, INDIRECT_INDEXED_LOOP);
+
+BENCHMARK(BM_RamReadByte);
+BENCHMARK(BM_RamWriteByte);
+BENCHMARK(BM_Mos6502Construction);
+BENCHMARK(BM_RomLoad);
+
+BENCHMARK(BM_Refork)->ArgNames({"dirty_chunks", "prg_ram"})->Args({0, 0})->Args({2, 0})->Args({8, 0})->Args({2, 1});
+BENCHMARK(BM_ForkFull);
+
+int main(int argc, char **argv) {
+    // Take our own flag out before Google Benchmark sees the command line.
+    int kept = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--perf-counters") == 0)
+            use_perf_counters = true;
+        else
+            argv[kept++] = argv[i];
+    }
+    argc = kept;
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
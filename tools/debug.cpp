@@ -0,0 +1,83 @@
+/**
+ * Debugger front end. Loads a ROM and reads debugger commands, either interactively from
+ * standard input or from a script file for automated investigations ("help" lists them).
+ *
+ * Usage: NESDebug [--script FILE] rom
+ *
+ * A script runs until it ends, reaches a "quit" line or a command fails; the exit code is 0
+ * if every command succeeded.
+ */
+
+#include "../system/debugger.hpp"
+#include "../system/nes.hpp"
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+static void print_help()
+{
+    std::cout << "break ADDR | watch r|w|x|rw|... START [END] | delete [ID] | list" << std::endl
+              << "continue [FRAMES] | step [N] | next | finish | regs | mem ADDR [LENGTH] | quit" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::string script_path;
+    std::string rom_path;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+
+        if (argument == "--script" && i + 1 < argc)
+            script_path = argv[++i];
+        else if (argument.compare(0, 2, "--") != 0 && rom_path.empty())
+            rom_path = argument;
+        else
+        {
+            std::cout << "Usage: " << argv[0] << " [--script FILE] rom" << std::endl;
+            return 1;
+        }
+    }
+
+    if (rom_path.empty())
+    {
+        std::cout << "Usage: " << argv[0] << " [--script FILE] rom" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<NES> nes(new NES());
+    if (!nes->load_rom(rom_path))
+        return 1;
+
+    Debugger debugger(*nes);
+
+    if (!script_path.empty())
+    {
+        std::ifstream script(script_path);
+        if (!script)
+        {
+            std::cout << "Could not read script ``" << script_path << "''." << std::endl;
+            return 1;
+        }
+
+        return debugger.run_script(script, std::cout, true) ? 0 : 1;
+    }
+
+    std::string line;
+    std::cout << "(nes) " << std::flush;
+
+    while (std::getline(std::cin, line))
+    {
+        if (line == "quit")
+            break;
+        else if (line == "help")
+            print_help();
+        else if (line.find_first_not_of(" \t\r") != std::string::npos)
+            debugger.execute(line, std::cout);
+
+        std::cout << "(nes) " << std::flush;
+    }
+
+    return 0;
+}
@@ -0,0 +1,295 @@
+/**
+ * Headless batch runner. Runs many ROMs (or many runs of the same ROM) in parallel, one
+ * emulator instance per worker thread, and writes one CSV line per job.
+ *
+ * Usage: NESHeadless [--threads N] [--frames N] [--jobs FILE] [--output FILE] [--jit | --verify-jit]
+ *                    [--idle-skip] [--profile PREFIX] [--trace PREFIX] [rom ...]
+ *
+ * --jit runs the CPU through the recompiler. --verify-jit runs every job twice in lockstep,
+ * interpreted and recompiled, comparing the machine state after each frame; a job whose
+ * states differ is reported as jit_mismatch.
+ *
+ * --idle-skip skips idle loops (see NES::set_idle_skip_enabled). With --verify-jit the
+ * reference run still executes them, so the comparison checks the skipping too.
+ *
+ * --profile PREFIX profiles the guest code of every job (on the interpreter) and writes a
+ * hot-spot report to PREFIX<job>.txt and folded call stacks for flamegraph.pl to
+ * PREFIX<job>.folded, numbering jobs from 0 in input order.
+ *
+ * --trace PREFIX writes every instruction each job executes (on the interpreter) to
+ * PREFIX<job>.bin as binary trace records, which NESTraceFormat turns into a nestest-style
+ * log. Only Debug builds, which define NESEMU_TRACE, have tracing compiled in.
+ *
+ * A jobs file has one job per line: a ROM path, optionally followed by a frame count that
+ * overrides --frames. Blank lines and lines starting with '#' are ignored.
+ */
+
+#include "../system/nes.hpp"
+#include "../system/thread_pool.hpp"
+#include "../system/trace.hpp"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct job_t
+{
+    std::string rom_path;
+    uint64_t frames;
+};
+
+struct job_result_t
+{
+    std::string status = "not_run"; // ok, halted, load_error or jit_mismatch.
+    uint64_t cycles = 0;
+    double wall_ms = 0;
+    uint64_t state_hash = 0;
+    uint16_t halt_address = 0;
+    uint8_t halt_opcode = 0;
+};
+
+static bool read_jobs_file(const std::string& path, uint64_t default_frames, std::vector<job_t>& jobs)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        job_t job;
+        job.frames = default_frames;
+
+        if (!(fields >> job.rom_path) || job.rom_path[0] == '#')
+            continue;
+
+        fields >> job.frames;
+        jobs.push_back(job);
+    }
+
+    return true;
+}
+
+// `reference', if given, is an interpreter-only console run alongside `nes' to check it.
+// `profiler', if given, counts the guest code `nes' runs; `tracer', if given, logs it.
+static void run_job(NES& nes, NES* reference, Profiler* profiler, Tracer* tracer, const job_t& job,
+                    job_result_t& result)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    if (!nes.load_rom(job.rom_path) || (reference != nullptr && !reference->load_rom(job.rom_path)))
+    {
+        result.status = "load_error";
+        return;
+    }
+
+    MOS6502& cpu = nes.get_cpu();
+    cpu.attach_profiler(profiler);
+    cpu.attach_tracer(tracer);
+
+    if (reference == nullptr)
+    {
+        result.cycles = nes.run_frames(job.frames);
+        result.status = cpu.is_halted() ? "halted" : "ok";
+    }
+    else
+    {
+        result.status = "ok";
+
+        for (uint64_t frame = 0; frame < job.frames && !cpu.is_halted(); frame++)
+        {
+            result.cycles += nes.run_frames(1);
+            reference->run_frames(1);
+
+            if (nes.state_hash() != reference->state_hash())
+            {
+                result.status = "jit_mismatch";
+                std::cerr << job.rom_path << ": recompiled state differs from the interpreter's after frame "
+                          << frame + 1 << " (PC $" << std::hex << cpu.PC << " vs $" << reference->get_cpu().PC
+                          << std::dec << ")." << std::endl;
+                break;
+            }
+        }
+
+        if (result.status == "ok" && cpu.is_halted())
+            result.status = "halted";
+    }
+
+    cpu.attach_profiler(nullptr);
+    cpu.attach_tracer(nullptr);
+
+    result.halt_address = cpu.halt_address;
+    result.halt_opcode = cpu.halt_opcode;
+    result.state_hash = nes.state_hash();
+
+    result.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    std::size_t thread_count = 0;
+    uint64_t default_frames = 600;
+    std::string jobs_path;
+    std::string output_path;
+    std::vector<std::string> roms;
+    bool use_jit = false;
+    bool verify_jit = false;
+    bool idle_skip = false;
+    std::string profile_prefix;
+    std::string trace_prefix;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (argument == "--threads" && has_value)
+            thread_count = std::stoul(argv[++i]);
+        else if (argument == "--frames" && has_value)
+            default_frames = std::stoull(argv[++i]);
+        else if (argument == "--jobs" && has_value)
+            jobs_path = argv[++i];
+        else if (argument == "--output" && has_value)
+            output_path = argv[++i];
+        else if (argument == "--jit")
+            use_jit = true;
+        else if (argument == "--verify-jit")
+            verify_jit = true;
+        else if (argument == "--idle-skip")
+            idle_skip = true;
+        else if (argument == "--profile" && has_value)
+            profile_prefix = argv[++i];
+        else if (argument == "--trace" && has_value)
+            trace_prefix = argv[++i];
+        else if (argument.compare(0, 2, "--") == 0)
+        {
+            std::cout << "Usage: " << argv[0] << " [--threads N] [--frames N] [--jobs FILE] [--output FILE]"
+                      << " [--jit | --verify-jit] [--idle-skip] [--profile PREFIX] [--trace PREFIX] [rom ...]"
+                      << std::endl;
+            return 1;
+        }
+        else
+            roms.push_back(argument);
+    }
+
+    std::vector<job_t> jobs;
+
+    if (!jobs_path.empty() && !read_jobs_file(jobs_path, default_frames, jobs))
+    {
+        std::cout << "Could not read jobs file ``" << jobs_path << "''." << std::endl;
+        return 1;
+    }
+
+    for (const std::string& rom : roms)
+        jobs.push_back({ rom, default_frames });
+
+    if ((use_jit || verify_jit) && !JIT::is_supported())
+    {
+        std::cout << "The recompiler is not available on this platform." << std::endl;
+        return 1;
+    }
+
+#ifndef NESEMU_TRACE
+    if (!trace_prefix.empty())
+    {
+        std::cout << "Tracing is only compiled into Debug builds." << std::endl;
+        return 1;
+    }
+#endif
+
+    if (jobs.empty())
+    {
+        std::cout << "Nothing to run: give ROM paths or --jobs FILE." << std::endl;
+        return 1;
+    }
+
+    std::vector<job_result_t> results(jobs.size());
+    auto batch_start = std::chrono::steady_clock::now();
+
+    {
+        ThreadPool pool(thread_count);
+
+        // One console per worker, created on first use and reused for every job that worker
+        // picks up afterwards.
+        std::vector<std::unique_ptr<NES>> instances(pool.size());
+        std::vector<std::unique_ptr<NES>> references(pool.size());
+        std::vector<std::unique_ptr<Profiler>> profilers(pool.size());
+
+        for (std::size_t i = 0; i < jobs.size(); i++)
+        {
+            pool.submit([&, i](std::size_t worker) {
+                if (!instances[worker])
+                {
+                    instances[worker].reset(new NES());
+                    instances[worker]->set_jit_enabled(use_jit || verify_jit);
+                    instances[worker]->set_idle_skip_enabled(idle_skip);
+                }
+
+                if (verify_jit && !references[worker])
+                    references[worker].reset(new NES());
+
+                if (!profile_prefix.empty())
+                {
+                    if (!profilers[worker])
+                        profilers[worker].reset(new Profiler());
+                    profilers[worker]->clear();
+                }
+
+                std::unique_ptr<Tracer> tracer;
+                if (!trace_prefix.empty())
+                    tracer.reset(new Tracer(trace_prefix + std::to_string(i) + ".bin", trace_format_t::BINARY));
+
+                run_job(*instances[worker], references[worker].get(), profilers[worker].get(), tracer.get(), jobs[i],
+                        results[i]);
+
+                if (!profile_prefix.empty() && results[i].status != "load_error")
+                {
+                    const std::string prefix = profile_prefix + std::to_string(i);
+                    profilers[worker]->write_report(prefix + ".txt");
+                    profilers[worker]->write_folded(prefix + ".folded");
+                }
+            });
+        }
+
+        pool.wait();
+    }
+
+    double batch_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - batch_start).count();
+
+    std::ofstream output_file;
+    if (!output_path.empty())
+    {
+        output_file.open(output_path);
+        if (!output_file)
+        {
+            std::cout << "Could not open ``" << output_path << "'' for writing." << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& output = output_path.empty() ? std::cout : output_file;
+
+    output << "rom,status,frames,cycles,wall_ms,state_hash,halt_address,halt_opcode" << std::endl;
+
+    std::size_t failures = 0;
+    for (std::size_t i = 0; i < jobs.size(); i++)
+    {
+        const job_result_t& result = results[i];
+        char line[128];
+        std::snprintf(line, sizeof(line), ",%s,%llu,%llu,%.3f,%016llx,%04X,%02X",
+                      result.status.c_str(), (unsigned long long)jobs[i].frames, (unsigned long long)result.cycles,
+                      result.wall_ms, (unsigned long long)result.state_hash, result.halt_address, result.halt_opcode);
+
+        output << jobs[i].rom_path << line << std::endl;
+
+        if (result.status != "ok")
+            failures++;
+    }
+
+    std::cerr << jobs.size() << " job(s) in " << batch_ms << " ms, " << failures << " not ok." << std::endl;
+
+    return failures == 0 ? 0 : 2;
+}
@@ -0,0 +1,94 @@
+/**
+ * Microbenchmark for the PPU pixel kernels: times tile decoding and palette expansion for
+ * every kernel set the host supports against the scalar one, after checking that they all
+ * produce the same output.
+ *
+ * Usage: NESPixelBench [iterations]
+ */
+
+#include "../system/pixel_kernels.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    const std::size_t CHR_SIZE = 0x2000; // One 8KiB CHR bank: 512 tiles.
+    const std::size_t FRAME_PIXELS = 256 * 240;
+
+    template<typename F>
+    double time_ns(unsigned int iterations, F&& work)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < iterations; i++)
+            work();
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+    }
+}
+
+int main(int argc, char **argv) {
+    unsigned int iterations = argc > 1 ? std::stoul(argv[1]) : 2000;
+
+    std::mt19937 random(12345);
+    std::vector<uint8_t> chr(CHR_SIZE);
+    std::vector<uint8_t> indices(FRAME_PIXELS);
+    for (uint8_t& byte : chr)
+        byte = random() & 0xFF;
+    for (uint8_t& index : indices)
+        index = random() & 0x3F;
+
+    uint32_t colours[64];
+    for (unsigned int i = 0; i < 64; i++)
+        colours[i] = 0xFF000000 | (random() & 0xFFFFFF);
+
+    palette_lut_t palette;
+    pixel_kernels::make_palette_lut(colours, palette);
+
+    const pixel_kernels_t& scalar = pixel_kernels::get(kernel_isa_t::SCALAR);
+    std::vector<uint8_t> reference_pixels(CHR_SIZE * 4);
+    std::vector<uint32_t> reference_frame(FRAME_PIXELS);
+    scalar.decode_tiles(chr.data(), CHR_SIZE / 16, reference_pixels.data());
+    scalar.expand_palette(indices.data(), indices.size(), palette, reference_frame.data());
+
+    double scalar_decode = 0, scalar_expand = 0;
+    bool all_match = true;
+
+    std::printf("%-8s %16s %10s %18s %10s\n", "kernels", "decode ns/8KiB", "speedup", "expand ns/frame", "speedup");
+
+    for (kernel_isa_t isa : { kernel_isa_t::SCALAR, kernel_isa_t::SSSE3, kernel_isa_t::AVX2 })
+    {
+        if (!pixel_kernels::is_supported(isa))
+            continue;
+
+        const pixel_kernels_t& kernels = pixel_kernels::get(isa);
+        std::vector<uint8_t> pixels(CHR_SIZE * 4);
+        std::vector<uint32_t> frame(FRAME_PIXELS);
+
+        kernels.decode_tiles(chr.data(), CHR_SIZE / 16, pixels.data());
+        kernels.expand_palette(indices.data(), indices.size(), palette, frame.data());
+
+        if (pixels != reference_pixels || frame != reference_frame)
+        {
+            std::printf("%-8s output differs from the scalar kernels!\n", kernels.name);
+            all_match = false;
+            continue;
+        }
+
+        double decode = time_ns(iterations, [&]() { kernels.decode_tiles(chr.data(), CHR_SIZE / 16, pixels.data()); });
+        double expand = time_ns(iterations, [&]() { kernels.expand_palette(indices.data(), indices.size(), palette, frame.data()); });
+
+        if (isa == kernel_isa_t::SCALAR)
+        {
+            scalar_decode = decode;
+            scalar_expand = expand;
+        }
+
+        std::printf("%-8s %16.0f %9.2fx %18.0f %9.2fx\n", kernels.name, decode, scalar_decode / decode, expand, scalar_expand / expand);
+    }
+
+    std::printf("Selected at runtime: %s\n", pixel_kernels::best().name);
+    return all_match ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+/**
+ * Input movie replay. Loads a ROM and a movie recorded for it (NESEmulator --record), replays
+ * the movie unthrottled with video and audio output off, and reports the speed and whether
+ * the replay stayed in sync with the recording's state hash checkpoints.
+ *
+ * Usage: NESReplay [--jit] [--idle-skip] rom movie
+ *
+ * The exit code is 0 if every checkpoint matched, 2 on a desync and 1 on any other error.
+ */
+
+#include "../system/movie.hpp"
+#include "../system/nes.hpp"
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+
+int main(int argc, char **argv) {
+    std::string rom_path;
+    std::string movie_path;
+    bool use_jit = false;
+    bool idle_skip = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+
+        if (argument == "--jit")
+            use_jit = true;
+        else if (argument == "--idle-skip")
+            idle_skip = true;
+        else if (argument.compare(0, 2, "--") != 0 && rom_path.empty())
+            rom_path = argument;
+        else if (argument.compare(0, 2, "--") != 0 && movie_path.empty())
+            movie_path = argument;
+        else
+        {
+            std::cout << "Usage: " << argv[0] << " [--jit] [--idle-skip] rom movie" << std::endl;
+            return 1;
+        }
+    }
+
+    if (rom_path.empty() || movie_path.empty())
+    {
+        std::cout << "Usage: " << argv[0] << " [--jit] [--idle-skip] rom movie" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<NES> nes(new NES());
+    Movie movie;
+
+    if (!nes->load_rom(rom_path) || !movie.read_file(movie_path))
+        return 1;
+
+    if (use_jit)
+        nes->set_jit_enabled(true);
+
+    nes->set_idle_skip_enabled(idle_skip);
+
+    movie_replay_result_t result;
+    const auto started = std::chrono::steady_clock::now();
+
+    if (!movie.replay(*nes, result))
+    {
+        std::cout << "Movie ``" << movie_path << "'' was not recorded with ``" << rom_path << "''." << std::endl;
+        return 1;
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::cout << "Replayed " << result.frames << " of " << movie.get_frame_count() << " frame(s) in " << seconds * 1000
+              << " ms (" << (seconds > 0 ? result.frames / seconds : 0) << " frames/s), " << result.checkpoints
+              << " checkpoint(s) matched." << std::endl;
+
+    if (idle_skip)
+    {
+        const MOS6502& cpu = nes->get_cpu();
+        std::cout << "Idle loops skipped: " << (cpu.cycles > 0 ? 100.0 * cpu.get_idle_skipped_cycles() / cpu.cycles : 0)
+                  << "% of cycles." << std::endl;
+    }
+
+    if (result.desync_frame != 0)
+    {
+        std::cout << "DESYNC: the state after frame " << result.desync_frame << " differs from the recording." << std::endl;
+        return 2;
+    }
+
+    if (result.frames < movie.get_frame_count())
+    {
+        std::cout << "The CPU halted before the end of the movie." << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+/**
+ * Converts a binary instruction trace (written by Tracer in BINARY format) into a
+ * nestest-style text log.
+ *
+ * Usage: NESTraceFormat <trace.bin> <trace.log>
+ */
+
+#include "../system/trace.hpp"
+#include <iostream>
+
+int main(int argc, char **argv) {
+    if (argc != 3)
+    {
+        std::cout << "Usage: " << argv[0] << " <trace.bin> <trace.log>" << std::endl;
+        return 1;
+    }
+
+    if (!Tracer::format_file(argv[1], argv[2]))
+    {
+        std::cout << "Could not open ``" << argv[1] << "'' or ``" << argv[2] << "''." << std::endl;
+        return 1;
+    }
+
+    return 0;
+}